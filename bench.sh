@@ -0,0 +1 @@
+gcc -O2 -ggdb -o myamp-bench main.c `sdl2-config --cflags --libs` && ./myamp-bench --bench "$@"
@@ -1,6 +1,28 @@
 #include <stdio.h>
 #include "SDL2/SDL.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define MYAMP_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(MYAMP_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define MYAMP_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#define MYAMP_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define MYAMP_HAVE_MMAP 1
+#define MYAMP_HAVE_DIRENT 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 typedef void (*ClickFunc)(void);
 
@@ -34,33 +56,185 @@ typedef struct{
     int y_offset;
     int w;
     int h;
+    int frames_per_row; // background frames are laid out left to right first, then down
+    SDL_bool vertical;  // value 1 at the top
     SDL_Rect dst_rect;
     float value;
+    //Not owned, where `value` is published for the audio thread. May be NULL.
+    SDL_atomic_t *audio_param;
+    // Called after `value` changes from dragging. May be NULL.
+    ClickFunc onChange;
+    // Called when the knob is let go. May be NULL.
+    ClickFunc onRelease;
     
 } WinAmpSkinSlider;
 
+/* Winamp's equalizer bands, 60Hz to 16kHz. */
+#define EQ_NUM_BANDS 10
+
 typedef enum{
     WASSLD_VOLUME = 0,
     WASSLD_BALANCE,
+    WASSLD_POSITION,
+    WASSLD_EQ_PREAMP,
+    WASSLD_EQ_BAND_FIRST,
+    WASSLD_EQ_BAND_LAST = WASSLD_EQ_BAND_FIRST + EQ_NUM_BANDS - 1,
     WASSLD_COUNT
 } WinAmpSkinSliderId;
 
 
+typedef enum{
+    WASBMP_MAIN = 0,
+    WASBMP_CBUTTONS,
+    WASBMP_VOLUME,
+    WASBMP_BALANCE,
+    WASBMP_TITLEBAR,
+    WASBMP_POSBAR,
+    WASBMP_PLEDIT,
+    WASBMP_EQMAIN,
+    WASBMP_TEXT,
+    WASBMP_NUMBERS,
+    WASBMP_NUMS_EX,
+    WASBMP_COUNT
+} WinAmpSkinBitmapId;
+
+static const char *skin_bitmap_names[WASBMP_COUNT] = {
+    "MAIN.BMP",
+    "CBUTTONS.BMP",
+    "VOLUME.BMP",
+    "BALANCE.BMP",
+    "TITLEBAR.BMP",
+    "POSBAR.BMP",
+    "PLEDIT.BMP",
+    "EQMAIN.BMP",
+    "TEXT.BMP",
+    "NUMBERS.BMP",
+    "NUMS_EX.BMP",
+};
+
+/* Colours in a skin's VISCOLOR.TXT: background, grid dots, 16 spectrum rows
+   from the top down, 5 oscilloscope shades and the analyzer peak dots. */
+#define VIS_NUM_COLORS 24
+
+/* [Text] section of a skin's PLEDIT.TXT. */
+typedef struct{
+    SDL_Color normal;
+    SDL_Color current;
+    SDL_Color normal_bg;
+    SDL_Color selected_bg;
+} PlaylistColors;
+
+/* Size of MAIN.BMP. */
+#define SKIN_MAIN_W 275
+#define SKIN_MAIN_H 116
+/* The equalizer is docked under the main window, same size. */
+#define SKIN_EQ_Y SKIN_MAIN_H
+#define SKIN_EQ_H 116
+/* Then the playlist editor, at its smallest size. */
+#define SKIN_PLEDIT_Y (SKIN_EQ_Y + SKIN_EQ_H)
+#define SKIN_PLEDIT_H 116
+#define SKIN_WINDOW_W SKIN_MAIN_W
+#define SKIN_WINDOW_H (SKIN_MAIN_H + SKIN_EQ_H + SKIN_PLEDIT_H)
+
+/* Glyphs in TEXT.BMP, and digits in NUMBERS.BMP or NUMS_EX.BMP. */
+#define SKIN_TEXT_GLYPH_W 5
+#define SKIN_TEXT_GLYPH_H 6
+#define SKIN_DIGIT_W 9
+#define SKIN_DIGIT_H 13
+/* Where MAIN.BMP leaves room for the elapsed time, "mm:ss" with the colon
+   printed on the bitmap, and for the title marquee. */
+static const SDL_Rect time_rect = { 48, 26, 51, SKIN_DIGIT_H };
+static const int time_digit_x[4] = { 0, 12, 30, 42 };
+static const SDL_Rect marquee_rect = { 111, 27, 154, SKIN_TEXT_GLYPH_H };
+#define MARQUEE_CHARS (154 / SKIN_TEXT_GLYPH_W + 1)
+/* The marquee moves a pixel this often while playing. */
+#define MARQUEE_STEP_MS 40
+
+/* What's under each pixel of the window, for mouse dispatch. Buttons go
+   over sliders, and lower numbered controls over higher ones. */
+typedef enum{
+    HIT_NONE = 0, // outside the skin's region
+    HIT_BUTTON_FIRST,
+    HIT_SLIDER_FIRST = HIT_BUTTON_FIRST + WASBTN_COUNT,
+    HIT_VISUALIZER = HIT_SLIDER_FIRST + WASSLD_COUNT,
+    HIT_PLAYLIST,
+    HIT_TITLEBAR, // drags the window when it has no decorations
+    HIT_WINDOW,   // the rest of the skin
+    HIT_COUNT
+} HitId;
+
+SDL_COMPILE_TIME_ASSERT(hit_id_fits, HIT_COUNT <= 256);
+
+/* Window pixels per skin pixel: 1, Winamp's double size, or any other whole
+   number up to SKIN_MAX_SCALE. Whole only, so every skin pixel is the same
+   size and nothing is stretched per frame. From myamp.ini, --scale or
+   Ctrl+D. UI thread, kept out of the skin so it survives skin changes. */
+#define SKIN_MAX_SCALE 4.0f
+
+typedef enum SkinFilter{
+    SKIN_FILTER_NEAREST, // blocks, like Winamp's own double size
+    SKIN_FILTER_SCALE2X  // rounds off diagonals, doubling as often as it takes
+} SkinFilter;
+
+static float skin_scale = 1.0f;
+static SkinFilter skin_filter = SKIN_FILTER_NEAREST;
+
 typedef struct{
     
-    SDL_Texture *tex_main;    
+    /* Every skin bitmap packed into one texture, so a frame is one draw call.
+       Scaled up `atlas_scale` times on the CPU whenever the scale changes,
+       from the 1x `atlas_pixels`, so sprites always land texel for pixel in
+       frame_target. atlas_w and atlas_h are at 1x. */
+    SDL_Texture *atlas;
+    SDL_Surface *atlas_pixels;
+    int atlas_scale;
+    int atlas_w;
+    int atlas_h;
+    SDL_Rect bitmaps[WASBMP_COUNT]; // where each bitmap landed in `atlas`, w == 0 if the skin lacks it
+    SDL_Rect white_pixel; // for untextured fills, so they can go in the same batch
 
-    SDL_Texture *tex_cbuttons;    
     WinAmpSkinButton buttons[WASBTN_COUNT];
 
-    SDL_Texture *tex_volume;    
-    SDL_Texture *tex_balance;    
     WinAmpSkinSlider sliders[WASSLD_COUNT];
 
     WinAmpSkinButton *pressed;
 
+    /* Last composed frame, `atlas_scale` times the skin's size, which is the
+       window's. draw_frame only redraws the dirty parts into this and then
+       copies it out as is. NULL if the renderer can't do render targets. */
+    SDL_Texture *frame_target;
+    SDL_Rect dirty_rects[16];
+    int num_dirty_rects;
+    SDL_bool needs_present; // frame_target is fine but the window lost its contents
+
+    /* The visualizer isn't in the atlas, it streams into its own small texture. */
+    SDL_Texture *vis_texture;
+    SDL_Color vis_colors[VIS_NUM_COLORS];
+
+    /* Time and title readouts, each redrawn into its own texture only when
+       its text changes. NULL if the renderer can't do render targets, then
+       draw_skin queues the glyphs every frame instead. */
+    SDL_Texture *time_texture;
+    SDL_Texture *title_texture;
+    char time_text[8];    // "mmss", empty while stopped
+    char title_text[128]; // padded to fill the marquee, or with its separator if it scrolls
+    int title_w;          // of title_text, in pixels
+    int title_index;      // playlist entry title_text is for, -1 if none
+    int marquee_offset;   // pixels scrolled into title_text
+    Uint64 marquee_last_step;
+    SDL_bool readouts_stale; // textures need redrawing even if the text is the same
+
+    PlaylistColors playlist_colors;
+
+    /* HitId of every pixel, rebuilt with the controls when a skin is applied. */
+    Uint8 hit_map[SKIN_WINDOW_H][SKIN_WINDOW_W];
+    Uint8 *region; // copy of the skin's REGION.TXT mask, for reshaping the window, NULL if none
+
 } WinAmpSkin;
 
+/* How long handle_events sleeps waiting for something to happen. */
+#define IDLE_WAIT_MS 250
+
 
 static SDL_AudioDeviceID audio_device = 0;
 static SDL_Window *window = NULL;
@@ -69,576 +243,10301 @@ static SDL_bool paused = SDL_TRUE;
 
 static WinAmpSkin skin;
 
-static Uint8 *wavbuf = NULL;
-static Uint32 wavlen = 0;
-static SDL_AudioSpec wavspec;
-static SDL_AudioStream *stream = NULL;
-
-static void SDLCALL feed_audio_device_callback(void *userdata, Uint8 *output_stream, int len){
+/* Frames draw_frame actually drew versus ones it skipped because nothing
+   changed. Reported at exit. */
+static Uint64 frames_rendered = 0;
+static Uint64 frames_skipped = 0;
 
-    SDL_AudioStream *input_stream = (SDL_AudioStream *)SDL_AtomicGetPtr((void **) &stream);
-    
-    if(input_stream == NULL){
-        SDL_memset(output_stream, '\0', len);
-        return; 
+/* Queues `rect` to be redrawn on the next draw_frame. */
+static void mark_dirty(WinAmpSkin *skin, const SDL_Rect *rect){
+    const SDL_Rect whole = { 0, 0, SKIN_WINDOW_W, SKIN_WINDOW_H };
+    SDL_Rect clipped;
+    if(!SDL_IntersectRect(rect, &whole, &clipped)){
+        return;
     }
-    const int num_converted_bytes = SDL_AudioStreamGet(input_stream, output_stream, len); 
-    if(num_converted_bytes > 0){
-        const float volume = skin.sliders[WASSLD_VOLUME].value;
-        const float balance = skin.sliders[WASSLD_BALANCE].value;
-        const int num_samples = num_converted_bytes/sizeof(float);
-        float *samples = (float *)output_stream;
-
-        // Always dealing with stereo for now
-        SDL_assert((num_samples % 2) == 0);
-
-        // change volume of audio playing
-        if(volume != 1.0f){
-            for(size_t i = 0; i < num_samples; ++i){
-                samples[i] *= volume;
-            }
-        }
-
-        // change balance of audio playing
-        if(balance != 0.5f){
-            for(size_t i = 0; i < num_samples; i += 2){
-
-                const float weightLeft  = balance <= 0.5f ? 1.0f: 2.0f*(1.0f - balance);
-                const float weightRight = balance >= 0.5f ? 1.0f: 2.0f*       (balance);
-
-                samples[i]   *= weightLeft;
-                samples[i+1] *= weightRight;
-            }
+    for(int i = 0; i < skin->num_dirty_rects; ++i){
+        if(SDL_HasIntersection(&skin->dirty_rects[i], &clipped)){
+            SDL_UnionRect(&skin->dirty_rects[i], &clipped, &skin->dirty_rects[i]);
+            return;
         }
     }
-    // now has number of bytes after feeding the device 
-    len -= num_converted_bytes; 
-    output_stream += num_converted_bytes;
-
-    // fill the rest with silence
-    if(len > 0){
-        SDL_memset(output_stream, '\0', len);
+    if(skin->num_dirty_rects == SDL_arraysize(skin->dirty_rects)){
+        // too many little changes, just redraw everything
+        skin->dirty_rects[0] = whole;
+        skin->num_dirty_rects = 1;
+        return;
     }
+    skin->dirty_rects[skin->num_dirty_rects++] = clipped;
 }
 
-static void panic_and_abort(const char *title, const char *message){
-    fprintf(stderr, "PANIC: %s ... %s\n", title, message);
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title, message, window);
-    SDL_Quit();
-    exit(1);
+static void mark_all_dirty(WinAmpSkin *skin){
+    const SDL_Rect whole = { 0, 0, SKIN_WINDOW_W, SKIN_WINDOW_H };
+    skin->dirty_rects[0] = whole;
+    skin->num_dirty_rects = 1;
 }
 
+/* Audio is always handed to the device as interleaved float32 stereo, at
+   whatever rate the device was opened with. The rate is fixed for the
+   session: sources, EQ and visualizer are all set up for it. */
+#define AUDIO_DEFAULT_FREQ 48000
+#define AUDIO_OUT_CHANNELS 2
+#define AUDIO_OUT_FRAME_SIZE (sizeof(float) * AUDIO_OUT_CHANNELS)
 
-typedef struct ZipEntry{
-    char *fname; 
-    Uint32 compression_type;
-    Uint32 compressed_size;
-    Uint32 uncompressed_size;
-    Uint32 file_pos;
-} ZipEntry;
-
-typedef struct ZipArchive{
-    SDL_RWops *rw;
-    Uint32 num_entries;
-    ZipEntry *entries;
-} ZipArchive;
-
-static void ZipArchive_unload(ZipArchive *zip){
-    if(zip){
-        if(zip->rw) {
-            SDL_RWclose(zip->rw);
-        }
-        SDL_free(zip->entries);
-        SDL_free(zip);
-    }
-}
+static int audio_out_freq = AUDIO_DEFAULT_FREQ;
 
-static ZipArchive *ZipArchive_load(const char *fname){
-    SDL_RWops *rw = SDL_RWFromFile(fname, "rb");
-    if(!rw){
-        return NULL;
-    }
+/* Frames of converted audio buffered between the decoder thread and the
+   audio callback. Must be a power of two. ~680ms at 48000Hz. */
+#define AUDIO_RING_FRAMES (1 << 15)
+/* Frames read from disk per decoder iteration. */
+#define DECODE_CHUNK_FRAMES 4096
+/* How long the decoder sleeps when the ring is full. */
+#define DECODE_IDLE_MS 10
 
-    ZipArchive *ret_val = (ZipArchive *)SDL_calloc( 1, sizeof(ZipArchive));
-    if(ret_val == NULL){
-        SDL_RWclose(rw);
-        return NULL;
-    }
+/* Single producer (decoder thread), single consumer (audio callback) ring of
+   stereo frames. head and tail are free running frame counters, only ever
+   written by their owning thread, so no locking is needed. */
+typedef struct AudioRing{
+    float *samples;
+    Uint32 capacity; // in frames, power of two
+    SDL_atomic_t head; // written by producer only
+    SDL_atomic_t tail; // written by consumer only
+} AudioRing;
 
-    ret_val->rw = rw;
+struct AudioDecoder;
 
-    Uint32 ui32;
-    Uint16 ui16;
+typedef struct AudioSource{
+    SDL_RWops *rw;           // the file, read by `decoder`
+    const struct AudioDecoder *decoder; // picked from the first few bytes of the file
+    void *decoder_data;      // owned by `decoder`
+    SDL_AudioFormat format;  // format of what `decoder` hands back
+    Uint8 channels;
+    int freq;
+    Uint64 num_frames;       // at `freq`, 0 if the file doesn't say
+    char *fname;
 
-    while(SDL_RWread(rw, &ui32, sizeof(ui32), 1) == 1){
-        ZipEntry entry;
-        SDL_zero(entry);
+    /* WAV only. */
+    Uint8 *wavbuf;           // only set when SDL_LoadWAV had to decode the whole file
+    int bytes_per_frame;     // as stored in the file
+    Uint32 data_remaining;   // bytes of PCM data left in `rw`
+    Sint64 data_start;       // where the PCM data starts in `rw`
+    Uint32 data_len;         // bytes of PCM data in all
 
-        Uint16 fname_len;
-        Uint16 extra_len;
+    AudioRing ring;
+    SDL_atomic_t refcount;   // UI's and the decoder thread's
+    SDL_atomic_t quit;       // set by main thread to stop the decoder
+    SDL_atomic_t finished;   // set by decoder once everything is in the ring
+    struct AudioSource *next; // gapless: played straight after this one, set with SDL_AtomicSetPtr
+    int playlist_index;
+    Uint64 busy_ticks;       // decoder time not spent waiting on the ring, read once `finished`
 
-        ui32 = SDL_SwapLE32(ui32);
-        if(ui32 != 0x04034b50 ){
-            break;
-        }
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // version needed to extract
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // general purpose bit flag
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // compression method
-        entry.compression_type = SDL_SwapLE16(ui16);
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // last mod file time
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // last mod file date
-        SDL_RWread(rw, &ui32, sizeof(ui32), 1); // crc-32
-        SDL_RWread(rw, &ui32, sizeof(ui32), 1); // compressed size
-        entry.compressed_size = SDL_SwapLE32(ui32);
-        SDL_RWread(rw, &ui32, sizeof(ui32), 1); // uncompressed size
-        entry.uncompressed_size = SDL_SwapLE32(ui32);
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // file name length
-        fname_len = SDL_SwapLE16(ui16);
-        SDL_RWread(rw, &ui16, sizeof(ui16), 1); // extra field length
-        extra_len = SDL_SwapLE16(ui16);
-
-        entry.fname = (char *) SDL_malloc(fname_len + 1);
-        SDL_RWread(rw, entry.fname, fname_len, 1);
-        entry.fname[fname_len] ='\0';
-        SDL_RWseek(rw, extra_len, RW_SEEK_CUR);
-
-        entry.file_pos = SDL_RWtell(rw); 
-        SDL_RWseek(rw, entry.compressed_size, RW_SEEK_CUR); /* ready for next local file header */
-
-        void *ptr = SDL_realloc(ret_val->entries, sizeof(ZipEntry) * (ret_val->num_entries + 1));
-
-        ret_val->entries = ptr;
-        SDL_memcpy(&ret_val->entries[ret_val->num_entries], &entry, sizeof(ZipEntry));
-        ret_val->num_entries++;
-    }
-    return ret_val;
-}
+    /* In device frames. `length` is 0 until the decoder has opened the file,
+       `position` is how far the callback has read. */
+    SDL_atomic_t length;
+    SDL_atomic_t position;
 
+    /* Seeking, see AudioSource_seek. The UI sets seek_to and bumps
+       seek_request, the decoder moves the file cursor and bumps seek_done,
+       the callback drops what's in the ring before seek_head. */
+    SDL_atomic_t seek_to;
+    SDL_atomic_t seek_request;
+    SDL_atomic_t seek_done;
+    Uint32 seek_head;        // ring head when the decoder started writing from the new spot
+    int seek_position;       // device frame it started at
+    int seek_seen;           // audio thread only, last seek_done it caught up with
 
+    /* Files already at the device rate, stereo, 16-bit or float, skip the
+       decoder and the ring: the callback reads straight out of a read-only
+       mapping. `pcm` points into `map` and is published with
+       SDL_AtomicSetPtr once the file is mapped. */
+    void *map;
+    size_t map_len;
+    const void *pcm;
+    Uint32 pcm_frames;
 
+    /* Loudness normalization in hundredths of a dB, 0 until the track's
+       loudness is known or with normalization off. Set by the UI, read by
+       the callback. `loudness_checked` is UI only, set once it's been
+       looked for. `gain` is audio thread only, `gain_mb` as it was when
+       the source started playing. */
+    SDL_atomic_t gain_mb;
+    SDL_bool loudness_checked;
+    float gain;
+    SDL_bool gain_latched;
+} AudioSource;
 
+static AudioSource *source = NULL;
 
-static void stop_audio(void){
+/* Parameters the UI publishes to the audio callback. Floats are stored as
+   their bit pattern so neither side ever has to lock the audio device. */
+static SDL_atomic_t audio_volume;
+static SDL_atomic_t audio_balance;
 
-    // Make sure audio callback cant touch stream whilst freeing it 
-    SDL_LockAudioDevice(audio_device); 
-    if(stream){
-        SDL_FreeAudioStream(stream);
-        SDL_AtomicSetPtr((void **) &stream, NULL);
-    }
-    SDL_UnlockAudioDevice(audio_device);
+/* How long the UI held the audio device lock, i.e. how long the audio
+   thread could have been blocked waiting on us. Reported at exit. */
+static Uint64 audio_lock_count = 0;
+static Uint64 audio_lock_ticks = 0;
+static Uint64 audio_lock_max_ticks = 0;
+static Uint64 audio_lock_start = 0;
 
-    if(wavbuf){
-        SDL_FreeWAV(wavbuf);
-    }
-    wavbuf = NULL;
-    wavlen = 0;
-}
+/* Callback wall time histogram, bucket i counts callbacks that took under
+   2^i microseconds, the last one everything slower. */
+#define AUDIO_STATS_BUCKETS 20
 
-static SDL_bool open_new_audio_file(const char *fname){
-   
+/* What the audio callback has been up to. Only the audio thread writes it,
+   making audio_stats_sequence odd while it does, so the UI can take a
+   consistent copy with AudioStats_snapshot without ever blocking it. */
+typedef struct AudioStats{
+    Uint64 callbacks;
+    Uint64 frames_filled;     // from the sources
+    Uint64 frames_padded;     // silence, for whatever reason
+    Uint64 underruns;         // callbacks that padded because a decoder was behind
+    Uint64 frames_underrun;
+    Uint64 deadline_misses;   // callbacks that took longer than the audio they produced lasts
+    Uint64 late_callbacks;    // started more than half a period late, the device probably ran dry
+    Uint64 busy_ticks;
+    Uint64 max_ticks;
+    Uint64 max_interval_ticks;
+    Uint32 period_frames;     // frames the device asked for last time
+    Uint64 histogram[AUDIO_STATS_BUCKETS];
+} AudioStats;
 
-    SDL_AudioStream *tmp_stream = stream;
-    // Make sure audio callback cant touch stream whilst freeing it 
-    SDL_LockAudioDevice(audio_device); 
-    SDL_AtomicSetPtr((void **) &stream, NULL);
-    SDL_UnlockAudioDevice(audio_device);
+static AudioStats audio_stats;
+static SDL_atomic_t audio_stats_sequence;
+/* Bumped by the UI whenever it pauses or resumes the device, so the gap
+   doesn't look like a late callback. */
+static SDL_atomic_t audio_device_epoch;
+/* Audio thread only. */
+static Uint64 audio_stats_last_start = 0;
+static int audio_stats_last_epoch = 0;
 
-    SDL_FreeAudioStream(tmp_stream);
+/* Where playback is as of the callback's last buffer, published the same
+   way as audio_stats so the UI gets a consistent copy without the audio
+   lock. `source` is only there to compare against, the UI owns it and may
+   already have freed it. */
+typedef struct PlaybackState{
+    const AudioSource *source;      // NULL when nothing is playing
+    Uint32 position;                // device frames into `source`
+    Uint32 length;
+    float peaks[AUDIO_OUT_CHANNELS]; // of the last buffer, after volume
+} PlaybackState;
 
-    SDL_FreeWAV(wavbuf);
-    wavbuf = NULL;
-    wavlen = 0;
+static PlaybackState playback_state;
+static SDL_atomic_t playback_state_sequence;
 
+static void atomic_set_float(SDL_atomic_t *a, const float f){
+    int bits;
+    SDL_COMPILE_TIME_ASSERT(float_bits, sizeof(bits) == sizeof(f));
+    SDL_memcpy(&bits, &f, sizeof(bits));
+    SDL_AtomicSet(a, bits);
+}
 
-    if(SDL_LoadWAV(fname, &wavspec, &wavbuf, &wavlen) == NULL){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "LoadWAV Failed!", SDL_GetError(), window);
-        goto failed;
-    }
-    tmp_stream = SDL_NewAudioStream(wavspec.format, wavspec.channels, wavspec.freq, AUDIO_F32, 2, 48000);
-    if(!tmp_stream){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not create Audio Stream!", SDL_GetError(), window);
-        goto failed;
-    }
-    if(SDL_AudioStreamPut(tmp_stream, wavbuf, wavlen) == -1){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "AudioStreamPut Failed!", SDL_GetError(), window);
-        goto failed;
-    }
-    if(SDL_AudioStreamFlush(tmp_stream) == -1){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "AudioStreamFlush Failed!", SDL_GetError(), window);
-        goto failed;
-    }
+static float atomic_get_float(SDL_atomic_t *a){
+    const int bits = SDL_AtomicGet(a);
+    float f;
+    SDL_memcpy(&f, &bits, sizeof(f));
+    return f;
+}
 
+static Uint32 AudioRing_available(AudioRing *ring){
+    const Uint32 head = (Uint32) SDL_AtomicGet(&ring->head);
+    const Uint32 tail = (Uint32) SDL_AtomicGet(&ring->tail);
+    SDL_MemoryBarrierAcquire();
+    return head - tail;
+}
 
-    // Make new `stream` available to audio callback thread
-    SDL_LockAudioDevice(audio_device); 
-    SDL_AtomicSetPtr((void **) &stream, tmp_stream);
-    SDL_UnlockAudioDevice(audio_device);
+/* Producer side, returns number of frames actually written. */
+static Uint32 AudioRing_write(AudioRing *ring, const float *frames, Uint32 num_frames){
+    const Uint32 head = (Uint32) SDL_AtomicGet(&ring->head);
+    const Uint32 tail = (Uint32) SDL_AtomicGet(&ring->tail);
+    SDL_MemoryBarrierAcquire();
 
+    const Uint32 space = ring->capacity - (head - tail);
+    const Uint32 total = SDL_min(num_frames, space);
+    const Uint32 start = head & (ring->capacity - 1);
+    const Uint32 first = SDL_min(total, ring->capacity - start);
 
-    return SDL_TRUE;
+    SDL_memcpy(&ring->samples[start * AUDIO_OUT_CHANNELS], frames, first * AUDIO_OUT_FRAME_SIZE);
+    SDL_memcpy(ring->samples, &frames[first * AUDIO_OUT_CHANNELS], (total - first) * AUDIO_OUT_FRAME_SIZE);
 
-failed:
-    stop_audio();
-    return SDL_FALSE;
+    // samples must be visible before the consumer sees the new head
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ring->head, (int) (head + total));
+    return total;
 }
-/* Creates a Texture from Surface create from a file and returns it. */
-SDL_Texture *load_texture(SDL_RWops *rw){
-    if(rw == NULL){
-        return NULL;
-    }
-    SDL_Surface *surface = SDL_LoadBMP_RW(rw, 1);
-    if(!surface){
-        return NULL;
+
+/* Consumer side, returns number of frames actually read. */
+static Uint32 AudioRing_read(AudioRing *ring, float *frames, Uint32 num_frames){
+    const Uint32 tail = (Uint32) SDL_AtomicGet(&ring->tail);
+    const Uint32 total = SDL_min(num_frames, AudioRing_available(ring));
+    if(total == 0){
+        return 0; // might not even have `samples` yet
     }
+    const Uint32 start = tail & (ring->capacity - 1);
+    const Uint32 first = SDL_min(total, ring->capacity - start);
 
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_FreeSurface(surface);
-    return texture; // MAY BE NULL
+    SDL_memcpy(frames, &ring->samples[start * AUDIO_OUT_CHANNELS], first * AUDIO_OUT_FRAME_SIZE);
+    SDL_memcpy(&frames[first * AUDIO_OUT_CHANNELS], ring->samples, (total - first) * AUDIO_OUT_FRAME_SIZE);
 
+    // done reading before the producer may overwrite these frames
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ring->tail, (int) (tail + total));
+    return total;
 }
-static SDL_INLINE void init_skin_button(WinAmpSkinButton *btn, SDL_Texture *tex, ClickFunc onClick,
-                                               const int w, const int h, 
-                                               const int dx, const int dy, 
-                                               const int sxu, const int syu, 
-                                               const int sxp, const int syp){
-        btn->texture = tex;
-        btn->onClick = onClick;
-        btn->src_rect_unpressed.x = sxu;
-        btn->src_rect_unpressed.y = syu;
-        btn->src_rect_unpressed.w = w;
-        btn->src_rect_unpressed.h = h;
-        btn->src_rect_pressed.x = sxp;
-        btn->src_rect_pressed.y = syp;
-        btn->src_rect_pressed.w = w;
-        btn->src_rect_pressed.h = h;
-
-        btn->dst_rect.x = dx;
-        btn->dst_rect.y = dy;
-        btn->dst_rect.w = w;
-        btn->dst_rect.h = h;
 
+/* Consumer side, throws away everything before `head`. */
+static void AudioRing_discard_to(AudioRing *ring, const Uint32 head){
+    SDL_AtomicSet(&ring->tail, (int) head);
 }
 
-static SDL_INLINE void init_skin_slider(WinAmpSkinSlider *slider, SDL_Texture *tex, 
-                                               const int w, const int h, 
-                                               const int dx, const int dy, 
-                                               const int knob_w, const int knob_h,
-                                               const int sxu, const int syu, 
-                                               const int sxp, const int syp, 
-                                               const int frame_x_offset, const int frame_y_offset,
-                                               const int frame_w, const int frame_h,
-                                               const int num_frames, const float value){
+/* Frames of post-gain output kept for the visualizer. Must be a power of two. */
+#define VIS_TAP_FRAMES (1 << 14)
 
+/* Copy of what the callback last handed the device, for the visualizer.
+   The audio thread never waits on it: new frames just overwrite the oldest,
+   and the UI checks `reserve` afterwards to see if that happened under it. */
+typedef struct VisTap{
+    float samples[VIS_TAP_FRAMES * AUDIO_OUT_CHANNELS];
+    SDL_atomic_t head;    // frames written, free running
+    SDL_atomic_t reserve; // frames that may be in the middle of being written
+} VisTap;
 
-    init_skin_button(&slider->knob, tex, NULL, knob_w, knob_h, dx + (int)(((w - knob_w) * value) + 0.5f), dy, sxu, syu, sxp, syp);
-    slider->texture = tex;
-    slider->num_frames = num_frames;
-    slider->value = value;
-    slider->x_offset = frame_x_offset;
-    slider->y_offset = frame_y_offset;
-    slider->w = frame_w;
-    slider->h = frame_h;
+static VisTap vis_tap;
 
-    slider->dst_rect.x = dx;
-    slider->dst_rect.y = dy;
-    slider->dst_rect.w = w;
-    slider->dst_rect.h = h;
+/* Audio thread only. */
+static void VisTap_write(VisTap *tap, const float *frames, Uint32 num_frames){
+    const Uint32 head = (Uint32) SDL_AtomicGet(&tap->head);
+    const Uint32 skip = (num_frames > VIS_TAP_FRAMES) ? (num_frames - VIS_TAP_FRAMES) : 0;
+    const Uint32 total = num_frames - skip;
+    const Uint32 start = (head + skip) & (VIS_TAP_FRAMES - 1);
+    const Uint32 first = SDL_min(total, VIS_TAP_FRAMES - start);
+
+    // reader must be able to tell these slots are being overwritten before they are
+    SDL_AtomicSet(&tap->reserve, (int) (head + num_frames));
+    SDL_MemoryBarrierRelease();
 
+    SDL_memcpy(&tap->samples[start * AUDIO_OUT_CHANNELS], &frames[skip * AUDIO_OUT_CHANNELS], first * AUDIO_OUT_FRAME_SIZE);
+    SDL_memcpy(tap->samples, &frames[(skip + first) * AUDIO_OUT_CHANNELS], (total - first) * AUDIO_OUT_FRAME_SIZE);
 
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&tap->head, (int) (head + num_frames));
 }
 
-static void click_func_prev(void){
-    SDL_AudioStreamClear(stream);
-    if(SDL_AudioStreamPut(stream, wavbuf, wavlen) == -1){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "AudioStreamPut Failed!", SDL_GetError(), window);
-        stop_audio();
-    }else if(SDL_AudioStreamFlush(stream) == -1){
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "AudioStreamFlush Failed!", SDL_GetError(), window);
-        stop_audio();
+/* Multiplies interleaved stereo frames by a per-channel gain that moves
+   linearly from `from` to `to` across the buffer: frame i gets
+   from + ((to - from) / num_frames) * (i + 1). When from == to this is a
+   plain stereo gain. Picked at startup by select_dsp_kernels(). */
+typedef void (*StereoGainFunc)(float *samples, Uint32 num_frames, const float *from, const float *to);
+
+static void apply_stereo_gain_frames(float *samples, Uint32 first, Uint32 num_frames, const float *from, const float *step){
+    for(Uint32 i = first; i < num_frames; ++i){
+        const float frame = (float) (i + 1);
+        samples[i*2]   *= from[0] + (step[0] * frame);
+        samples[i*2+1] *= from[1] + (step[1] * frame);
     }
 }
 
-static void click_func_pause(void){
-    paused = paused ? SDL_FALSE : SDL_TRUE;
-    SDL_PauseAudioDevice(audio_device, paused);
+static void apply_stereo_gain_scalar(float *samples, Uint32 num_frames, const float *from, const float *to){
+    const float step[2] = { (to[0] - from[0]) / (float) num_frames, (to[1] - from[1]) / (float) num_frames };
+    apply_stereo_gain_frames(samples, 0, num_frames, from, step);
 }
 
-static void click_func_stop(void){
-    stop_audio();
-}
+#ifdef MYAMP_HAVE_SSE2
+static void apply_stereo_gain_sse2(float *samples, Uint32 num_frames, const float *from, const float *to){
+    const float step[2] = { (to[0] - from[0]) / (float) num_frames, (to[1] - from[1]) / (float) num_frames };
+    const __m128 base = _mm_setr_ps(from[0], from[1], from[0], from[1]);
+    const __m128 delta = _mm_setr_ps(step[0], step[1], step[0], step[1]);
+    const __m128 two = _mm_set1_ps(2.0f);
+    __m128 frame = _mm_setr_ps(1.0f, 1.0f, 2.0f, 2.0f);
+    Uint32 i;
 
-static SDL_RWops *openrw(ZipArchive *zip, const char *dirname, const char *fname){
-    if(zip){
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        const __m128 gain = _mm_add_ps(base, _mm_mul_ps(delta, frame));
+        _mm_storeu_ps(&samples[i*2], _mm_mul_ps(_mm_loadu_ps(&samples[i*2]), gain));
+        frame = _mm_add_ps(frame, two);
+    }
+    apply_stereo_gain_frames(samples, i, num_frames, from, step);
+}
+#endif
 
-        for(Uint32 i = 0; i < zip->num_entries; ++i){
-            const ZipEntry *entry = &zip->entries[i];
-            if(SDL_strcasecmp(entry->fname, fname) == 0){
-                SDL_RWseek(zip->rw, entry->file_pos, RW_SEEK_SET);
-                Uint8 *data = SDL_malloc(entry->compressed_size);
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void apply_stereo_gain_avx2(float *samples, Uint32 num_frames, const float *from, const float *to){
+    const float step[2] = { (to[0] - from[0]) / (float) num_frames, (to[1] - from[1]) / (float) num_frames };
+    const __m256 base = _mm256_setr_ps(from[0], from[1], from[0], from[1], from[0], from[1], from[0], from[1]);
+    const __m256 delta = _mm256_setr_ps(step[0], step[1], step[0], step[1], step[0], step[1], step[0], step[1]);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    __m256 frame = _mm256_setr_ps(1.0f, 1.0f, 2.0f, 2.0f, 3.0f, 3.0f, 4.0f, 4.0f);
+    Uint32 i;
 
-                SDL_RWread(zip->rw, data, entry->compressed_size, 1);
-                SDL_assert(entry->compression_type == 0);
-                // not checking if compressed data is actually compressed
-                return SDL_RWFromConstMem(data, entry->uncompressed_size);
-            }
-        }
-        return NULL;
+    for(i = 0; (i + 4) <= num_frames; i += 4){
+        const __m256 gain = _mm256_add_ps(base, _mm256_mul_ps(delta, frame));
+        _mm256_storeu_ps(&samples[i*2], _mm256_mul_ps(_mm256_loadu_ps(&samples[i*2]), gain));
+        frame = _mm256_add_ps(frame, four);
     }
-    // we dont have a zipfile, read from disk
-    const size_t fullpathlen = SDL_strlen(dirname) + 1 + SDL_strlen(fname) + 1;
-    char *fullpath = (char *)SDL_malloc(fullpathlen);
-    // FIXME: Name Case is a problem on linux
-    SDL_snprintf(fullpath, fullpathlen, "%s/%s", dirname, fname);
-    SDL_RWops *retval = SDL_RWFromFile(fullpath, "rb");
-    SDL_free(fullpath);
-    return retval;
+    apply_stereo_gain_frames(samples, i, num_frames, from, step);
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+static void apply_stereo_gain_neon(float *samples, Uint32 num_frames, const float *from, const float *to){
+    const float step[2] = { (to[0] - from[0]) / (float) num_frames, (to[1] - from[1]) / (float) num_frames };
+    const float base_init[4] = { from[0], from[1], from[0], from[1] };
+    const float delta_init[4] = { step[0], step[1], step[0], step[1] };
+    const float frame_init[4] = { 1.0f, 1.0f, 2.0f, 2.0f };
+    const float32x4_t base = vld1q_f32(base_init);
+    const float32x4_t delta = vld1q_f32(delta_init);
+    const float32x4_t two = vdupq_n_f32(2.0f);
+    float32x4_t frame = vld1q_f32(frame_init);
+    Uint32 i;
 
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        const float32x4_t gain = vaddq_f32(base, vmulq_f32(delta, frame));
+        vst1q_f32(&samples[i*2], vmulq_f32(vld1q_f32(&samples[i*2]), gain));
+        frame = vaddq_f32(frame, two);
+    }
+    apply_stereo_gain_frames(samples, i, num_frames, from, step);
 }
+#endif
 
-// FIXME: Use fname variable
-static void load_skin(WinAmpSkin *skin, const char *fname){
+/* Winamp's equalizer: one peaking biquad per band, then the preamp as a
+   plain gain stage, padded with a pass-through stage so the SIMD kernels
+   always get whole groups of stages. */
+#define EQ_NUM_STAGES 12
+#define EQ_PREAMP_STAGE EQ_NUM_BANDS
+#define EQ_MAX_DB 12.0f
+#define EQ_Q 1.2
 
+static const float eq_band_hz[EQ_NUM_BANDS] = { 60, 170, 310, 600, 1000, 3000, 6000, 12000, 14000, 16000 };
 
-    if(skin->tex_main    ){ SDL_DestroyTexture(skin->tex_main    ); }
-    if(skin->tex_cbuttons){ SDL_DestroyTexture(skin->tex_cbuttons); }
-    if(skin->tex_volume  ){ SDL_DestroyTexture(skin->tex_volume  ); }
-    if(skin->tex_balance ){ SDL_DestroyTexture(skin->tex_balance ); }
+/* Normalized so a0 == 1, same coefficients for both channels. */
+typedef struct EqCoeffs{
+    float b0[EQ_NUM_STAGES];
+    float b1[EQ_NUM_STAGES];
+    float b2[EQ_NUM_STAGES];
+    float a1[EQ_NUM_STAGES];
+    float a2[EQ_NUM_STAGES];
+} EqCoeffs;
 
-    SDL_zerop(skin);
+/* Transposed direct form II state, [stage][channel]. Audio thread only. */
+typedef struct EqState{
+    float z1[EQ_NUM_STAGES][AUDIO_OUT_CHANNELS];
+    float z2[EQ_NUM_STAGES][AUDIO_OUT_CHANNELS];
+} EqState;
 
+typedef struct EqParams{
+    EqCoeffs coeffs;
+    SDL_bool enabled; // false when everything is flat, the callback skips the EQ then
+} EqParams;
 
-    ZipArchive *zip = ZipArchive_load(fname);
-    skin->tex_main = load_texture(openrw(zip, fname, "MAIN.BMP"));
-    skin->tex_cbuttons = load_texture(openrw(zip, fname, "CBUTTONS.BMP"));
-    skin->tex_volume = load_texture(openrw(zip, fname, "VOLUME.BMP"));
-    skin->tex_balance = load_texture(openrw(zip, fname, "BALANCE.BMP"));
-    ZipArchive_unload(zip);
+/* Runs all EQ_NUM_STAGES over interleaved stereo `samples` in place. */
+typedef void (*EqFunc)(float *samples, Uint32 num_frames, const EqCoeffs *coeffs, EqState *state);
 
-    init_skin_button(&skin->buttons[WASBTN_PREV],   skin->tex_cbuttons, click_func_prev,  23, 18,  16, 88,   0, 0,   0, 18);
-    init_skin_button(&skin->buttons[WASBTN_PLAY],   skin->tex_cbuttons, NULL,  23, 18,  39, 88,  23, 0,  23, 18);
-    init_skin_button(&skin->buttons[WASBTN_PAUSE],  skin->tex_cbuttons, click_func_pause, 23, 18,  62, 88,  46, 0,  46, 18);
-    init_skin_button(&skin->buttons[WASBTN_STOP],   skin->tex_cbuttons, click_func_stop,  23, 18,  85, 88,  69, 0,  69, 18);
-    init_skin_button(&skin->buttons[WASBTN_NEXT],   skin->tex_cbuttons, NULL,  22, 18, 108, 88,  92, 0,  92, 18);
-    init_skin_button(&skin->buttons[WASBTN_EJECT],  skin->tex_cbuttons, NULL, 22, 16, 136, 89, 114, 0, 114, 16);
+/* Triple buffered so the UI can publish new settings whenever it likes and
+   the callback picks up the newest at its next buffer, neither ever waits.
+   eq_params_latest is the index of the newest complete set, with
+   EQ_PARAMS_FRESH set until the audio thread takes it. */
+#define EQ_PARAMS_FRESH 4
+static EqParams eq_params[3];
+static SDL_atomic_t eq_params_latest = { 2 };
+static int eq_params_back = 1;  // UI thread's, being filled in
+static int eq_params_front = 0; // audio thread's, in use
 
-    init_skin_slider(&skin->sliders[WASSLD_VOLUME], skin->tex_volume, 68, 13, 107, 57, 14, 11, 15, 422, 0, 422, 0, 0, 68, 15, 28, 1.0f);
+/* What runs after the mix, EQ then volume and balance, and the state it
+   carries from one buffer to the next. The device has one, offline renders
+   get their own each so they come out exactly as the device would play. */
+typedef struct DspChain{
+    float applied_gain[AUDIO_OUT_CHANNELS]; // per channel, last applied, ramps to new settings instead of jumping
+    SDL_bool eq_was_enabled;
+    EqState eq_state;
+} DspChain;
 
-    init_skin_slider(&skin->sliders[WASSLD_BALANCE], skin->tex_balance, 38, 13, 177, 57, 14, 11, 15, 422, 0, 422, 9, 0, 47, 15, 28, 0.5f);
+static DspChain device_dsp = { { 1.0f, 1.0f }, SDL_FALSE, { { { 0.0f } }, { { 0.0f } } } }; // audio thread only
 
+/* Slider positions (0 is -12dB, 0.5 flat, 1 is +12dB), preamp first. UI thread
+   only, kept here rather than in the skin so they survive skin changes. */
+static float eq_values[EQ_NUM_BANDS + 1] = { 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 0.5f };
 
-}
+static void EqParams_compute(EqParams *params, const float *values){
+    EqCoeffs *c = &params->coeffs;
 
-static void init_everything(int argc, char **argv){
-    SDL_AudioSpec desired;
-    
-    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1){
-        panic_and_abort("SDL_Init failed", SDL_GetError());
+    params->enabled = SDL_FALSE;
+    for(int s = 0; s < EQ_NUM_STAGES; ++s){
+        // pass-through unless set below
+        c->b0[s] = 1.0f;
+        c->b1[s] = c->b2[s] = c->a1[s] = c->a2[s] = 0.0f;
     }
-
-    window = SDL_CreateWindow("Hello SDL", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 275, 116, 0);
-    if(!window){
-        panic_and_abort("SDL_CreateWindow Failed!", SDL_GetError());
+    for(int b = 0; b < EQ_NUM_BANDS; ++b){
+        const double db = ((values[b + 1] * 2.0) - 1.0) * EQ_MAX_DB;
+        if(db == 0.0){
+            continue;
+        }
+        // near Nyquist the band's bell folds over and the filter blows up, leave it flat
+        if(eq_band_hz[b] >= (0.45f * (float) audio_out_freq)){
+            continue;
+        }
+        // RBJ audio EQ cookbook peaking filter
+        const double A = SDL_pow(10.0, db / 40.0);
+        const double w0 = (2.0 * M_PI * eq_band_hz[b]) / audio_out_freq;
+        const double alpha = SDL_sin(w0) / (2.0 * EQ_Q);
+        const double a0 = 1.0 + (alpha / A);
+        c->b0[b] = (float) ((1.0 + (alpha * A)) / a0);
+        c->b1[b] = (float) ((-2.0 * SDL_cos(w0)) / a0);
+        c->b2[b] = (float) ((1.0 - (alpha * A)) / a0);
+        c->a1[b] = c->b1[b];
+        c->a2[b] = (float) ((1.0 - (alpha / A)) / a0);
+        params->enabled = SDL_TRUE;
     }
-    // Tells SDL we want this event enabled
-    // It is disabled by default due to having mem allocation
-    // unfamiliar users may fall in the trap of not freeing the mem
-    // resulting in memory leak <---
-
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
-    if(!renderer){
-        panic_and_abort("SDL_CreateRenderer Failed!", SDL_GetError());
+    const double preamp_db = ((values[0] * 2.0) - 1.0) * EQ_MAX_DB;
+    if(preamp_db != 0.0){
+        c->b0[EQ_PREAMP_STAGE] = (float) SDL_pow(10.0, preamp_db / 20.0);
+        params->enabled = SDL_TRUE;
     }
+}
 
+/* UI thread. */
+static void publish_eq(const float *values){
+    EqParams_compute(&eq_params[eq_params_back], values);
+    // the coefficients land before the index does, and we only reuse what the audio thread has let go of
+    SDL_MemoryBarrierRelease();
+    eq_params_back = SDL_AtomicSet(&eq_params_latest, eq_params_back | EQ_PARAMS_FRESH) & ~EQ_PARAMS_FRESH;
+    SDL_MemoryBarrierAcquire();
+}
 
-    // FIXME: Load a real thing
-    load_skin(&skin, "base.wsz");
-
-    SDL_zero(desired);
-    desired.freq = 48000;
-    desired.format = AUDIO_F32;
-    desired.channels = 2;
-    desired.samples = 4096;
-    desired.callback = feed_audio_device_callback;
+/* Audio thread. */
+static const EqParams *acquire_eq_params(void){
+    if(SDL_AtomicGet(&eq_params_latest) & EQ_PARAMS_FRESH){
+        // done reading the old set before handing it back, and see all of the new one
+        SDL_MemoryBarrierRelease();
+        eq_params_front = SDL_AtomicSet(&eq_params_latest, eq_params_front) & ~EQ_PARAMS_FRESH;
+        SDL_MemoryBarrierAcquire();
+    }
+    return &eq_params[eq_params_front];
+}
 
-    audio_device = SDL_OpenAudioDevice( NULL, 0, &desired, NULL, 0);
-    if(audio_device == 0){
-        panic_and_abort("OpeAudioDevice Failed!", SDL_GetError());
+static void eq_process_scalar(float *samples, Uint32 num_frames, const EqCoeffs *c, EqState *state){
+    for(int s = 0; s < EQ_NUM_STAGES; ++s){
+        for(int ch = 0; ch < AUDIO_OUT_CHANNELS; ++ch){
+            float z1 = state->z1[s][ch];
+            float z2 = state->z2[s][ch];
+            for(Uint32 i = 0; i < num_frames; ++i){
+                const float x = samples[i*2+ch];
+                const float y = (c->b0[s] * x) + z1;
+                z1 = (c->b1[s] * x) - (c->a1[s] * y) + z2;
+                z2 = (c->b2[s] * x) - (c->a2[s] * y);
+                samples[i*2+ch] = y;
+            }
+            state->z1[s][ch] = z1;
+            state->z2[s][ch] = z2;
+        }
     }
+}
 
-    SDL_EventState(SDL_DROPFILE, SDL_ENABLE); 
-    open_new_audio_file("music.wav");
+/* The SIMD kernels below run a group of stages per pass with a stereo frame
+   per stage in the vector, each stage one frame behind the one before it:
+   lanes are [stage s at frame i, stage s+1 at frame i-1, ...]. That way each
+   stage's input is what the previous stage produced last iteration and the
+   lanes never wait on each other. The first and last few iterations of a
+   pass only have some stages on real frames, the rest keep their state. */
 
+#ifdef MYAMP_HAVE_SSE2
+static SDL_INLINE __m128 eq_select_sse2(const __m128 mask, const __m128 a, const __m128 b){
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
 }
 
-static void draw_button(SDL_Renderer *renderer, WinAmpSkinButton *btn){
-   
-    const SDL_bool pressed = (skin.pressed == btn);
-    if(btn->texture == NULL){
-        if(pressed){
-            SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
-        }else{
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+static void eq_process_sse2(float *samples, Uint32 num_frames, const EqCoeffs *c, EqState *state){
+    const __m128 low_only = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, 0, 0));
+    const __m128 high_only = _mm_castsi128_ps(_mm_setr_epi32(0, 0, -1, -1));
+
+    if(num_frames == 0){
+        return;
+    }
+    for(int s = 0; s < EQ_NUM_STAGES; s += 2){
+        const __m128 b0 = _mm_setr_ps(c->b0[s], c->b0[s], c->b0[s+1], c->b0[s+1]);
+        const __m128 b1 = _mm_setr_ps(c->b1[s], c->b1[s], c->b1[s+1], c->b1[s+1]);
+        const __m128 b2 = _mm_setr_ps(c->b2[s], c->b2[s], c->b2[s+1], c->b2[s+1]);
+        const __m128 a1 = _mm_setr_ps(c->a1[s], c->a1[s], c->a1[s+1], c->a1[s+1]);
+        const __m128 a2 = _mm_setr_ps(c->a2[s], c->a2[s], c->a2[s+1], c->a2[s+1]);
+        __m128 z1 = _mm_loadu_ps(&state->z1[s][0]);
+        __m128 z2 = _mm_loadu_ps(&state->z2[s][0]);
+        __m128 y = _mm_setzero_ps();
+
+        for(Uint32 i = 0; i <= num_frames; ++i){
+            const __m128 in = (i < num_frames) ? _mm_castpd_ps(_mm_load_sd((const double *) &samples[i*2])) : _mm_setzero_ps();
+            const __m128 x = _mm_movelh_ps(in, y);
+            y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+            const __m128 new_z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+            const __m128 new_z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            if(i == 0){
+                z1 = eq_select_sse2(low_only, new_z1, z1);
+                z2 = eq_select_sse2(low_only, new_z2, z2);
+            }else if(i == num_frames){
+                z1 = eq_select_sse2(high_only, new_z1, z1);
+                z2 = eq_select_sse2(high_only, new_z2, z2);
+            }else{
+                z1 = new_z1;
+                z2 = new_z2;
+            }
+            if(i > 0){
+                _mm_storeh_pi((__m64 *) &samples[(i-1)*2], y);
+            }
         }
-        SDL_RenderFillRect(renderer, &btn->dst_rect);
-    }else{
-        SDL_Rect *btn_rect = pressed ? &btn->src_rect_pressed : &btn->src_rect_unpressed;
-        SDL_RenderCopy(renderer, btn->texture, btn_rect, &btn->dst_rect);
+        _mm_storeu_ps(&state->z1[s][0], z1);
+        _mm_storeu_ps(&state->z2[s][0], z2);
     }
 }
+#endif
 
-static void draw_slider(SDL_Renderer *renderer, WinAmpSkinSlider *slider){
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void eq_process_avx2(float *samples, Uint32 num_frames, const EqCoeffs *c, EqState *state){
+    // lane pair k holds stage s+k, which is k frames behind
+    const __m256i lane_delay = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i shift_up = _mm256_setr_epi32(0, 1, 0, 1, 2, 3, 4, 5);
+    const __m256i frame_count = _mm256_set1_epi32((int) num_frames);
 
+    if(num_frames == 0){
+        return;
+    }
+    SDL_COMPILE_TIME_ASSERT(eq_stages_avx2, (EQ_NUM_STAGES % 4) == 0);
+    for(int s = 0; s < EQ_NUM_STAGES; s += 4){
+        const __m256 b0 = _mm256_setr_ps(c->b0[s], c->b0[s], c->b0[s+1], c->b0[s+1], c->b0[s+2], c->b0[s+2], c->b0[s+3], c->b0[s+3]);
+        const __m256 b1 = _mm256_setr_ps(c->b1[s], c->b1[s], c->b1[s+1], c->b1[s+1], c->b1[s+2], c->b1[s+2], c->b1[s+3], c->b1[s+3]);
+        const __m256 b2 = _mm256_setr_ps(c->b2[s], c->b2[s], c->b2[s+1], c->b2[s+1], c->b2[s+2], c->b2[s+2], c->b2[s+3], c->b2[s+3]);
+        const __m256 a1 = _mm256_setr_ps(c->a1[s], c->a1[s], c->a1[s+1], c->a1[s+1], c->a1[s+2], c->a1[s+2], c->a1[s+3], c->a1[s+3]);
+        const __m256 a2 = _mm256_setr_ps(c->a2[s], c->a2[s], c->a2[s+1], c->a2[s+1], c->a2[s+2], c->a2[s+2], c->a2[s+3], c->a2[s+3]);
+        __m256 z1 = _mm256_loadu_ps(&state->z1[s][0]);
+        __m256 z2 = _mm256_loadu_ps(&state->z2[s][0]);
+        __m256 y = _mm256_setzero_ps();
 
-    SDL_assert(slider->value >= 0.0f);
-    SDL_assert(slider->value <= 1.0f);
-   
-    if(slider->texture == NULL){
-        const int color = (int)(slider->value * 255.0f);
-        SDL_SetRenderDrawColor(renderer, 200, 0, color, 255);
-        SDL_RenderFillRect(renderer, &slider->dst_rect);
-    }else{
-        const int frame_idx = ((int)((float)(slider->num_frames - 1) * slider->value));
-        const int srcy = slider->y_offset + (frame_idx * slider->h);
-        const SDL_Rect src_rect = { slider->x_offset, srcy, slider->dst_rect.w, slider->dst_rect.h};
-        SDL_RenderCopy(renderer, slider->texture, &src_rect, &slider->dst_rect);
+        for(Uint32 i = 0; i < num_frames + 3; ++i){
+            const __m256 in = (i < num_frames) ? _mm256_castpd_ps(_mm256_broadcast_sd((const double *) &samples[i*2])) : _mm256_setzero_ps();
+            const __m256 x = _mm256_blend_ps(_mm256_permutevar8x32_ps(y, shift_up), in, 0x03);
+            y = _mm256_add_ps(_mm256_mul_ps(b0, x), z1);
+            const __m256 new_z1 = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(b1, x), _mm256_mul_ps(a1, y)), z2);
+            const __m256 new_z2 = _mm256_sub_ps(_mm256_mul_ps(b2, x), _mm256_mul_ps(a2, y));
+            if((i >= 3) && (i < num_frames)){
+                z1 = new_z1;
+                z2 = new_z2;
+            }else{
+                // lanes whose frame i - delay is outside the buffer keep their state
+                const __m256i frame = _mm256_sub_epi32(_mm256_set1_epi32((int) i), lane_delay);
+                const __m256i valid = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), frame),
+                                                          _mm256_cmpgt_epi32(frame_count, frame));
+                z1 = _mm256_blendv_ps(z1, new_z1, _mm256_castsi256_ps(valid));
+                z2 = _mm256_blendv_ps(z2, new_z2, _mm256_castsi256_ps(valid));
+            }
+            if(i >= 3){
+                _mm_storeh_pi((__m64 *) &samples[(i-3)*2], _mm256_extractf128_ps(y, 1));
+            }
+        }
+        _mm256_storeu_ps(&state->z1[s][0], z1);
+        _mm256_storeu_ps(&state->z2[s][0], z2);
     }
-    draw_button(renderer, &slider->knob);
 }
+#endif
 
-static void draw_frame(SDL_Renderer *renderer, WinAmpSkin *skin){
-
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, skin->tex_main, NULL, NULL);
+#ifdef MYAMP_HAVE_NEON
+static void eq_process_neon(float *samples, Uint32 num_frames, const EqCoeffs *c, EqState *state){
+    const uint32_t low_init[4] = { ~0u, ~0u, 0, 0 };
+    const uint32x4_t low_only = vld1q_u32(low_init);
+    const uint32x4_t high_only = vmvnq_u32(low_only);
 
-    int i;
-    for(i = 0; i < SDL_arraysize(skin->buttons); ++i){
-        draw_button(renderer, &skin->buttons[i]);
+    if(num_frames == 0){
+        return;
     }
+    for(int s = 0; s < EQ_NUM_STAGES; s += 2){
+        const float32x4_t b0 = vcombine_f32(vdup_n_f32(c->b0[s]), vdup_n_f32(c->b0[s+1]));
+        const float32x4_t b1 = vcombine_f32(vdup_n_f32(c->b1[s]), vdup_n_f32(c->b1[s+1]));
+        const float32x4_t b2 = vcombine_f32(vdup_n_f32(c->b2[s]), vdup_n_f32(c->b2[s+1]));
+        const float32x4_t a1 = vcombine_f32(vdup_n_f32(c->a1[s]), vdup_n_f32(c->a1[s+1]));
+        const float32x4_t a2 = vcombine_f32(vdup_n_f32(c->a2[s]), vdup_n_f32(c->a2[s+1]));
+        float32x4_t z1 = vld1q_f32(&state->z1[s][0]);
+        float32x4_t z2 = vld1q_f32(&state->z2[s][0]);
+        float32x4_t y = vdupq_n_f32(0.0f);
 
-    for(i = 0; i < SDL_arraysize(skin->sliders); ++i){
-        draw_slider(renderer, &skin->sliders[i]);
+        for(Uint32 i = 0; i <= num_frames; ++i){
+            const float32x2_t in = (i < num_frames) ? vld1_f32(&samples[i*2]) : vdup_n_f32(0.0f);
+            const float32x4_t x = vcombine_f32(in, vget_low_f32(y));
+            y = vmlaq_f32(z1, b0, x);
+            const float32x4_t new_z1 = vaddq_f32(vmlsq_f32(vmulq_f32(b1, x), a1, y), z2);
+            const float32x4_t new_z2 = vmlsq_f32(vmulq_f32(b2, x), a2, y);
+            if(i == 0){
+                z1 = vbslq_f32(low_only, new_z1, z1);
+                z2 = vbslq_f32(low_only, new_z2, z2);
+            }else if(i == num_frames){
+                z1 = vbslq_f32(high_only, new_z1, z1);
+                z2 = vbslq_f32(high_only, new_z2, z2);
+            }else{
+                z1 = new_z1;
+                z2 = new_z2;
+            }
+            if(i > 0){
+                vst1_f32(&samples[(i-1)*2], vget_high_f32(y));
+            }
+        }
+        vst1q_f32(&state->z1[s][0], z1);
+        vst1q_f32(&state->z2[s][0], z2);
     }
-    SDL_RenderPresent(renderer);
 }
+#endif
 
+/* Native 16-bit PCM to float, same scale SDL_AudioStream uses. For files
+   that are already at the device rate and only need widening. */
+typedef void (*ConvertS16Func)(float *out, const Sint16 *in, Uint32 num_samples);
 
-static void deinit_everything(void){
-    // FIXME: free_skin
-    SDL_FreeWAV(wavbuf);
-
-
-    SDL_CloseAudioDevice(audio_device);
-    SDL_DestroyWindow(window);
-    SDL_DestroyRenderer(renderer);
-    SDL_Quit();
+static void convert_s16_samples(float *out, const Sint16 *in, Uint32 first, Uint32 num_samples){
+    for(Uint32 i = first; i < num_samples; ++i){
+        out[i] = (float) (Sint16) SDL_SwapLE16(in[i]) * (1.0f / 32768.0f);
+    }
 }
 
-static void handle_slider_motion(WinAmpSkinSlider *slider, const SDL_Point *pt){
-    if(skin.pressed == &slider->knob){
-        const float new_val = ((float)pt->x - (float)slider->dst_rect.x) / (float)slider->dst_rect.w;
-        const int new_knob_x = pt->x - (slider->knob.dst_rect.w/2);
-        const int leftx = slider->dst_rect.x;
-        const int rightx = leftx + slider->dst_rect.w - slider->knob.dst_rect.w;
-        slider->knob.dst_rect.x = SDL_clamp(new_knob_x, leftx, rightx);
+static void convert_s16_scalar(float *out, const Sint16 *in, Uint32 num_samples){
+    convert_s16_samples(out, in, 0, num_samples);
+}
 
-        // Make sure Mixer Thread isnt running when this value changes
-        SDL_LockAudioDevice(audio_device);
+#ifdef MYAMP_HAVE_SSE2
+static void convert_s16_sse2(float *out, const Sint16 *in, Uint32 num_samples){
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    Uint32 i;
 
-        slider->value = SDL_clamp(new_val, 0.0f, 1.0f);
-        SDL_UnlockAudioDevice(audio_device);
+    for(i = 0; (i + 8) <= num_samples; i += 8){
+        const __m128i v = _mm_loadu_si128((const __m128i *) &in[i]);
+        // each sample into the top half of a 32-bit lane, then shift down to sign extend
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(&out[i],     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(&out[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
     }
+    convert_s16_samples(out, in, i, num_samples);
 }
+#endif
 
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void convert_s16_avx2(float *out, const Sint16 *in, Uint32 num_samples){
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    Uint32 i;
 
-static SDL_bool handle_events(WinAmpSkin *skin){
+    for(i = 0; (i + 16) <= num_samples; i += 16){
+        const __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) &in[i]));
+        const __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) &in[i + 8]));
+        _mm256_storeu_ps(&out[i],     _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(&out[i + 8], _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    convert_s16_samples(out, in, i, num_samples);
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+static void convert_s16_neon(float *out, const Sint16 *in, Uint32 num_samples){
+    Uint32 i;
+
+    for(i = 0; (i + 8) <= num_samples; i += 8){
+        const int16x8_t v = vld1q_s16(&in[i]);
+        const float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        const float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        vst1q_f32(&out[i],     vmulq_n_f32(lo, 1.0f / 32768.0f));
+        vst1q_f32(&out[i + 4], vmulq_n_f32(hi, 1.0f / 32768.0f));
+    }
+    convert_s16_samples(out, in, i, num_samples);
+}
+#endif
+
+/* Adds interleaved stereo `in` into `out`, scaled by one gain for both
+   channels that moves from `from` to `to` the same way StereoGainFunc's does.
+   How the mixer sums its voices. */
+typedef void (*MixFunc)(float *out, const float *in, Uint32 num_frames, const float from, const float to);
+
+static void mix_frames(float *out, const float *in, Uint32 first, Uint32 num_frames, const float from, const float step){
+    for(Uint32 i = first; i < num_frames; ++i){
+        const float gain = from + (step * (float) (i + 1));
+        out[i*2]   += in[i*2]   * gain;
+        out[i*2+1] += in[i*2+1] * gain;
+    }
+}
+
+static void mix_scalar(float *out, const float *in, Uint32 num_frames, const float from, const float to){
+    mix_frames(out, in, 0, num_frames, from, (to - from) / (float) num_frames);
+}
+
+#ifdef MYAMP_HAVE_SSE2
+static void mix_sse2(float *out, const float *in, Uint32 num_frames, const float from, const float to){
+    const float step = (to - from) / (float) num_frames;
+    const __m128 base = _mm_set1_ps(from);
+    const __m128 delta = _mm_set1_ps(step);
+    const __m128 two = _mm_set1_ps(2.0f);
+    __m128 frame = _mm_setr_ps(1.0f, 1.0f, 2.0f, 2.0f);
+    Uint32 i;
+
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        const __m128 gain = _mm_add_ps(base, _mm_mul_ps(delta, frame));
+        _mm_storeu_ps(&out[i*2], _mm_add_ps(_mm_loadu_ps(&out[i*2]), _mm_mul_ps(_mm_loadu_ps(&in[i*2]), gain)));
+        frame = _mm_add_ps(frame, two);
+    }
+    mix_frames(out, in, i, num_frames, from, step);
+}
+#endif
+
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void mix_avx2(float *out, const float *in, Uint32 num_frames, const float from, const float to){
+    const float step = (to - from) / (float) num_frames;
+    const __m256 base = _mm256_set1_ps(from);
+    const __m256 delta = _mm256_set1_ps(step);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    __m256 frame = _mm256_setr_ps(1.0f, 1.0f, 2.0f, 2.0f, 3.0f, 3.0f, 4.0f, 4.0f);
+    Uint32 i;
+
+    for(i = 0; (i + 4) <= num_frames; i += 4){
+        const __m256 gain = _mm256_add_ps(base, _mm256_mul_ps(delta, frame));
+        _mm256_storeu_ps(&out[i*2], _mm256_add_ps(_mm256_loadu_ps(&out[i*2]), _mm256_mul_ps(_mm256_loadu_ps(&in[i*2]), gain)));
+        frame = _mm256_add_ps(frame, four);
+    }
+    mix_frames(out, in, i, num_frames, from, step);
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+static void mix_neon(float *out, const float *in, Uint32 num_frames, const float from, const float to){
+    const float step = (to - from) / (float) num_frames;
+    const float frame_init[4] = { 1.0f, 1.0f, 2.0f, 2.0f };
+    const float32x4_t base = vdupq_n_f32(from);
+    const float32x4_t two = vdupq_n_f32(2.0f);
+    float32x4_t frame = vld1q_f32(frame_init);
+    Uint32 i;
+
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        const float32x4_t gain = vmlaq_n_f32(base, frame, step);
+        vst1q_f32(&out[i*2], vmlaq_f32(vld1q_f32(&out[i*2]), vld1q_f32(&in[i*2]), gain));
+        frame = vaddq_f32(frame, two);
+    }
+    mix_frames(out, in, i, num_frames, from, step);
+}
+#endif
+
+/* Largest absolute sample in each channel of interleaved stereo `samples`,
+   for the level meters. */
+typedef void (*PeakFunc)(const float *samples, Uint32 num_frames, float *peaks);
+
+static void peak_frames(const float *samples, Uint32 first, Uint32 num_frames, float *peaks){
+    for(Uint32 i = first; i < num_frames; ++i){
+        peaks[0] = SDL_max(peaks[0], SDL_fabsf(samples[i*2]));
+        peaks[1] = SDL_max(peaks[1], SDL_fabsf(samples[i*2+1]));
+    }
+}
+
+static void peak_scalar(const float *samples, Uint32 num_frames, float *peaks){
+    peaks[0] = peaks[1] = 0.0f;
+    peak_frames(samples, 0, num_frames, peaks);
+}
+
+#ifdef MYAMP_HAVE_SSE2
+static void peak_sse2(const float *samples, Uint32 num_frames, float *peaks){
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 peak = _mm_setzero_ps();
+    Uint32 i;
+
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        peak = _mm_max_ps(peak, _mm_and_ps(_mm_loadu_ps(&samples[i*2]), abs_mask));
+    }
+    peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+    _mm_storel_pi((__m64 *) peaks, peak);
+    peak_frames(samples, i, num_frames, peaks);
+}
+#endif
+
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void peak_avx2(const float *samples, Uint32 num_frames, float *peaks){
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 peak = _mm256_setzero_ps();
+    Uint32 i;
+
+    for(i = 0; (i + 4) <= num_frames; i += 4){
+        peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(&samples[i*2]), abs_mask));
+    }
+    __m128 half = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+    half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+    _mm_storel_pi((__m64 *) peaks, half);
+    peak_frames(samples, i, num_frames, peaks);
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+static void peak_neon(const float *samples, Uint32 num_frames, float *peaks){
+    float32x4_t peak = vdupq_n_f32(0.0f);
+    Uint32 i;
+
+    for(i = 0; (i + 2) <= num_frames; i += 2){
+        peak = vmaxq_f32(peak, vabsq_f32(vld1q_f32(&samples[i*2])));
+    }
+    vst1_f32(peaks, vmax_f32(vget_low_f32(peak), vget_high_f32(peak)));
+    peak_frames(samples, i, num_frames, peaks);
+}
+#endif
+
+/* BS.1770 K-weighting: a high shelf for the head, then a high pass, as two
+   biquads run in doubles (floats can't hold a 38Hz pole steady). Returns
+   the sum of both channels' squared outputs for the loudness meter. */
+typedef struct KWeightCoeffs{
+    double b[2][3];
+    double a[2][2]; // a1, a2, a0 is 1
+} KWeightCoeffs;
+
+typedef struct KWeightState{
+    double z[2][2][2]; // [stage][delay][channel], channels side by side for SIMD
+    double pending[2]; // avx2 only, stage one's last output not through stage two yet
+} KWeightState;
+
+typedef double (*KWeightFunc)(const KWeightCoeffs *coeffs, KWeightState *state, const float *frames, Uint32 num_frames);
+
+static double kweight_scalar(const KWeightCoeffs *coeffs, KWeightState *state, const float *frames, Uint32 num_frames){
+    double energy = 0.0;
+    for(Uint32 i = 0; i < num_frames; ++i){
+        for(int ch = 0; ch < 2; ++ch){
+            double x = frames[i*2+ch];
+            for(int s = 0; s < 2; ++s){
+                const double y = (coeffs->b[s][0] * x) + state->z[s][0][ch];
+                state->z[s][0][ch] = (coeffs->b[s][1] * x) - (coeffs->a[s][0] * y) + state->z[s][1][ch];
+                state->z[s][1][ch] = (coeffs->b[s][2] * x) - (coeffs->a[s][1] * y);
+                x = y;
+            }
+            energy += x * x;
+        }
+    }
+    return energy;
+}
+
+#ifdef MYAMP_HAVE_SSE2
+/* Left and right in the two lanes. */
+static double kweight_sse2(const KWeightCoeffs *coeffs, KWeightState *state, const float *frames, Uint32 num_frames){
+    __m128d b[2][3], a[2][2], z[2][2];
+    __m128d energy = _mm_setzero_pd();
+    for(int s = 0; s < 2; ++s){
+        for(int k = 0; k < 3; ++k){
+            b[s][k] = _mm_set1_pd(coeffs->b[s][k]);
+        }
+        a[s][0] = _mm_set1_pd(coeffs->a[s][0]);
+        a[s][1] = _mm_set1_pd(coeffs->a[s][1]);
+        z[s][0] = _mm_loadu_pd(state->z[s][0]);
+        z[s][1] = _mm_loadu_pd(state->z[s][1]);
+    }
+    for(Uint32 i = 0; i < num_frames; ++i){
+        __m128d x = _mm_cvtps_pd(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) &frames[i*2]));
+        for(int s = 0; s < 2; ++s){
+            const __m128d y = _mm_add_pd(_mm_mul_pd(b[s][0], x), z[s][0]);
+            z[s][0] = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b[s][1], x), _mm_mul_pd(a[s][0], y)), z[s][1]);
+            z[s][1] = _mm_sub_pd(_mm_mul_pd(b[s][2], x), _mm_mul_pd(a[s][1], y));
+            x = y;
+        }
+        energy = _mm_add_pd(energy, _mm_mul_pd(x, x));
+    }
+    for(int s = 0; s < 2; ++s){
+        _mm_storeu_pd(state->z[s][0], z[s][0]);
+        _mm_storeu_pd(state->z[s][1], z[s][1]);
+    }
+    return _mm_cvtsd_f64(_mm_add_sd(energy, _mm_unpackhi_pd(energy, energy)));
+}
+#endif
+
+#ifdef MYAMP_HAVE_AVX2
+/* Both stages in one step: the low lanes take this frame through stage
+   one while the high lanes take the last frame's stage one output through
+   stage two, so the chain of dependent math per frame is half as long.
+   Stage two runs a frame behind, carried over in `pending`. */
+__attribute__((target("avx2")))
+static double kweight_avx2(const KWeightCoeffs *coeffs, KWeightState *state, const float *frames, Uint32 num_frames){
+    const __m256d b0 = _mm256_setr_pd(coeffs->b[0][0], coeffs->b[0][0], coeffs->b[1][0], coeffs->b[1][0]);
+    const __m256d b1 = _mm256_setr_pd(coeffs->b[0][1], coeffs->b[0][1], coeffs->b[1][1], coeffs->b[1][1]);
+    const __m256d b2 = _mm256_setr_pd(coeffs->b[0][2], coeffs->b[0][2], coeffs->b[1][2], coeffs->b[1][2]);
+    const __m256d a1 = _mm256_setr_pd(coeffs->a[0][0], coeffs->a[0][0], coeffs->a[1][0], coeffs->a[1][0]);
+    const __m256d a2 = _mm256_setr_pd(coeffs->a[0][1], coeffs->a[0][1], coeffs->a[1][1], coeffs->a[1][1]);
+    __m256d z1 = _mm256_setr_pd(state->z[0][0][0], state->z[0][0][1], state->z[1][0][0], state->z[1][0][1]);
+    __m256d z2 = _mm256_setr_pd(state->z[0][1][0], state->z[0][1][1], state->z[1][1][0], state->z[1][1][1]);
+    __m128d pending = _mm_loadu_pd(state->pending);
+    __m128d energy = _mm_setzero_pd();
+
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const __m128d x = _mm_cvtps_pd(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) &frames[i*2]));
+        const __m256d in = _mm256_insertf128_pd(_mm256_castpd128_pd256(x), pending, 1);
+        const __m256d y = _mm256_add_pd(_mm256_mul_pd(b0, in), z1);
+        z1 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b1, in), _mm256_mul_pd(a1, y)), z2);
+        z2 = _mm256_sub_pd(_mm256_mul_pd(b2, in), _mm256_mul_pd(a2, y));
+        const __m128d out = _mm256_extractf128_pd(y, 1);
+        energy = _mm_add_pd(energy, _mm_mul_pd(out, out));
+        pending = _mm256_castpd256_pd128(y);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, z1);
+    state->z[0][0][0] = lanes[0]; state->z[0][0][1] = lanes[1]; state->z[1][0][0] = lanes[2]; state->z[1][0][1] = lanes[3];
+    _mm256_storeu_pd(lanes, z2);
+    state->z[0][1][0] = lanes[0]; state->z[0][1][1] = lanes[1]; state->z[1][1][0] = lanes[2]; state->z[1][1][1] = lanes[3];
+    _mm_storeu_pd(state->pending, pending);
+    return _mm_cvtsd_f64(_mm_add_sd(energy, _mm_unpackhi_pd(energy, energy)));
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+#if defined(__aarch64__) || defined(_M_ARM64)
+static double kweight_neon(const KWeightCoeffs *coeffs, KWeightState *state, const float *frames, Uint32 num_frames){
+    float64x2_t z[2][2];
+    float64x2_t energy = vdupq_n_f64(0.0);
+    for(int s = 0; s < 2; ++s){
+        z[s][0] = vld1q_f64(state->z[s][0]);
+        z[s][1] = vld1q_f64(state->z[s][1]);
+    }
+    for(Uint32 i = 0; i < num_frames; ++i){
+        float64x2_t x = vcvt_f64_f32(vld1_f32(&frames[i*2]));
+        for(int s = 0; s < 2; ++s){
+            const float64x2_t y = vfmaq_n_f64(z[s][0], x, coeffs->b[s][0]);
+            z[s][0] = vfmsq_n_f64(vfmaq_n_f64(z[s][1], x, coeffs->b[s][1]), y, coeffs->a[s][0]);
+            z[s][1] = vfmsq_n_f64(vmulq_n_f64(x, coeffs->b[s][2]), y, coeffs->a[s][1]);
+            x = y;
+        }
+        energy = vfmaq_f64(energy, x, x);
+    }
+    for(int s = 0; s < 2; ++s){
+        vst1q_f64(state->z[s][0], z[s][0]);
+        vst1q_f64(state->z[s][1], z[s][1]);
+    }
+    return vaddvq_f64(energy);
+}
+#else
+// 32-bit NEON has no doubles
+#define kweight_neon kweight_scalar
+#endif
+#endif
+
+/* Streaming polyphase resampler, decoded audio on its way to the device
+   rate. Interleaved stereo in and out. With the rates reduced to out/in =
+   L/M, output frame n sits at input frame n*M/L, which is always one of L
+   phases between two input frames, each with its own FIR filter. Filters
+   and the input buffer are allocated in Resampler_init and nothing after. */
+#define RESAMPLER_MAX_PHASES 1024 // rarer ratios use the nearest of this many, plus one a whole frame on
+#define RESAMPLER_MAX_TAPS 512
+#define RESAMPLER_BLOCK_FRAMES 4096 // most Resampler_input hands out at once
+
+typedef struct Resampler Resampler;
+
+/* Fills `out` with `num_frames` from wherever `rs` is, and moves it on.
+   The caller checks there's enough input first. */
+typedef void (*ResampleFunc)(Resampler *rs, float *out, Uint32 num_frames);
+
+struct Resampler{
+    ResampleFunc process;
+    float *filters;     // [filter][tap][channel], zero padded to a multiple of 4 taps, num_filters + 1 of them
+    float *frames;      // input
+    Uint32 capacity;    // of `frames`
+    Uint32 taps;        // padded
+    Uint32 half;        // half the real length, tap half - 1 is the input frame at or before the output
+    Uint32 num_phases;  // L
+    Uint32 num_filters; // L, or RESAMPLER_MAX_PHASES if that's less
+    Uint32 step_whole;  // M / L
+    Uint32 step_frac;   // M % L
+    Uint32 start;       // first frame of the next output's window
+    Uint32 end;         // frames in `frames`
+    Uint32 phase;       // of the next output past `start` + half - 1, in 1/L frames
+    Uint64 frames_in;   // real ones, no priming or padding
+    Uint64 frames_out;
+    SDL_bool flushed;
+};
+
+static SDL_INLINE const float *Resampler_filter(const Resampler *rs){
+    // rounding up past the last phase lands on the extra filter, which is the first one a frame later
+    const Uint32 filter = (rs->num_filters == rs->num_phases) ? rs->phase :
+                          (Uint32) ((((Uint64) rs->phase * rs->num_filters) + (rs->num_phases / 2)) / rs->num_phases);
+    return &rs->filters[filter * rs->taps * AUDIO_OUT_CHANNELS];
+}
+
+static SDL_INLINE void Resampler_advance(Resampler *rs){
+    rs->start += rs->step_whole;
+    rs->phase += rs->step_frac;
+    if(rs->phase >= rs->num_phases){
+        rs->phase -= rs->num_phases;
+        rs->start++;
+    }
+}
+
+static void resample_scalar(Resampler *rs, float *out, Uint32 num_frames){
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const float *in = &rs->frames[rs->start * 2];
+        const float *filter = Resampler_filter(rs);
+        float left = 0.0f;
+        float right = 0.0f;
+        for(Uint32 k = 0; k < rs->taps * 2; k += 2){
+            left  += in[k]   * filter[k];
+            right += in[k+1] * filter[k+1];
+        }
+        out[i*2]   = left;
+        out[i*2+1] = right;
+        Resampler_advance(rs);
+    }
+}
+
+#ifdef MYAMP_HAVE_SSE2
+static void resample_sse2(Resampler *rs, float *out, Uint32 num_frames){
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const float *in = &rs->frames[rs->start * 2];
+        const float *filter = Resampler_filter(rs);
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for(Uint32 k = 0; k < rs->taps * 2; k += 8){
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(&in[k]),     _mm_loadu_ps(&filter[k])));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(&in[k + 4]), _mm_loadu_ps(&filter[k + 4])));
+        }
+        acc0 = _mm_add_ps(acc0, acc1);
+        // two frames to a register, fold them into one
+        acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+        _mm_storel_pi((__m64 *) &out[i*2], acc0);
+        Resampler_advance(rs);
+    }
+}
+#endif
+
+#ifdef MYAMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static void resample_avx2(Resampler *rs, float *out, Uint32 num_frames){
+    const Uint32 num_samples = rs->taps * 2;
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const float *in = &rs->frames[rs->start * 2];
+        const float *filter = Resampler_filter(rs);
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        Uint32 k;
+        for(k = 0; (k + 16) <= num_samples; k += 16){
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(&in[k]),     _mm256_loadu_ps(&filter[k])));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(&in[k + 8]), _mm256_loadu_ps(&filter[k + 8])));
+        }
+        if(k < num_samples){
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(&in[k]), _mm256_loadu_ps(&filter[k])));
+        }
+        acc0 = _mm256_add_ps(acc0, acc1);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        _mm_storel_pi((__m64 *) &out[i*2], sum);
+        Resampler_advance(rs);
+    }
+}
+#endif
+
+#ifdef MYAMP_HAVE_NEON
+static void resample_neon(Resampler *rs, float *out, Uint32 num_frames){
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const float *in = &rs->frames[rs->start * 2];
+        const float *filter = Resampler_filter(rs);
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        for(Uint32 k = 0; k < rs->taps * 2; k += 8){
+            acc0 = vmlaq_f32(acc0, vld1q_f32(&in[k]),     vld1q_f32(&filter[k]));
+            acc1 = vmlaq_f32(acc1, vld1q_f32(&in[k + 4]), vld1q_f32(&filter[k + 4]));
+        }
+        acc0 = vaddq_f32(acc0, acc1);
+        vst1_f32(&out[i*2], vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0)));
+        Resampler_advance(rs);
+    }
+}
+#endif
+
+typedef struct DspKernel{
+    const char *name;
+    SDL_bool (SDLCALL *supported)(void); // NULL if always available
+    StereoGainFunc stereo_gain;
+    EqFunc eq;
+    ConvertS16Func convert_s16;
+    MixFunc mix;
+    ResampleFunc resample;
+    PeakFunc peak;
+    KWeightFunc kweight;
+} DspKernel;
+
+/* Widest first, select_dsp_kernels() takes the first one the CPU supports. */
+static const DspKernel dsp_kernels[] = {
+#ifdef MYAMP_HAVE_AVX2
+    { "avx2", SDL_HasAVX2, apply_stereo_gain_avx2, eq_process_avx2, convert_s16_avx2, mix_avx2, resample_avx2, peak_avx2, kweight_avx2 },
+#endif
+#ifdef MYAMP_HAVE_SSE2
+    { "sse2", SDL_HasSSE2, apply_stereo_gain_sse2, eq_process_sse2, convert_s16_sse2, mix_sse2, resample_sse2, peak_sse2, kweight_sse2 },
+#endif
+#ifdef MYAMP_HAVE_NEON
+    { "neon", SDL_HasNEON, apply_stereo_gain_neon, eq_process_neon, convert_s16_neon, mix_neon, resample_neon, peak_neon, kweight_neon },
+#endif
+    { "scalar", NULL, apply_stereo_gain_scalar, eq_process_scalar, convert_s16_scalar, mix_scalar, resample_scalar, peak_scalar, kweight_scalar },
+};
+
+static const DspKernel *dsp_kernel = &dsp_kernels[SDL_arraysize(dsp_kernels) - 1];
+
+static void select_dsp_kernels(void){
+    for(size_t i = 0; i < SDL_arraysize(dsp_kernels); ++i){
+        if(!dsp_kernels[i].supported || dsp_kernels[i].supported()){
+            dsp_kernel = &dsp_kernels[i];
+            return;
+        }
+    }
+}
+
+/* `taps` is the filter length converting at 1:1, it's stretched to keep the
+   same cutoff relative to the output when going down. `cutoff` is where the
+   filter is 6dB down as a fraction of the lower Nyquist rate, placed so
+   the Kaiser window's transition band ends right at it. Zero `beta` is
+   plain linear interpolation. */
+typedef struct ResamplerPreset{
+    const char *name;
+    Uint32 taps;
+    double cutoff;
+    double beta;
+} ResamplerPreset;
+
+static const ResamplerPreset resampler_presets[] = {
+    { "fast",    2, 1.0,   0.0 },
+    { "medium", 32, 0.84,  8.0 }, // about 80dB down, flat to 15kHz from 44.1kHz
+    { "high",   96, 0.935, 10.0 }, // about 100dB down, flat to 19kHz
+};
+
+/* From myamp.ini or --resampler, read by every source as it starts decoding. */
+static const ResamplerPreset *resampler_preset = &resampler_presets[1];
+
+static double bessel_i0(const double x){
+    double sum = 1.0;
+    double term = 1.0;
+    for(int k = 1; (k < 64) && (term > (sum * 1e-12)); ++k){
+        term *= (x * x) / (4.0 * k * k);
+        sum += term;
+    }
+    return sum;
+}
+
+static Uint32 gcd32(Uint32 a, Uint32 b){
+    while(b){
+        const Uint32 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void Resampler_free(Resampler *rs){
+    SDL_free(rs->filters);
+    SDL_free(rs->frames);
+    SDL_zerop(rs);
+}
+
+/* Back to the start of a stream, like after a seek. Primes the input with
+   half - 1 frames of silence so output 0 is centred on input 0. */
+static void Resampler_reset(Resampler *rs){
+    rs->start = 0;
+    rs->end = rs->half - 1;
+    rs->phase = 0;
+    rs->frames_in = 0;
+    rs->frames_out = 0;
+    rs->flushed = SDL_FALSE;
+    SDL_memset(rs->frames, '\0', rs->end * AUDIO_OUT_FRAME_SIZE);
+}
+
+static SDL_bool Resampler_init(Resampler *rs, const ResamplerPreset *preset, const int in_freq, const int out_freq){
+    const Uint32 divisor = gcd32((Uint32) in_freq, (Uint32) out_freq);
+    const Uint32 up = (Uint32) out_freq / divisor;
+    const Uint32 down = (Uint32) in_freq / divisor;
+    double coeffs[RESAMPLER_MAX_TAPS];
+
+    SDL_zerop(rs);
+    rs->process = dsp_kernel->resample;
+    rs->num_phases = up;
+    rs->num_filters = SDL_min(up, RESAMPLER_MAX_PHASES);
+    rs->step_whole = down / up;
+    rs->step_frac = down % up;
+
+    // going down the cutoff follows the output's Nyquist rate, and the filter gets longer to keep its slope
+    const double scale = (down > up) ? ((double) up / (double) down) : 1.0;
+    Uint32 length = preset->taps;
+    if(preset->beta > 0.0){
+        length = (Uint32) SDL_ceil(preset->taps / scale);
+        length = SDL_min((length + 1) & ~1u, RESAMPLER_MAX_TAPS);
+    }
+    rs->half = length / 2;
+    rs->taps = (length + 3) & ~3u;
+    // a block of input, the window the next output needs and however far one step can overshoot it
+    rs->capacity = RESAMPLER_BLOCK_FRAMES + rs->taps + rs->step_whole + 1;
+    rs->filters = (float *) SDL_malloc((rs->num_filters + 1) * rs->taps * AUDIO_OUT_FRAME_SIZE);
+    rs->frames = (float *) SDL_malloc(rs->capacity * AUDIO_OUT_FRAME_SIZE);
+    if(!rs->filters || !rs->frames){
+        Resampler_free(rs);
+        SDL_OutOfMemory();
+        return SDL_FALSE;
+    }
+
+    const double fc = preset->cutoff * scale;
+    const double window_scale = 1.0 / bessel_i0(preset->beta);
+    for(Uint32 f = 0; f <= rs->num_filters; ++f){
+        const double frac = (double) f / (double) rs->num_filters;
+        float *filter = &rs->filters[f * rs->taps * AUDIO_OUT_CHANNELS];
+        double sum = 0.0;
+        for(Uint32 k = 0; k < length; ++k){
+            // how far input frame k is from the output, in input frames
+            const double d = (double) k - (double) (rs->half - 1) - frac;
+            if(preset->beta <= 0.0){
+                coeffs[k] = 1.0 - SDL_fabs(d);
+            }else{
+                const double x = d / rs->half;
+                const double window = (x * x < 1.0) ? (bessel_i0(preset->beta * SDL_sqrt(1.0 - (x * x))) * window_scale) : 0.0;
+                const double sinc = (d == 0.0) ? 1.0 : (SDL_sin(M_PI * fc * d) / (M_PI * fc * d));
+                coeffs[k] = fc * sinc * window;
+            }
+            sum += coeffs[k];
+        }
+        // every phase passes DC at exactly unity, or the ripple turns into a tone at the phase rate
+        for(Uint32 k = 0; k < rs->taps; ++k){
+            filter[k*2] = filter[k*2+1] = (k < length) ? (float) (coeffs[k] / sum) : 0.0f;
+        }
+    }
+    Resampler_reset(rs);
+    return SDL_TRUE;
+}
+
+/* Output frames the input so far is enough for. */
+static Uint32 Resampler_available(const Resampler *rs){
+    if(rs->end < (rs->start + rs->taps)){
+        return 0;
+    }
+    // frames the window can still move on before running past `end`
+    const Uint64 slack = rs->end - rs->start - rs->taps;
+    const Uint64 step = ((Uint64) rs->step_whole * rs->num_phases) + rs->step_frac;
+    Uint64 count = (((slack + 1) * rs->num_phases) - rs->phase + step - 1) / step;
+    if(rs->flushed){
+        // the padding is only there to finish the last real frames off
+        const Uint64 total = ((rs->frames_in * rs->num_phases) + step - 1) / step;
+        count = SDL_min(count, total - rs->frames_out);
+    }
+    return (Uint32) SDL_min(count, (Uint64) SDL_MAX_UINT32);
+}
+
+static Uint32 Resampler_read(Resampler *rs, float *out, Uint32 num_frames){
+    num_frames = SDL_min(num_frames, Resampler_available(rs));
+    if(num_frames){
+        rs->process(rs, out, num_frames);
+        rs->frames_out += num_frames;
+    }
+    return num_frames;
+}
+
+/* Where up to `*room` frames of input can go, Resampler_commit then says how
+   many did. Read everything available first, or there may be no room. */
+static float *Resampler_input(Resampler *rs, Uint32 *room){
+    // a big step down can leave `start` past the end, then the next frames to come in are skipped
+    const Uint32 drop = SDL_min(rs->start, rs->end);
+    if(drop){
+        SDL_memmove(rs->frames, &rs->frames[drop * 2], (rs->end - drop) * AUDIO_OUT_FRAME_SIZE);
+        rs->start -= drop;
+        rs->end -= drop;
+    }
+    *room = SDL_min(rs->capacity - rs->end, RESAMPLER_BLOCK_FRAMES);
+    return &rs->frames[rs->end * 2];
+}
+
+static void Resampler_commit(Resampler *rs, const Uint32 num_frames){
+    rs->end += num_frames;
+    rs->frames_in += num_frames;
+}
+
+/* End of the stream, pads it out so the last frames make it through the filter. */
+static void Resampler_flush(Resampler *rs){
+    Uint32 room;
+    float *input = Resampler_input(rs, &room);
+    const Uint32 padding = rs->taps - rs->half + 1;
+    SDL_assert(padding <= room);
+    SDL_memset(input, '\0', padding * AUDIO_OUT_FRAME_SIZE);
+    rs->end += padding;
+    rs->flushed = SDL_TRUE;
+}
+
+/* Audio thread. Drops whatever the decoder wrote before its last seek. */
+static void AudioSource_sync_seek(AudioSource *src){
+    int done = SDL_AtomicGet(&src->seek_done);
+    while(done != src->seek_seen){
+        SDL_MemoryBarrierAcquire(); // pairs with the release in AudioSource_do_seek
+        const Uint32 head = src->seek_head;
+        const int position = src->seek_position;
+        // decoder might have seeked again while we were reading those
+        SDL_MemoryBarrierAcquire();
+        const int again = SDL_AtomicGet(&src->seek_done);
+        if(again == done){
+            AudioRing_discard_to(&src->ring, head);
+            SDL_AtomicSet(&src->position, position);
+            src->seek_seen = done;
+        }
+        done = again;
+    }
+}
+
+/* Frames the callback could read from `src` right now. */
+static Uint32 AudioSource_available(AudioSource *src){
+    if(SDL_AtomicGetPtr((void **) &src->pcm)){
+        const Uint32 position = (Uint32) SDL_AtomicGet(&src->position);
+        return (position < src->pcm_frames) ? (src->pcm_frames - position) : 0;
+    }
+    return AudioRing_available(&src->ring);
+}
+
+/* Audio thread. */
+static Uint32 AudioSource_read(AudioSource *src, float *frames, const Uint32 num_frames){
+    AudioSource_sync_seek(src);
+    const void *pcm = SDL_AtomicGetPtr((void **) &src->pcm);
+    Uint32 got;
+    if(pcm){
+        const Uint32 position = (Uint32) SDL_AtomicGet(&src->position);
+        got = SDL_min(num_frames, AudioSource_available(src));
+        if(src->format == AUDIO_S16LSB){
+            dsp_kernel->convert_s16(frames, &((const Sint16 *) pcm)[position * AUDIO_OUT_CHANNELS], got * AUDIO_OUT_CHANNELS);
+        }else{
+            SDL_memcpy(frames, &((const float *) pcm)[position * AUDIO_OUT_CHANNELS], got * AUDIO_OUT_FRAME_SIZE);
+        }
+    }else{
+        got = AudioRing_read(&src->ring, frames, num_frames);
+    }
+    SDL_AtomicAdd(&src->position, (int) got);
+    return got;
+}
+
+/* Audio thread. Fixed the first time it's asked for, once the source has
+   frames to play, so a measurement that lands partway through a track
+   waits for the next time it plays instead of jumping the level. Not
+   before: the UI only looks the track up in the cache after it's started
+   it, and the callback usually runs in between with nothing decoded yet. */
+static float AudioSource_gain(AudioSource *src){
+    if(!src->gain_latched){
+        const int gain_mb = SDL_AtomicGet(&src->gain_mb);
+        src->gain = gain_mb ? SDL_powf(10.0f, (float) gain_mb / 2000.0f) : 1.0f;
+        src->gain_latched = SDL_TRUE;
+    }
+    return src->gain;
+}
+
+/* Audio thread, or a render worker. Scales `num_frames` just read from `src`
+   by its loudness gain. */
+static void AudioSource_normalize(AudioSource *src, float *frames, const Uint32 num_frames){
+    const float gain = num_frames ? AudioSource_gain(src) : 1.0f;
+    if(gain != 1.0f){
+        const float gains[AUDIO_OUT_CHANNELS] = { gain, gain };
+        dsp_kernel->stereo_gain(frames, num_frames, gains, gains);
+    }
+}
+
+/* Audio thread. AudioSource_read with the source's loudness gain applied. */
+static Uint32 AudioSource_read_normalized(AudioSource *src, float *frames, const Uint32 num_frames){
+    const Uint32 got = AudioSource_read(src, frames, num_frames);
+    AudioSource_normalize(src, frames, got);
+    return got;
+}
+
+/* Audio thread. Fills `frames` from `src`, and the moment it runs out carries
+   on from the next queued source in the same buffer, so tracks join up with
+   no gap. */
+static Uint32 read_audio_sources(AudioSource *src, float *frames, const Uint32 num_frames){
+    Uint32 total = AudioSource_read_normalized(src, frames, num_frames);
+    while(total < num_frames){
+        // the decoder sets finished after its last write, so look at it before the ring
+        if(!SDL_AtomicGet(&src->finished)){
+            break; // just running behind
+        }
+        total += AudioSource_read_normalized(src, &frames[total * AUDIO_OUT_CHANNELS], num_frames - total);
+        AudioSource *next = (AudioSource *) SDL_AtomicGetPtr((void **) &src->next);
+        if((total == num_frames) || !next){
+            break;
+        }
+        // the UI frees `src` once it sees we've moved on
+        SDL_AtomicSetPtr((void **) &source, next);
+        src = next;
+        total += AudioSource_read_normalized(src, &frames[total * AUDIO_OUT_CHANNELS], num_frames - total);
+    }
+    return total;
+}
+
+/* Sources layered over the current track, each with its own gain envelope:
+   the last track fading out under the next one, UI sounds. The audio thread
+   owns the voices outright and never locks, allocates or frees for them.
+   The UI sends it commands through mixer_commands and gets sources back
+   through mixer_retired once their voice is done, to free them. */
+#define MIXER_MAX_VOICES 8
+#define MIXER_QUEUE_LEN 16 // power of two, and room for every voice so mixer_retired never fills up
+#define MIXER_CHUNK_FRAMES 1024
+
+SDL_COMPILE_TIME_ASSERT(mixer_queue_len, MIXER_QUEUE_LEN >= MIXER_MAX_VOICES);
+
+/* Gain moving in a straight line to `target` over the next `remaining`
+   frames, then holding there. Only advances over frames actually played. */
+typedef struct MixerEnvelope{
+    float gain;
+    float target;
+    float step;
+    Uint32 remaining;
+} MixerEnvelope;
+
+typedef struct MixerVoice{
+    AudioSource *src; // NULL if the slot is free
+    MixerEnvelope envelope;
+    SDL_bool stop_at_target; // fade outs end when the envelope does, not the source
+} MixerVoice;
+
+typedef enum MixerCommandType{
+    MIXER_ADD_VOICE,  // play `src` from `from` ramping to `to`
+    MIXER_FADE_MUSIC, // ramp the current track from `from` to `to`
+} MixerCommandType;
+
+typedef struct MixerCommand{
+    MixerCommandType type;
+    AudioSource *src;
+    float from;
+    float to;
+    Uint32 frames;
+    SDL_bool stop_at_target;
+} MixerCommand;
+
+/* Single producer, single consumer, free running counters like AudioRing. */
+static MixerCommand mixer_commands[MIXER_QUEUE_LEN];
+static SDL_atomic_t mixer_commands_head; // UI
+static SDL_atomic_t mixer_commands_tail; // audio thread
+static AudioSource *mixer_retired[MIXER_QUEUE_LEN];
+static SDL_atomic_t mixer_retired_head; // audio thread
+static SDL_atomic_t mixer_retired_tail; // UI
+
+/* Audio thread only. */
+static MixerVoice mixer_voices[MIXER_MAX_VOICES];
+static int mixer_num_voices = 0;
+static MixerEnvelope music_envelope = { 1.0f, 1.0f, 0.0f, 0 };
+static float mixer_scratch[MIXER_CHUNK_FRAMES * AUDIO_OUT_CHANNELS];
+
+static void MixerEnvelope_set(MixerEnvelope *env, const float from, const float to, const Uint32 frames){
+    env->gain = frames ? from : to;
+    env->target = to;
+    env->step = frames ? ((to - from) / (float) frames) : 0.0f;
+    env->remaining = frames;
+}
+
+/* Audio thread. Takes the next straight stretch of `env`, at most
+   `num_frames` long: the gain goes from *from to *to across the frames
+   returned. */
+static Uint32 MixerEnvelope_next(MixerEnvelope *env, const Uint32 num_frames, float *from, float *to){
+    *from = env->gain;
+    if(env->remaining == 0){
+        *to = env->gain;
+        return num_frames;
+    }
+    const Uint32 count = SDL_min(num_frames, env->remaining);
+    env->remaining -= count;
+    env->gain = env->remaining ? (env->gain + (env->step * (float) count)) : env->target;
+    *to = env->gain;
+    return count;
+}
+
+/* Audio thread. Scales the current track's frames by its envelope. */
+static void MixerEnvelope_apply(MixerEnvelope *env, float *frames, const Uint32 num_frames){
+    for(Uint32 done = 0; done < num_frames;){
+        float from, to;
+        const Uint32 count = MixerEnvelope_next(env, num_frames - done, &from, &to);
+        if((from != 1.0f) || (to != 1.0f)){
+            const float from_gain[AUDIO_OUT_CHANNELS] = { from, from };
+            const float to_gain[AUDIO_OUT_CHANNELS] = { to, to };
+            dsp_kernel->stereo_gain(&frames[done * AUDIO_OUT_CHANNELS], count, from_gain, to_gain);
+        }
+        done += count;
+    }
+}
+
+/* Audio thread. Hands the voice's source back to the UI. */
+static void Mixer_retire(MixerVoice *voice){
+    const int head = SDL_AtomicGet(&mixer_retired_head);
+    mixer_retired[head & (MIXER_QUEUE_LEN - 1)] = voice->src;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&mixer_retired_head, head + 1);
+    voice->src = NULL;
+    mixer_num_voices--;
+}
+
+/* Audio thread. Picks up whatever the UI has sent since the last callback. */
+static void Mixer_run_commands(void){
+    const int head = SDL_AtomicGet(&mixer_commands_head);
+    int tail = SDL_AtomicGet(&mixer_commands_tail);
+
+    SDL_MemoryBarrierAcquire();
+    for(; tail != head; ++tail){
+        const MixerCommand *cmd = &mixer_commands[tail & (MIXER_QUEUE_LEN - 1)];
+        if(cmd->type == MIXER_FADE_MUSIC){
+            MixerEnvelope_set(&music_envelope, cmd->from, cmd->to, cmd->frames);
+            continue;
+        }
+        // the UI never has more than MIXER_MAX_VOICES out, so there's always a slot
+        MixerVoice *voice = mixer_voices;
+        while(voice->src){
+            voice++;
+        }
+        SDL_assert(voice < &mixer_voices[MIXER_MAX_VOICES]);
+        voice->src = cmd->src;
+        voice->stop_at_target = cmd->stop_at_target;
+        MixerEnvelope_set(&voice->envelope, cmd->from, cmd->to, cmd->frames);
+        mixer_num_voices++;
+    }
+    SDL_AtomicSet(&mixer_commands_tail, tail);
+}
+
+/* Audio thread. Adds every voice into `frames`, retiring the ones that are
+   done. Returns how many frames from the start any voice reached. */
+static Uint32 Mixer_mix(float *frames, const Uint32 num_frames){
+    Uint32 mixed = 0;
+
+    for(int v = 0; mixer_num_voices && (v < MIXER_MAX_VOICES); ++v){
+        MixerVoice *voice = &mixer_voices[v];
+        Uint32 done = 0;
+        if(!voice->src){
+            continue;
+        }
+        while((done < num_frames) && !(voice->stop_at_target && !voice->envelope.remaining)){
+            const Uint32 wanted = SDL_min(num_frames - done, MIXER_CHUNK_FRAMES);
+            const Uint32 got = AudioSource_read(voice->src, mixer_scratch, wanted);
+            const float gain = got ? AudioSource_gain(voice->src) : 1.0f;
+            for(Uint32 i = 0; i < got;){
+                float from, to;
+                const Uint32 count = MixerEnvelope_next(&voice->envelope, got - i, &from, &to);
+                if((from != 0.0f) || (to != 0.0f)){
+                    dsp_kernel->mix(&frames[(done + i) * AUDIO_OUT_CHANNELS], &mixer_scratch[i * AUDIO_OUT_CHANNELS], count, from * gain, to * gain);
+                }
+                i += count;
+            }
+            done += got;
+            if(got < wanted){
+                break; // decoder behind, or the end
+            }
+        }
+        mixed = SDL_max(mixed, done);
+        // finished is set after the decoder's last write, so check it before what's left
+        if((voice->stop_at_target && !voice->envelope.remaining) ||
+           (SDL_AtomicGet(&voice->src->finished) && !AudioSource_available(voice->src))){
+            Mixer_retire(voice);
+        }
+    }
+    return mixed;
+}
+
+/* Audio thread. A couple of counter reads and some adds, cheap enough to
+   leave on all the time. */
+static void AudioStats_record(const Uint64 start, const Uint32 num_frames, const Uint32 num_filled, const SDL_bool starved){
+    const Uint64 now = SDL_GetPerformanceCounter();
+    const Uint64 ticks_per_sec = SDL_GetPerformanceFrequency();
+    const Uint64 ticks = now - start;
+    const Uint64 period_ticks = ((Uint64) num_frames * ticks_per_sec) / audio_out_freq;
+    const Uint64 usec = (ticks * 1000000) / ticks_per_sec;
+    const int epoch = SDL_AtomicGet(&audio_device_epoch);
+    AudioStats *stats = &audio_stats;
+
+    int bucket = 0;
+    while((bucket < (AUDIO_STATS_BUCKETS - 1)) && (usec >= ((Uint64) 1 << bucket))){
+        ++bucket;
+    }
+
+    SDL_AtomicAdd(&audio_stats_sequence, 1);
+    SDL_MemoryBarrierRelease();
+    stats->callbacks++;
+    stats->frames_filled += num_filled;
+    stats->frames_padded += num_frames - num_filled;
+    if(starved){
+        stats->underruns++;
+        stats->frames_underrun += num_frames - num_filled;
+    }
+    if(ticks > period_ticks){
+        stats->deadline_misses++;
+    }
+    if(audio_stats_last_start && (epoch == audio_stats_last_epoch)){
+        const Uint64 interval = start - audio_stats_last_start;
+        if(interval > (period_ticks + (period_ticks / 2))){
+            stats->late_callbacks++;
+        }
+        stats->max_interval_ticks = SDL_max(stats->max_interval_ticks, interval);
+    }
+    stats->busy_ticks += ticks;
+    stats->max_ticks = SDL_max(stats->max_ticks, ticks);
+    stats->period_frames = num_frames;
+    stats->histogram[bucket]++;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&audio_stats_sequence, 1);
+
+    audio_stats_last_start = start;
+    audio_stats_last_epoch = epoch;
+}
+
+/* Audio thread, at the end of every callback. */
+static void PlaybackState_publish(AudioSource *current, const float *frames, const Uint32 num_frames){
+    SDL_AtomicAdd(&playback_state_sequence, 1);
+    SDL_MemoryBarrierRelease();
+    playback_state.source = current;
+    playback_state.position = current ? (Uint32) SDL_AtomicGet(&current->position) : 0;
+    playback_state.length = current ? (Uint32) SDL_AtomicGet(&current->length) : 0;
+    if(frames){
+        dsp_kernel->peak(frames, num_frames, playback_state.peaks);
+    }else{
+        playback_state.peaks[0] = playback_state.peaks[1] = 0.0f;
+    }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&playback_state_sequence, 1);
+}
+
+/* UI side. Same retry loop as AudioStats_snapshot. */
+static void PlaybackState_snapshot(PlaybackState *out){
+    for(;;){
+        const int sequence = SDL_AtomicGet(&playback_state_sequence);
+        SDL_MemoryBarrierAcquire();
+        if(!(sequence & 1)){
+            SDL_memcpy(out, &playback_state, sizeof(*out));
+            SDL_MemoryBarrierAcquire();
+            if(SDL_AtomicGet(&playback_state_sequence) == sequence){
+                return;
+            }
+        }
+    }
+}
+
+/* UI side. Retries until it gets a copy the callback didn't touch halfway. */
+static void AudioStats_snapshot(AudioStats *out){
+    for(;;){
+        const int sequence = SDL_AtomicGet(&audio_stats_sequence);
+        SDL_MemoryBarrierAcquire();
+        if(!(sequence & 1)){
+            SDL_memcpy(out, &audio_stats, sizeof(*out));
+            SDL_MemoryBarrierAcquire();
+            if(SDL_AtomicGet(&audio_stats_sequence) == sequence){
+                return;
+            }
+        }
+    }
+}
+
+/* Volume and balance folded into one gain per channel. */
+static void dsp_target_gain(const float volume, const float balance, float *gain){
+    const float weightLeft  = balance <= 0.5f ? 1.0f: 2.0f*(1.0f - balance);
+    const float weightRight = balance >= 0.5f ? 1.0f: 2.0f*       (balance);
+    gain[0] = volume * weightLeft;
+    gain[1] = volume * weightRight;
+}
+
+/* Audio thread for device_dsp, a render worker for its own chain. EQ, then
+   volume and balance, over `num_frames` in place. */
+static void DspChain_process(DspChain *chain, float *frames, const Uint32 num_frames, const EqParams *eq,
+                             const float volume, const float balance){
+    if(eq->enabled){
+        if(!chain->eq_was_enabled){
+            SDL_zero(chain->eq_state); // don't ring out whatever was left from the last time it was on
+        }
+        dsp_kernel->eq(frames, num_frames, &eq->coeffs, &chain->eq_state);
+    }
+    chain->eq_was_enabled = eq->enabled;
+
+    // Always dealing with stereo for now
+    SDL_assert(AUDIO_OUT_CHANNELS == 2);
+
+    float target_gain[AUDIO_OUT_CHANNELS];
+    dsp_target_gain(volume, balance, target_gain);
+
+    // ramps from the old gain to the new one across the buffer, so slider drags don't zipper
+    if((target_gain[0] != chain->applied_gain[0]) || (target_gain[1] != chain->applied_gain[1]) ||
+       (target_gain[0] != 1.0f) || (target_gain[1] != 1.0f)){
+        dsp_kernel->stereo_gain(frames, num_frames, chain->applied_gain, target_gain);
+        chain->applied_gain[0] = target_gain[0];
+        chain->applied_gain[1] = target_gain[1];
+    }
+}
+
+/* Settles `chain` on `volume` and `balance` with nothing left ringing in
+   the EQ, the state a track starts from when there was silence before it. */
+static void DspChain_reset(DspChain *chain, const float volume, const float balance){
+    dsp_target_gain(volume, balance, chain->applied_gain);
+    chain->eq_was_enabled = SDL_FALSE; // zeroes eq_state the next time it's on
+}
+
+static void SDLCALL feed_audio_device_callback(void *userdata, Uint8 *output_stream, int len){
+
+    const Uint64 start = SDL_GetPerformanceCounter();
+    AudioSource *input_source = (AudioSource *)SDL_AtomicGetPtr((void **) &source);
+    float *output_frames = (float *) output_stream;
+    const Uint32 frames_wanted = len / AUDIO_OUT_FRAME_SIZE;
+
+    Mixer_run_commands();
+    if((input_source == NULL) && !mixer_num_voices){
+        // nothing's audible, so the next track starts without the last one's tail or a ramp, as --render starts it
+        DspChain_reset(&device_dsp, atomic_get_float(&audio_volume), atomic_get_float(&audio_balance));
+        SDL_memset(output_stream, '\0', len);
+        PlaybackState_publish(NULL, NULL, 0);
+        AudioStats_record(start, frames_wanted, 0, SDL_FALSE);
+        return; 
+    }
+    const Uint32 num_frames = input_source ? read_audio_sources(input_source, output_frames, frames_wanted) : 0;
+    Uint32 num_mixed = num_frames;
+    MixerEnvelope_apply(&music_envelope, output_frames, num_frames);
+    if(mixer_num_voices){
+        // voices can carry on past the end of the track
+        SDL_memset(&output_frames[num_frames * AUDIO_OUT_CHANNELS], '\0', (frames_wanted - num_frames) * AUDIO_OUT_FRAME_SIZE);
+        const Uint32 num_voice_frames = Mixer_mix(output_frames, frames_wanted);
+        num_mixed = SDL_max(num_frames, num_voice_frames);
+    }
+    const int num_converted_bytes = (int) (num_mixed * AUDIO_OUT_FRAME_SIZE);
+    if(num_converted_bytes > 0){
+        DspChain_process(&device_dsp, output_frames, num_mixed, acquire_eq_params(),
+                         atomic_get_float(&audio_volume), atomic_get_float(&audio_balance));
+    }
+    // now has number of bytes after feeding the device 
+    len -= num_converted_bytes; 
+    output_stream += num_converted_bytes;
+
+    // fill the rest with silence
+    if(len > 0){
+        SDL_memset(output_stream, '\0', len);
+    }
+
+    VisTap_write(&vis_tap, output_frames, (num_converted_bytes + len) / AUDIO_OUT_FRAME_SIZE);
+
+    // short with the decoder still going means it fell behind, not that the music ended
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    const SDL_bool starved = (num_frames < frames_wanted) && current && !SDL_AtomicGet(&current->finished);
+    PlaybackState_publish(current, output_frames, frames_wanted);
+    AudioStats_record(start, frames_wanted, num_frames, starved);
+}
+
+static void panic_and_abort(const char *title, const char *message){
+    fprintf(stderr, "PANIC: %s ... %s\n", title, message);
+    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title, message, window);
+    SDL_Quit();
+    exit(1);
+}
+
+/* Everything that needs the audio thread stopped goes through these, so we
+   know how long we've kept it waiting. */
+static void lock_audio_device(void){
+    SDL_LockAudioDevice(audio_device);
+    audio_lock_start = SDL_GetPerformanceCounter();
+}
+
+static void unlock_audio_device(void){
+    const Uint64 held = SDL_GetPerformanceCounter() - audio_lock_start;
+    SDL_UnlockAudioDevice(audio_device);
+    audio_lock_count++;
+    audio_lock_ticks += held;
+    audio_lock_max_ticks = SDL_max(audio_lock_max_ticks, held);
+}
+
+
+typedef struct ZipEntry{
+    const char *fname; // points into the archive's name table
+    Uint32 compression_type;
+    Uint32 compressed_size;
+    Uint32 uncompressed_size;
+    Uint32 crc32;
+    Uint32 local_header_pos;
+} ZipEntry;
+
+typedef struct ZipArchive{
+    SDL_RWops *rw;
+    Uint32 num_entries;
+    ZipEntry *entries;
+    /* Open addressed, case-insensitive index keyed on the file's base name
+       (skins are often zipped with a folder around them). Holds index + 1
+       into `entries`, 0 is an empty slot. */
+    Uint32 *buckets;
+    Uint32 num_buckets; // power of two
+} ZipArchive;
+
+static SDL_INLINE Uint16 zip_le16(const Uint8 *ptr){
+    return (Uint16) (ptr[0] | (ptr[1] << 8));
+}
+
+static SDL_INLINE Uint32 zip_le32(const Uint8 *ptr){
+    return ((Uint32) ptr[0]) | ((Uint32) ptr[1] << 8) | ((Uint32) ptr[2] << 16) | ((Uint32) ptr[3] << 24);
+}
+
+static const char *zip_basename(const char *fname){
+    const char *ptr = SDL_strrchr(fname, '/');
+    return ptr ? ptr + 1 : fname;
+}
+
+static Uint32 zip_hash(const char *fname){
+    Uint32 hash = 2166136261u; // FNV-1a
+    for(const char *ptr = fname; *ptr; ++ptr){
+        hash = (hash ^ (Uint8) SDL_tolower((unsigned char) *ptr)) * 16777619u;
+    }
+    return hash;
+}
+
+static const ZipEntry *ZipArchive_find(const ZipArchive *zip, const char *fname){
+    const char *basename = zip_basename(fname);
+    Uint32 slot = zip_hash(basename) & (zip->num_buckets - 1);
+    while(zip->buckets[slot]){
+        const ZipEntry *entry = &zip->entries[zip->buckets[slot] - 1];
+        if(SDL_strcasecmp(zip_basename(entry->fname), basename) == 0){
+            return entry;
+        }
+        slot = (slot + 1) & (zip->num_buckets - 1);
+    }
+    return NULL;
+}
+
+static void ZipArchive_unload(ZipArchive *zip){
+    if(zip){
+        if(zip->rw) {
+            SDL_RWclose(zip->rw);
+        }
+        SDL_free(zip->entries); // buckets and names live in the same allocation
+        SDL_free(zip);
+    }
+}
+
+/* Reads the end of central directory record and the central directory it
+   points at, so the entry table is sized once and sizes are correct even
+   for entries written with data descriptors. */
+static ZipArchive *ZipArchive_load(const char *fname){
+    SDL_RWops *rw = SDL_RWFromFile(fname, "rb");
+    if(!rw){
+        return NULL;
+    }
+
+    ZipArchive *ret_val = (ZipArchive *)SDL_calloc( 1, sizeof(ZipArchive));
+    Uint8 *buf = NULL;
+    if(ret_val == NULL){
+        SDL_OutOfMemory();
+        goto failed;
+    }
+    ret_val->rw = rw;
+
+    // EOCD is 22 bytes plus a comment of up to 64k at the very end of the file
+    const Sint64 file_size = SDL_RWsize(rw);
+    if(file_size < 22){
+        SDL_SetError("Not a ZIP archive");
+        goto failed;
+    }
+    const Uint32 tail_len = (Uint32) SDL_min(file_size, (Sint64) (22 + 0xFFFF));
+    buf = (Uint8 *) SDL_malloc(tail_len);
+    if(!buf){
+        SDL_OutOfMemory();
+        goto failed;
+    }
+    if((SDL_RWseek(rw, file_size - tail_len, RW_SEEK_SET) < 0) || (SDL_RWread(rw, buf, tail_len, 1) != 1)){
+        goto failed;
+    }
+
+    const Uint8 *eocd = NULL;
+    for(Sint64 i = (Sint64) tail_len - 22; i >= 0; --i){
+        if(zip_le32(&buf[i]) == 0x06054b50){
+            eocd = &buf[i];
+            break;
+        }
+    }
+    if(!eocd){
+        SDL_SetError("Not a ZIP archive (no end of central directory)");
+        goto failed;
+    }
+
+    const Uint32 num_entries = zip_le16(&eocd[10]);
+    const Uint32 cd_size = zip_le32(&eocd[12]);
+    const Uint32 cd_offset = zip_le32(&eocd[16]);
+    if((num_entries == 0xFFFF) || (cd_offset == 0xFFFFFFFF)){
+        SDL_SetError("ZIP64 archives are not supported");
+        goto failed;
+    }
+    if(((Sint64) cd_offset + cd_size) > file_size){
+        SDL_SetError("Corrupt ZIP archive (bad central directory)");
+        goto failed;
+    }
+
+    SDL_free(buf);
+    buf = (Uint8 *) SDL_malloc(cd_size ? cd_size : 1);
+    if(!buf){
+        SDL_OutOfMemory();
+        goto failed;
+    }
+    if((SDL_RWseek(rw, cd_offset, RW_SEEK_SET) < 0) || (cd_size && (SDL_RWread(rw, buf, cd_size, 1) != 1))){
+        goto failed;
+    }
+
+    // entries, hash buckets and every file name in one allocation. Each central
+    // directory record is 46 bytes plus its name, so cd_size covers the names.
+    Uint32 num_buckets = 16;
+    while(num_buckets < (num_entries * 2)){
+        num_buckets <<= 1;
+    }
+    const size_t table_len = (sizeof(ZipEntry) * num_entries) + (sizeof(Uint32) * num_buckets) + cd_size;
+    ret_val->entries = (ZipEntry *) SDL_calloc(1, table_len);
+    if(!ret_val->entries){
+        SDL_OutOfMemory();
+        goto failed;
+    }
+    ret_val->buckets = (Uint32 *) &ret_val->entries[num_entries];
+    ret_val->num_buckets = num_buckets;
+    char *names = (char *) &ret_val->buckets[num_buckets];
+
+    Uint32 pos = 0;
+    for(Uint32 i = 0; i < num_entries; ++i){
+        const Uint8 *hdr = &buf[pos];
+        if(((pos + 46) > cd_size) || (zip_le32(hdr) != 0x02014b50)){
+            SDL_SetError("Corrupt ZIP archive (bad central directory entry)");
+            goto failed;
+        }
+        const Uint16 flags = zip_le16(&hdr[8]);
+        const Uint16 fname_len = zip_le16(&hdr[28]);
+        const Uint32 record_len = 46 + fname_len + zip_le16(&hdr[30]) + zip_le16(&hdr[32]);
+        if((pos + record_len) > cd_size){
+            SDL_SetError("Corrupt ZIP archive (bad central directory entry)");
+            goto failed;
+        }
+
+        ZipEntry *entry = &ret_val->entries[ret_val->num_entries];
+        entry->compression_type = zip_le16(&hdr[10]);
+        entry->crc32 = zip_le32(&hdr[16]);
+        entry->compressed_size = zip_le32(&hdr[20]);
+        entry->uncompressed_size = zip_le32(&hdr[24]);
+        entry->local_header_pos = zip_le32(&hdr[42]);
+        SDL_memcpy(names, &hdr[46], fname_len);
+        names[fname_len] = '\0';
+        entry->fname = names;
+        names += fname_len + 1;
+        pos += record_len;
+
+        // directories and encrypted entries are never anything we can load
+        if((fname_len == 0) || (entry->fname[fname_len - 1] == '/') || (flags & 0x1)){
+            continue;
+        }
+
+        // first entry with a given name wins, same as the old linear scan
+        if(!ZipArchive_find(ret_val, entry->fname)){
+            Uint32 slot = zip_hash(zip_basename(entry->fname)) & (num_buckets - 1);
+            while(ret_val->buckets[slot]){
+                slot = (slot + 1) & (num_buckets - 1);
+            }
+            ret_val->buckets[slot] = ret_val->num_entries + 1;
+        }
+        ret_val->num_entries++;
+    }
+
+    SDL_free(buf);
+    return ret_val;
+
+failed:
+    SDL_free(buf);
+    if(ret_val){
+        ZipArchive_unload(ret_val);
+    }else{
+        SDL_RWclose(rw);
+    }
+    return NULL;
+}
+
+/* Raw DEFLATE (RFC 1951) decoder. Reads compressed bytes from the archive a
+   buffer at a time and writes straight into the caller's output buffer. */
+#define INFLATE_FAST_BITS 9
+
+typedef struct InflateHuffman{
+    Uint16 fast[1 << INFLATE_FAST_BITS]; // (length << 9) | symbol, 0 means take the slow path
+    Uint16 count[16];   // number of codes of each length
+    Uint16 symbol[288]; // symbols in canonical code order
+} InflateHuffman;
+
+typedef struct Inflater{
+    SDL_RWops *rw;
+    Uint32 in_remaining; // compressed bytes still in `rw`
+    Uint32 in_pos;
+    Uint32 in_len;
+    Uint32 overrun;      // zero bytes we made up past the end of the input
+    Uint32 bitbuf;
+    int bitcnt;
+    Uint8 *out;
+    Uint32 out_len;
+    Uint32 out_pos;
+    Uint8 in[4096];
+} Inflater;
+
+static SDL_INLINE Uint32 inflate_byte(Inflater *s){
+    if(s->in_pos == s->in_len){
+        const Uint32 want = SDL_min(s->in_remaining, (Uint32) sizeof(s->in));
+        s->in_len = want ? (Uint32) SDL_RWread(s->rw, s->in, 1, want) : 0;
+        s->in_remaining -= s->in_len;
+        s->in_pos = 0;
+        if(s->in_len == 0){
+            // Peeking ahead for a Huffman code can run past the end legitimately,
+            // inflate_stream() checks we never actually consumed these.
+            s->overrun++;
+            return 0;
+        }
+    }
+    return s->in[s->in_pos++];
+}
+
+static SDL_INLINE void inflate_fill(Inflater *s, const int need){
+    while(s->bitcnt < need){
+        s->bitbuf |= inflate_byte(s) << s->bitcnt;
+        s->bitcnt += 8;
+    }
+}
+
+static SDL_INLINE Uint32 inflate_bits(Inflater *s, const int need){
+    if(need == 0){
+        return 0;
+    }
+    inflate_fill(s, need);
+    const Uint32 val = s->bitbuf & ((1u << need) - 1);
+    s->bitbuf >>= need;
+    s->bitcnt -= need;
+    return val;
+}
+
+/* Builds canonical Huffman tables from code lengths. Returns 0 for a
+   complete code, > 0 for an incomplete one, < 0 if over-subscribed. */
+static int inflate_build(InflateHuffman *h, const Uint8 *lengths, const int num_symbols){
+    Uint16 offs[16];
+    int left = 1;
+
+    SDL_zeroa(h->count);
+    SDL_zeroa(h->fast);
+    for(int sym = 0; sym < num_symbols; ++sym){
+        h->count[lengths[sym]]++;
+    }
+    if(h->count[0] == num_symbols){
+        return 0; // no codes, complete but decoding will fail
+    }
+    for(int len = 1; len < 16; ++len){
+        left = (left << 1) - h->count[len];
+        if(left < 0){
+            return left;
+        }
+    }
+
+    offs[1] = 0;
+    for(int len = 1; len < 15; ++len){
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+
+    Uint32 code = 0;
+    int index = 0;
+    for(int len = 1; len < 16; ++len){
+        for(int sym = 0; sym < num_symbols; ++sym){
+            if(lengths[sym] != len){
+                continue;
+            }
+            h->symbol[offs[len]++] = (Uint16) sym;
+            index++;
+            if(len <= INFLATE_FAST_BITS){
+                // codes are packed most significant bit first, our bit buffer is LSB first
+                Uint32 rev = 0;
+                for(int b = 0; b < len; ++b){
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                }
+                for(; rev < (1u << INFLATE_FAST_BITS); rev += (1u << len)){
+                    h->fast[rev] = (Uint16) ((len << 9) | sym);
+                }
+            }
+            code++;
+        }
+        code <<= 1;
+    }
+    SDL_assert(index == (num_symbols - h->count[0]));
+    return left;
+}
+
+static int inflate_decode(Inflater *s, const InflateHuffman *h){
+    inflate_fill(s, INFLATE_FAST_BITS);
+    const Uint16 fast = h->fast[s->bitbuf & ((1u << INFLATE_FAST_BITS) - 1)];
+    if(fast){
+        const int len = fast >> 9;
+        s->bitbuf >>= len;
+        s->bitcnt -= len;
+        return fast & 0x1FF;
+    }
+
+    // longer than INFLATE_FAST_BITS, walk the canonical code a bit at a time
+    int code = 0, first = 0, index = 0;
+    for(int len = 1; len < 16; ++len){
+        code |= (int) inflate_bits(s, 1);
+        const int count = h->count[len];
+        if((code - count) < first){
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static SDL_bool inflate_codes(Inflater *s, const InflateHuffman *lencode, const InflateHuffman *distcode){
+    static const Uint16 len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const Uint8 len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const Uint16 dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const Uint8 dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    for(;;){
+        if(s->overrun > 4){
+            return SDL_FALSE; // ran off the end of the compressed data
+        }
+        int sym = inflate_decode(s, lencode);
+        if(sym < 0){
+            return SDL_FALSE;
+        }else if(sym < 256){
+            if(s->out_pos == s->out_len){
+                return SDL_FALSE;
+            }
+            s->out[s->out_pos++] = (Uint8) sym;
+        }else if(sym == 256){
+            return SDL_TRUE;
+        }else{
+            sym -= 257;
+            if(sym >= 29){
+                return SDL_FALSE;
+            }
+            const Uint32 len = len_base[sym] + inflate_bits(s, len_extra[sym]);
+            const int dsym = inflate_decode(s, distcode);
+            if((dsym < 0) || (dsym >= 30)){
+                return SDL_FALSE;
+            }
+            const Uint32 dist = dist_base[dsym] + inflate_bits(s, dist_extra[dsym]);
+            if((dist > s->out_pos) || (len > (s->out_len - s->out_pos))){
+                return SDL_FALSE;
+            }
+            // may overlap, so byte at a time
+            const Uint8 *from = &s->out[s->out_pos - dist];
+            Uint8 *to = &s->out[s->out_pos];
+            for(Uint32 i = 0; i < len; ++i){
+                to[i] = from[i];
+            }
+            s->out_pos += len;
+        }
+    }
+}
+
+static SDL_bool inflate_stream(Inflater *s){
+    static const Uint8 order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    InflateHuffman lencode, distcode;
+    Uint8 lengths[288 + 32];
+    Uint32 last;
+
+    do{
+        last = inflate_bits(s, 1);
+        const Uint32 type = inflate_bits(s, 2);
+        if(type == 0){ // stored
+            s->bitbuf >>= (s->bitcnt & 7);
+            s->bitcnt -= (s->bitcnt & 7);
+            const Uint32 len = inflate_bits(s, 16);
+            if((inflate_bits(s, 16) ^ 0xFFFF) != len){
+                return SDL_FALSE;
+            }
+            if(len > (s->out_len - s->out_pos)){
+                return SDL_FALSE;
+            }
+            for(Uint32 i = 0; i < len; ++i){
+                s->out[s->out_pos++] = (Uint8) inflate_bits(s, 8);
+            }
+        }else if(type == 1){ // fixed Huffman codes
+            int sym = 0;
+            for(; sym < 144; ++sym) lengths[sym] = 8;
+            for(; sym < 256; ++sym) lengths[sym] = 9;
+            for(; sym < 280; ++sym) lengths[sym] = 7;
+            for(; sym < 288; ++sym) lengths[sym] = 8;
+            inflate_build(&lencode, lengths, 288);
+            SDL_memset(lengths, 5, 30);
+            inflate_build(&distcode, lengths, 30);
+            if(!inflate_codes(s, &lencode, &distcode)){
+                return SDL_FALSE;
+            }
+        }else if(type == 2){ // dynamic Huffman codes
+            const int nlen = (int) inflate_bits(s, 5) + 257;
+            const int ndist = (int) inflate_bits(s, 5) + 1;
+            const int ncode = (int) inflate_bits(s, 4) + 4;
+            if((nlen > 286) || (ndist > 30)){
+                return SDL_FALSE;
+            }
+            SDL_zeroa(lengths);
+            for(int i = 0; i < ncode; ++i){
+                lengths[order[i]] = (Uint8) inflate_bits(s, 3);
+            }
+            if(inflate_build(&lencode, lengths, 19) != 0){
+                return SDL_FALSE;
+            }
+
+            int index = 0;
+            while(index < (nlen + ndist)){
+                int sym = inflate_decode(s, &lencode);
+                int repeat;
+                Uint8 len = 0;
+                if(sym < 0){
+                    return SDL_FALSE;
+                }else if(sym < 16){
+                    lengths[index++] = (Uint8) sym;
+                    continue;
+                }else if(sym == 16){
+                    if(index == 0){
+                        return SDL_FALSE;
+                    }
+                    len = lengths[index - 1];
+                    repeat = 3 + (int) inflate_bits(s, 2);
+                }else if(sym == 17){
+                    repeat = 3 + (int) inflate_bits(s, 3);
+                }else{
+                    repeat = 11 + (int) inflate_bits(s, 7);
+                }
+                if((index + repeat) > (nlen + ndist)){
+                    return SDL_FALSE;
+                }
+                while(repeat--){
+                    lengths[index++] = len;
+                }
+            }
+            if(lengths[256] == 0){
+                return SDL_FALSE; // no end of block code
+            }
+
+            // incomplete codes are only allowed if there's a single code
+            int err = inflate_build(&lencode, lengths, nlen);
+            if((err < 0) || ((err > 0) && ((nlen - lencode.count[0]) != 1))){
+                return SDL_FALSE;
+            }
+            err = inflate_build(&distcode, &lengths[nlen], ndist);
+            if((err < 0) || ((err > 0) && ((ndist - distcode.count[0]) != 1))){
+                return SDL_FALSE;
+            }
+            if(!inflate_codes(s, &lencode, &distcode)){
+                return SDL_FALSE;
+            }
+        }else{
+            return SDL_FALSE;
+        }
+    }while(!last);
+
+    // any made up padding has to still be sitting unused in the bit buffer
+    return ((s->overrun * 8) <= (Uint32) s->bitcnt) ? SDL_TRUE : SDL_FALSE;
+}
+
+static Uint32 zip_crc32(const Uint8 *data, const Uint32 len){
+    static const Uint32 table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    Uint32 crc = 0xFFFFFFFF;
+    for(Uint32 i = 0; i < len; ++i){
+        crc = (crc >> 4) ^ table[(crc ^ data[i]) & 0xF];
+        crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 0xF];
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+static int SDLCALL close_owned_mem_rw(SDL_RWops *rw){
+    SDL_free(rw->hidden.mem.base);
+    SDL_FreeRW(rw);
+    return 0;
+}
+
+/* Decompresses `entry` into a freshly allocated buffer, the returned RWops
+   frees it when closed. */
+static SDL_RWops *ZipArchive_open_entry(ZipArchive *zip, const ZipEntry *entry){
+    Uint8 local[30];
+    if((SDL_RWseek(zip->rw, entry->local_header_pos, RW_SEEK_SET) < 0) ||
+       (SDL_RWread(zip->rw, local, sizeof(local), 1) != 1) || (zip_le32(local) != 0x04034b50)){
+        SDL_SetError("Corrupt ZIP archive (bad local header for %s)", entry->fname);
+        return NULL;
+    }
+    // the local extra field doesn't have to match the central directory's
+    SDL_RWseek(zip->rw, zip_le16(&local[26]) + zip_le16(&local[28]), RW_SEEK_CUR);
+
+    Uint8 *data = (Uint8 *) SDL_malloc(entry->uncompressed_size ? entry->uncompressed_size : 1);
+    if(!data){
+        SDL_OutOfMemory();
+        return NULL;
+    }
+
+    SDL_bool ok = SDL_FALSE;
+    if(entry->compression_type == 0){
+        ok = (entry->compressed_size == entry->uncompressed_size) &&
+             ((entry->uncompressed_size == 0) || (SDL_RWread(zip->rw, data, entry->uncompressed_size, 1) == 1));
+    }else if(entry->compression_type == 8){
+        Inflater *inflater = (Inflater *) SDL_malloc(sizeof(Inflater));
+        if(inflater){
+            SDL_zerop(inflater);
+            inflater->rw = zip->rw;
+            inflater->in_remaining = entry->compressed_size;
+            inflater->out = data;
+            inflater->out_len = entry->uncompressed_size;
+            ok = inflate_stream(inflater) && (inflater->out_pos == entry->uncompressed_size);
+            SDL_free(inflater);
+        }
+    }else{
+        SDL_SetError("Unsupported ZIP compression method %u for %s", (unsigned int) entry->compression_type, entry->fname);
+        SDL_free(data);
+        return NULL;
+    }
+
+    if(!ok || (zip_crc32(data, entry->uncompressed_size) != entry->crc32)){
+        SDL_SetError("Corrupt ZIP archive (could not extract %s)", entry->fname);
+        SDL_free(data);
+        return NULL;
+    }
+
+    SDL_RWops *rw = SDL_RWFromConstMem(data, (int) entry->uncompressed_size);
+    if(!rw){
+        SDL_free(data);
+        return NULL;
+    }
+    rw->close = close_owned_mem_rw;
+    return rw;
+}
+
+
+
+
+
+/* What a library scan keeps about a file, from its headers and tags alone. */
+typedef struct TrackInfo{
+    int freq;          // 0 if the file couldn't be read
+    int channels;
+    Uint64 num_frames; // at `freq`, 0 if the headers don't say
+    char *artist;      // UTF-8, NULL if untagged
+    char *title;
+} TrackInfo;
+
+static void TrackInfo_free(TrackInfo *info){
+    SDL_free(info->artist);
+    SDL_free(info->title);
+    SDL_zerop(info);
+}
+
+/* Longest title or artist read, anything longer is skipped. */
+#define TAG_MAX_LEN 1024
+
+/* Keeps the first of each tag, trimmed. Taggers love trailing NULs. */
+static void set_tag(char **tag, const char *text, size_t len){
+    while((len > 0) && ((text[len - 1] == '\0') || SDL_isspace((unsigned char) text[len - 1]))){
+        len--;
+    }
+    if(*tag || (len == 0)){
+        return;
+    }
+    *tag = (char *) SDL_malloc(len + 1);
+    if(*tag){
+        SDL_memcpy(*tag, text, len);
+        (*tag)[len] = '\0';
+    }
+}
+
+/* One file format. The decoder thread picks one with `probe`, then pulls
+   frames out of it a chunk at a time as the ring drains, so only the part
+   about to be played is ever decoded. */
+typedef struct AudioDecoder{
+    const char *name;
+    /* Whether `magic`, the first 12 bytes of the file (after any ID3v2 tag),
+       look like one of ours. */
+    SDL_bool (*probe)(const Uint8 *magic);
+    /* `src->rw` is at `magic`. Fills in format, channels, freq and num_frames. */
+    SDL_bool (*open)(AudioSource *src);
+    /* Up to `num_frames` frames in `src->format` into `buf`, which has room
+       for 8 bytes a sample. Returns 0 once the file is done. */
+    Uint32 (*read)(AudioSource *src, void *buf, Uint32 num_frames);
+    /* The next read starts at `frame`, counted at `src->freq`. */
+    void (*seek)(AudioSource *src, Uint64 frame);
+    /* Frees decoder_data, even after a failed open. Runs on whichever thread
+       lets go of the source last. */
+    void (*close)(AudioSource *src);
+    /* Like open, but only reads as far as it must to fill in `info` and
+       leaves nothing behind for close. */
+    SDL_bool (*info)(AudioSource *src, TrackInfo *info);
+    /* Space separated, lower case, what library scans look at. */
+    const char *extensions;
+} AudioDecoder;
+
+/* Reads the RIFF/WAVE header and leaves `rw` at the start of the PCM data.
+   Returns SDL_FALSE if this is a WAV we can't stream directly (compressed
+   formats etc), in which case the caller can still fall back to SDL_LoadWAV. */
+static SDL_bool parse_wav_header(AudioSource *src){
+    SDL_RWops *rw = src->rw;
+    const Sint64 file_size = SDL_RWsize(rw);
+    Uint32 ui32;
+    Uint16 format_tag = 0;
+    Uint16 bits = 0;
+    SDL_bool have_fmt = SDL_FALSE;
+
+    if(SDL_ReadLE32(rw) != 0x46464952){ // "RIFF"
+        return SDL_FALSE;
+    }
+    SDL_ReadLE32(rw); // RIFF size, frequently wrong, not trusted
+    if(SDL_ReadLE32(rw) != 0x45564157){ // "WAVE"
+        return SDL_FALSE;
+    }
+
+    while(SDL_RWread(rw, &ui32, sizeof(ui32), 1) == 1){
+        const Uint32 chunk_id = SDL_SwapLE32(ui32);
+        const Uint32 chunk_size = SDL_ReadLE32(rw);
+        const Sint64 chunk_start = SDL_RWtell(rw);
+
+        if(chunk_id == 0x20746d66){ // "fmt "
+            if(chunk_size < 16){
+                return SDL_FALSE;
+            }
+            format_tag = SDL_ReadLE16(rw);
+            src->channels = (Uint8) SDL_ReadLE16(rw);
+            src->freq = (int) SDL_ReadLE32(rw);
+            SDL_ReadLE32(rw); // byte rate
+            src->bytes_per_frame = SDL_ReadLE16(rw); // block align
+            bits = SDL_ReadLE16(rw);
+            if((format_tag == 0xFFFE) && (chunk_size >= 40)){ // WAVE_FORMAT_EXTENSIBLE
+                SDL_ReadLE16(rw); // cbSize
+                SDL_ReadLE16(rw); // valid bits per sample
+                SDL_ReadLE32(rw); // channel mask
+                format_tag = SDL_ReadLE16(rw); // first two bytes of the subformat GUID
+            }
+            have_fmt = SDL_TRUE;
+        }else if(chunk_id == 0x61746164){ // "data"
+            if(!have_fmt){
+                return SDL_FALSE;
+            }
+            src->data_remaining = chunk_size;
+            // files written by streaming recorders leave this as 0 or 0xFFFFFFFF
+            if((file_size > 0) && ((chunk_start + chunk_size) > file_size)){
+                src->data_remaining = (Uint32) (file_size - chunk_start);
+            }
+            break;
+        }
+        SDL_RWseek(rw, chunk_start + chunk_size + (chunk_size & 1), RW_SEEK_SET);
+    }
+
+    if(!have_fmt || (src->channels == 0) || (src->freq <= 0) || (src->bytes_per_frame != ((bits / 8) * src->channels))){
+        return SDL_FALSE;
+    }
+    // SDL_AudioStreamPut refuses partial sample frames
+    src->data_remaining -= src->data_remaining % src->bytes_per_frame;
+
+    if(format_tag == 1){ // PCM
+        switch(bits){
+            case 8:  src->format = AUDIO_U8; break;
+            case 16: src->format = AUDIO_S16LSB; break;
+            case 24: src->format = AUDIO_S32LSB; break; // widened by the decoder thread
+            case 32: src->format = AUDIO_S32LSB; break;
+            default: return SDL_FALSE;
+        }
+    }else if(format_tag == 3){ // IEEE float
+        switch(bits){
+            case 32: src->format = AUDIO_F32LSB; break;
+            case 64: src->format = AUDIO_F32LSB; break; // narrowed by the decoder thread
+            default: return SDL_FALSE;
+        }
+    }else{
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+/* Turns what we read from disk into something SDL_AudioStream understands,
+   in place. 24-bit ints become 32-bit, 64-bit floats become 32-bit. Returns
+   the new length in bytes. */
+static Uint32 widen_wav_chunk(const AudioSource *src, Uint8 *buf, Uint32 len){
+    const int sample_size = src->bytes_per_frame / src->channels;
+    const Uint32 num_samples = len / sample_size;
+
+    if(sample_size == 3){
+        // buffer was sized for 32-bit samples, walk backwards so we don't stomp unread data
+        Sint32 *dst = (Sint32 *) buf;
+        for(Uint32 i = num_samples; i > 0; --i){
+            const Uint8 *ptr = &buf[(i - 1) * 3];
+            dst[i - 1] = (Sint32) (((Uint32) ptr[0] << 8) | ((Uint32) ptr[1] << 16) | ((Uint32) ptr[2] << 24));
+        }
+        return num_samples * sizeof(Sint32);
+    }else if((sample_size == 8) && (src->format == AUDIO_F32LSB)){
+        float *dst = (float *) buf;
+        for(Uint32 i = 0; i < num_samples; ++i){
+            double d;
+            SDL_memcpy(&d, &buf[i * 8], sizeof(d));
+            dst[i] = (float) d;
+        }
+        return num_samples * sizeof(float);
+    }
+    return len;
+}
+
+/* Posted by decoder threads that couldn't open their file, message in data1. */
+static Uint32 audio_error_event = (Uint32) -1;
+/* Decoder threads still running, deinit waits for them. */
+static SDL_atomic_t decoders_in_flight;
+
+#ifdef MYAMP_HAVE_MMAP
+/* Maps the file if the callback can play its PCM data as is: 48000Hz
+   stereo, 16-bit or float, little endian like the host. Opening costs the
+   same however long the file is, and every player that has it open shares
+   the same pages in the page cache. */
+static SDL_bool AudioSource_map_file(AudioSource *src){
+    const SDL_bool s16 = (src->format == AUDIO_S16LSB) && (src->bytes_per_frame == 4);
+    const SDL_bool f32 = (src->format == AUDIO_F32LSB) && (src->bytes_per_frame == 8);
+    struct stat st;
+
+    if((SDL_BYTEORDER != SDL_LIL_ENDIAN) || (src->freq != audio_out_freq) || (src->channels != AUDIO_OUT_CHANNELS) || !(s16 || f32)){
+        return SDL_FALSE;
+    }
+    if((src->data_start % sizeof(float)) != 0){
+        return SDL_FALSE; // no sane writer does this, not worth unaligned loads
+    }
+    const int fd = open(src->fname, O_RDONLY);
+    if(fd == -1){
+        return SDL_FALSE;
+    }
+    if((fstat(fd, &st) == -1) || ((Sint64) st.st_size < src->data_start + src->data_len)){
+        close(fd);
+        return SDL_FALSE;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if(map == MAP_FAILED){
+        return SDL_FALSE;
+    }
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    src->map = map;
+    src->map_len = (size_t) st.st_size;
+    src->pcm_frames = src->data_len / src->bytes_per_frame;
+    // callback may start reading the moment it sees `pcm`
+    SDL_AtomicSetPtr((void **) &src->pcm, (Uint8 *) map + src->data_start);
+    return SDL_TRUE;
+}
+
+/* Decoder thread. Touches every page the callback will read over the next
+   AUDIO_RING_FRAMES, so a cold page cache blocks this thread and not the
+   audio thread. */
+static void AudioSource_prefetch(AudioSource *src){
+    const Uint32 position = (Uint32) SDL_AtomicGet(&src->position);
+    if(position >= src->pcm_frames){
+        return;
+    }
+    const Uint8 *pcm = (const Uint8 *) src->pcm;
+    const Uint8 *end = pcm + ((size_t) SDL_min(position + AUDIO_RING_FRAMES, src->pcm_frames) * src->bytes_per_frame);
+    volatile Uint8 sink = 0;
+    for(const Uint8 *ptr = pcm + ((size_t) position * src->bytes_per_frame); ptr < end; ptr += 4096){
+        sink += *ptr;
+    }
+    sink += end[-1];
+    (void) sink;
+}
+#endif
+
+static SDL_bool wav_probe(const Uint8 *magic){
+    return (SDL_memcmp(magic, "RIFF", 4) == 0) && (SDL_memcmp(&magic[8], "WAVE", 4) == 0);
+}
+
+static SDL_bool wav_open(AudioSource *src){
+    if(!parse_wav_header(src)){
+        // Not something we can stream (ADPCM, mu-law, etc), let SDL decode the whole
+        // thing and stream that from memory instead.
+        SDL_AudioSpec wavspec;
+        Uint32 wavlen = 0;
+        SDL_RWseek(src->rw, 0, RW_SEEK_SET);
+        if(SDL_LoadWAV_RW(src->rw, 1, &wavspec, &src->wavbuf, &wavlen) == NULL){
+            src->rw = NULL; // SDL_LoadWAV_RW closed it
+            return SDL_FALSE;
+        }
+        src->rw = SDL_RWFromConstMem(src->wavbuf, (int) wavlen);
+        if(!src->rw){
+            return SDL_FALSE;
+        }
+        src->format = wavspec.format;
+        src->channels = wavspec.channels;
+        src->freq = wavspec.freq;
+        src->bytes_per_frame = (SDL_AUDIO_BITSIZE(wavspec.format) / 8) * wavspec.channels;
+        src->data_remaining = wavlen;
+    }
+    src->data_start = SDL_RWtell(src->rw);
+    src->data_len = src->data_remaining;
+    src->num_frames = src->data_len / src->bytes_per_frame;
+
+#ifdef MYAMP_HAVE_MMAP
+    if(!src->wavbuf && AudioSource_map_file(src)){
+        SDL_RWclose(src->rw);
+        src->rw = NULL;
+    }
+#endif
+    return SDL_TRUE;
+}
+
+static Uint32 wav_read(AudioSource *src, void *buf, Uint32 num_frames){
+    const Uint32 want = SDL_min(num_frames * (Uint32) src->bytes_per_frame, src->data_remaining);
+    const Uint32 len = (Uint32) SDL_RWread(src->rw, buf, 1, want);
+    src->data_remaining -= len;
+    widen_wav_chunk(src, (Uint8 *) buf, len);
+    return len / src->bytes_per_frame;
+}
+
+/* One RWseek no matter how long the file is. */
+static void wav_seek(AudioSource *src, Uint64 frame){
+    const Uint32 offset = (Uint32) frame * (Uint32) src->bytes_per_frame;
+    SDL_RWseek(src->rw, src->data_start + offset, RW_SEEK_SET);
+    src->data_remaining = src->data_len - offset;
+}
+
+static void wav_close(AudioSource *src){
+    SDL_FreeWAV(src->wavbuf);
+    src->wavbuf = NULL;
+}
+
+static SDL_bool wav_info(AudioSource *src, TrackInfo *info){
+    // compressed ones still say their rate and channels, just not their length
+    const SDL_bool pcm = parse_wav_header(src);
+    info->freq = src->freq;
+    info->channels = src->channels;
+    info->num_frames = pcm ? (src->data_remaining / src->bytes_per_frame) : 0;
+    return SDL_TRUE;
+}
+
+/* FLAC, decoded a frame at a time straight from the file. Covers everything
+   the reference encoder writes: constant, verbatim, fixed and LPC subframes,
+   rice coded residuals and all the stereo modes, up to 24 bits. */
+#define FLAC_MAX_CHANNELS 8
+#define FLAC_MAX_BITS 24
+#define FLAC_READ_SIZE 16384
+/* Seeking bisects on frame headers until the target is this close, then
+   decodes its way there. */
+#define FLAC_SEEK_SLACK 65536
+
+typedef struct{
+    Uint64 sample;
+    Uint64 offset; // from the first frame
+} FlacSeekPoint;
+
+typedef struct{
+    Uint64 first_sample;
+    Uint32 block_size;
+    int channel_mode; // 0-7 independent channels, 8 left/side, 9 side/right, 10 mid/side
+} FlacFrameHeader;
+
+typedef struct{
+    SDL_RWops *rw;    // Not owned, src->rw
+    Uint8 in[FLAC_READ_SIZE];
+    Uint32 in_len;
+    Uint32 in_pos;
+    Sint64 in_offset; // file offset of in[0]
+    Uint64 bits;      // read from `in` but not used yet, right aligned
+    int num_bits;
+    SDL_bool overrun; // wanted bits past the end of the file
+
+    Uint32 min_block_size;
+    Uint32 max_block_size;
+    int channels;
+    int bits_per_sample;
+    Sint64 first_frame;
+    Sint64 file_size;
+    FlacSeekPoint *seek_points;
+    int num_seek_points;
+
+    Sint32 *block[FLAC_MAX_CHANNELS];
+    Uint32 block_size;
+    Uint32 block_pos; // frames of `block` already handed out
+    Uint64 skip;      // frames still to drop after seeking to a frame before the target
+} FlacDecoder;
+
+static void flac_reset(FlacDecoder *d, const Sint64 offset){
+    SDL_RWseek(d->rw, offset, RW_SEEK_SET);
+    d->in_offset = offset;
+    d->in_len = 0;
+    d->in_pos = 0;
+    d->bits = 0;
+    d->num_bits = 0;
+    d->overrun = SDL_FALSE;
+}
+
+static Sint64 flac_tell(const FlacDecoder *d){
+    return d->in_offset + d->in_pos - (d->num_bits / 8);
+}
+
+static void flac_fill(FlacDecoder *d){
+    while(d->num_bits <= 48){
+        if(d->in_pos == d->in_len){
+            d->in_offset += d->in_len;
+            d->in_len = (Uint32) SDL_RWread(d->rw, d->in, 1, sizeof(d->in));
+            d->in_pos = 0;
+            if(d->in_len == 0){
+                return;
+            }
+        }
+        d->bits = (d->bits << 8) | d->in[d->in_pos++];
+        d->num_bits += 8;
+    }
+}
+
+static Uint32 flac_bits(FlacDecoder *d, const int n){
+    if(n == 0){
+        return 0;
+    }
+    if(d->num_bits < n){
+        flac_fill(d);
+        if(d->num_bits < n){
+            d->overrun = SDL_TRUE;
+            d->num_bits = 0;
+            return 0;
+        }
+    }
+    d->num_bits -= n;
+    return (Uint32) ((d->bits >> d->num_bits) & (((Uint64) 1 << n) - 1));
+}
+
+static Sint32 flac_signed(FlacDecoder *d, const int n){
+    if(n == 0){
+        return 0;
+    }
+    const Uint32 sign = (Uint32) 1 << (n - 1);
+    return (Sint32) ((Sint64) (flac_bits(d, n) ^ sign) - (Sint64) sign);
+}
+
+/* Counts zeros up to the next one bit, and eats the one. */
+static Uint32 flac_unary(FlacDecoder *d){
+    Uint32 zeros = 0;
+    for(;;){
+        if(d->num_bits == 0){
+            flac_fill(d);
+            if(d->num_bits == 0){
+                d->overrun = SDL_TRUE;
+                return 0;
+            }
+        }
+        const Uint64 avail = d->bits & (((Uint64) 1 << d->num_bits) - 1);
+        if(avail == 0){
+            zeros += d->num_bits;
+            d->num_bits = 0;
+            continue;
+        }
+        const int top = (avail >> 32) ? (SDL_MostSignificantBitIndex32((Uint32) (avail >> 32)) + 32) : SDL_MostSignificantBitIndex32((Uint32) avail);
+        zeros += d->num_bits - 1 - top;
+        d->num_bits = top;
+        return zeros;
+    }
+}
+
+static Uint8 flac_crc8(const Uint8 *data, const int len){
+    Uint8 crc = 0;
+    for(int i = 0; i < len; ++i){
+        crc ^= data[i];
+        for(int j = 0; j < 8; ++j){
+            crc = (crc & 0x80) ? (Uint8) ((crc << 1) ^ 0x07) : (Uint8) (crc << 1);
+        }
+    }
+    return crc;
+}
+
+/* Size of the frame header starting at `p`, from its first 5 bytes. 0 if
+   that can't be a frame header. */
+static int flac_header_len(const Uint8 *p){
+    static const Uint8 utf8_len[32] = {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0xxxxxxx
+        0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0   // 10xxxxxx is a continuation, 11111 is checked below
+    };
+    if((p[0] != 0xFF) || ((p[1] & 0xFE) != 0xF8)){
+        return 0;
+    }
+    int len = utf8_len[p[4] >> 3];
+    if(p[4] >= 0xF8){
+        len = (p[4] < 0xFC) ? 5 : (p[4] < 0xFE) ? 6 : (p[4] == 0xFE) ? 7 : 0;
+    }
+    if(len == 0){
+        return 0;
+    }
+    len += 4;
+    const int block_code = p[2] >> 4;
+    const int rate_code = p[2] & 0xF;
+    len += (block_code == 6) ? 1 : (block_code == 7) ? 2 : 0;
+    len += (rate_code == 12) ? 1 : ((rate_code == 13) || (rate_code == 14)) ? 2 : 0;
+    return len + 1; // CRC-8
+}
+
+/* `len` bytes from flac_header_len. Only takes headers that agree with
+   STREAMINFO, the sync code turns up in compressed data all the time. */
+static SDL_bool flac_parse_header(const FlacDecoder *d, const Uint8 *p, const int len, FlacFrameHeader *h){
+    static const int sample_bits[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+    const int block_code = p[2] >> 4;
+    const int size_code = (p[3] >> 1) & 7;
+    const int bits = size_code ? sample_bits[size_code] : d->bits_per_sample;
+
+    h->channel_mode = p[3] >> 4;
+    if((block_code == 0) || ((p[2] & 0xF) == 15) || (h->channel_mode > 10) || (p[3] & 1) ||
+       (bits != d->bits_per_sample) || (((h->channel_mode < 8) ? (h->channel_mode + 1) : 2) != d->channels) ||
+       (flac_crc8(p, len - 1) != p[len - 1])){
+        return SDL_FALSE;
+    }
+
+    // frame or sample number, UTF-8 style
+    int pos = 4;
+    Uint64 number = p[pos++];
+    if(number >= 0x80){
+        int extra = 1;
+        while((number << extra) & 0x40){
+            ++extra;
+        }
+        number &= ((Uint64) 1 << (6 - extra)) - 1;
+        while(extra--){
+            if((p[pos] & 0xC0) != 0x80){
+                return SDL_FALSE;
+            }
+            number = (number << 6) | (p[pos++] & 0x3F);
+        }
+    }
+
+    if(block_code == 1){
+        h->block_size = 192;
+    }else if(block_code <= 5){
+        h->block_size = 576 << (block_code - 2);
+    }else if(block_code == 6){
+        h->block_size = p[pos] + 1;
+    }else if(block_code == 7){
+        h->block_size = ((p[pos] << 8) | p[pos + 1]) + 1;
+    }else{
+        h->block_size = 256 << (block_code - 8);
+    }
+    if(h->block_size > d->max_block_size){
+        return SDL_FALSE;
+    }
+    // fixed block size streams count frames, variable ones count samples
+    h->first_sample = (p[1] & 1) ? number : (number * d->min_block_size);
+    return SDL_TRUE;
+}
+
+/* Leaves the reader on the first frame header at or after `offset`. */
+static SDL_bool flac_find_frame(FlacDecoder *d, const Sint64 offset, FlacFrameHeader *h){
+    SDL_bool eof = SDL_FALSE;
+    flac_reset(d, offset);
+    for(;;){
+        Uint32 avail = d->in_len - d->in_pos;
+        if((avail < 16) && !eof){
+            // keep a whole header's worth in the buffer
+            SDL_memmove(d->in, &d->in[d->in_pos], avail);
+            d->in_offset += d->in_pos;
+            d->in_pos = 0;
+            const Uint32 got = (Uint32) SDL_RWread(d->rw, &d->in[avail], 1, sizeof(d->in) - avail);
+            eof = (got == 0);
+            d->in_len = avail + got;
+            avail = d->in_len;
+        }
+        if(avail < 6){
+            return SDL_FALSE;
+        }
+        const Uint8 *p = &d->in[d->in_pos];
+        if((p[0] == 0xFF) && ((p[1] & 0xFE) == 0xF8)){
+            const int len = flac_header_len(p);
+            if(len && (len <= (int) avail) && flac_parse_header(d, p, len, h)){
+                return SDL_TRUE;
+            }
+        }
+        ++d->in_pos;
+    }
+}
+
+static SDL_bool flac_decode_residual(FlacDecoder *d, Sint32 *out, const Uint32 block_size, const Uint32 order){
+    const Uint32 method = flac_bits(d, 2);
+    if(method > 1){
+        return SDL_FALSE;
+    }
+    const int param_bits = method ? 5 : 4;
+    const Uint32 escape = method ? 31 : 15;
+    const int partition_order = (int) flac_bits(d, 4);
+    const Uint32 partition_size = block_size >> partition_order;
+    if(((partition_size << partition_order) != block_size) || (partition_size < order)){
+        return SDL_FALSE;
+    }
+
+    Uint32 i = order;
+    for(Uint32 partition = 0; partition < ((Uint32) 1 << partition_order); ++partition){
+        const Uint32 end = (partition + 1) * partition_size;
+        const int param = (int) flac_bits(d, param_bits);
+        if((Uint32) param == escape){
+            const int bits = (int) flac_bits(d, 5);
+            for(; i < end; ++i){
+                out[i] = flac_signed(d, bits);
+            }
+        }else{
+            for(; i < end; ++i){
+                const Uint32 folded = (flac_unary(d) << param) | flac_bits(d, param);
+                out[i] = (Sint32) (folded >> 1) ^ -(Sint32) (folded & 1);
+            }
+        }
+        if(d->overrun){
+            return SDL_FALSE;
+        }
+    }
+    return SDL_TRUE;
+}
+
+static SDL_bool flac_decode_subframe(FlacDecoder *d, Sint32 *out, const Uint32 block_size, int bits){
+    if(flac_bits(d, 1) != 0){
+        return SDL_FALSE;
+    }
+    const Uint32 type = flac_bits(d, 6);
+    int wasted = 0;
+    if(flac_bits(d, 1)){
+        wasted = (int) flac_unary(d) + 1;
+        bits -= wasted;
+        if(bits <= 0){
+            return SDL_FALSE;
+        }
+    }
+
+    if(type == 0){ // constant
+        const Sint32 value = flac_signed(d, bits);
+        for(Uint32 i = 0; i < block_size; ++i){
+            out[i] = value;
+        }
+    }else if(type == 1){ // verbatim
+        for(Uint32 i = 0; i < block_size; ++i){
+            out[i] = flac_signed(d, bits);
+        }
+    }else if((type >= 8) && (type <= 12)){ // fixed polynomial
+        const Uint32 order = type - 8;
+        if(order > block_size){
+            return SDL_FALSE;
+        }
+        for(Uint32 i = 0; i < order; ++i){
+            out[i] = flac_signed(d, bits);
+        }
+        if(!flac_decode_residual(d, out, block_size, order)){
+            return SDL_FALSE;
+        }
+        for(Uint32 i = order; i < block_size; ++i){
+            switch(order){
+                case 1: out[i] += out[i - 1]; break;
+                case 2: out[i] += (Sint32) (2 * (Sint64) out[i - 1] - out[i - 2]); break;
+                case 3: out[i] += (Sint32) (3 * ((Sint64) out[i - 1] - out[i - 2]) + out[i - 3]); break;
+                case 4: out[i] += (Sint32) (4 * ((Sint64) out[i - 1] + out[i - 3]) - 6 * (Sint64) out[i - 2] - out[i - 4]); break;
+                default: break;
+            }
+        }
+    }else if(type >= 32){ // LPC
+        const Uint32 order = type - 31;
+        Sint32 coefs[32];
+        if(order > block_size){
+            return SDL_FALSE;
+        }
+        for(Uint32 i = 0; i < order; ++i){
+            out[i] = flac_signed(d, bits);
+        }
+        const int precision = (int) flac_bits(d, 4) + 1;
+        const int shift = flac_signed(d, 5);
+        if((precision == 16) || (shift < 0)){
+            return SDL_FALSE;
+        }
+        for(Uint32 i = 0; i < order; ++i){
+            coefs[i] = flac_signed(d, precision);
+        }
+        if(!flac_decode_residual(d, out, block_size, order)){
+            return SDL_FALSE;
+        }
+        for(Uint32 i = order; i < block_size; ++i){
+            Sint64 sum = 0;
+            for(Uint32 j = 0; j < order; ++j){
+                sum += (Sint64) coefs[j] * out[i - 1 - j];
+            }
+            out[i] += (Sint32) (sum >> shift);
+        }
+    }else{
+        return SDL_FALSE;
+    }
+
+    if(wasted){
+        for(Uint32 i = 0; i < block_size; ++i){
+            out[i] = (Sint32) ((Uint32) out[i] << wasted);
+        }
+    }
+    return !d->overrun;
+}
+
+/* Decodes the frame under the reader into `block`. */
+static SDL_bool flac_decode_frame(FlacDecoder *d){
+    Uint8 header[16];
+    FlacFrameHeader h;
+
+    for(int i = 0; i < 5; ++i){
+        header[i] = (Uint8) flac_bits(d, 8);
+    }
+    const int len = flac_header_len(header);
+    if(d->overrun || (len == 0)){
+        return SDL_FALSE;
+    }
+    for(int i = 5; i < len; ++i){
+        header[i] = (Uint8) flac_bits(d, 8);
+    }
+    if(d->overrun || !flac_parse_header(d, header, len, &h)){
+        return SDL_FALSE;
+    }
+
+    for(int c = 0; c < d->channels; ++c){
+        // the side channel needs an extra bit
+        const SDL_bool side = ((h.channel_mode == 8) && (c == 1)) || ((h.channel_mode == 9) && (c == 0)) || ((h.channel_mode == 10) && (c == 1));
+        if(!flac_decode_subframe(d, d->block[c], h.block_size, d->bits_per_sample + side)){
+            return SDL_FALSE;
+        }
+    }
+
+    Sint32 *left = d->block[0];
+    Sint32 *right = d->block[1];
+    if(h.channel_mode == 8){
+        for(Uint32 i = 0; i < h.block_size; ++i){
+            right[i] = left[i] - right[i];
+        }
+    }else if(h.channel_mode == 9){
+        for(Uint32 i = 0; i < h.block_size; ++i){
+            left[i] += right[i];
+        }
+    }else if(h.channel_mode == 10){
+        for(Uint32 i = 0; i < h.block_size; ++i){
+            const Sint32 side = right[i];
+            const Sint32 mid = (Sint32) (((Uint32) left[i] << 1) | (side & 1));
+            left[i] = (mid + side) >> 1;
+            right[i] = (mid - side) >> 1;
+        }
+    }
+
+    d->num_bits -= d->num_bits % 8;
+    flac_bits(d, 16); // CRC-16, not checked, the header's CRC-8 catches lost sync
+    d->block_size = h.block_size;
+    d->block_pos = 0;
+    return !d->overrun;
+}
+
+static SDL_bool flac_next_frame(FlacDecoder *d){
+    Sint64 start = flac_tell(d);
+    while(!flac_decode_frame(d)){
+        // damaged frame, carry on from the next one that looks right
+        FlacFrameHeader h;
+        if(!flac_find_frame(d, start + 1, &h)){
+            return SDL_FALSE;
+        }
+        start = flac_tell(d);
+    }
+    if(d->skip){
+        d->block_pos = (Uint32) SDL_min(d->skip, (Uint64) d->block_size);
+        d->skip -= d->block_pos;
+    }
+    return SDL_TRUE;
+}
+
+static SDL_bool flac_probe(const Uint8 *magic){
+    return SDL_memcmp(magic, "fLaC", 4) == 0;
+}
+
+static Uint64 flac_be(const Uint8 *p, const int len){
+    Uint64 value = 0;
+    for(int i = 0; i < len; ++i){
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static SDL_bool flac_open(AudioSource *src){
+    FlacDecoder *d = (FlacDecoder *) SDL_calloc(1, sizeof(FlacDecoder));
+    Uint8 info[34];
+    Uint8 header[4];
+
+    if(!d){
+        SDL_OutOfMemory();
+        return SDL_FALSE;
+    }
+    src->decoder_data = d; // flac_close cleans up from here on
+    d->rw = src->rw;
+    d->file_size = SDL_RWsize(src->rw);
+
+    SDL_RWseek(src->rw, 4, RW_SEEK_CUR); // "fLaC"
+    if((SDL_RWread(src->rw, header, sizeof(header), 1) != 1) || ((header[0] & 0x7F) != 0) ||
+       (flac_be(&header[1], 3) < sizeof(info)) || (SDL_RWread(src->rw, info, sizeof(info), 1) != 1)){
+        SDL_SetError("Corrupt FLAC file (no STREAMINFO)");
+        return SDL_FALSE;
+    }
+    SDL_RWseek(src->rw, (Sint64) flac_be(&header[1], 3) - (Sint64) sizeof(info), RW_SEEK_CUR);
+    d->min_block_size = (Uint32) flac_be(&info[0], 2);
+    d->max_block_size = (Uint32) flac_be(&info[2], 2);
+    src->freq = (int) (flac_be(&info[10], 3) >> 4);
+    d->channels = ((info[12] >> 1) & 7) + 1;
+    d->bits_per_sample = (int) ((flac_be(&info[12], 2) >> 4) & 0x1F) + 1;
+    src->num_frames = flac_be(&info[13], 5) & 0xFFFFFFFFF;
+    if((d->max_block_size < 16) || (d->min_block_size > d->max_block_size) || (src->freq == 0)){
+        SDL_SetError("Corrupt FLAC file (bad STREAMINFO)");
+        return SDL_FALSE;
+    }
+    if(d->bits_per_sample > FLAC_MAX_BITS){
+        SDL_SetError("Unsupported FLAC file (%d bits per sample)", d->bits_per_sample);
+        return SDL_FALSE;
+    }
+
+    // the seek table is the only other block we care about
+    while(!(header[0] & 0x80)){
+        if(SDL_RWread(src->rw, header, sizeof(header), 1) != 1){
+            SDL_SetError("Corrupt FLAC file (truncated metadata)");
+            return SDL_FALSE;
+        }
+        const Uint32 len = (Uint32) flac_be(&header[1], 3);
+        if(((header[0] & 0x7F) == 3) && !d->seek_points){
+            const int num_points = (int) (len / 18);
+            d->seek_points = (FlacSeekPoint *) SDL_malloc(sizeof(FlacSeekPoint) * (num_points ? num_points : 1));
+            if(!d->seek_points){
+                SDL_OutOfMemory();
+                return SDL_FALSE;
+            }
+            for(int i = 0; i < num_points; ++i){
+                Uint8 point[18];
+                if(SDL_RWread(src->rw, point, sizeof(point), 1) != 1){
+                    break;
+                }
+                const Uint64 sample = flac_be(point, 8);
+                if(sample == 0xFFFFFFFFFFFFFFFFull){
+                    continue; // placeholder
+                }
+                d->seek_points[d->num_seek_points].sample = sample;
+                d->seek_points[d->num_seek_points].offset = flac_be(&point[8], 8);
+                d->num_seek_points++;
+            }
+            SDL_RWseek(src->rw, len % 18, RW_SEEK_CUR);
+        }else{
+            SDL_RWseek(src->rw, len, RW_SEEK_CUR);
+        }
+    }
+
+    for(int c = 0; c < d->channels; ++c){
+        d->block[c] = (Sint32 *) SDL_malloc(d->max_block_size * sizeof(Sint32));
+        if(!d->block[c]){
+            SDL_OutOfMemory();
+            return SDL_FALSE;
+        }
+    }
+    d->first_frame = SDL_RWtell(src->rw);
+    flac_reset(d, d->first_frame);
+
+    // left aligned 32-bit whatever the file has, SDL_AudioStream only does 8/16/32
+    src->format = AUDIO_S32SYS;
+    src->channels = (Uint8) d->channels;
+    return SDL_TRUE;
+}
+
+static Uint32 flac_read(AudioSource *src, void *buf, Uint32 num_frames){
+    FlacDecoder *d = (FlacDecoder *) src->decoder_data;
+    const int shift = 32 - d->bits_per_sample;
+    Sint32 *out = (Sint32 *) buf;
+    Uint32 done = 0;
+
+    while(done < num_frames){
+        if(d->block_pos == d->block_size){
+            if(!flac_next_frame(d)){
+                break;
+            }
+            continue;
+        }
+        const Uint32 n = SDL_min(num_frames - done, d->block_size - d->block_pos);
+        for(Uint32 i = d->block_pos; i < d->block_pos + n; ++i){
+            for(int c = 0; c < d->channels; ++c){
+                *(out++) = (Sint32) ((Uint32) d->block[c][i] << shift);
+            }
+        }
+        d->block_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+/* Starts from the closest seek table entry, then bisects on frame headers,
+   so it costs a handful of small reads however long the file is. */
+static void flac_seek(AudioSource *src, Uint64 frame){
+    FlacDecoder *d = (FlacDecoder *) src->decoder_data;
+    Sint64 lo = d->first_frame;
+    Sint64 hi = d->file_size;
+    Uint64 lo_sample = 0;
+    FlacFrameHeader h;
+
+    for(int i = 0; i < d->num_seek_points; ++i){
+        if(d->seek_points[i].sample > frame){
+            hi = SDL_min(hi, d->first_frame + (Sint64) d->seek_points[i].offset);
+            break;
+        }
+        lo = d->first_frame + (Sint64) d->seek_points[i].offset;
+        lo_sample = d->seek_points[i].sample;
+    }
+
+    while((hi - lo) > FLAC_SEEK_SLACK){
+        const Sint64 mid = lo + ((hi - lo) / 2);
+        if(!flac_find_frame(d, mid, &h) || (h.first_sample > frame)){
+            hi = mid;
+            continue;
+        }
+        lo = flac_tell(d);
+        lo_sample = h.first_sample;
+        if(frame < (h.first_sample + h.block_size)){
+            break;
+        }
+    }
+
+    flac_reset(d, lo);
+    d->block_size = 0;
+    d->block_pos = 0;
+    d->skip = frame - lo_sample;
+}
+
+static void flac_close(AudioSource *src){
+    FlacDecoder *d = (FlacDecoder *) src->decoder_data;
+    if(d){
+        for(int c = 0; c < FLAC_MAX_CHANNELS; ++c){
+            SDL_free(d->block[c]);
+        }
+        SDL_free(d->seek_points);
+        SDL_free(d);
+        src->decoder_data = NULL;
+    }
+}
+
+/* Title and artist out of a Vorbis comment block, `len` bytes at the
+   reader. Fields too long to be either (cover art, mostly) are seeked over. */
+static void read_vorbis_comments(SDL_RWops *rw, const Uint32 len, TrackInfo *info){
+    char field[TAG_MAX_LEN];
+    Uint32 pos = 8;
+    const Uint32 vendor_len = SDL_ReadLE32(rw);
+
+    if((vendor_len > len) || ((len - vendor_len) < pos)){
+        return;
+    }
+    pos += vendor_len;
+    SDL_RWseek(rw, vendor_len, RW_SEEK_CUR);
+    for(Uint32 count = SDL_ReadLE32(rw); count && ((len - pos) >= 4) && !(info->artist && info->title); --count){
+        const Uint32 field_len = SDL_ReadLE32(rw);
+        pos += 4;
+        if(field_len > (len - pos)){
+            break;
+        }
+        pos += field_len;
+        if((field_len >= sizeof(field)) || (SDL_RWread(rw, field, field_len, 1) != 1)){
+            SDL_RWseek(rw, field_len, RW_SEEK_CUR);
+            continue;
+        }
+        if((field_len > 6) && (SDL_strncasecmp(field, "TITLE=", 6) == 0)){
+            set_tag(&info->title, &field[6], field_len - 6);
+        }else if((field_len > 7) && (SDL_strncasecmp(field, "ARTIST=", 7) == 0)){
+            set_tag(&info->artist, &field[7], field_len - 7);
+        }
+    }
+}
+
+/* STREAMINFO, then the metadata blocks up to the first VORBIS_COMMENT. */
+static SDL_bool flac_info(AudioSource *src, TrackInfo *info){
+    Uint8 streaminfo[34];
+    Uint8 header[4];
+
+    SDL_RWseek(src->rw, 4, RW_SEEK_CUR); // "fLaC"
+    if((SDL_RWread(src->rw, header, sizeof(header), 1) != 1) || ((header[0] & 0x7F) != 0) ||
+       (flac_be(&header[1], 3) < sizeof(streaminfo)) || (SDL_RWread(src->rw, streaminfo, sizeof(streaminfo), 1) != 1)){
+        SDL_SetError("Corrupt FLAC file (no STREAMINFO)");
+        return SDL_FALSE;
+    }
+    SDL_RWseek(src->rw, (Sint64) flac_be(&header[1], 3) - (Sint64) sizeof(streaminfo), RW_SEEK_CUR);
+    info->freq = (int) (flac_be(&streaminfo[10], 3) >> 4);
+    info->channels = ((streaminfo[12] >> 1) & 7) + 1;
+    info->num_frames = flac_be(&streaminfo[13], 5) & 0xFFFFFFFFF;
+
+    while(!(header[0] & 0x80) && (SDL_RWread(src->rw, header, sizeof(header), 1) == 1)){
+        const Uint32 len = (Uint32) flac_be(&header[1], 3);
+        if((header[0] & 0x7F) == 4){
+            read_vorbis_comments(src->rw, len, info);
+            break;
+        }
+        SDL_RWseek(src->rw, len, RW_SEEK_CUR);
+    }
+    return SDL_TRUE;
+}
+
+static const AudioDecoder audio_decoders[] = {
+    { "wav", wav_probe, wav_open, wav_read, wav_seek, wav_close, wav_info, "wav wave" },
+    { "flac", flac_probe, flac_open, flac_read, flac_seek, flac_close, flac_info, "flac" },
+};
+
+/* ID3v2 sizes are stored 7 bits a byte. */
+static Uint32 id3_syncsafe(const Uint8 *p){
+    return ((Uint32) (p[0] & 0x7F) << 21) | ((Uint32) (p[1] & 0x7F) << 14) | ((Uint32) (p[2] & 0x7F) << 7) | (Uint32) (p[3] & 0x7F);
+}
+
+/* A text frame's payload: an encoding byte, then the text. */
+static void set_id3_tag(char **tag, const Uint8 *frame, const Uint32 len){
+    static const char *encodings[4] = { "ISO-8859-1", "UTF-16", "UTF-16BE", "UTF-8" };
+    if((len < 2) || (frame[0] > 3) || *tag){
+        return;
+    }
+    char *text = SDL_iconv_string("UTF-8", encodings[frame[0]], (const char *) &frame[1], len - 1);
+    if(text){
+        set_tag(tag, text, SDL_strlen(text));
+        SDL_free(text);
+    }
+}
+
+/* Title and artist out of the ID3v2 tag `header` starts, seeking over every
+   other frame (cover art and all). The tag ends at `end`. */
+static void read_id3v2_tags(SDL_RWops *rw, const Uint8 *header, const Sint64 end, TrackInfo *info){
+    const int version = header[3];
+    const int id_len = (version == 2) ? 3 : 4;
+    const Sint64 frame_header_len = (version == 2) ? 6 : 10;
+    Uint8 frame[TAG_MAX_LEN];
+    Sint64 pos = 10;
+
+    if((version < 2) || (version > 4) || (header[5] & 0x80)){
+        return; // unsynchronised tags are rare, not worth undoing
+    }
+    SDL_RWseek(rw, pos, RW_SEEK_SET);
+    if((version > 2) && (header[5] & 0x40) && (SDL_RWread(rw, frame, 4, 1) == 1)){
+        // extended header, v2.4 counts its own size field, v2.3 doesn't
+        pos += (version == 4) ? id3_syncsafe(frame) : ((Sint64) flac_be(frame, 4) + 4);
+        SDL_RWseek(rw, pos, RW_SEEK_SET);
+    }
+
+    while(((pos + frame_header_len) <= end) && !(info->artist && info->title) &&
+          (SDL_RWread(rw, frame, (size_t) frame_header_len, 1) == 1) && (frame[0] != 0)){ // then it's padding
+        const Uint32 len = (version == 4) ? id3_syncsafe(&frame[4]) : (Uint32) flac_be(&frame[id_len], id_len);
+        // compressed, encrypted or otherwise mangled frames aren't worth it either
+        const SDL_bool plain = (version == 2) || ((frame[9] & ((version == 4) ? 0x0F : 0xC0)) == 0);
+        char **tag = NULL;
+        if(SDL_memcmp(frame, (version == 2) ? "TT2" : "TIT2", id_len) == 0){
+            tag = &info->title;
+        }else if(SDL_memcmp(frame, (version == 2) ? "TP1" : "TPE1", id_len) == 0){
+            tag = &info->artist;
+        }
+        pos += frame_header_len + len;
+        if(pos > end){
+            break;
+        }
+        if(tag && !*tag && plain && (len <= sizeof(frame)) && (SDL_RWread(rw, frame, len, 1) == 1)){
+            set_id3_tag(tag, frame, len);
+        }
+        SDL_RWseek(rw, pos, RW_SEEK_SET);
+    }
+}
+
+/* Leaves `rw` on the first 12 bytes after any ID3v2 tag and copies them to
+   `magic`. With `info`, picks the title and artist out of the tag on the
+   way past. */
+static void find_audio_magic(SDL_RWops *rw, Uint8 *magic, TrackInfo *info){
+    Sint64 start = 0;
+
+    SDL_memset(magic, 0, 12);
+    SDL_RWread(rw, magic, 1, 12);
+    if(SDL_memcmp(magic, "ID3", 3) == 0){
+        start = 10 + (Sint64) id3_syncsafe(&magic[6]);
+        if(info){
+            read_id3v2_tags(rw, magic, start, info);
+        }
+        if(magic[5] & 0x10){
+            start += 10; // footer
+        }
+        SDL_memset(magic, 0, 12);
+        SDL_RWseek(rw, start, RW_SEEK_SET);
+        SDL_RWread(rw, magic, 1, 12);
+    }
+    SDL_RWseek(rw, start, RW_SEEK_SET);
+}
+
+static const AudioDecoder *find_audio_decoder(const Uint8 *magic){
+    for(size_t i = 0; i < SDL_arraysize(audio_decoders); ++i){
+        if(audio_decoders[i].probe(magic)){
+            return &audio_decoders[i];
+        }
+    }
+    SDL_SetError("Unsupported audio file");
+    return NULL;
+}
+
+/* Finds out what's in `src->fname` and gets its decoder ready to read from
+   the start. Decoder thread, so the UI never waits on the disk. */
+static SDL_bool AudioSource_open_file(AudioSource *src){
+    Uint8 magic[12];
+
+    src->rw = SDL_RWFromFile(src->fname, "rb");
+    if(!src->rw){
+        return SDL_FALSE;
+    }
+
+    find_audio_magic(src->rw, magic, NULL);
+    src->decoder = find_audio_decoder(magic);
+    if(!src->decoder || !src->decoder->open(src)){
+        return SDL_FALSE;
+    }
+    if((src->channels == 0) || (src->freq <= 0)){
+        SDL_SetError("Corrupt %s file (no channels or sample rate)", src->decoder->name);
+        return SDL_FALSE;
+    }
+
+    const Uint64 length = (src->num_frames * audio_out_freq) / (Uint64) src->freq;
+    SDL_AtomicSet(&src->length, (int) SDL_min(length, (Uint64) SDL_MAX_SINT32));
+    return SDL_TRUE;
+}
+
+/* Any thread. Headers and tags only, nothing is decoded. */
+static SDL_bool read_track_info(const char *fname, TrackInfo *info){
+    AudioSource src;
+    Uint8 magic[12];
+    SDL_bool ok = SDL_FALSE;
+
+    SDL_zero(src);
+    SDL_zerop(info);
+    src.fname = (char *) fname;
+    src.rw = SDL_RWFromFile(fname, "rb");
+    if(!src.rw){
+        return SDL_FALSE;
+    }
+    find_audio_magic(src.rw, magic, info);
+    src.decoder = find_audio_decoder(magic);
+    if(src.decoder && src.decoder->info(&src, info)){
+        ok = (info->channels > 0) && (info->freq > 0);
+        if(!ok){
+            SDL_SetError("Corrupt %s file (no channels or sample rate)", src.decoder->name);
+        }
+    }
+    SDL_RWclose(src.rw);
+    if(!ok){
+        TrackInfo_free(info);
+    }
+    return ok;
+}
+
+/* Decoder thread. Puts the decoder on the frame nearest the requested
+   device frame. */
+static void AudioSource_do_seek(AudioSource *src, const int request){
+    const Sint64 length = SDL_AtomicGet(&src->length);
+    const Sint64 seek_to = SDL_max((Sint64) SDL_AtomicGet(&src->seek_to), 0);
+    // no length (a FLAC that doesn't say) means no end to clamp to, the decoder stops at EOF
+    const Sint64 target = length ? SDL_min(seek_to, length) : seek_to;
+    const Uint64 wanted = ((Uint64) target * (Uint64) src->freq) / audio_out_freq;
+    const Uint64 frame = src->num_frames ? SDL_min(wanted, src->num_frames) : wanted;
+
+    if(!src->map){ // mapped files have nothing to seek, the callback just moves its cursor
+        src->decoder->seek(src, frame);
+    }
+    src->seek_head = (Uint32) SDL_AtomicGet(&src->ring.head);
+    src->seek_position = (int) ((frame * audio_out_freq) / (Uint64) src->freq);
+    // the callback reads seek_head/seek_position after it sees this
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&src->seek_done, request);
+}
+
+static void report_audio_error(const char *fname, const char *error){
+    const size_t len = SDL_strlen(fname) + SDL_strlen(error) + 3;
+    char *message = (char *) SDL_malloc(len);
+    SDL_Event e;
+
+    if(!message){
+        return;
+    }
+    SDL_snprintf(message, len, "%s: %s", fname, error);
+    SDL_zero(e);
+    e.type = audio_error_event;
+    e.user.data1 = message;
+    if((audio_error_event == (Uint32) -1) || (SDL_PushEvent(&e) != 1)){
+        fprintf(stderr, "Could not open audio file! %s\n", message);
+        SDL_free(message);
+    }
+}
+
+static void AudioSource_destroy(AudioSource *src){
+    if(src->decoder){
+        src->decoder->close(src);
+    }
+    if(src->rw){
+        SDL_RWclose(src->rw);
+    }
+#ifdef MYAMP_HAVE_MMAP
+    if(src->map){
+        munmap(src->map, src->map_len);
+    }
+#endif
+    SDL_free(src->ring.samples);
+    SDL_free(src->fname);
+    SDL_free(src);
+}
+
+/* The UI and the decoder thread each hold a reference, whoever lets go last
+   cleans up. That way the UI never has to wait for the decoder to finish
+   a read before it can move on. */
+static void AudioSource_release(AudioSource *src){
+    if(SDL_AtomicAdd(&src->refcount, -1) == 1){
+        AudioSource_destroy(src);
+    }
+}
+
+/* Feeds a source's ring for whoever decodes it: the decoder thread, or a
+   render worker doing it inline. Reads a chunk at a time from the decoder,
+   has SDL convert it to float stereo at the file's own rate and, unless
+   that's already the device rate, runs it through a Resampler. `pending`
+   frames of `converted` from `offset` on are still waiting for room in
+   the ring. */
+typedef struct AudioConverter{
+    Uint8 *chunk;
+    float *converted;
+    SDL_AudioStream *cvt;
+    Resampler resampler;
+    SDL_bool resampling;
+    Uint32 frame_size;
+    Uint32 pending;
+    Uint32 offset;
+    SDL_bool input_done;
+} AudioConverter;
+
+typedef enum AudioConvertStatus{
+    AUDIO_CONVERT_BUSY,  // did some work, call again
+    AUDIO_CONVERT_FULL,  // the ring has no room until someone reads from it
+    AUDIO_CONVERT_DONE,  // flushed and drained, everything is in the ring
+    AUDIO_CONVERT_ERROR
+} AudioConvertStatus;
+
+static void AudioConverter_free(AudioConverter *conv){
+    Resampler_free(&conv->resampler);
+    SDL_FreeAudioStream(conv->cvt);
+    SDL_free(conv->converted);
+    SDL_free(conv->chunk);
+    SDL_zerop(conv);
+}
+
+/* Also allocates the ring, only now that we know `src` isn't mapped and
+   needs it. */
+static SDL_bool AudioConverter_init(AudioConverter *conv, AudioSource *src){
+    SDL_zerop(conv);
+    src->ring.capacity = AUDIO_RING_FRAMES;
+    src->ring.samples = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+
+    conv->frame_size = (SDL_AUDIO_BITSIZE(src->format) / 8) * src->channels;
+    // 8 bytes a sample, WAV's doubles get narrowed in place
+    conv->chunk = (Uint8 *) SDL_malloc(DECODE_CHUNK_FRAMES * src->channels * sizeof(double));
+    conv->converted = (float *) SDL_malloc(DECODE_CHUNK_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    conv->cvt = SDL_NewAudioStream(src->format, src->channels, src->freq, AUDIO_F32, AUDIO_OUT_CHANNELS, src->freq);
+    conv->resampling = (src->freq != audio_out_freq) ? SDL_TRUE : SDL_FALSE;
+    if(!src->ring.samples || !conv->chunk || !conv->converted || !conv->cvt ||
+       (conv->resampling && !Resampler_init(&conv->resampler, resampler_preset, src->freq, audio_out_freq))){
+        AudioConverter_free(conv);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+/* After a seek, whatever is still in the converter is from the old spot. */
+static void AudioConverter_clear(AudioConverter *conv){
+    SDL_AudioStreamClear(conv->cvt);
+    if(conv->resampling){
+        Resampler_reset(&conv->resampler);
+    }
+    conv->pending = 0;
+    conv->input_done = SDL_FALSE;
+}
+
+/* Does one step's worth: moves what's pending into the ring, pulls
+   converted frames out, or decodes another chunk. */
+static AudioConvertStatus AudioConverter_step(AudioConverter *conv, AudioSource *src){
+    if(conv->pending){
+        const Uint32 written = AudioRing_write(&src->ring, &conv->converted[conv->offset * AUDIO_OUT_CHANNELS], conv->pending);
+        conv->offset += written;
+        conv->pending -= written;
+        return conv->pending ? AUDIO_CONVERT_FULL : AUDIO_CONVERT_BUSY;
+    }
+
+    if(conv->resampling){
+        Resampler *rs = &conv->resampler;
+        conv->pending = Resampler_read(rs, conv->converted, DECODE_CHUNK_FRAMES);
+        conv->offset = 0;
+        if(conv->pending){
+            return AUDIO_CONVERT_BUSY;
+        }else if(rs->flushed){
+            return AUDIO_CONVERT_DONE;
+        }
+        Uint32 room;
+        float *input = Resampler_input(rs, &room);
+        const int got = SDL_AudioStreamGet(conv->cvt, input, (int) (room * AUDIO_OUT_FRAME_SIZE));
+        if(got < 0){
+            return AUDIO_CONVERT_ERROR;
+        }else if(got > 0){
+            Resampler_commit(rs, got / AUDIO_OUT_FRAME_SIZE);
+            return AUDIO_CONVERT_BUSY;
+        }else if(conv->input_done){
+            Resampler_flush(rs);
+            return AUDIO_CONVERT_BUSY;
+        }
+    }else{
+        const int got = SDL_AudioStreamGet(conv->cvt, conv->converted, DECODE_CHUNK_FRAMES * AUDIO_OUT_FRAME_SIZE);
+        if(got < 0){
+            return AUDIO_CONVERT_ERROR;
+        }else if(got > 0){
+            conv->pending = got / AUDIO_OUT_FRAME_SIZE;
+            conv->offset = 0;
+            return AUDIO_CONVERT_BUSY;
+        }else if(conv->input_done){
+            return AUDIO_CONVERT_DONE;
+        }
+    }
+
+    const Uint32 frames = src->decoder->read(src, conv->chunk, DECODE_CHUNK_FRAMES);
+    if(frames == 0){
+        conv->input_done = SDL_TRUE;
+        if(SDL_AudioStreamFlush(conv->cvt) == -1){
+            return AUDIO_CONVERT_ERROR;
+        }
+    }else if(SDL_AudioStreamPut(conv->cvt, conv->chunk, (int) (frames * conv->frame_size)) == -1){
+        return AUDIO_CONVERT_ERROR;
+    }
+    return AUDIO_CONVERT_BUSY;
+}
+
+/* Worker. For sources opened outside of a decoder thread, which decode
+   inline as they're read: tops the ring up to `num_frames` ahead, like a
+   decoder thread that's keeping up, then reads. `*decoding` starts out set
+   unless `src` is mapped. Returns 0 once everything has been read, -1 if
+   the decoder failed. */
+static int AudioSource_pull(AudioSource *src, AudioConverter *conv, SDL_bool *decoding, float *frames, const Uint32 num_frames){
+    while(*decoding && (AudioRing_available(&src->ring) < num_frames)){
+        const AudioConvertStatus status = AudioConverter_step(conv, src);
+        if(status == AUDIO_CONVERT_ERROR){
+            return -1;
+        }else if(status == AUDIO_CONVERT_DONE){
+            *decoding = SDL_FALSE;
+        }else if(status == AUDIO_CONVERT_FULL){
+            break;
+        }
+    }
+    // the ring is never left empty before decoding is done
+    return (int) AudioSource_read(src, frames, num_frames);
+}
+
+/* Decoder thread. Opens the file, then keeps the ring topped up through an
+   AudioConverter, sleeping whenever the ring is full. */
+static int SDLCALL decode_audio_thread(void *data){
+    AudioSource *src = (AudioSource *) data;
+    AudioConverter conv;
+    Uint64 busy_start = SDL_GetPerformanceCounter();
+
+    SDL_zero(conv);
+    if(!AudioSource_open_file(src)){
+        report_audio_error(src->fname, SDL_GetError());
+        goto done;
+    }
+
+#ifdef MYAMP_HAVE_MMAP
+    if(src->map){
+        // nothing to decode, just keep what the callback reads next in memory
+        src->busy_ticks += SDL_GetPerformanceCounter() - busy_start;
+        SDL_AtomicSet(&src->finished, 1);
+        while(!SDL_AtomicGet(&src->quit)){
+            const int seek_request = SDL_AtomicGet(&src->seek_request);
+            if(seek_request != SDL_AtomicGet(&src->seek_done)){
+                AudioSource_do_seek(src, seek_request);
+            }
+            AudioSource_prefetch(src);
+            SDL_Delay(DECODE_IDLE_MS);
+        }
+        goto done;
+    }
+#endif
+
+    // the callback ignores the ring while it's empty
+    if(!AudioConverter_init(&conv, src)){
+        goto done;
+    }
+
+    while(!SDL_AtomicGet(&src->quit)){
+        const int seek_request = SDL_AtomicGet(&src->seek_request);
+        if(seek_request != SDL_AtomicGet(&src->seek_done)){
+            AudioConverter_clear(&conv);
+            SDL_AtomicSet(&src->finished, 0);
+            AudioSource_do_seek(src, seek_request);
+            continue;
+        }
+
+        const AudioConvertStatus status = AudioConverter_step(&conv, src);
+        if(status == AUDIO_CONVERT_ERROR){
+            break;
+        }else if(status == AUDIO_CONVERT_DONE){
+            // stick around in case we're asked to seek
+            if(!SDL_AtomicGet(&src->finished)){
+                src->busy_ticks += SDL_GetPerformanceCounter() - busy_start;
+                SDL_AtomicSet(&src->finished, 1);
+            }
+            SDL_Delay(DECODE_IDLE_MS);
+            busy_start = SDL_GetPerformanceCounter();
+        }else if(status == AUDIO_CONVERT_FULL){
+            src->busy_ticks += SDL_GetPerformanceCounter() - busy_start;
+            SDL_Delay(DECODE_IDLE_MS); // let the audio callback drain it
+            busy_start = SDL_GetPerformanceCounter();
+        }
+    }
+
+done:
+    if(!SDL_AtomicGet(&src->finished)){
+        src->busy_ticks += SDL_GetPerformanceCounter() - busy_start;
+    }
+    AudioConverter_free(&conv);
+    // nothing more is coming, the callback can move on to `next`
+    SDL_AtomicSet(&src->finished, 1);
+    AudioSource_release(src);
+    SDL_AtomicAdd(&decoders_in_flight, -1);
+    return 0;
+}
+
+/* UI side. Tells the decoder to stop and lets go of `src`, doesn't wait. */
+static void AudioSource_free(AudioSource *src){
+    if(src){
+        SDL_AtomicSet(&src->quit, 1);
+        AudioSource_release(src);
+    }
+}
+
+/* UI side. Playback jumps to device frame `position` as soon as the decoder
+   gets to it, nothing already converted has to be redone. */
+static void AudioSource_seek(AudioSource *src, const int position){
+    SDL_AtomicSet(&src->seek_to, position);
+    SDL_AtomicAdd(&src->seek_request, 1);
+}
+
+/* Starts a decoder thread for `fname`. Nothing is read here, if the file turns
+   out to be unplayable the thread posts audio_error_event and the source
+   just finishes without any audio. */
+static AudioSource *AudioSource_open(const char *fname){
+    AudioSource *src = (AudioSource *) SDL_calloc(1, sizeof(AudioSource));
+    if(!src){
+        SDL_OutOfMemory();
+        return NULL;
+    }
+
+    SDL_AtomicSet(&src->refcount, 1);
+    src->fname = SDL_strdup(fname);
+    if(!src->fname){
+        SDL_OutOfMemory();
+        AudioSource_release(src);
+        return NULL;
+    }
+
+    SDL_AtomicAdd(&src->refcount, 1); // the decoder's
+    SDL_AtomicAdd(&decoders_in_flight, 1);
+    SDL_Thread *thread = SDL_CreateThread(decode_audio_thread, "decoder", src);
+    if(!thread){
+        SDL_AtomicAdd(&decoders_in_flight, -1);
+        SDL_AtomicAdd(&src->refcount, -1);
+        AudioSource_release(src);
+        return NULL;
+    }
+    SDL_DetachThread(thread);
+    return src;
+}
+
+/* Voices handed to the mixer and not yet back through mixer_retired. UI thread only. */
+static int mixer_voices_out = 0;
+
+/* How long tracks overlap when one replaces another, 0 to cut straight over
+   (or play gaplessly, at the end of a track). From myamp.ini or --crossfade. */
+#define MAX_CROSSFADE_MS 10000
+static int crossfade_ms = 0;
+/* Played over the music on every button click, from myamp.ini. MAY BE NULL. */
+static char *click_sound = NULL;
+
+static SDL_bool Mixer_push(const MixerCommand *cmd){
+    const int head = SDL_AtomicGet(&mixer_commands_head);
+    if((Uint32) (head - SDL_AtomicGet(&mixer_commands_tail)) >= MIXER_QUEUE_LEN){
+        return SDL_FALSE;
+    }
+    mixer_commands[head & (MIXER_QUEUE_LEN - 1)] = *cmd;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&mixer_commands_head, head + 1);
+    return SDL_TRUE;
+}
+
+/* UI thread. Plays `src` over the current track, taking over the caller's
+   reference: the gain ramps from `from` to `to` over `frames`, and with
+   `stop_at_target` the voice ends there rather than at the end of the
+   source. SDL_FALSE if the mixer is full, `src` is still the caller's then. */
+static SDL_bool Mixer_add_voice(AudioSource *src, const float from, const float to, const Uint32 frames, const SDL_bool stop_at_target){
+    const MixerCommand cmd = { MIXER_ADD_VOICE, src, from, to, frames, stop_at_target };
+    if((mixer_voices_out >= MIXER_MAX_VOICES) || !Mixer_push(&cmd)){
+        return SDL_FALSE;
+    }
+    mixer_voices_out++;
+    return SDL_TRUE;
+}
+
+/* UI thread. Ramps the current track, from the next frame it plays. */
+static void Mixer_fade_music(const float from, const float to, const Uint32 frames){
+    const MixerCommand cmd = { MIXER_FADE_MUSIC, NULL, from, to, frames, SDL_FALSE };
+    Mixer_push(&cmd);
+}
+
+/* UI thread. Frees the sources of voices that have finished. */
+static void Mixer_reap(void){
+    const int head = SDL_AtomicGet(&mixer_retired_head);
+    int tail = SDL_AtomicGet(&mixer_retired_tail);
+
+    SDL_MemoryBarrierAcquire();
+    for(; tail != head; ++tail){
+        AudioSource_free(mixer_retired[tail & (MIXER_QUEUE_LEN - 1)]);
+        mixer_voices_out--;
+    }
+    SDL_AtomicSet(&mixer_retired_tail, tail);
+}
+
+/* UI thread. Silences every voice at once. Takes the audio lock to do it,
+   which is fine for STOP but not for anything that happens while playing. */
+static void Mixer_stop_all(void){
+    lock_audio_device();
+    Mixer_run_commands(); // so voices still in the queue get dropped too
+    for(int v = 0; v < MIXER_MAX_VOICES; ++v){
+        if(mixer_voices[v].src){
+            Mixer_retire(&mixer_voices[v]);
+        }
+    }
+    MixerEnvelope_set(&music_envelope, 1.0f, 1.0f, 0);
+    unlock_audio_device();
+    Mixer_reap();
+}
+
+/* UI thread. Layers click_sound over whatever is playing. */
+static void play_click_sound(void){
+    if(click_sound && (mixer_voices_out < MIXER_MAX_VOICES)){
+        AudioSource *src = AudioSource_open(click_sound);
+        if(src && !Mixer_add_voice(src, 1.0f, 1.0f, 0, SDL_FALSE)){
+            AudioSource_free(src);
+        }
+    }
+}
+
+static Uint32 crossfade_frames(void){
+    return (Uint32) (((Uint64) crossfade_ms * (Uint64) audio_out_freq) / 1000);
+}
+
+/* Sources the UI has opened, linked by `next`. The callback walks `source`
+   down this chain on its own as tracks end, reap_audio_sources() catches up
+   and frees whatever it has left behind. UI thread only. */
+static AudioSource *audio_sources = NULL;
+
+/* Drops the current track and everything queued after it. With `fade_frames`
+   the current track isn't cut off but handed to the mixer to fade out, in
+   which case this returns SDL_TRUE. */
+static SDL_bool stop_music(const Uint32 fade_frames){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    SDL_bool faded = SDL_FALSE;
+
+    // Make sure audio callback cant touch source whilst freeing it 
+    lock_audio_device();
+    SDL_AtomicSetPtr((void **) &source, NULL);
+    if(fade_frames && current && !paused){
+        faded = Mixer_add_voice(current, 1.0f, 0.0f, fade_frames, SDL_TRUE);
+    }
+    unlock_audio_device();
+
+    while(audio_sources){
+        AudioSource *next = (AudioSource *) SDL_AtomicGetPtr((void **) &audio_sources->next);
+        if(!faded || (audio_sources != current)){
+            AudioSource_free(audio_sources);
+        }
+        audio_sources = next;
+    }
+    if(faded){
+        SDL_AtomicSetPtr((void **) &current->next, NULL); // whatever it pointed at is gone
+    }
+    return faded;
+}
+
+static void stop_audio(void){
+    stop_music(0);
+    Mixer_stop_all();
+}
+
+static SDL_bool open_new_audio_file(const char *fname){
+   
+    const Uint32 fade_frames = crossfade_frames();
+    const SDL_bool faded = stop_music(fade_frames);
+
+    AudioSource *tmp_source = AudioSource_open(fname);
+    if(!tmp_source){
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not open audio file!", SDL_GetError(), window);
+        return SDL_FALSE;
+    }
+
+    // Make new `source` available to audio callback thread
+    lock_audio_device();
+    SDL_AtomicSetPtr((void **) &source, tmp_source);
+    Mixer_fade_music(faded ? 0.0f : 1.0f, 1.0f, faded ? fade_frames : 0);
+    unlock_audio_device();
+    audio_sources = tmp_source;
+
+    return SDL_TRUE;
+}
+
+/* Decodes `fname` in the background, the callback switches to it the moment
+   `tail` runs out. */
+static void queue_audio_file(AudioSource *tail, const char *fname, const int playlist_index){
+    AudioSource *next = AudioSource_open(fname);
+    if(next){
+        next->playlist_index = playlist_index;
+        // fully set up before the audio thread can see it
+        SDL_AtomicSetPtr((void **) &tail->next, next);
+    }
+}
+
+/* Frees sources the callback has finished with. Returns how many tracks it
+   moved on by. */
+static int reap_audio_sources(void){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    int advanced = 0;
+    while(current && audio_sources && (audio_sources != current)){
+        AudioSource *next = (AudioSource *) SDL_AtomicGetPtr((void **) &audio_sources->next);
+        AudioSource_free(audio_sources);
+        audio_sources = next;
+        advanced++;
+    }
+    return advanced;
+}
+
+/* True once the current source has played everything and there's nothing after it. */
+static SDL_bool audio_ran_out(void){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    return current && SDL_AtomicGet(&current->finished) && !AudioSource_available(current) &&
+           !SDL_AtomicGetPtr((void **) &current->next);
+}
+
+/* Files queued up to play, in order. UI thread only. */
+typedef struct Playlist{
+    char **entries;
+    int num_entries;
+    int capacity;
+    int current; // playing, or what PLAY would start
+    int scroll;  // first entry shown in the playlist window
+    int loudness_next; // first entry update_loudness hasn't looked at
+} Playlist;
+
+static Playlist playlist;
+
+static void Playlist_clear(Playlist *pl){
+    for(int i = 0; i < pl->num_entries; ++i){
+        SDL_free(pl->entries[i]);
+    }
+    SDL_free(pl->entries);
+    SDL_zerop(pl);
+}
+
+static SDL_bool Playlist_append(Playlist *pl, const char *fname){
+    if(pl->num_entries == pl->capacity){
+        const int capacity = pl->capacity ? (pl->capacity * 2) : 16;
+        char **entries = (char **) SDL_realloc(pl->entries, capacity * sizeof(char *));
+        if(!entries){
+            return SDL_FALSE;
+        }
+        pl->entries = entries;
+        pl->capacity = capacity;
+    }
+    char *entry = SDL_strdup(fname);
+    if(!entry){
+        return SDL_FALSE;
+    }
+    pl->entries[pl->num_entries++] = entry;
+    return SDL_TRUE;
+}
+
+/* Where PLEDIT.BMP leaves room for the list, 8 pixel rows. */
+#define PLAYLIST_ROW_H 8
+#define PLAYLIST_ROWS 7
+static const SDL_Rect playlist_rect = { 12, SKIN_PLEDIT_Y + 20, 243, PLAYLIST_ROWS * PLAYLIST_ROW_H };
+
+static void set_current_track(WinAmpSkin *skin, const int index){
+    playlist.current = index;
+    // keep it on screen
+    if(index < playlist.scroll){
+        playlist.scroll = index;
+    }else if(index >= playlist.scroll + PLAYLIST_ROWS){
+        playlist.scroll = index - PLAYLIST_ROWS + 1;
+    }
+    mark_dirty(skin, &playlist_rect);
+}
+
+static void play_track(WinAmpSkin *skin, const int index){
+    if((index < 0) || (index >= playlist.num_entries)){
+        return;
+    }
+    set_current_track(skin, index);
+    if(open_new_audio_file(playlist.entries[index])){
+        audio_sources->playlist_index = index;
+    }
+}
+
+/* No callbacks while paused, so the stats are told the gap is on purpose. */
+static void pause_audio_device(const SDL_bool pause){
+    SDL_AtomicAdd(&audio_device_epoch, 1);
+    SDL_PauseAudioDevice(audio_device, pause);
+}
+
+static void start_playback(void){
+    paused = SDL_FALSE;
+    pause_audio_device(paused);
+}
+
+/* Moves the position bar's knob to where playback is, unless it's being dragged. */
+static void update_position_bar(WinAmpSkin *skin){
+    WinAmpSkinSlider *posbar = &skin->sliders[WASSLD_POSITION];
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    PlaybackState state;
+    float value = 0.0f;
+
+    if(skin->pressed == &posbar->knob){
+        return;
+    }
+    PlaybackState_snapshot(&state);
+    if(current && (state.source == current)){
+        if(SDL_AtomicGet(&current->seek_request) != SDL_AtomicGet(&current->seek_done)){
+            return; // stay where the user let go until the decoder gets there
+        }
+        value = (state.length > 0) ? SDL_clamp((float) state.position / (float) state.length, 0.0f, 1.0f) : 0.0f;
+    }
+    const int knob_x = posbar->dst_rect.x + (int) (((posbar->dst_rect.w - posbar->knob.dst_rect.w) * value) + 0.5f);
+    posbar->value = value;
+    if(knob_x != posbar->knob.dst_rect.x){
+        posbar->knob.dst_rect.x = knob_x;
+        mark_dirty(skin, &posbar->dst_rect);
+    }
+}
+
+/* Instead of the callback running straight on into the next track, starts
+   it early and fades across once the current one is within crossfade_ms of
+   its end (half its length for short ones). */
+static SDL_bool crossfade_to_next(void){
+    AudioSource *current = audio_sources;
+    AudioSource *next = (AudioSource *) SDL_AtomicGetPtr((void **) &current->next);
+    if(!next || paused || (current != SDL_AtomicGetPtr((void **) &source))){
+        return SDL_FALSE;
+    }
+    const int length = SDL_AtomicGet(&current->length);
+    const int position = SDL_AtomicGet(&current->position);
+    const Uint32 fade_frames = SDL_min(crossfade_frames(), (Uint32) length / 2);
+    if((length <= 0) || (position >= length) || ((Uint32) (length - position) > fade_frames)){
+        return SDL_FALSE;
+    }
+
+    const Uint32 remaining = (Uint32) (length - position);
+    SDL_bool faded;
+    lock_audio_device();
+    faded = Mixer_add_voice(current, 1.0f, 0.0f, remaining, SDL_TRUE);
+    if(faded){
+        SDL_AtomicSetPtr((void **) &source, next);
+        Mixer_fade_music(0.0f, 1.0f, remaining);
+    }
+    unlock_audio_device();
+    if(faded){
+        SDL_AtomicSetPtr((void **) &current->next, NULL);
+        audio_sources = next;
+    }
+    return faded;
+}
+
+/* Called once per main loop iteration. Catches up with the tracks the
+   callback has moved on to, keeps the next one decoding while this one
+   plays, and stops after the last. */
+static void update_playback(WinAmpSkin *skin){
+    update_position_bar(skin);
+    Mixer_reap();
+    if(!audio_sources){
+        return;
+    }
+    if(reap_audio_sources()){
+        set_current_track(skin, audio_sources->playlist_index);
+    }
+    if(crossfade_ms && crossfade_to_next()){
+        set_current_track(skin, audio_sources->playlist_index);
+    }
+
+    // One track ahead, more if that one is already all in its ring (short,
+    // or couldn't be opened) so the callback never runs out between them.
+    AudioSource *tail = audio_sources;
+    while(SDL_AtomicGetPtr((void **) &tail->next)){
+        tail = (AudioSource *) SDL_AtomicGetPtr((void **) &tail->next);
+    }
+    const int index = tail->playlist_index + 1;
+    if((tail == audio_sources) || SDL_AtomicGet(&tail->finished)){
+        if(index < playlist.num_entries){
+            queue_audio_file(tail, playlist.entries[index], index);
+        }
+    }
+    if((index >= playlist.num_entries) && audio_ran_out()){
+        stop_audio();
+    }
+}
+
+/* Gap left around each bitmap in the atlas so filtering never bleeds across. */
+#define SKIN_ATLAS_PADDING 1
+#define SKIN_ATLAS_W 1024
+
+/* Packs `bitmaps` into one surface with simple shelf packing, tallest
+   first. Missing bitmaps get an empty rect. The last rect handed back is a
+   single white pixel for untextured fills. Returns NULL on failure. */
+static SDL_Surface *pack_skin_atlas(SDL_Surface **bitmaps, const int num_bitmaps, SDL_Rect *rects){
+    int order[WASBMP_COUNT];
+    int num_order = 0;
+    int x = SKIN_ATLAS_PADDING + 3 + SKIN_ATLAS_PADDING; // white pixel lives at the start of the first shelf
+    int y = SKIN_ATLAS_PADDING;
+    int shelf_h = 1;
+
+    SDL_assert(num_bitmaps <= WASBMP_COUNT);
+    for(int i = 0; i < num_bitmaps; ++i){
+        SDL_zero(rects[i]);
+        if(bitmaps[i]){
+            // insertion sort by height, there's only a handful
+            int j = num_order++;
+            while((j > 0) && (bitmaps[order[j - 1]]->h < bitmaps[i]->h)){
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+    }
+
+    for(int i = 0; i < num_order; ++i){
+        const SDL_Surface *bmp = bitmaps[order[i]];
+        if((x + bmp->w + SKIN_ATLAS_PADDING) > SKIN_ATLAS_W){
+            x = SKIN_ATLAS_PADDING;
+            y += shelf_h + SKIN_ATLAS_PADDING;
+            shelf_h = 0;
+        }
+        rects[order[i]].x = x;
+        rects[order[i]].y = y;
+        rects[order[i]].w = bmp->w;
+        rects[order[i]].h = bmp->h;
+        x += bmp->w + SKIN_ATLAS_PADDING;
+        shelf_h = SDL_max(shelf_h, bmp->h);
+    }
+
+    SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, SKIN_ATLAS_W, y + shelf_h + SKIN_ATLAS_PADDING, 32, SDL_PIXELFORMAT_ARGB8888);
+    if(!atlas){
+        return NULL;
+    }
+    SDL_FillRect(atlas, NULL, SDL_MapRGBA(atlas->format, 0, 0, 0, 0));
+
+    // 3x3 block so even a filtered sample of the middle texel stays white
+    SDL_Rect *white = &rects[num_bitmaps];
+    white->x = SKIN_ATLAS_PADDING;
+    white->y = SKIN_ATLAS_PADDING;
+    white->w = 3;
+    white->h = 3;
+    SDL_FillRect(atlas, white, SDL_MapRGBA(atlas->format, 255, 255, 255, 255));
+    white->x++;
+    white->y++;
+    white->w = 1;
+    white->h = 1;
+
+    for(int i = 0; i < num_bitmaps; ++i){
+        if(bitmaps[i]){
+            SDL_Rect dst = rects[i];
+            SDL_SetSurfaceBlendMode(bitmaps[i], SDL_BLENDMODE_NONE);
+            SDL_BlitSurface(bitmaps[i], NULL, atlas, &dst);
+        }
+    }
+    return atlas;
+}
+
+/* Source coordinates are relative to bitmap `bmp`, they get moved to
+   wherever that bitmap was packed in the atlas. */
+static SDL_INLINE void init_skin_button(WinAmpSkinButton *btn, const WinAmpSkin *skin, const WinAmpSkinBitmapId bmp, ClickFunc onClick,
+                                               const int w, const int h, 
+                                               const int dx, const int dy, 
+                                               const int sxu, const int syu, 
+                                               const int sxp, const int syp){
+        const SDL_Rect *origin = &skin->bitmaps[bmp];
+        btn->texture = origin->w ? skin->atlas : NULL;
+        btn->onClick = onClick;
+        btn->src_rect_unpressed.x = origin->x + sxu;
+        btn->src_rect_unpressed.y = origin->y + syu;
+        btn->src_rect_unpressed.w = w;
+        btn->src_rect_unpressed.h = h;
+        btn->src_rect_pressed.x = origin->x + sxp;
+        btn->src_rect_pressed.y = origin->y + syp;
+        btn->src_rect_pressed.w = w;
+        btn->src_rect_pressed.h = h;
+
+        btn->dst_rect.x = dx;
+        btn->dst_rect.y = dy;
+        btn->dst_rect.w = w;
+        btn->dst_rect.h = h;
+
+}
+
+static SDL_INLINE void init_skin_slider(WinAmpSkinSlider *slider, const WinAmpSkin *skin, const WinAmpSkinBitmapId bmp, SDL_atomic_t *audio_param,
+                                               const int w, const int h, 
+                                               const int dx, const int dy, 
+                                               const int knob_w, const int knob_h,
+                                               const int sxu, const int syu, 
+                                               const int sxp, const int syp, 
+                                               const int frame_x_offset, const int frame_y_offset,
+                                               const int frame_w, const int frame_h,
+                                               const int num_frames, const float value){
+
+
+    const SDL_Rect *origin = &skin->bitmaps[bmp];
+    init_skin_button(&slider->knob, skin, bmp, NULL, knob_w, knob_h, dx + (int)(((w - knob_w) * value) + 0.5f), dy, sxu, syu, sxp, syp);
+    slider->texture = origin->w ? skin->atlas : NULL;
+    slider->num_frames = num_frames;
+    slider->value = value;
+    slider->audio_param = audio_param;
+    if(audio_param){
+        atomic_set_float(audio_param, value);
+    }
+    slider->x_offset = origin->x + frame_x_offset;
+    slider->y_offset = origin->y + frame_y_offset;
+    slider->w = frame_w;
+    slider->h = frame_h;
+    slider->frames_per_row = 1;
+
+    slider->dst_rect.x = dx;
+    slider->dst_rect.y = dy;
+    slider->dst_rect.w = w;
+    slider->dst_rect.h = h;
+
+
+}
+
+/* Back to the start of whatever's playing, without reopening it. */
+static void restart_track(void){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    if(current){
+        AudioSource_seek(current, 0);
+    }
+}
+
+static void click_func_prev(void){
+    if(playlist.current > 0){
+        play_track(&skin, playlist.current - 1);
+    }else{
+        restart_track();
+    }
+}
+
+static void click_func_play(void){
+    if(!source){
+        play_track(&skin, playlist.current);
+    }else if(!paused){
+        restart_track(); // like Winamp, PLAY while playing starts the track over
+    }
+    start_playback();
+}
+
+static void position_bar_released(void){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    if(current){
+        const WinAmpSkinSlider *posbar = &skin.sliders[WASSLD_POSITION];
+        AudioSource_seek(current, (int) (posbar->value * (float) SDL_AtomicGet(&current->length)));
+    }
+}
+
+/* POSBAR.BMP: 248x10 groove, 29x10 knob at (248,0) and (278,0) pressed. */
+static void init_skin_position_bar(WinAmpSkinSlider *slider, const WinAmpSkin *skin, const float value){
+    init_skin_slider(slider, skin, WASBMP_POSBAR, NULL, 248, 10, 16, 72, 29, 10, 248, 0, 278, 0, 0, 0, 248, 10, 1, value);
+    slider->onRelease = position_bar_released;
+}
+
+static void click_func_next(void){
+    if(playlist.current + 1 < playlist.num_entries){
+        play_track(&skin, playlist.current + 1);
+    }
+}
+
+/* No file dialog in SDL, drop files on the window to fill the playlist again. */
+static void click_func_eject(void){
+    stop_audio();
+    Playlist_clear(&playlist);
+    mark_dirty(&skin, &playlist_rect);
+}
+
+static void eq_slider_changed(void){
+    for(int i = 0; i <= EQ_NUM_BANDS; ++i){
+        eq_values[i] = skin.sliders[WASSLD_EQ_PREAMP + i].value;
+    }
+    publish_eq(eq_values);
+}
+
+/* EQMAIN.BMP's sliders: 14x63, 28 background frames in two rows of 14
+   starting at (13,164), knob at (0,164) and (0,176) pressed. */
+static void init_skin_eq_slider(WinAmpSkinSlider *slider, const WinAmpSkin *skin, const int dx, const float value){
+    const int dy = SKIN_EQ_Y + 38;
+    init_skin_slider(slider, skin, WASBMP_EQMAIN, NULL, 14, 63, dx, dy, 11, 11, 0, 164, 0, 176, 13, 164, 15, 65, 28, value);
+    slider->frames_per_row = 14;
+    slider->vertical = SDL_TRUE;
+    slider->onChange = eq_slider_changed;
+    slider->knob.dst_rect.x = dx + 1;
+    slider->knob.dst_rect.y = dy + (int) (((63 - 11) * (1.0f - value)) + 0.5f);
+}
+
+static void click_func_pause(void){
+    paused = paused ? SDL_FALSE : SDL_TRUE;
+    pause_audio_device(paused);
+}
+
+static void click_func_stop(void){
+    stop_audio();
+}
+
+static SDL_RWops *openrw(ZipArchive *zip, const char *dirname, const char *fname){
+    if(zip){
+        const ZipEntry *entry = ZipArchive_find(zip, fname);
+        return entry ? ZipArchive_open_entry(zip, entry) : NULL;
+    }
+    // we dont have a zipfile, read from disk
+    const size_t fullpathlen = SDL_strlen(dirname) + 1 + SDL_strlen(fname) + 1;
+    char *fullpath = (char *)SDL_malloc(fullpathlen);
+    // FIXME: Name Case is a problem on linux
+    SDL_snprintf(fullpath, fullpathlen, "%s/%s", dirname, fname);
+    SDL_RWops *retval = SDL_RWFromFile(fullpath, "rb");
+    SDL_free(fullpath);
+    return retval;
+
+}
+
+/* Where MAIN.BMP leaves room for the visualizer. */
+#define VIS_X 24
+#define VIS_Y 43
+#define VIS_W 76
+#define VIS_H 16
+
+/* Real samples per analysis, ~21ms at 48000Hz. Power of two. */
+#define VIS_FFT_SIZE 1024
+#define VIS_FFT_HALF (VIS_FFT_SIZE / 2)
+/* Winamp's thick bars, 3 pixels wide with a 1 pixel gap. */
+#define VIS_NUM_BANDS 19
+#define VIS_MIN_HZ 50.0
+#define VIS_MAX_HZ 16000.0
+/* Quietest level that still lights a pixel, and how much we lift highs
+   since music has far less energy up there. */
+#define VIS_FLOOR_DB -60.0f
+#define VIS_TILT_DB_PER_OCTAVE 3.0f
+/* In pixels per second. */
+#define VIS_BAR_FALL 48.0f
+#define VIS_PEAK_FALL 12.0f
+/* ~60fps while there's something to show. */
+#define VIS_FRAME_MS 16
+
+static const SDL_Rect vis_rect = { VIS_X, VIS_Y, VIS_W, VIS_H };
+
+/* base skin's VISCOLOR.TXT, for skins that don't have one. */
+static const SDL_Color default_vis_colors[VIS_NUM_COLORS] = {
+    {   0,   0,   0, 255 }, {  24,  33,  41, 255 }, { 239,  49,  16, 255 }, { 206,  41,  16, 255 },
+    { 214,  90,   0, 255 }, { 214, 102,   0, 255 }, { 214, 115,   0, 255 }, { 198, 123,   8, 255 },
+    { 222, 165,  24, 255 }, { 214, 181,  33, 255 }, { 189, 222,  41, 255 }, { 148, 222,  33, 255 },
+    {  41, 206,  16, 255 }, {  50, 190,  16, 255 }, {  57, 181,  16, 255 }, {  49, 156,   8, 255 },
+    {  41, 148,   0, 255 }, {  24, 132,   8, 255 }, { 255, 255, 255, 255 }, { 214, 214, 222, 255 },
+    { 181, 189, 189, 255 }, { 160, 170, 175, 255 }, { 148, 156, 165, 255 }, { 150, 150, 150, 255 },
+};
+
+/* VISCOLOR.TXT is one "r,g,b," per line, optionally followed by a // comment
+   (which likes to contain numbers). Colours it doesn't have keep the default. */
+static void parse_viscolor(SDL_RWops *rw, SDL_Color *colors){
+    char line[128];
+    int num_colors = 0;
+    size_t len = 0;
+    SDL_bool eof = SDL_FALSE;
+
+    SDL_memcpy(colors, default_vis_colors, sizeof(default_vis_colors));
+    if(!rw){
+        return;
+    }
+    while(!eof && (num_colors < VIS_NUM_COLORS)){
+        char ch;
+        eof = (SDL_RWread(rw, &ch, 1, 1) != 1) ? SDL_TRUE : SDL_FALSE;
+        if(!eof && (ch != '\n')){
+            if(len < sizeof(line) - 1){
+                line[len++] = ch;
+            }
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+
+        char *comment = SDL_strstr(line, "//");
+        if(comment){
+            *comment = '\0';
+        }
+        int rgb[3];
+        int num_values = 0;
+        char *ptr = line;
+        while(*ptr && (num_values < 3)){
+            if((*ptr >= '0') && (*ptr <= '9')){
+                rgb[num_values++] = (int) SDL_strtol(ptr, &ptr, 10);
+            }else{
+                ptr++;
+            }
+        }
+        if(num_values == 3){
+            const SDL_Color color = { (Uint8) SDL_min(rgb[0], 255), (Uint8) SDL_min(rgb[1], 255), (Uint8) SDL_min(rgb[2], 255), 255 };
+            colors[num_colors++] = color;
+        }
+    }
+    SDL_RWclose(rw);
+}
+
+typedef enum{
+    VIS_SPECTRUM = 0,
+    VIS_SCOPE,
+    VIS_OFF,
+    VIS_MODE_COUNT
+} VisMode;
+
+/* UI thread only, the audio thread just fills vis_tap. */
+typedef struct Visualizer{
+    VisMode mode;
+
+    // built once by init_visualizer
+    float window[VIS_FFT_SIZE];     // Hann
+    float twiddle_re[VIS_FFT_HALF]; // complex FFT stage with half size h uses [h-1, 2h-1)
+    float twiddle_im[VIS_FFT_HALF];
+    float split_re[VIS_FFT_HALF];   // e^(-2*pi*i*k/VIS_FFT_SIZE), turns the complex FFT into a real one
+    float split_im[VIS_FFT_HALF];
+    Uint16 bitrev[VIS_FFT_HALF];
+    int band_edges[VIS_NUM_BANDS + 1]; // FFT bins, band b is [edges[b], edges[b+1])
+
+    // scratch
+    float frames[VIS_FFT_SIZE * AUDIO_OUT_CHANNELS];
+    float re[VIS_FFT_HALF];
+    float im[VIS_FFT_HALF];
+
+    // what's on screen, in pixels
+    float bars[VIS_NUM_BANDS];
+    float peaks[VIS_NUM_BANDS];
+    Sint8 scope[VIS_W];
+
+    // where we are in vis_tap
+    Uint32 tap_head;
+    Uint32 tap_chunk;  // frames the last callback added
+    Uint64 tap_seen;   // when we noticed it
+
+    Uint64 last_update;
+    SDL_bool idle;     // nothing moving and nothing playing, no need to wake up
+} Visualizer;
+
+static Visualizer visualizer;
+
+static void init_visualizer(Visualizer *vis){
+    int bits = 0;
+    while((1 << bits) < VIS_FFT_HALF){
+        bits++;
+    }
+    for(int n = 0; n < VIS_FFT_SIZE; ++n){
+        vis->window[n] = (float) (0.5 - (0.5 * SDL_cos((2.0 * M_PI * n) / VIS_FFT_SIZE)));
+    }
+    for(int half = 1; half < VIS_FFT_HALF; half *= 2){
+        for(int k = 0; k < half; ++k){
+            vis->twiddle_re[half - 1 + k] = (float)  SDL_cos((M_PI * k) / half);
+            vis->twiddle_im[half - 1 + k] = (float) -SDL_sin((M_PI * k) / half);
+        }
+    }
+    for(int k = 0; k < VIS_FFT_HALF; ++k){
+        vis->split_re[k] = (float)  SDL_cos((2.0 * M_PI * k) / VIS_FFT_SIZE);
+        vis->split_im[k] = (float) -SDL_sin((2.0 * M_PI * k) / VIS_FFT_SIZE);
+        int reversed = 0;
+        for(int b = 0; b < bits; ++b){
+            reversed |= ((k >> b) & 1) << (bits - 1 - b);
+        }
+        vis->bitrev[k] = (Uint16) reversed;
+    }
+    // log spaced, but the lowest bands are narrower than a bin so give each at least one
+    for(int b = 0; b <= VIS_NUM_BANDS; ++b){
+        const double hz = VIS_MIN_HZ * SDL_pow(VIS_MAX_HZ / VIS_MIN_HZ, (double) b / VIS_NUM_BANDS);
+        const int bin = (int) ((hz * VIS_FFT_SIZE / audio_out_freq) + 0.5);
+        const int lowest = (b == 0) ? 1 : (vis->band_edges[b - 1] + 1);
+        vis->band_edges[b] = SDL_clamp(bin, lowest, VIS_FFT_HALF);
+    }
+    vis->idle = SDL_TRUE;
+}
+
+/* One radix-2 pass over `half` butterflies, re/im split so it vectorizes. */
+static void vis_fft_butterflies(float *re, float *im, const float *wre, const float *wim, const int half){
+    int k = 0;
+#ifdef MYAMP_HAVE_SSE2
+    for(; k + 4 <= half; k += 4){
+        const __m128 ar = _mm_loadu_ps(&re[k]);
+        const __m128 ai = _mm_loadu_ps(&im[k]);
+        const __m128 br = _mm_loadu_ps(&re[k + half]);
+        const __m128 bi = _mm_loadu_ps(&im[k + half]);
+        const __m128 wr = _mm_loadu_ps(&wre[k]);
+        const __m128 wi = _mm_loadu_ps(&wim[k]);
+        const __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+        const __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+        _mm_storeu_ps(&re[k], _mm_add_ps(ar, tr));
+        _mm_storeu_ps(&im[k], _mm_add_ps(ai, ti));
+        _mm_storeu_ps(&re[k + half], _mm_sub_ps(ar, tr));
+        _mm_storeu_ps(&im[k + half], _mm_sub_ps(ai, ti));
+    }
+#elif defined(MYAMP_HAVE_NEON)
+    for(; k + 4 <= half; k += 4){
+        const float32x4_t ar = vld1q_f32(&re[k]);
+        const float32x4_t ai = vld1q_f32(&im[k]);
+        const float32x4_t br = vld1q_f32(&re[k + half]);
+        const float32x4_t bi = vld1q_f32(&im[k + half]);
+        const float32x4_t wr = vld1q_f32(&wre[k]);
+        const float32x4_t wi = vld1q_f32(&wim[k]);
+        const float32x4_t tr = vmlsq_f32(vmulq_f32(br, wr), bi, wi);
+        const float32x4_t ti = vmlaq_f32(vmulq_f32(br, wi), bi, wr);
+        vst1q_f32(&re[k], vaddq_f32(ar, tr));
+        vst1q_f32(&im[k], vaddq_f32(ai, ti));
+        vst1q_f32(&re[k + half], vsubq_f32(ar, tr));
+        vst1q_f32(&im[k + half], vsubq_f32(ai, ti));
+    }
+#endif
+    for(; k < half; ++k){
+        const float tr = (re[k + half] * wre[k]) - (im[k + half] * wim[k]);
+        const float ti = (re[k + half] * wim[k]) + (im[k + half] * wre[k]);
+        re[k + half] = re[k] - tr;
+        im[k + half] = im[k] - ti;
+        re[k] += tr;
+        im[k] += ti;
+    }
+}
+
+/* In place complex FFT of vis->re/im, which must already be in bit reversed order. */
+static void vis_fft(Visualizer *vis){
+    for(int half = 1; half < VIS_FFT_HALF; half *= 2){
+        for(int i = 0; i < VIS_FFT_HALF; i += half * 2){
+            vis_fft_butterflies(&vis->re[i], &vis->im[i], &vis->twiddle_re[half - 1], &vis->twiddle_im[half - 1], half);
+        }
+    }
+}
+
+/* Spectrum of vis->frames in dB per band. The real signal is packed as
+   VIS_FFT_HALF complex samples, so the FFT is half the size it would be. */
+static void vis_spectrum(Visualizer *vis, float *levels){
+    const float *frames = vis->frames;
+    for(int n = 0; n < VIS_FFT_HALF; ++n){
+        const int i = n * 2;
+        vis->re[vis->bitrev[n]] = (frames[i*2]   + frames[i*2+1]) * 0.5f * vis->window[i];
+        vis->im[vis->bitrev[n]] = (frames[i*2+2] + frames[i*2+3]) * 0.5f * vis->window[i+1];
+    }
+    vis_fft(vis);
+
+    // a full scale sine comes out at VIS_FFT_SIZE/4 through a Hann window
+    const float norm = 1.0f / ((VIS_FFT_SIZE / 4.0f) * (VIS_FFT_SIZE / 4.0f));
+    for(int b = 0; b < VIS_NUM_BANDS; ++b){
+        float power = 0.0f;
+        for(int k = vis->band_edges[b]; k < vis->band_edges[b + 1]; ++k){
+            // separate the even and odd halves again and recombine them into bin k
+            const int mk = VIS_FFT_HALF - k;
+            const float even_re = (vis->re[k] + vis->re[mk]) * 0.5f;
+            const float even_im = (vis->im[k] - vis->im[mk]) * 0.5f;
+            const float odd_re = (vis->im[k] + vis->im[mk]) * 0.5f;
+            const float odd_im = (vis->re[mk] - vis->re[k]) * 0.5f;
+            const float xr = even_re + (vis->split_re[k] * odd_re) - (vis->split_im[k] * odd_im);
+            const float xi = even_im + (vis->split_re[k] * odd_im) + (vis->split_im[k] * odd_re);
+            power = SDL_max(power, (xr * xr) + (xi * xi));
+        }
+        const float center_hz = (vis->band_edges[b] + vis->band_edges[b + 1]) * (0.5f * audio_out_freq / VIS_FFT_SIZE);
+        const float tilt = VIS_TILT_DB_PER_OCTAVE * SDL_log10f(center_hz / 1000.0f) * 3.321928f;
+        levels[b] = (10.0f * SDL_log10f((power * norm) + 1e-12f)) + tilt;
+    }
+}
+
+/* Copies the VIS_FFT_SIZE frames the device should be playing about now into
+   vis->frames. SDL_FALSE if there's not enough yet, or the audio thread lapped
+   us while we were copying. */
+static SDL_bool vis_read_tap(Visualizer *vis, const Uint64 now){
+    const Uint32 head = (Uint32) SDL_AtomicGet(&vis_tap.head);
+    SDL_MemoryBarrierAcquire();
+    if(head != vis->tap_head){
+        vis->tap_chunk = SDL_min(head - vis->tap_head, VIS_TAP_FRAMES / 2);
+        vis->tap_head = head;
+        vis->tap_seen = now;
+    }
+    if(head < (VIS_FFT_SIZE + vis->tap_chunk)){
+        return SDL_FALSE;
+    }
+
+    // the device is still playing what the callback gave it last, walk through it with the clock
+    const Uint64 elapsed = ((now - vis->tap_seen) * audio_out_freq) / SDL_GetPerformanceFrequency();
+    const Uint32 end = head - vis->tap_chunk + (Uint32) SDL_min(elapsed, (Uint64) vis->tap_chunk);
+    const Uint32 start = end - VIS_FFT_SIZE;
+    const Uint32 slot = start & (VIS_TAP_FRAMES - 1);
+    const Uint32 first = SDL_min(VIS_FFT_SIZE, VIS_TAP_FRAMES - slot);
+    SDL_memcpy(vis->frames, &vis_tap.samples[slot * AUDIO_OUT_CHANNELS], first * AUDIO_OUT_FRAME_SIZE);
+    SDL_memcpy(&vis->frames[first * AUDIO_OUT_CHANNELS], vis_tap.samples, (VIS_FFT_SIZE - first) * AUDIO_OUT_FRAME_SIZE);
+
+    SDL_MemoryBarrierAcquire();
+    const Uint32 reserve = (Uint32) SDL_AtomicGet(&vis_tap.reserve);
+    return ((reserve - start) <= VIS_TAP_FRAMES) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Updates bars/peaks/scope from vis->frames, or decays them if `have_audio` is false. */
+static void vis_analyze(Visualizer *vis, const SDL_bool have_audio, const float dt){
+    SDL_bool moving = SDL_FALSE;
+
+    if(vis->mode == VIS_SPECTRUM){
+        float levels[VIS_NUM_BANDS];
+        if(have_audio){
+            vis_spectrum(vis, levels);
+        }
+        for(int b = 0; b < VIS_NUM_BANDS; ++b){
+            const float height = have_audio ? (((levels[b] - VIS_FLOOR_DB) / -VIS_FLOOR_DB) * VIS_H) : 0.0f;
+            vis->bars[b] = SDL_clamp(SDL_max(height, vis->bars[b] - (VIS_BAR_FALL * dt)), 0.0f, (float) VIS_H);
+            vis->peaks[b] = SDL_max(vis->bars[b], vis->peaks[b] - (VIS_PEAK_FALL * dt));
+            moving |= (vis->peaks[b] > 0.0f) ? SDL_TRUE : SDL_FALSE;
+        }
+    }else if(vis->mode == VIS_SCOPE){
+        for(int x = 0; x < VIS_W; ++x){
+            const int i = (x * VIS_FFT_SIZE) / VIS_W;
+            const float mono = have_audio ? ((vis->frames[i*2] + vis->frames[i*2+1]) * 0.5f) : 0.0f;
+            vis->scope[x] = (Sint8) SDL_clamp((int) (mono * (VIS_H / 2)), -(VIS_H / 2), (VIS_H / 2) - 1);
+        }
+    }
+    vis->idle = (!have_audio && !moving) ? SDL_TRUE : SDL_FALSE;
+}
+
+static SDL_INLINE Uint32 vis_pixel(const SDL_Color *c){
+    return 0xFF000000 | ((Uint32) c->r << 16) | ((Uint32) c->g << 8) | (Uint32) c->b;
+}
+
+/* Draws the current bars or scope as ARGB8888, `pitch` in pixels. */
+static void vis_paint(const Visualizer *vis, const SDL_Color *colors, Uint32 *pixels, const int pitch){
+    const Uint32 background = vis_pixel(&colors[0]);
+    const Uint32 dots = vis_pixel(&colors[1]);
+
+    for(int y = 0; y < VIS_H; ++y){
+        for(int x = 0; x < VIS_W; ++x){
+            pixels[(y * pitch) + x] = ((x & 1) == 0 && (y & 1) == 1) ? dots : background;
+        }
+    }
+
+    if(vis->mode == VIS_SPECTRUM){
+        for(int b = 0; b < VIS_NUM_BANDS; ++b){
+            const int top = VIS_H - (int) vis->bars[b];
+            const int peak = VIS_H - 1 - (int) vis->peaks[b];
+            for(int x = b * 4; x < (b * 4) + 3; ++x){
+                for(int y = top; y < VIS_H; ++y){
+                    pixels[(y * pitch) + x] = vis_pixel(&colors[2 + y]); // colour by row, not by bar height
+                }
+                if((vis->peaks[b] >= 1.0f) && (peak >= 0)){
+                    pixels[(peak * pitch) + x] = vis_pixel(&colors[23]);
+                }
+            }
+        }
+    }else if(vis->mode == VIS_SCOPE){
+        for(int x = 0; x < VIS_W; ++x){
+            // joined up with the previous column so fast swings stay a line
+            const int y = (VIS_H / 2) - 1 - vis->scope[x];
+            const int prev = (x > 0) ? ((VIS_H / 2) - 1 - vis->scope[x - 1]) : y;
+            for(int row = SDL_min(y, prev); row <= SDL_max(y, prev); ++row){
+                const int shade = SDL_min(SDL_abs(row - ((VIS_H / 2) - 1)) / 2, 4);
+                pixels[(row * pitch) + x] = vis_pixel(&colors[18 + shade]);
+            }
+        }
+    }
+}
+
+/* Called once per main loop iteration, re-analyzes at most every VIS_FRAME_MS. */
+static void update_visualizer(WinAmpSkin *skin){
+    Visualizer *vis = &visualizer;
+    const SDL_bool playing = (source != NULL) && !paused;
+    const Uint64 now = SDL_GetPerformanceCounter();
+    const Uint64 freq = SDL_GetPerformanceFrequency();
+
+    if((vis->mode == VIS_OFF) || !skin->vis_texture || (vis->idle && !playing)){
+        return;
+    }
+    if(vis->last_update && (((now - vis->last_update) * 1000) < (VIS_FRAME_MS * freq))){
+        return;
+    }
+    const float dt = vis->last_update ? SDL_min((float) (now - vis->last_update) / (float) freq, 0.1f) : 0.0f;
+    vis->last_update = now;
+
+    vis_analyze(vis, playing && vis_read_tap(vis, now), dt);
+
+    void *pixels;
+    int pitch;
+    if(SDL_LockTexture(skin->vis_texture, NULL, &pixels, &pitch) == 0){
+        vis_paint(vis, skin->vis_colors, (Uint32 *) pixels, pitch / 4);
+        SDL_UnlockTexture(skin->vis_texture);
+        mark_dirty(skin, &vis_rect);
+    }
+}
+
+/* How long handle_events can sleep before update_visualizer wants to run. */
+static Uint32 visualizer_wait_ms(const WinAmpSkin *skin){
+    const Visualizer *vis = &visualizer;
+    const SDL_bool playing = (source != NULL) && !paused;
+    if((vis->mode == VIS_OFF) || !skin->vis_texture || (vis->idle && !playing)){
+        return IDLE_WAIT_MS;
+    }
+    const Uint64 elapsed_ms = ((SDL_GetPerformanceCounter() - vis->last_update) * 1000) / SDL_GetPerformanceFrequency();
+    return (elapsed_ms >= VIS_FRAME_MS) ? 1 : (Uint32) (VIS_FRAME_MS - elapsed_ms);
+}
+
+/* Clicking the visualizer goes spectrum -> scope -> off, like Winamp. */
+static void cycle_visualizer_mode(WinAmpSkin *skin){
+    Visualizer *vis = &visualizer;
+    vis->mode = (VisMode) ((vis->mode + 1) % VIS_MODE_COUNT);
+    SDL_zero(vis->bars);
+    SDL_zero(vis->peaks);
+    SDL_zero(vis->scope);
+    vis->idle = SDL_FALSE; // paint the new mode once even if nothing's playing
+    vis->last_update = 0;
+    mark_dirty(skin, &vis_rect);
+}
+
+/* Audio callback numbers over the playlist, toggled with F3. */
+#define STATS_OVERLAY_MS 250
+
+static SDL_bool stats_overlay = SDL_FALSE;
+static Uint64 stats_overlay_last_update = 0;
+/* Where --audio-stats wants the callback numbers written at exit, NULL if nowhere. */
+static const char *audio_stats_path = NULL;
+
+/* Callback time below which `fraction` of the callbacks fall, as a power of
+   two microseconds. 0 if there haven't been any. */
+static Uint32 AudioStats_percentile_us(const AudioStats *stats, const double fraction){
+    const Uint64 wanted = (Uint64) SDL_ceil((double) stats->callbacks * fraction);
+    Uint64 seen = 0;
+    for(int i = 0; (i < AUDIO_STATS_BUCKETS) && stats->callbacks; ++i){
+        seen += stats->histogram[i];
+        if(seen >= wanted){
+            return (Uint32) 1 << i;
+        }
+    }
+    return 0;
+}
+
+static void toggle_stats_overlay(WinAmpSkin *skin){
+    stats_overlay = stats_overlay ? SDL_FALSE : SDL_TRUE;
+    stats_overlay_last_update = 0;
+    mark_dirty(skin, &playlist_rect);
+}
+
+/* Called once per main loop iteration, repaints the numbers every STATS_OVERLAY_MS. */
+static void update_stats_overlay(WinAmpSkin *skin){
+    const Uint64 now = SDL_GetPerformanceCounter();
+    if(stats_overlay && (((now - stats_overlay_last_update) * 1000) >= (STATS_OVERLAY_MS * SDL_GetPerformanceFrequency()))){
+        stats_overlay_last_update = now;
+        mark_dirty(skin, &playlist_rect);
+    }
+}
+
+/* How long handle_events can sleep before update_stats_overlay wants to run. */
+static Uint32 stats_overlay_wait_ms(void){
+    if(!stats_overlay){
+        return IDLE_WAIT_MS;
+    }
+    const Uint64 elapsed_ms = ((SDL_GetPerformanceCounter() - stats_overlay_last_update) * 1000) / SDL_GetPerformanceFrequency();
+    return (elapsed_ms >= STATS_OVERLAY_MS) ? 1 : (Uint32) (STATS_OVERLAY_MS - elapsed_ms);
+}
+
+/* base skin's PLEDIT.TXT. */
+static const PlaylistColors default_playlist_colors = {
+    {   0, 255,   0, 255 }, { 255, 255, 255, 255 }, {   0,   0,   0, 255 }, {   0,   0, 198, 255 },
+};
+
+/* Reads the next line of an ini file into `line` and splits "key=value" in
+   place, trimming the whitespace around both. *value is NULL for lines
+   without an '='. Returns SDL_FALSE once the file is used up. */
+static SDL_bool read_ini_line(SDL_RWops *rw, char *line, const size_t size, char **value){
+    size_t len = 0;
+    SDL_bool eof;
+    char ch;
+
+    for(;;){
+        eof = (SDL_RWread(rw, &ch, 1, 1) != 1) ? SDL_TRUE : SDL_FALSE;
+        if(eof || (ch == '\n')){
+            break;
+        }
+        if(len < size - 1){
+            line[len++] = ch;
+        }
+    }
+    if(eof && (len == 0)){
+        return SDL_FALSE;
+    }
+    line[len] = '\0';
+
+    *value = SDL_strchr(line, '=');
+    if(*value){
+        char *end = *value;
+        while((end > line) && SDL_isspace((unsigned char) end[-1])){
+            end--;
+        }
+        *end = '\0';
+        ++*value;
+        while(SDL_isspace((unsigned char) **value)){
+            ++*value;
+        }
+        end = *value + SDL_strlen(*value);
+        while((end > *value) && SDL_isspace((unsigned char) end[-1])){
+            end--;
+        }
+        *end = '\0';
+    }
+    return SDL_TRUE;
+}
+
+/* PLEDIT.TXT is an ini file, we only want the "Key=#rrggbb" lines. Anything
+   missing or malformed keeps the default. */
+static void parse_pledit_txt(SDL_RWops *rw, PlaylistColors *colors){
+    static const struct{ const char *key; size_t offset; } keys[] = {
+        { "Normal",     offsetof(PlaylistColors, normal)      },
+        { "Current",    offsetof(PlaylistColors, current)     },
+        { "NormalBG",   offsetof(PlaylistColors, normal_bg)   },
+        { "SelectedBG", offsetof(PlaylistColors, selected_bg) },
+    };
+    char line[128];
+    char *value;
+
+    *colors = default_playlist_colors;
+    if(!rw){
+        return;
+    }
+    while(read_ini_line(rw, line, sizeof(line), &value)){
+        if(!value){
+            continue;
+        }
+        if(*value == '#'){
+            value++;
+        }
+        char *rest;
+        const unsigned long rgb = SDL_strtoul(value, &rest, 16);
+        if((rest - value) != 6){
+            continue;
+        }
+        for(size_t i = 0; i < SDL_arraysize(keys); ++i){
+            if(SDL_strcasecmp(line, keys[i].key) == 0){
+                const SDL_Color color = { (Uint8) (rgb >> 16), (Uint8) (rgb >> 8), (Uint8) rgb, 255 };
+                *(SDL_Color *) (((Uint8 *) colors) + keys[i].offset) = color;
+            }
+        }
+    }
+    SDL_RWclose(rw);
+}
+
+/* Fills the pixels whose centres are inside polygon `xy` (x,y pairs, the
+   last point joins the first), even-odd, into rows `top` to `top + height`
+   of a SKIN_WINDOW_W wide `mask`. */
+static void fill_region_polygon(Uint8 *mask, const int top, const int height, const int *xy, const int num_points){
+    float *crossings = (float *) SDL_malloc(num_points * sizeof(float));
+    if(!crossings){
+        return;
+    }
+    for(int y = 0; y < height; ++y){
+        const float cy = (float) y + 0.5f;
+        int num_crossings = 0;
+        for(int i = 0, j = num_points - 1; i < num_points; j = i++){
+            const float y0 = (float) xy[i*2+1];
+            const float y1 = (float) xy[j*2+1];
+            if((y0 > cy) != (y1 > cy)){
+                const float x0 = (float) xy[i*2];
+                const float x1 = (float) xy[j*2];
+                // insertion sort, polygons are a handful of points
+                const float x = x0 + (((cy - y0) * (x1 - x0)) / (y1 - y0));
+                int k = num_crossings++;
+                for(; (k > 0) && (crossings[k-1] > x); --k){
+                    crossings[k] = crossings[k-1];
+                }
+                crossings[k] = x;
+            }
+        }
+        for(int i = 0; (i + 1) < num_crossings; i += 2){
+            const int x0 = SDL_max((int) SDL_ceilf(crossings[i] - 0.5f), 0);
+            const int x1 = SDL_min((int) SDL_ceilf(crossings[i+1] - 0.5f), SKIN_WINDOW_W);
+            if(x1 > x0){
+                SDL_memset(&mask[((top + y) * SKIN_WINDOW_W) + x0], 1, x1 - x0);
+            }
+        }
+    }
+    SDL_free(crossings);
+}
+
+/* Reads a comma or space separated list of ints, up to `max` of them. */
+static int parse_region_ints(const char *text, int *values, const int max){
+    int count = 0;
+    while(*text && (count < max)){
+        char *end;
+        const long value = SDL_strtol(text, &end, 10);
+        if(end == text){
+            if((*text != ',') && !SDL_isspace((unsigned char) *text)){
+                break;
+            }
+            text++;
+            continue;
+        }
+        values[count++] = (int) value;
+        text = end;
+    }
+    return count;
+}
+
+/* REGION.TXT gives the main window and the equalizer each a set of polygons
+   in an ini section, [Normal] and [Equalizer], as "NumPoints=4,4" and all
+   their corners in one "PointList=0,0, 275,0, ..." in outside pixel
+   coordinates. The first definition of a section wins. Rasterized into
+   `mask`, SKIN_WINDOW_W x SKIN_WINDOW_H and nonzero inside, where windows
+   without a section keep their whole rect. SDL_FALSE if there's no usable
+   section, so there's no shape to speak of. */
+#define REGION_MAX_POINTS 1024
+static SDL_bool parse_region_txt(SDL_RWops *rw, Uint8 *mask){
+    static const struct{ const char *name; int top; int height; } windows[] = {
+        { "[Normal]",    0,         SKIN_MAIN_H },
+        { "[Equalizer]", SKIN_EQ_Y, SKIN_EQ_H   },
+    };
+    SDL_bool done[SDL_arraysize(windows)] = { SDL_FALSE, SDL_FALSE };
+    int counts[64];
+    int num_counts = 0;
+    int num_coords = 0;
+    int section = -1;
+    SDL_bool shaped = SDL_FALSE;
+    char *line = (char *) SDL_malloc(8192); // a PointList is all on one line
+    int *coords = (int *) SDL_malloc(REGION_MAX_POINTS * 2 * sizeof(int));
+    char *value;
+
+    SDL_memset(mask, 1, SKIN_WINDOW_W * SKIN_WINDOW_H);
+    if(!rw || !line || !coords){
+        goto done;
+    }
+    while(read_ini_line(rw, line, 8192, &value)){
+        char *comment = SDL_strchr(value ? value : line, ';');
+        if(comment){
+            *comment = '\0';
+        }
+        if(line[0] == '['){
+            section = -1;
+            for(int i = 0; i < (int) SDL_arraysize(windows); ++i){
+                if(!done[i] && (SDL_strncasecmp(line, windows[i].name, SDL_strlen(windows[i].name)) == 0)){
+                    section = i;
+                }
+            }
+            num_counts = num_coords = 0;
+            continue;
+        }
+        if((section < 0) || !value){
+            continue;
+        }
+        if(SDL_strcasecmp(line, "NumPoints") == 0){
+            num_counts = parse_region_ints(value, counts, (int) SDL_arraysize(counts));
+        }else if(SDL_strcasecmp(line, "PointList") == 0){
+            num_coords = parse_region_ints(value, coords, REGION_MAX_POINTS * 2);
+        }
+        if(!num_counts || !num_coords){
+            continue;
+        }
+
+        // both seen, every polygon has to have its points or the section's no good
+        Sint64 needed = 0;
+        for(int i = 0; i < num_counts; ++i){
+            // more than were ever parsed, so a count that's no polygon or too big rules the section out
+            needed += ((counts[i] >= 3) && (counts[i] <= REGION_MAX_POINTS)) ? counts[i] : (REGION_MAX_POINTS + 1);
+        }
+        if(needed * 2 <= num_coords){
+            const int top = windows[section].top;
+            SDL_memset(&mask[top * SKIN_WINDOW_W], 0, windows[section].height * SKIN_WINDOW_W);
+            for(int i = 0, first = 0; i < num_counts; first += counts[i++]){
+                fill_region_polygon(mask, top, windows[section].height, &coords[first * 2], counts[i]);
+            }
+            shaped = SDL_TRUE;
+        }
+        done[section] = SDL_TRUE;
+        section = -1;
+    }
+
+done:
+    if(rw){
+        SDL_RWclose(rw);
+    }
+    SDL_free(coords);
+    SDL_free(line);
+    return shaped;
+}
+
+/* CPU side of a skin: everything that can be done off the render thread.
+   decode_skin() builds one, apply_skin() turns it into textures. */
+typedef struct DecodedSkin{
+    SDL_Surface *atlas; // NULL if none of the bitmaps could be decoded
+    SDL_Rect rects[WASBMP_COUNT + 1]; // last one is the white pixel
+    SDL_Color vis_colors[VIS_NUM_COLORS];
+    PlaylistColors playlist_colors;
+    Uint8 *region; // from REGION.TXT, SKIN_WINDOW_W x SKIN_WINDOW_H and nonzero inside. NULL if the skin has none
+    int generation;
+    /* Set when it came from the skin cache, `atlas` and `region` point into it. */
+    void *cache;
+    size_t cache_len;
+} DecodedSkin;
+
+static void DecodedSkin_free(DecodedSkin *decoded){
+    if(decoded){
+        SDL_FreeSurface(decoded->atlas);
+        if(decoded->cache){
+#ifdef MYAMP_HAVE_MMAP
+            munmap(decoded->cache, decoded->cache_len);
+#else
+            SDL_free(decoded->cache);
+#endif
+        }else{
+            SDL_free(decoded->region);
+        }
+        SDL_free(decoded);
+    }
+}
+
+/* Reads the .wsz/BMPs/text files and packs the atlas, the slow way. */
+static DecodedSkin *decode_skin_files(const char *fname){
+    DecodedSkin *decoded = (DecodedSkin *) SDL_calloc(1, sizeof(DecodedSkin));
+    if(!decoded){
+        return NULL;
+    }
+
+    SDL_Surface *bitmaps[WASBMP_COUNT];
+    int num_bitmaps = 0;
+    ZipArchive *zip = ZipArchive_load(fname);
+    for(int i = 0; i < WASBMP_COUNT; ++i){
+        SDL_RWops *rw = openrw(zip, fname, skin_bitmap_names[i]);
+        bitmaps[i] = rw ? SDL_LoadBMP_RW(rw, 1) : NULL; // MAY BE NULL
+        num_bitmaps += bitmaps[i] ? 1 : 0;
+    }
+    parse_viscolor(openrw(zip, fname, "VISCOLOR.TXT"), decoded->vis_colors);
+    parse_pledit_txt(openrw(zip, fname, "PLEDIT.TXT"), &decoded->playlist_colors);
+    decoded->region = (Uint8 *) SDL_malloc(SKIN_WINDOW_W * SKIN_WINDOW_H);
+    if(decoded->region && !parse_region_txt(openrw(zip, fname, "REGION.TXT"), decoded->region)){
+        SDL_free(decoded->region);
+        decoded->region = NULL;
+    }
+    ZipArchive_unload(zip);
+
+    if(num_bitmaps){
+        decoded->atlas = pack_skin_atlas(bitmaps, WASBMP_COUNT, decoded->rects);
+    }
+    for(int i = 0; i < WASBMP_COUNT; ++i){
+        SDL_FreeSurface(bitmaps[i]);
+    }
+    return decoded;
+}
+
+/* Decoded skins are kept in the pref dir as skin-<hash>.cache, keyed on a
+   hash of the .wsz's bytes: a header with the atlas rects and colours, then
+   the atlas pixels ready for SDL_CreateTextureFromSurface, then the region
+   mask if there is one. A warm start is
+   hashing the .wsz and mapping one file. Skin directories aren't cached,
+   there's no single file to hash. Bump SKIN_CACHE_VERSION whenever
+   decode_skin_files would produce something different for the same file. */
+#define SKIN_CACHE_VERSION 3
+#define SKIN_CACHE_PIXELS_OFFSET 4096 // page aligned, must be >= sizeof(SkinCacheHeader)
+
+typedef struct SkinCacheHeader{
+    char magic[8]; // "MYAMPSKN"
+    Uint32 version;
+    Uint32 header_len; // sizeof(SkinCacheHeader), catches builds that lay it out differently
+    Uint32 byte_order; // 0x01020304 as written, the pixels are host endian
+    Sint32 atlas_w; // 0 if there's no atlas
+    Sint32 atlas_h;
+    Sint32 atlas_pitch;
+    Sint32 has_region; // SKIN_WINDOW_W * SKIN_WINDOW_H bytes after the pixels
+    Uint64 source_hash;
+    Uint64 source_len;
+    SDL_Rect rects[WASBMP_COUNT + 1];
+    SDL_Color vis_colors[VIS_NUM_COLORS];
+    PlaylistColors playlist_colors;
+} SkinCacheHeader;
+
+SDL_COMPILE_TIME_ASSERT(skin_cache_header_fits, sizeof(SkinCacheHeader) <= SKIN_CACHE_PIXELS_OFFSET);
+
+/* Pref dir with a trailing separator, NULL to go without the skin cache
+   and the library index. Set before the first skin loads and never
+   changed after. */
+static char *pref_dir = NULL;
+
+/* Not cryptographic, just needs to notice when a skin file changes. Works a
+   word at a time so hashing a skin costs a fraction of decoding it. */
+static Uint64 hash_bytes(Uint64 hash, const Uint8 *data, const size_t len){
+    size_t i = 0;
+    for(; (i + 8) <= len; i += 8){
+        Uint64 word;
+        SDL_memcpy(&word, &data[i], sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    for(; i < len; ++i){
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/* SDL_FALSE if it can't be read, which includes it being a directory. */
+static SDL_bool hash_file(const char *fname, Uint64 *hash, Uint64 *len){
+    SDL_RWops *rw = SDL_RWFromFile(fname, "rb");
+    Uint8 buf[16 * 1024]; // multiple of 8, so only the last block has a ragged end
+    size_t got;
+
+    if(!rw){
+        return SDL_FALSE;
+    }
+    *hash = 0xCBF29CE484222325ull;
+    *len = 0;
+    while((got = SDL_RWread(rw, buf, 1, sizeof(buf))) > 0){
+        *hash = hash_bytes(*hash, buf, got);
+        *len += got;
+    }
+    SDL_RWclose(rw);
+    return (*len > 0) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Caller frees. */
+static char *skin_cache_path(const Uint64 hash, const char *suffix){
+    const size_t len = SDL_strlen(pref_dir) + 64;
+    char *path = (char *) SDL_malloc(len);
+    if(path){
+        SDL_snprintf(path, len, "%sskin-%016" SDL_PRIx64 ".cache%s", pref_dir, hash, suffix);
+    }
+    return path;
+}
+
+/* Loads the cache file, mapped where we can. NULL on a miss, a stale or
+   damaged file is a miss too. */
+static DecodedSkin *SkinCache_load(const Uint64 hash, const Uint64 source_len){
+    char *path = skin_cache_path(hash, "");
+    DecodedSkin *decoded = NULL;
+    void *data = NULL;
+    size_t len = 0;
+
+    if(!path){
+        return NULL;
+    }
+#ifdef MYAMP_HAVE_MMAP
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd != -1){
+        if((fstat(fd, &st) == 0) && (st.st_size >= SKIN_CACHE_PIXELS_OFFSET)){
+            // private and writable so nothing SDL does to the surface can reach the file
+            data = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            data = (data == MAP_FAILED) ? NULL : data;
+            len = (size_t) st.st_size;
+        }
+        close(fd);
+    }
+#else
+    data = SDL_LoadFile(path, &len);
+#endif
+    SDL_free(path);
+    if(!data){
+        return NULL;
+    }
+
+    const SkinCacheHeader *header = (const SkinCacheHeader *) data;
+    SDL_bool valid = (len >= SKIN_CACHE_PIXELS_OFFSET) && (SDL_memcmp(header->magic, "MYAMPSKN", 8) == 0) &&
+                     (header->version == SKIN_CACHE_VERSION) && (header->header_len == sizeof(SkinCacheHeader)) &&
+                     (header->byte_order == 0x01020304) && (header->source_hash == hash) && (header->source_len == source_len) &&
+                     (header->atlas_w >= 0) && (header->atlas_h >= 0) && (header->atlas_pitch >= header->atlas_w * 4) &&
+                     (len == SKIN_CACHE_PIXELS_OFFSET + ((size_t) header->atlas_pitch * (size_t) header->atlas_h) +
+                             (header->has_region ? (SKIN_WINDOW_W * SKIN_WINDOW_H) : 0));
+    for(int i = 0; valid && header->atlas_w && (i <= WASBMP_COUNT); ++i){
+        const SDL_Rect *rect = &header->rects[i];
+        valid = (rect->x >= 0) && (rect->y >= 0) && (rect->w >= 0) && (rect->h >= 0) &&
+                (rect->x + rect->w <= header->atlas_w) && (rect->y + rect->h <= header->atlas_h);
+    }
+    if(valid){
+        decoded = (DecodedSkin *) SDL_calloc(1, sizeof(DecodedSkin));
+    }
+    if(decoded){
+        decoded->cache = data;
+        decoded->cache_len = len;
+        SDL_memcpy(decoded->rects, header->rects, sizeof(decoded->rects));
+        SDL_memcpy(decoded->vis_colors, header->vis_colors, sizeof(decoded->vis_colors));
+        decoded->playlist_colors = header->playlist_colors;
+        if(header->has_region){
+            decoded->region = (Uint8 *) data + SKIN_CACHE_PIXELS_OFFSET + ((size_t) header->atlas_pitch * (size_t) header->atlas_h);
+        }
+        if(header->atlas_w && header->atlas_h){
+            decoded->atlas = SDL_CreateRGBSurfaceWithFormatFrom((Uint8 *) data + SKIN_CACHE_PIXELS_OFFSET, header->atlas_w, header->atlas_h,
+                                                                32, header->atlas_pitch, SDL_PIXELFORMAT_ARGB8888);
+            if(!decoded->atlas){
+                DecodedSkin_free(decoded);
+                return NULL;
+            }
+        }
+        return decoded;
+    }
+#ifdef MYAMP_HAVE_MMAP
+    munmap(data, len);
+#else
+    SDL_free(data);
+#endif
+    return NULL;
+}
+
+/* Best effort, a skin that can't be cached still loads. Written to a
+   temporary file and renamed so a reader never sees half of one. */
+static void SkinCache_store(const Uint64 hash, const Uint64 source_len, const DecodedSkin *decoded){
+    const SDL_Surface *atlas = decoded->atlas;
+    char suffix[32];
+    char *path = skin_cache_path(hash, "");
+    char *tmp_path;
+    SDL_RWops *rw;
+    SkinCacheHeader *header = (SkinCacheHeader *) SDL_calloc(1, SKIN_CACHE_PIXELS_OFFSET);
+    SDL_bool ok;
+
+    SDL_snprintf(suffix, sizeof(suffix), ".%lu", SDL_ThreadID()); // two loaders may race on one skin
+    tmp_path = skin_cache_path(hash, suffix);
+    rw = (path && tmp_path && header) ? SDL_RWFromFile(tmp_path, "wb") : NULL;
+    if(!rw){
+        goto done;
+    }
+    SDL_memcpy(header->magic, "MYAMPSKN", 8);
+    header->version = SKIN_CACHE_VERSION;
+    header->header_len = sizeof(SkinCacheHeader);
+    header->byte_order = 0x01020304;
+    header->atlas_w = atlas ? atlas->w : 0;
+    header->atlas_h = atlas ? atlas->h : 0;
+    header->atlas_pitch = header->atlas_w * 4;
+    header->has_region = decoded->region ? 1 : 0;
+    header->source_hash = hash;
+    header->source_len = source_len;
+    SDL_memcpy(header->rects, decoded->rects, sizeof(header->rects));
+    SDL_memcpy(header->vis_colors, decoded->vis_colors, sizeof(header->vis_colors));
+    header->playlist_colors = decoded->playlist_colors;
+
+    ok = (SDL_RWwrite(rw, header, SKIN_CACHE_PIXELS_OFFSET, 1) == 1) ? SDL_TRUE : SDL_FALSE;
+    for(int y = 0; ok && (y < header->atlas_h); ++y){
+        ok = (SDL_RWwrite(rw, (const Uint8 *) atlas->pixels + (y * atlas->pitch), header->atlas_pitch, 1) == 1) ? SDL_TRUE : SDL_FALSE;
+    }
+    if(ok && decoded->region){
+        ok = (SDL_RWwrite(rw, decoded->region, SKIN_WINDOW_W * SKIN_WINDOW_H, 1) == 1) ? SDL_TRUE : SDL_FALSE;
+    }
+    ok = ((SDL_RWclose(rw) == 0) && ok) ? SDL_TRUE : SDL_FALSE;
+    if(!ok || (rename(tmp_path, path) != 0)){
+        remove(tmp_path);
+    }
+
+done:
+    SDL_free(header);
+    SDL_free(tmp_path);
+    SDL_free(path);
+}
+
+/* Any thread. Tries the skin cache first, decodes and fills it on a miss. */
+static DecodedSkin *decode_skin(const char *fname){
+    Uint64 hash;
+    Uint64 len;
+
+    if(!pref_dir || !hash_file(fname, &hash, &len)){
+        return decode_skin_files(fname);
+    }
+    DecodedSkin *decoded = SkinCache_load(hash, len);
+    if(!decoded){
+        decoded = decode_skin_files(fname);
+        if(decoded){
+            SkinCache_store(hash, len, decoded);
+        }
+    }
+    return decoded;
+}
+
+static void fill_hit_rect(WinAmpSkin *skin, const SDL_Rect *rect, const HitId id){
+    const SDL_Rect window_rect = { 0, 0, SKIN_WINDOW_W, SKIN_WINDOW_H };
+    SDL_Rect visible;
+    if(SDL_IntersectRect(rect, &window_rect, &visible)){
+        for(int y = visible.y; y < visible.y + visible.h; ++y){
+            SDL_memset(&skin->hit_map[y][visible.x], id, visible.w);
+        }
+    }
+}
+
+/* Rasterizes every control into skin->hit_map, back to front, then cuts
+   out what's outside `region` (may be NULL). */
+static void build_hit_map(WinAmpSkin *skin, const Uint8 *region){
+    static const SDL_Rect titlebars[] = {
+        { 0, 0,             SKIN_MAIN_W, 14 },
+        { 0, SKIN_EQ_Y,     SKIN_MAIN_W, 14 },
+        { 0, SKIN_PLEDIT_Y, SKIN_MAIN_W, 20 },
+    };
+
+    SDL_memset(skin->hit_map, HIT_WINDOW, sizeof(skin->hit_map));
+    for(int i = 0; i < (int) SDL_arraysize(titlebars); ++i){
+        fill_hit_rect(skin, &titlebars[i], HIT_TITLEBAR);
+    }
+    fill_hit_rect(skin, &playlist_rect, HIT_PLAYLIST);
+    fill_hit_rect(skin, &vis_rect, HIT_VISUALIZER);
+    for(int i = WASSLD_COUNT - 1; i >= 0; --i){
+        fill_hit_rect(skin, &skin->sliders[i].dst_rect, (HitId) (HIT_SLIDER_FIRST + i));
+    }
+    for(int i = WASBTN_COUNT - 1; i >= 0; --i){
+        fill_hit_rect(skin, &skin->buttons[i].dst_rect, (HitId) (HIT_BUTTON_FIRST + i));
+    }
+    if(region){
+        Uint8 *hit = &skin->hit_map[0][0];
+        for(int i = 0; i < SKIN_WINDOW_W * SKIN_WINDOW_H; ++i){
+            hit[i] = region[i] ? hit[i] : HIT_NONE;
+        }
+    }
+}
+
+/* What's at `pt` in window coordinates, HIT_NONE off the edges. */
+static HitId hit_test(const WinAmpSkin *skin, const SDL_Point *pt){
+    if((pt->x < 0) || (pt->y < 0) || (pt->x >= SKIN_WINDOW_W) || (pt->y >= SKIN_WINDOW_H)){
+        return HIT_NONE;
+    }
+    return (HitId) skin->hit_map[pt->y][pt->x];
+}
+
+/* For bench_skin. Every pixel of every control's rect that `region` (may
+   be NULL) keeps has to hit that control, or the one in front of it where
+   two overlap: buttons before sliders, lower numbers first. SDL_SetError
+   says where it doesn't. */
+static SDL_bool hit_map_matches_controls(const WinAmpSkin *skin, const Uint8 *region){
+    for(int y = 0; y < SKIN_WINDOW_H; ++y){
+        for(int x = 0; x < SKIN_WINDOW_W; ++x){
+            const SDL_Point pt = { x, y };
+            int expected = -1;
+            if(region && !region[(y * SKIN_WINDOW_W) + x]){
+                continue;
+            }
+            for(int i = 0; (expected < 0) && (i < WASBTN_COUNT + WASSLD_COUNT); ++i){
+                const SDL_Rect *rect = (i < WASBTN_COUNT) ? &skin->buttons[i].dst_rect : &skin->sliders[i - WASBTN_COUNT].dst_rect;
+                expected = SDL_PointInRect(&pt, rect) ? i : -1;
+            }
+            if((expected >= 0) && (hit_test(skin, &pt) != (HitId) (HIT_BUTTON_FIRST + expected))){
+                SDL_SetError("Pixel %d,%d hits %d instead of control %d", x, y, (int) hit_test(skin, &pt), HIT_BUTTON_FIRST + expected);
+                return SDL_FALSE;
+            }
+        }
+    }
+    return SDL_TRUE;
+}
+
+/* Window coordinates to skin pixels. Rounds down, so points left of or
+   above the window stay outside the skin while a drag is captured. */
+static SDL_Point window_to_skin(const int x, const int y){
+    const SDL_Point pt = { (int) SDL_floorf((float) x / skin_scale), (int) SDL_floorf((float) y / skin_scale) };
+    return pt;
+}
+
+/* Size of the window at `skin_scale`. */
+static void scaled_window_size(int *w, int *h){
+    *w = (int) SDL_floorf((SKIN_WINDOW_W * skin_scale) + 0.5f);
+    *h = (int) SDL_floorf((SKIN_WINDOW_H * skin_scale) + 0.5f);
+}
+
+/* Lets the titlebars move a window that has no decorations. */
+static SDL_HitTestResult SDLCALL window_hit_test(SDL_Window *win, const SDL_Point *area, void *data){
+    const WinAmpSkin *skin = (const WinAmpSkin *) data;
+    const SDL_Point pt = window_to_skin(area->x, area->y);
+    return (hit_test(skin, &pt) == HIT_TITLEBAR) ? SDL_HITTEST_DRAGGABLE : SDL_HITTEST_NORMAL;
+}
+
+/* Cuts the window to `region`, or back to a rectangle when NULL. Shaped
+   windows stay hidden until they have a shape, so it's shown either way. */
+static void shape_window(const Uint8 *region){
+    int w, h;
+    if(!window || !SDL_IsShapedWindow(window)){
+        return;
+    }
+    scaled_window_size(&w, &h);
+    SDL_Surface *shape = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if(shape){
+        for(int y = 0; y < h; ++y){
+            Uint32 *row = (Uint32 *) ((Uint8 *) shape->pixels + (y * shape->pitch));
+            const int skin_y = SDL_min((y * SKIN_WINDOW_H) / h, SKIN_WINDOW_H - 1);
+            for(int x = 0; x < w; ++x){
+                const int skin_x = SDL_min((x * SKIN_WINDOW_W) / w, SKIN_WINDOW_W - 1);
+                row[x] = (!region || region[(skin_y * SKIN_WINDOW_W) + skin_x]) ? 0xFF000000 : 0;
+            }
+        }
+        SDL_WindowShapeMode mode;
+        mode.mode = ShapeModeBinarizeAlpha;
+        mode.parameters.binarizationCutoff = 128;
+        if(SDL_SetWindowShape(window, shape, &mode) != 0){
+            SDL_Log("Could not shape the window: %s", SDL_GetError());
+        }
+        SDL_FreeSurface(shape);
+    }
+    SDL_ShowWindow(window);
+}
+
+/* `src` blown up `factor` times, every pixel a block. A plain copy at 1. */
+static SDL_Surface *scale_surface_nearest(const SDL_Surface *src, const int factor){
+    SDL_Surface *dst = SDL_CreateRGBSurfaceWithFormat(0, src->w * factor, src->h * factor, 32, SDL_PIXELFORMAT_ARGB8888);
+    if(!dst){
+        return NULL;
+    }
+    for(int y = 0; y < dst->h; ++y){
+        const Uint32 *in = (const Uint32 *) ((const Uint8 *) src->pixels + ((y / factor) * src->pitch));
+        Uint32 *out = (Uint32 *) ((Uint8 *) dst->pixels + (y * dst->pitch));
+        if(factor == 1){
+            SDL_memcpy(out, in, src->w * sizeof(Uint32));
+            continue;
+        }
+        for(int x = 0; x < src->w; ++x){
+            for(int i = 0; i < factor; ++i){
+                *out++ = in[x];
+            }
+        }
+    }
+    return dst;
+}
+
+/* Scale2x (AdvMAME2x) of `rect` in `src` into `dst`, twice the size. Edges
+   are clamped to `rect`, so bitmaps packed side by side in the atlas don't
+   reach into each other. */
+static void scale2x_rect(const SDL_Surface *src, SDL_Surface *dst, const SDL_Rect *rect){
+    #define SCALE2X_PIXEL(px, py) (((const Uint32 *) ((const Uint8 *) src->pixels + ((py) * src->pitch)))[px])
+    for(int y = rect->y; y < rect->y + rect->h; ++y){
+        const int up = SDL_max(y - 1, rect->y);
+        const int down = SDL_min(y + 1, rect->y + rect->h - 1);
+        Uint32 *out0 = (Uint32 *) ((Uint8 *) dst->pixels + ((y * 2) * dst->pitch));
+        Uint32 *out1 = (Uint32 *) ((Uint8 *) dst->pixels + (((y * 2) + 1) * dst->pitch));
+        for(int x = rect->x; x < rect->x + rect->w; ++x){
+            const Uint32 p = SCALE2X_PIXEL(x, y);
+            const Uint32 a = SCALE2X_PIXEL(x, up);
+            const Uint32 b = SCALE2X_PIXEL(SDL_min(x + 1, rect->x + rect->w - 1), y);
+            const Uint32 c = SCALE2X_PIXEL(SDL_max(x - 1, rect->x), y);
+            const Uint32 d = SCALE2X_PIXEL(x, down);
+            out0[x*2]   = ((c == a) && (c != d) && (a != b)) ? a : p;
+            out0[x*2+1] = ((a == b) && (a != c) && (b != d)) ? b : p;
+            out1[x*2]   = ((d == c) && (d != b) && (c != a)) ? c : p;
+            out1[x*2+1] = ((b == d) && (b != a) && (d != c)) ? d : p;
+        }
+    }
+    #undef SCALE2X_PIXEL
+}
+
+/* How many times over the atlas is drawn for `skin_scale`, and so
+   frame_target: all of it, the window is composed texel for pixel. */
+static int skin_atlas_scale(void){
+    return (int) skin_scale;
+}
+
+/* The skin's 1x atlas at `factor`, through `skin_filter`. Scale2x doubles
+   as far as `factor` allows, nearest does whatever's left, so 3x is all
+   nearest. */
+static SDL_Surface *scale_atlas(const WinAmpSkin *skin, const int factor){
+    if(skin_filter == SKIN_FILTER_NEAREST){
+        return scale_surface_nearest(skin->atlas_pixels, factor);
+    }
+    SDL_Surface *scaled = scale_surface_nearest(skin->atlas_pixels, 1);
+    int done = 1;
+    for(; scaled && ((factor % (done * 2)) == 0); done *= 2){
+        SDL_Surface *next = scale_surface_nearest(scaled, 2);
+        if(next){
+            // nearest covers the padding between bitmaps, Scale2x the bitmaps themselves
+            for(int i = 0; i <= WASBMP_COUNT; ++i){
+                const SDL_Rect *bitmap = (i < WASBMP_COUNT) ? &skin->bitmaps[i] : &skin->white_pixel;
+                const SDL_Rect rect = { bitmap->x * done, bitmap->y * done, bitmap->w * done, bitmap->h * done };
+                if(rect.w && rect.h){
+                    scale2x_rect(scaled, next, &rect);
+                }
+            }
+        }
+        SDL_FreeSurface(scaled);
+        scaled = next;
+    }
+    if(scaled && (done < factor)){
+        SDL_Surface *next = scale_surface_nearest(scaled, factor / done);
+        SDL_FreeSurface(scaled);
+        scaled = next;
+    }
+    return scaled;
+}
+
+static void destroy_skin_textures(WinAmpSkin *skin){
+    if(skin->atlas        ){ SDL_DestroyTexture(skin->atlas        ); }
+    if(skin->frame_target ){ SDL_DestroyTexture(skin->frame_target ); }
+    if(skin->time_texture ){ SDL_DestroyTexture(skin->time_texture ); }
+    if(skin->title_texture){ SDL_DestroyTexture(skin->title_texture); }
+    skin->atlas = skin->frame_target = skin->time_texture = skin->title_texture = NULL;
+}
+
+/* Render thread only. (Re)makes everything that depends on `skin_scale`:
+   the scaled atlas, frame_target and the readouts at the atlas' scale, and
+   the window's size and shape. Done once per scale change, never per frame. */
+static void scale_skin(WinAmpSkin *skin){
+    SDL_Surface *scaled = NULL;
+    int window_w, window_h;
+
+    destroy_skin_textures(skin);
+    skin->atlas_scale = 1;
+    if(skin->atlas_pixels){
+        skin->atlas_scale = skin_atlas_scale();
+        scaled = scale_atlas(skin, skin->atlas_scale);
+        skin->atlas = scaled ? SDL_CreateTextureFromSurface(renderer, scaled) : NULL;
+        if(!skin->atlas && (skin->atlas_scale > 1)){
+            // too big for the renderer, it'll have to scale the 1x one when presenting
+            SDL_Log("Could not scale the skin %dx: %s", skin->atlas_scale, SDL_GetError());
+            skin->atlas_scale = 1;
+            skin->atlas = SDL_CreateTextureFromSurface(renderer, skin->atlas_pixels); // MAY BE NULL
+        }
+        SDL_FreeSurface(scaled);
+    }
+
+    if(SDL_RenderTargetSupported(renderer)){
+        const int scale = skin->atlas_scale;
+        // MAY BE NULL, draw_frame falls back to redrawing everything
+        skin->frame_target = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, SKIN_WINDOW_W * scale, SKIN_WINDOW_H * scale);
+        // MAY BE NULL, draw_skin queues the glyphs itself then
+        skin->time_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, time_rect.w * scale, time_rect.h * scale);
+        skin->title_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                                (int) (sizeof(skin->title_text) - 1) * SKIN_TEXT_GLYPH_W * scale, SKIN_TEXT_GLYPH_H * scale);
+        if(skin->time_texture){ SDL_SetTextureBlendMode(skin->time_texture, SDL_BLENDMODE_NONE); }
+        if(skin->title_texture){ SDL_SetTextureBlendMode(skin->title_texture, SDL_BLENDMODE_NONE); }
+        if(skin->frame_target){
+            // only stretched if the scaled atlas was too big and it's at 1x
+            SDL_SetTextureScaleMode(skin->frame_target, SDL_ScaleModeNearest);
+            // it's opaque, and blending the whole window in every frame is most of a software renderer's time
+            SDL_SetTextureBlendMode(skin->frame_target, SDL_BLENDMODE_NONE);
+        }
+    }
+    if(skin->atlas){
+        SDL_SetTextureScaleMode(skin->atlas, SDL_ScaleModeNearest);
+        // skin bitmaps have no transparency, ARGB textures just default to blending
+        SDL_SetTextureBlendMode(skin->atlas, SDL_BLENDMODE_NONE);
+    }
+
+    if(window){
+        scaled_window_size(&window_w, &window_h);
+        SDL_SetWindowSize(window, window_w, window_h);
+    }
+    shape_window(skin->region);
+    skin->readouts_stale = SDL_TRUE;
+    mark_all_dirty(skin);
+}
+
+/* UI thread. */
+static void set_skin_scale(WinAmpSkin *skin, const float scale){
+    if(scale != skin_scale){
+        skin_scale = scale;
+        scale_skin(skin);
+    }
+}
+
+/* Render thread only. Uploads `decoded` and replaces whatever skin was there. */
+static void apply_skin(WinAmpSkin *skin, const DecodedSkin *decoded){
+
+    // the decoded skin goes away after this, keep what scale_skin needs
+    SDL_Surface *atlas_pixels = (decoded && decoded->atlas) ? scale_surface_nearest(decoded->atlas, 1) : NULL; // MAY BE NULL
+    Uint8 *region = (decoded && decoded->region) ? (Uint8 *) SDL_malloc(SKIN_WINDOW_W * SKIN_WINDOW_H) : NULL; // MAY BE NULL, the window stays square
+    if(region){
+        SDL_memcpy(region, decoded->region, SKIN_WINDOW_W * SKIN_WINDOW_H);
+    }
+
+    if(skin->pressed){
+        SDL_CaptureMouse(SDL_FALSE);
+    }
+    destroy_skin_textures(skin);
+    if(skin->vis_texture ){ SDL_DestroyTexture(skin->vis_texture ); }
+    SDL_FreeSurface(skin->atlas_pixels);
+    SDL_free(skin->region);
+
+    SDL_zerop(skin);
+    SDL_memcpy(skin->vis_colors, decoded ? decoded->vis_colors : default_vis_colors, sizeof(skin->vis_colors));
+    skin->playlist_colors = decoded ? decoded->playlist_colors : default_playlist_colors;
+    skin->region = region;
+
+    if(atlas_pixels){
+        skin->atlas_pixels = atlas_pixels;
+        skin->atlas_w = atlas_pixels->w;
+        skin->atlas_h = atlas_pixels->h;
+        SDL_memcpy(skin->bitmaps, decoded->rects, sizeof(skin->bitmaps));
+        skin->white_pixel = decoded->rects[WASBMP_COUNT];
+    }
+
+    init_skin_button(&skin->buttons[WASBTN_PREV],   skin, WASBMP_CBUTTONS, click_func_prev,  23, 18,  16, 88,   0, 0,   0, 18);
+    init_skin_button(&skin->buttons[WASBTN_PLAY],   skin, WASBMP_CBUTTONS, click_func_play,  23, 18,  39, 88,  23, 0,  23, 18);
+    init_skin_button(&skin->buttons[WASBTN_PAUSE],  skin, WASBMP_CBUTTONS, click_func_pause, 23, 18,  62, 88,  46, 0,  46, 18);
+    init_skin_button(&skin->buttons[WASBTN_STOP],   skin, WASBMP_CBUTTONS, click_func_stop,  23, 18,  85, 88,  69, 0,  69, 18);
+    init_skin_button(&skin->buttons[WASBTN_NEXT],   skin, WASBMP_CBUTTONS, click_func_next,  22, 18, 108, 88,  92, 0,  92, 18);
+    init_skin_button(&skin->buttons[WASBTN_EJECT],  skin, WASBMP_CBUTTONS, click_func_eject, 22, 16, 136, 89, 114, 0, 114, 16);
+
+    init_skin_slider(&skin->sliders[WASSLD_VOLUME], skin, WASBMP_VOLUME, &audio_volume, 68, 13, 107, 57, 14, 11, 15, 422, 0, 422, 0, 0, 68, 15, 28, 1.0f);
+
+    init_skin_slider(&skin->sliders[WASSLD_BALANCE], skin, WASBMP_BALANCE, &audio_balance, 38, 13, 177, 57, 14, 11, 15, 422, 0, 422, 9, 0, 47, 15, 28, 0.5f);
+
+    init_skin_position_bar(&skin->sliders[WASSLD_POSITION], skin, 0.0f); // update_playback moves it
+
+    init_skin_eq_slider(&skin->sliders[WASSLD_EQ_PREAMP], skin, 21, eq_values[0]);
+    for(int i = 0; i < EQ_NUM_BANDS; ++i){
+        init_skin_eq_slider(&skin->sliders[WASSLD_EQ_BAND_FIRST + i], skin, 78 + (i * 18), eq_values[i + 1]);
+    }
+    build_hit_map(skin, skin->region);
+
+    scale_skin(skin);
+    skin->title_index = -1;
+    // MAY BE NULL, we just go without a visualizer
+    skin->vis_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, VIS_W, VIS_H);
+    if(skin->vis_texture){
+        // stretched with the skin, bars should stay bars
+        SDL_SetTextureScaleMode(skin->vis_texture, SDL_ScaleModeNearest);
+        SDL_SetTextureBlendMode(skin->vis_texture, SDL_BLENDMODE_NONE);
+    }
+    // repaint it with the new colours
+    visualizer.idle = SDL_FALSE;
+    visualizer.last_update = 0;
+}
+
+/* Synchronous, only used at startup when there's nothing on screen to keep. */
+static void load_skin(WinAmpSkin *skin, const char *fname){
+    DecodedSkin *decoded = decode_skin(fname);
+    apply_skin(skin, decoded);
+    DecodedSkin_free(decoded);
+}
+
+/* Posted by load_skin_thread with a DecodedSkin in data1. */
+static Uint32 skin_loaded_event = (Uint32) -1;
+/* Bumped for every skin requested, so a slow load can't replace a newer one. */
+static SDL_atomic_t skin_generation;
+/* Loader threads still running, deinit waits for them. */
+static SDL_atomic_t skin_loads_in_flight;
+
+typedef struct SkinLoadRequest{
+    char *fname;
+    int generation;
+} SkinLoadRequest;
+
+static int SDLCALL load_skin_thread(void *data){
+    SkinLoadRequest *request = (SkinLoadRequest *) data;
+    DecodedSkin *decoded = decode_skin(request->fname);
+    SDL_Event e;
+
+    if(decoded){
+        decoded->generation = request->generation;
+        SDL_zero(e);
+        e.type = skin_loaded_event;
+        e.user.data1 = decoded;
+        if(SDL_PushEvent(&e) != 1){
+            DecodedSkin_free(decoded);
+        }
+    }
+    SDL_free(request->fname);
+    SDL_free(request);
+    SDL_AtomicAdd(&skin_loads_in_flight, -1);
+    return 0;
+}
+
+/* Decodes `fname` on a worker thread, the current skin stays up until
+   handle_events gets the result and applies it. */
+static void load_skin_async(const char *fname){
+    SkinLoadRequest *request = (SkinLoadRequest *) SDL_calloc(1, sizeof(SkinLoadRequest));
+    if(request){
+        request->fname = SDL_strdup(fname);
+        request->generation = SDL_AtomicAdd(&skin_generation, 1) + 1;
+    }
+    if(!request || !request->fname){
+        SDL_free(request);
+        return;
+    }
+
+    SDL_AtomicAdd(&skin_loads_in_flight, 1);
+    SDL_Thread *thread = SDL_CreateThread(load_skin_thread, "skinloader", request);
+    if(!thread){
+        SDL_AtomicAdd(&skin_loads_in_flight, -1);
+        SDL_free(request->fname);
+        SDL_free(request);
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not load skin!", SDL_GetError(), window);
+        return;
+    }
+    SDL_DetachThread(thread);
+}
+
+/* A few worker threads for work that splits into lots of small independent
+   tasks, library scans for now. Each worker has a deque of its own: what
+   its tasks spawn goes on the bottom and it pops the newest first, so it
+   works depth first through whatever it just found. A worker that runs dry
+   steals the oldest task off another's top instead, which tends to be the
+   biggest piece left (a whole folder still to walk). */
+#define THREAD_POOL_MAX_WORKERS 16
+
+typedef void (*TaskFunc)(int worker, void *data);
+
+typedef struct Task{
+    TaskFunc func;
+    void *data;
+} Task;
+
+/* The owner and thieves only ever hold the lock for a few loads and stores. */
+typedef struct TaskDeque{
+    SDL_SpinLock lock;
+    Task *tasks;     // ring, capacity a power of two
+    Uint32 capacity;
+    Uint32 top;      // thieves take from here
+    Uint32 bottom;   // the owner pushes and pops here
+} TaskDeque;
+
+typedef struct ThreadPool{
+    int num_workers; // 0 until ThreadPool_start
+    SDL_Thread *threads[THREAD_POOL_MAX_WORKERS];
+    TaskDeque deques[THREAD_POOL_MAX_WORKERS];
+    SDL_sem *wake;   // posted once per task pushed
+    SDL_atomic_t next_deque; // round robin for tasks from outside the pool
+    SDL_atomic_t quit;
+} ThreadPool;
+
+static ThreadPool thread_pool;
+
+static SDL_bool TaskDeque_push(TaskDeque *q, const Task *task){
+    SDL_bool ok = SDL_TRUE;
+    SDL_AtomicLock(&q->lock);
+    if((q->bottom - q->top) == q->capacity){
+        const Uint32 capacity = q->capacity ? (q->capacity * 2) : 64;
+        Task *tasks = (Task *) SDL_malloc(capacity * sizeof(Task));
+        if(tasks){
+            for(Uint32 i = q->top; i != q->bottom; ++i){
+                tasks[i & (capacity - 1)] = q->tasks[i & (q->capacity - 1)];
+            }
+            SDL_free(q->tasks);
+            q->tasks = tasks;
+            q->capacity = capacity;
+        }else{
+            ok = SDL_FALSE;
+        }
+    }
+    if(ok){
+        q->tasks[q->bottom++ & (q->capacity - 1)] = *task;
+    }
+    SDL_AtomicUnlock(&q->lock);
+    return ok;
+}
+
+/* The owner takes the newest, thieves the oldest. */
+static SDL_bool TaskDeque_take(TaskDeque *q, const SDL_bool newest, Task *task){
+    SDL_bool found = SDL_FALSE;
+    SDL_AtomicLock(&q->lock);
+    if(q->bottom != q->top){
+        *task = newest ? q->tasks[--q->bottom & (q->capacity - 1)] : q->tasks[q->top++ & (q->capacity - 1)];
+        found = SDL_TRUE;
+    }
+    SDL_AtomicUnlock(&q->lock);
+    return found;
+}
+
+/* Runs tasks until there are none anywhere, sleeps until there are. Only
+   leaves once quit is set and every deque is empty. */
+static int SDLCALL thread_pool_worker(void *data){
+    const int worker = (int) (intptr_t) data;
+    Task task;
+
+    for(;;){
+        SDL_bool found = TaskDeque_take(&thread_pool.deques[worker], SDL_TRUE, &task);
+        for(int i = 1; !found && (i < thread_pool.num_workers); ++i){
+            found = TaskDeque_take(&thread_pool.deques[(worker + i) % thread_pool.num_workers], SDL_FALSE, &task);
+        }
+        if(found){
+            task.func(worker, task.data);
+        }else if(SDL_AtomicGet(&thread_pool.quit)){
+            return 0;
+        }else{
+            // a worker that found work without waiting leaves the count high, so this can wake for nothing
+            SDL_SemWait(thread_pool.wake);
+        }
+    }
+}
+
+static void ThreadPool_stop(void){
+    if(!thread_pool.wake){
+        return;
+    }
+    SDL_AtomicSet(&thread_pool.quit, 1);
+    for(int i = 0; i < thread_pool.num_workers; ++i){
+        SDL_SemPost(thread_pool.wake);
+    }
+    for(int i = 0; i < thread_pool.num_workers; ++i){
+        if(thread_pool.threads[i]){
+            SDL_WaitThread(thread_pool.threads[i], NULL);
+        }
+        SDL_free(thread_pool.deques[i].tasks);
+    }
+    SDL_DestroySemaphore(thread_pool.wake);
+    SDL_zero(thread_pool);
+}
+
+/* UI thread. Starts the workers the first time something needs them, one
+   per core. */
+static SDL_bool ThreadPool_start(void){
+    if(thread_pool.num_workers){
+        return SDL_TRUE;
+    }
+    thread_pool.wake = SDL_CreateSemaphore(0);
+    if(!thread_pool.wake){
+        return SDL_FALSE;
+    }
+    thread_pool.num_workers = SDL_clamp(SDL_GetCPUCount(), 1, THREAD_POOL_MAX_WORKERS);
+    for(int i = 0; i < thread_pool.num_workers; ++i){
+        char name[16];
+        SDL_snprintf(name, sizeof(name), "worker%d", i);
+        thread_pool.threads[i] = SDL_CreateThread(thread_pool_worker, name, (void *) (intptr_t) i);
+        if(!thread_pool.threads[i]){
+            ThreadPool_stop();
+            return SDL_FALSE;
+        }
+    }
+    return SDL_TRUE;
+}
+
+/* `worker` is the calling task's, so what it spawns lands on its own deque,
+   or -1 from outside the pool. */
+static SDL_bool ThreadPool_submit(const int worker, TaskFunc func, void *data){
+    const Task task = { func, data };
+    const int index = (worker >= 0) ? worker : (int) ((Uint32) SDL_AtomicAdd(&thread_pool.next_deque, 1) % (Uint32) thread_pool.num_workers);
+    if(!TaskDeque_push(&thread_pool.deques[index], &task)){
+        SDL_OutOfMemory();
+        return SDL_FALSE;
+    }
+    SDL_SemPost(thread_pool.wake);
+    return SDL_TRUE;
+}
+
+#ifdef MYAMP_HAVE_DIRENT
+/* Everything library scans have found, kept in the pref dir so a rescan
+   only has to open the files whose size or mtime changed since. */
+#define LIBRARY_INDEX_VERSION 1
+/* mtime, size, freq, channels, num_frames, then the three string lengths. */
+#define LIBRARY_RECORD_LEN 38
+#define LIBRARY_MAX_PATH 4096
+
+typedef struct LibraryTrack{
+    char *path;
+    Sint64 mtime;
+    Sint64 size;
+    TrackInfo info; // freq 0 if it couldn't be read, so it isn't retried until it changes
+} LibraryTrack;
+
+typedef struct LibraryIndex{
+    LibraryTrack *tracks; // sorted by path, except while a scan is filling it
+    int num_tracks;
+    int capacity;
+} LibraryIndex;
+
+/* UI thread. NULL until the first scan loads it, and while a scan has it. */
+static LibraryIndex *library = NULL;
+/* Where `library` is kept, NULL to start every session from scratch. */
+static char *library_index_path = NULL;
+
+static void LibraryIndex_free(LibraryIndex *index){
+    if(index){
+        for(int i = 0; i < index->num_tracks; ++i){
+            SDL_free(index->tracks[i].path);
+            TrackInfo_free(&index->tracks[i].info);
+        }
+        SDL_free(index->tracks);
+        SDL_free(index);
+    }
+}
+
+static SDL_bool LibraryIndex_append(LibraryIndex *index, const LibraryTrack *track){
+    if(index->num_tracks == index->capacity){
+        const int capacity = index->capacity ? (index->capacity * 2) : 256;
+        LibraryTrack *tracks = (LibraryTrack *) SDL_realloc(index->tracks, capacity * sizeof(LibraryTrack));
+        if(!tracks){
+            return SDL_FALSE;
+        }
+        index->tracks = tracks;
+        index->capacity = capacity;
+    }
+    index->tracks[index->num_tracks++] = *track;
+    return SDL_TRUE;
+}
+
+static int SDLCALL compare_library_tracks(const void *a, const void *b){
+    return SDL_strcmp(((const LibraryTrack *) a)->path, ((const LibraryTrack *) b)->path);
+}
+
+/* -1 if it's not there. */
+static int LibraryIndex_find(const LibraryIndex *index, const char *path){
+    int lo = 0;
+    int hi = index->num_tracks;
+    while(lo < hi){
+        const int mid = lo + ((hi - lo) / 2);
+        const int cmp = SDL_strcmp(index->tracks[mid].path, path);
+        if(cmp == 0){
+            return mid;
+        }
+        if(cmp < 0){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+static Uint64 library_le64(const Uint8 *ptr){
+    return ((Uint64) zip_le32(&ptr[4]) << 32) | zip_le32(ptr);
+}
+
+/* NULL for an empty string. */
+static char *library_string(const Uint8 *ptr, const Uint16 len){
+    char *str = len ? (char *) SDL_malloc(len + 1) : NULL;
+    if(str){
+        SDL_memcpy(str, ptr, len);
+        str[len] = '\0';
+    }
+    return str;
+}
+
+/* Any thread. Empty if there's no index yet, or it's damaged or from another
+   version, NULL only when out of memory. A damaged one keeps whatever it
+   had before the damage, the scan reads the rest again. */
+static LibraryIndex *LibraryIndex_load(void){
+    LibraryIndex *index = (LibraryIndex *) SDL_calloc(1, sizeof(LibraryIndex));
+    size_t len = 0;
+    Uint8 *data = library_index_path ? (Uint8 *) SDL_LoadFile(library_index_path, &len) : NULL;
+
+    if(!index || !data || (len < 16) || (SDL_memcmp(data, "MYAMPLIB", 8) != 0) || (zip_le32(&data[8]) != LIBRARY_INDEX_VERSION)){
+        SDL_free(data);
+        return index;
+    }
+    const Uint32 count = zip_le32(&data[12]);
+    index->tracks = (count <= (len / LIBRARY_RECORD_LEN)) ? (LibraryTrack *) SDL_calloc(count ? count : 1, sizeof(LibraryTrack)) : NULL;
+    index->capacity = index->tracks ? (int) count : 0;
+
+    size_t pos = 16;
+    while((index->num_tracks < index->capacity) && ((len - pos) >= LIBRARY_RECORD_LEN)){
+        const Uint8 *record = &data[pos];
+        const Uint16 path_len = zip_le16(&record[32]);
+        const Uint16 artist_len = zip_le16(&record[34]);
+        const Uint16 title_len = zip_le16(&record[36]);
+        const size_t strings_len = (size_t) path_len + artist_len + title_len;
+        if((path_len == 0) || ((len - pos - LIBRARY_RECORD_LEN) < strings_len)){
+            break;
+        }
+        LibraryTrack *track = &index->tracks[index->num_tracks];
+        track->mtime = (Sint64) library_le64(&record[0]);
+        track->size = (Sint64) library_le64(&record[8]);
+        track->info.freq = (int) zip_le32(&record[16]);
+        track->info.channels = (int) zip_le32(&record[20]);
+        track->info.num_frames = library_le64(&record[24]);
+        track->path = library_string(&record[LIBRARY_RECORD_LEN], path_len);
+        track->info.artist = library_string(&record[LIBRARY_RECORD_LEN + path_len], artist_len);
+        track->info.title = library_string(&record[LIBRARY_RECORD_LEN + path_len + artist_len], title_len);
+        if(!track->path || (artist_len && !track->info.artist) || (title_len && !track->info.title)){
+            SDL_free(track->path);
+            TrackInfo_free(&track->info);
+            break;
+        }
+        index->num_tracks++;
+        pos += LIBRARY_RECORD_LEN + strings_len;
+    }
+    SDL_free(data);
+    return index;
+}
+
+/* Best effort. Written to a temporary file and renamed so a crash can't
+   leave half of one. */
+static void LibraryIndex_save(const LibraryIndex *index){
+    const size_t len = library_index_path ? (SDL_strlen(library_index_path) + 32) : 0;
+    char *tmp_path = len ? (char *) SDL_malloc(len) : NULL;
+    SDL_RWops *rw;
+
+    if(!tmp_path){
+        return;
+    }
+    SDL_snprintf(tmp_path, len, "%s.%lu", library_index_path, SDL_ThreadID());
+    rw = SDL_RWFromFile(tmp_path, "wb");
+    if(!rw){
+        SDL_free(tmp_path);
+        return;
+    }
+    SDL_bool ok = (SDL_RWwrite(rw, "MYAMPLIB", 8, 1) == 1) && SDL_WriteLE32(rw, LIBRARY_INDEX_VERSION) && SDL_WriteLE32(rw, (Uint32) index->num_tracks);
+    for(int i = 0; ok && (i < index->num_tracks); ++i){
+        const LibraryTrack *track = &index->tracks[i];
+        // scans skip longer paths, set_tag longer tags
+        const Uint16 path_len = (Uint16) SDL_strlen(track->path);
+        const Uint16 artist_len = (Uint16) (track->info.artist ? SDL_strlen(track->info.artist) : 0);
+        const Uint16 title_len = (Uint16) (track->info.title ? SDL_strlen(track->info.title) : 0);
+        ok = SDL_WriteLE64(rw, (Uint64) track->mtime) && SDL_WriteLE64(rw, (Uint64) track->size) &&
+             SDL_WriteLE32(rw, (Uint32) track->info.freq) && SDL_WriteLE32(rw, (Uint32) track->info.channels) &&
+             SDL_WriteLE64(rw, track->info.num_frames) && SDL_WriteLE16(rw, path_len) &&
+             SDL_WriteLE16(rw, artist_len) && SDL_WriteLE16(rw, title_len) &&
+             (SDL_RWwrite(rw, track->path, path_len, 1) == 1) &&
+             (!artist_len || (SDL_RWwrite(rw, track->info.artist, artist_len, 1) == 1)) &&
+             (!title_len || (SDL_RWwrite(rw, track->info.title, title_len, 1) == 1));
+    }
+    ok = (SDL_RWclose(rw) == 0) && ok;
+    if(!ok || (rename(tmp_path, library_index_path) != 0)){
+        remove(tmp_path);
+    }
+    SDL_free(tmp_path);
+}
+
+/* Only files with an extension one of the decoders claims are opened, so
+   the cover art, cue sheets and logs in a music folder cost a readdir entry
+   and nothing else. */
+static SDL_bool library_wants_file(const char *name){
+    const char *ext = SDL_strrchr(name, '.');
+    if(!ext || !ext[1]){
+        return SDL_FALSE;
+    }
+    const size_t ext_len = SDL_strlen(++ext);
+    for(size_t i = 0; i < SDL_arraysize(audio_decoders); ++i){
+        const char *ptr = audio_decoders[i].extensions;
+        while(*ptr){
+            size_t len = 0;
+            while(ptr[len] && (ptr[len] != ' ')){
+                len++;
+            }
+            if((len == ext_len) && (SDL_strncasecmp(ptr, ext, len) == 0)){
+                return SDL_TRUE;
+            }
+            ptr += len;
+            while(*ptr == ' '){
+                ptr++;
+            }
+        }
+    }
+    return SDL_FALSE;
+}
+
+/* Walks some folders on the thread pool: a task per folder, which stats
+   what's in it and spawns a task per folder and per new or changed file.
+   Files the index already has as they are aren't opened at all. */
+typedef struct LibraryScan{
+    char **roots;             // no trailing separator, "" for the root
+    int num_roots;
+    SDL_bool play;            // play the first track found once done
+    LibraryIndex *old;        // taken from `library`, or loaded, read only until the walk is done
+    Uint8 *unchanged;         // per old track, set by the worker that found it as it was
+    LibraryIndex found[THREAD_POOL_MAX_WORKERS]; // read this time, each worker appends to its own
+    LibraryIndex *index;      // old and found merged, NULL if that didn't happen
+    SDL_atomic_t outstanding; // tasks queued or running, whoever finishes the last merges
+    SDL_atomic_t files;       // audio files found
+    SDL_atomic_t files_read;  // of those, opened
+    Uint64 start;
+} LibraryScan;
+
+typedef struct LibraryScanTask{
+    LibraryScan *scan;
+    Sint64 mtime;
+    Sint64 size;
+    char *path;               // allocated along with the task
+} LibraryScanTask;
+
+/* Posted by the last task of a scan with the LibraryScan in data1. */
+static Uint32 library_scanned_event = (Uint32) -1;
+/* Scans started and not posted yet, deinit waits for them. */
+static SDL_atomic_t library_scans_in_flight;
+/* Set at exit, scans wind down without reading or merging anything more. */
+static SDL_atomic_t library_scan_cancel;
+/* UI thread. Folders dropped while a scan runs, started once it's done. */
+static LibraryScan *library_next_scan = NULL;
+
+static void LibraryScan_free(LibraryScan *scan){
+    for(int i = 0; i < scan->num_roots; ++i){
+        SDL_free(scan->roots[i]);
+    }
+    SDL_free(scan->roots);
+    LibraryIndex_free(scan->old);
+    SDL_free(scan->unchanged);
+    for(int i = 0; i < THREAD_POOL_MAX_WORKERS; ++i){
+        for(int j = 0; j < scan->found[i].num_tracks; ++j){
+            SDL_free(scan->found[i].tracks[j].path);
+            TrackInfo_free(&scan->found[i].tracks[j].info);
+        }
+        SDL_free(scan->found[i].tracks);
+    }
+    LibraryIndex_free(scan->index);
+    SDL_free(scan);
+}
+
+static SDL_bool LibraryScan_add_root(LibraryScan *scan, const char *path){
+    char **roots = (char **) SDL_realloc(scan->roots, (scan->num_roots + 1) * sizeof(char *));
+    if(!roots){
+        return SDL_FALSE;
+    }
+    scan->roots = roots;
+    char *root = SDL_strdup(path);
+    if(!root){
+        return SDL_FALSE;
+    }
+    size_t len = SDL_strlen(root);
+    while((len > 0) && (root[len - 1] == '/')){
+        root[--len] = '\0';
+    }
+    scan->roots[scan->num_roots++] = root;
+    return SDL_TRUE;
+}
+
+static SDL_bool LibraryScan_covers(const LibraryScan *scan, const char *path){
+    for(int i = 0; i < scan->num_roots; ++i){
+        const size_t len = SDL_strlen(scan->roots[i]);
+        if((SDL_strncmp(path, scan->roots[i], len) == 0) && (path[len] == '/')){
+            return SDL_TRUE;
+        }
+    }
+    return SDL_FALSE;
+}
+
+/* Old tracks the walk found as they were, or that are outside the roots,
+   carry over. The rest are gone or were read again. */
+static void LibraryScan_merge(LibraryScan *scan){
+    LibraryIndex *old = scan->old;
+    SDL_bool changed = SDL_FALSE;
+    int total = old->num_tracks;
+
+    for(int i = 0; i < THREAD_POOL_MAX_WORKERS; ++i){
+        total += scan->found[i].num_tracks;
+    }
+    LibraryIndex *index = (LibraryIndex *) SDL_calloc(1, sizeof(LibraryIndex));
+    LibraryTrack *tracks = (LibraryTrack *) SDL_malloc((total ? total : 1) * sizeof(LibraryTrack));
+    if(!index || !tracks){
+        SDL_free(index);
+        SDL_free(tracks);
+        return;
+    }
+    index->tracks = tracks;
+    index->capacity = total;
+
+    for(int i = 0; i < old->num_tracks; ++i){
+        LibraryTrack *track = &old->tracks[i];
+        if(scan->unchanged[i] || !LibraryScan_covers(scan, track->path)){
+            index->tracks[index->num_tracks++] = *track;
+        }else{
+            SDL_free(track->path);
+            TrackInfo_free(&track->info);
+            changed = SDL_TRUE;
+        }
+    }
+    old->num_tracks = 0;
+    for(int i = 0; i < THREAD_POOL_MAX_WORKERS; ++i){
+        LibraryIndex *found = &scan->found[i];
+        if(found->num_tracks){
+            SDL_memcpy(&index->tracks[index->num_tracks], found->tracks, found->num_tracks * sizeof(LibraryTrack));
+            index->num_tracks += found->num_tracks;
+            found->num_tracks = 0;
+            changed = SDL_TRUE;
+        }
+    }
+    SDL_qsort(index->tracks, index->num_tracks, sizeof(LibraryTrack), compare_library_tracks);
+
+    // overlapping roots walk some folders twice
+    int kept = 0;
+    for(int i = 0; i < index->num_tracks; ++i){
+        LibraryTrack *track = &index->tracks[i];
+        if(kept && (SDL_strcmp(index->tracks[kept - 1].path, track->path) == 0)){
+            SDL_free(track->path);
+            TrackInfo_free(&track->info);
+        }else{
+            index->tracks[kept++] = *track;
+        }
+    }
+    index->num_tracks = kept;
+    if(changed){
+        LibraryIndex_save(index);
+    }
+    scan->index = index;
+}
+
+static void LibraryScan_task_done(LibraryScan *scan){
+    SDL_Event e;
+    if(SDL_AtomicAdd(&scan->outstanding, -1) != 1){
+        return;
+    }
+    if(scan->unchanged && !SDL_AtomicGet(&library_scan_cancel)){
+        LibraryScan_merge(scan);
+    }
+    SDL_zero(e);
+    e.type = library_scanned_event;
+    e.user.data1 = scan;
+    if(SDL_PushEvent(&e) != 1){
+        LibraryScan_free(scan); // the next scan loads the index from disk
+    }
+    SDL_AtomicAdd(&library_scans_in_flight, -1);
+}
+
+static void LibraryScan_spawn(LibraryScan *scan, const int worker, TaskFunc func, const char *path, const Sint64 mtime, const Sint64 size){
+    const size_t len = SDL_strlen(path) + 1;
+    LibraryScanTask *task = (LibraryScanTask *) SDL_malloc(sizeof(LibraryScanTask) + len);
+    if(!task){
+        return;
+    }
+    task->scan = scan;
+    task->mtime = mtime;
+    task->size = size;
+    task->path = (char *) (task + 1);
+    SDL_memcpy(task->path, path, len);
+    SDL_AtomicAdd(&scan->outstanding, 1);
+    if(!ThreadPool_submit(worker, func, task)){
+        SDL_AtomicAdd(&scan->outstanding, -1); // never the last, the caller's task holds one
+        SDL_free(task);
+    }
+}
+
+/* Worker. A new or changed file, headers and tags only. */
+static void library_read_file(int worker, void *data){
+    LibraryScanTask *task = (LibraryScanTask *) data;
+    LibraryScan *scan = task->scan;
+    LibraryTrack track;
+
+    if(!SDL_AtomicGet(&library_scan_cancel)){
+        SDL_zero(track);
+        track.mtime = task->mtime;
+        track.size = task->size;
+        read_track_info(task->path, &track.info); // unreadable ones are kept too, with freq 0
+        SDL_AtomicAdd(&scan->files_read, 1);
+        track.path = SDL_strdup(task->path);
+        if(!track.path || !LibraryIndex_append(&scan->found[worker], &track)){
+            SDL_free(track.path);
+            TrackInfo_free(&track.info);
+        }
+    }
+    SDL_free(task);
+    LibraryScan_task_done(scan);
+}
+
+/* Worker. One folder, not recursing itself, so the pool can spread a deep
+   or wide tree across every worker. */
+static void library_scan_dir(int worker, void *data){
+    LibraryScanTask *task = (LibraryScanTask *) data;
+    LibraryScan *scan = task->scan;
+    DIR *dir = SDL_AtomicGet(&library_scan_cancel) ? NULL : opendir(task->path[0] ? task->path : "/");
+    struct dirent *entry;
+    char path[LIBRARY_MAX_PATH];
+    struct stat st;
+
+    while(dir && ((entry = readdir(dir)) != NULL)){
+        const char *name = entry->d_name;
+        if(name[0] == '.'){
+            continue; // ".", ".." and hidden files
+        }
+        const SDL_bool wanted = library_wants_file(name);
+#if defined(DT_DIR) && defined(DT_UNKNOWN)
+        if(!wanted && (entry->d_type != DT_DIR) && (entry->d_type != DT_UNKNOWN)){
+            continue; // no stat for a file we'd never open
+        }
+#endif
+        if(((size_t) SDL_snprintf(path, sizeof(path), "%s/%s", task->path, name) >= sizeof(path)) ||
+           (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)){
+            continue;
+        }
+        if(S_ISLNK(st.st_mode)){
+            // symlinked files are fine, symlinked folders can loop
+            if(!wanted || (fstatat(dirfd(dir), name, &st, 0) != 0) || !S_ISREG(st.st_mode)){
+                continue;
+            }
+        }
+        if(S_ISDIR(st.st_mode)){
+            LibraryScan_spawn(scan, worker, library_scan_dir, path, 0, 0);
+        }else if(S_ISREG(st.st_mode) && wanted){
+            const int old_index = LibraryIndex_find(scan->old, path);
+            SDL_AtomicAdd(&scan->files, 1);
+            if((old_index >= 0) && (scan->old->tracks[old_index].mtime == (Sint64) st.st_mtime) &&
+               (scan->old->tracks[old_index].size == (Sint64) st.st_size)){
+                scan->unchanged[old_index] = 1;
+            }else{
+                LibraryScan_spawn(scan, worker, library_read_file, path, (Sint64) st.st_mtime, (Sint64) st.st_size);
+            }
+        }
+    }
+    if(dir){
+        closedir(dir);
+    }
+    SDL_free(task);
+    LibraryScan_task_done(scan);
+}
+
+/* Worker. The first scan of a session loads the index here rather than on
+   the UI thread. */
+static void library_scan_begin(int worker, void *data){
+    LibraryScan *scan = (LibraryScan *) data;
+    if(!scan->old){
+        scan->old = LibraryIndex_load();
+    }
+    if(scan->old){
+        scan->unchanged = (Uint8 *) SDL_calloc(scan->old->num_tracks ? scan->old->num_tracks : 1, 1);
+    }
+    for(int i = 0; scan->unchanged && (i < scan->num_roots); ++i){
+        LibraryScan_spawn(scan, worker, library_scan_dir, scan->roots[i], 0, 0);
+    }
+    LibraryScan_task_done(scan);
+}
+
+/* UI thread. Hands `library` to library_next_scan and starts it. */
+static SDL_bool library_start_next_scan(void){
+    LibraryScan *scan = library_next_scan;
+    library_next_scan = NULL;
+    if(!ThreadPool_start()){
+        LibraryScan_free(scan);
+        return SDL_FALSE;
+    }
+    scan->old = library;
+    library = NULL;
+    scan->start = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&scan->outstanding, 1);
+    SDL_AtomicAdd(&library_scans_in_flight, 1);
+    if(!ThreadPool_submit(-1, library_scan_begin, scan)){
+        SDL_AtomicAdd(&library_scans_in_flight, -1);
+        library = scan->old;
+        scan->old = NULL;
+        LibraryScan_free(scan);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+/* UI thread. Appends what's under `path` to the playlist once it's been
+   scanned. One scan runs at a time, folders dropped meanwhile share the
+   next one. */
+static SDL_bool library_add_folder(const char *path, const SDL_bool play){
+    if(!library_next_scan){
+        library_next_scan = (LibraryScan *) SDL_calloc(1, sizeof(LibraryScan));
+        if(!library_next_scan){
+            SDL_OutOfMemory();
+            return SDL_FALSE;
+        }
+    }
+    if(!LibraryScan_add_root(library_next_scan, path)){
+        SDL_OutOfMemory();
+        return SDL_FALSE;
+    }
+    library_next_scan->play |= play;
+    return (SDL_AtomicGet(&library_scans_in_flight) > 0) ? SDL_TRUE : library_start_next_scan();
+}
+
+/* UI thread, with the LibraryScan from library_scanned_event. */
+static void library_scan_done(WinAmpSkin *skin, LibraryScan *scan){
+    const int first = playlist.num_entries;
+    const double ms = ((SDL_GetPerformanceCounter() - scan->start) * 1000.0) / (double) SDL_GetPerformanceFrequency();
+
+    // a scan that couldn't merge leaves the library as it was. One started
+    // while this event waited loaded the index this one saved, and wins.
+    LibraryIndex_free(library);
+    library = scan->index ? scan->index : scan->old;
+    if(scan->index){
+        scan->index = NULL;
+    }else{
+        scan->old = NULL;
+    }
+    for(int i = 0; library && (i < library->num_tracks); ++i){
+        const LibraryTrack *track = &library->tracks[i];
+        if((track->info.freq > 0) && LibraryScan_covers(scan, track->path)){
+            Playlist_append(&playlist, track->path);
+        }
+    }
+    SDL_Log("Library scan: %d audio files, %d read, %d unchanged, %.1fms", SDL_AtomicGet(&scan->files), SDL_AtomicGet(&scan->files_read),
+            SDL_AtomicGet(&scan->files) - SDL_AtomicGet(&scan->files_read), ms);
+    if(scan->play && (playlist.num_entries > first)){
+        play_track(skin, first);
+    }
+    mark_dirty(skin, &playlist_rect);
+    LibraryScan_free(scan);
+
+    if(library_next_scan && !library_start_next_scan()){
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not scan folder!", SDL_GetError(), window);
+    }
+}
+
+static SDL_bool is_directory(const char *path){
+    struct stat st;
+    return ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) ? SDL_TRUE : SDL_FALSE;
+}
+#endif
+
+/* Loudness normalization: each track's EBU R128 integrated loudness and
+   true peak, measured on the thread pool as the playlist fills up and
+   kept in the pref dir, turned into a gain each source is scaled by as
+   it's read. Off unless myamp.ini or --normalize ask for it. */
+#define LOUDNESS_ABSOLUTE_GATE_LUFS -70.0
+#define LOUDNESS_RELATIVE_GATE_LU 10.0
+#define LOUDNESS_NONE -200.0f // silent, too short to gate, or unreadable
+#define LOUDNESS_CHUNK_FRAMES 4096
+#define NORMALIZE_DEFAULT_LUFS -18.0f // ReplayGain 2's reference level
+#define NORMALIZE_MIN_LUFS -40.0f
+#define NORMALIZE_MAX_LUFS -5.0f
+#define NORMALIZE_MAX_BOOST_DB 12.0f
+
+typedef struct Loudness{
+    float lufs;  // integrated, LOUDNESS_NONE if there's nothing to go by
+    float peak;  // true peak, linear
+} Loudness;
+
+/* From myamp.ini or --normalize. */
+static SDL_bool normalize_enabled = SDL_FALSE;
+static float normalize_target_lufs = NORMALIZE_DEFAULT_LUFS;
+
+/* BS.1770-4's filters, worked out for `freq` rather than only the 48kHz
+   coefficients the spec lists, the way libebur128 does it. */
+static void KWeightCoeffs_compute(KWeightCoeffs *c, const int freq){
+    // the head: a high shelf, about +4dB from 1.5kHz up
+    const double shelf_q = 0.7071752369554196;
+    const double vh = SDL_pow(10.0, 3.999843853973347 / 20.0);
+    const double vb = SDL_pow(vh, 0.4996667741545416);
+    double k = SDL_tan((M_PI * 1681.974450955533) / freq);
+    double a0 = 1.0 + (k / shelf_q) + (k * k);
+    c->b[0][0] = (vh + ((vb * k) / shelf_q) + (k * k)) / a0;
+    c->b[0][1] = (2.0 * ((k * k) - vh)) / a0;
+    c->b[0][2] = (vh - ((vb * k) / shelf_q) + (k * k)) / a0;
+    c->a[0][0] = (2.0 * ((k * k) - 1.0)) / a0;
+    c->a[0][1] = (1.0 - (k / shelf_q) + (k * k)) / a0;
+
+    // RLB: a high pass at 38Hz
+    const double pass_q = 0.5003270373238773;
+    k = SDL_tan((M_PI * 38.13547087602444) / freq);
+    a0 = 1.0 + (k / pass_q) + (k * k);
+    c->b[1][0] = 1.0;
+    c->b[1][1] = -2.0;
+    c->b[1][2] = 1.0;
+    c->a[1][0] = (2.0 * ((k * k) - 1.0)) / a0;
+    c->a[1][1] = (1.0 - (k / pass_q) + (k * k)) / a0;
+}
+
+/* Mean square a block needs to be as loud as `lufs`. */
+static double loudness_energy(const double lufs){
+    return SDL_pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+/* Takes stereo at the device rate in chunks of any size. Keeps the mean
+   square of every 100ms, the gating blocks are four of those in a row.
+   Mono tracks are measured as the two channels they're played on. */
+typedef struct LoudnessMeter{
+    KWeightCoeffs coeffs;
+    KWeightState state;
+    Uint32 block_len;      // frames in 100ms
+    Uint32 block_filled;   // frames in the one being summed
+    double block_energy;   // its sum of squares so far
+    double *blocks;        // mean square of each finished one
+    int num_blocks;
+    int capacity;
+    // true peak: 4x oversampled at 44.1 or 48kHz, 2x up to 96kHz, and as is past that
+    Resampler oversampler;
+    SDL_bool oversampling;
+    float *oversampled;
+    Uint32 oversampled_len;
+    float peak;
+} LoudnessMeter;
+
+static void LoudnessMeter_free(LoudnessMeter *m){
+    Resampler_free(&m->oversampler);
+    SDL_free(m->oversampled);
+    SDL_free(m->blocks);
+    SDL_zerop(m);
+}
+
+static SDL_bool LoudnessMeter_init(LoudnessMeter *m, const int freq){
+    const int factor = (freq <= 48000) ? 4 : ((freq <= 96000) ? 2 : 1);
+
+    SDL_zerop(m);
+    KWeightCoeffs_compute(&m->coeffs, freq);
+    m->block_len = (Uint32) ((freq + 5) / 10);
+    m->oversampling = (factor > 1) ? SDL_TRUE : SDL_FALSE;
+    if(m->oversampling){
+        m->oversampled_len = LOUDNESS_CHUNK_FRAMES * factor;
+        m->oversampled = (float *) SDL_malloc(m->oversampled_len * AUDIO_OUT_FRAME_SIZE);
+        if(!m->oversampled || !Resampler_init(&m->oversampler, &resampler_presets[1], freq, freq * factor)){
+            LoudnessMeter_free(m);
+            return SDL_FALSE;
+        }
+    }
+    return SDL_TRUE;
+}
+
+static void LoudnessMeter_peak(LoudnessMeter *m, const float *frames, const Uint32 num_frames){
+    float peaks[2];
+    dsp_kernel->peak(frames, num_frames, peaks);
+    m->peak = SDL_max(m->peak, SDL_max(peaks[0], peaks[1]));
+}
+
+static void LoudnessMeter_drain(LoudnessMeter *m){
+    Uint32 got;
+    while((got = Resampler_read(&m->oversampler, m->oversampled, m->oversampled_len)) > 0){
+        LoudnessMeter_peak(m, m->oversampled, got);
+    }
+}
+
+static SDL_bool LoudnessMeter_feed(LoudnessMeter *m, const float *frames, const Uint32 num_frames){
+    if(m->oversampling){
+        for(Uint32 fed = 0; fed < num_frames;){
+            Uint32 room;
+            float *input = Resampler_input(&m->oversampler, &room);
+            const Uint32 count = SDL_min(room, num_frames - fed);
+            SDL_memcpy(input, &frames[fed * AUDIO_OUT_CHANNELS], count * AUDIO_OUT_FRAME_SIZE);
+            Resampler_commit(&m->oversampler, count);
+            LoudnessMeter_drain(m);
+            fed += count;
+        }
+    }else{
+        LoudnessMeter_peak(m, frames, num_frames);
+    }
+
+    for(Uint32 done = 0; done < num_frames;){
+        const Uint32 count = SDL_min(num_frames - done, m->block_len - m->block_filled);
+        m->block_energy += dsp_kernel->kweight(&m->coeffs, &m->state, &frames[done * AUDIO_OUT_CHANNELS], count);
+        m->block_filled += count;
+        done += count;
+        if(m->block_filled < m->block_len){
+            break;
+        }
+        if(m->num_blocks == m->capacity){
+            const int capacity = m->capacity ? (m->capacity * 2) : 4096;
+            double *blocks = (double *) SDL_realloc(m->blocks, capacity * sizeof(double));
+            if(!blocks){
+                SDL_OutOfMemory();
+                return SDL_FALSE;
+            }
+            m->blocks = blocks;
+            m->capacity = capacity;
+        }
+        m->blocks[m->num_blocks++] = m->block_energy / m->block_len;
+        m->block_energy = 0.0;
+        m->block_filled = 0;
+    }
+    return SDL_TRUE;
+}
+
+/* Gated the way R128 says: 400ms blocks overlapping by 300ms, dropping
+   the ones under -70 LUFS, then the ones 10 LU under what's left. A part
+   of a block at the end doesn't count. */
+static void LoudnessMeter_finish(LoudnessMeter *m, Loudness *out){
+    const double absolute_gate = loudness_energy(LOUDNESS_ABSOLUTE_GATE_LUFS);
+    double sum = 0.0;
+    int count = 0;
+
+    if(m->oversampling){
+        Resampler_flush(&m->oversampler);
+        LoudnessMeter_drain(m);
+    }
+    out->peak = m->peak;
+    out->lufs = LOUDNESS_NONE;
+
+    for(int i = 3; i < m->num_blocks; ++i){
+        const double z = (m->blocks[i-3] + m->blocks[i-2] + m->blocks[i-1] + m->blocks[i]) / 4.0;
+        if(z > absolute_gate){
+            sum += z;
+            count++;
+        }
+    }
+    if(!count){
+        return;
+    }
+    const double relative_gate = (sum / count) * SDL_pow(10.0, -LOUDNESS_RELATIVE_GATE_LU / 10.0);
+    sum = 0.0;
+    count = 0;
+    for(int i = 3; i < m->num_blocks; ++i){
+        const double z = (m->blocks[i-3] + m->blocks[i-2] + m->blocks[i-1] + m->blocks[i]) / 4.0;
+        if((z > absolute_gate) && (z > relative_gate)){
+            sum += z;
+            count++;
+        }
+    }
+    // the loudest block always clears the relative gate
+    out->lufs = (float) (-0.691 + (10.0 * SDL_log10(sum / count)));
+}
+
+/* Worker. Decodes `path` at the device rate through the same converter
+   playback uses, so it measures what will be heard. FALSE if it couldn't
+   be read, or `cancel` got set partway. */
+static SDL_bool analyze_loudness(const char *path, Loudness *out, SDL_atomic_t *cancel){
+    AudioSource *src = (AudioSource *) SDL_calloc(1, sizeof(AudioSource));
+    float *frames = (float *) SDL_malloc(LOUDNESS_CHUNK_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    AudioConverter conv;
+    LoudnessMeter meter;
+    SDL_bool decoding;
+    SDL_bool ok = SDL_FALSE;
+    int got;
+
+    SDL_zero(conv);
+    SDL_zero(meter);
+    if(src){
+        SDL_AtomicSet(&src->refcount, 1);
+        src->fname = SDL_strdup(path);
+    }
+    if(!src || !src->fname || !frames){
+        SDL_OutOfMemory();
+        goto done;
+    }
+    if(!AudioSource_open_file(src)){
+        goto done;
+    }
+    decoding = src->map ? SDL_FALSE : SDL_TRUE;
+    if((decoding && !AudioConverter_init(&conv, src)) || !LoudnessMeter_init(&meter, audio_out_freq)){
+        SDL_OutOfMemory();
+        goto done;
+    }
+    while((got = AudioSource_pull(src, &conv, &decoding, frames, LOUDNESS_CHUNK_FRAMES)) > 0){
+        if(SDL_AtomicGet(cancel) || !LoudnessMeter_feed(&meter, frames, (Uint32) got)){
+            goto done;
+        }
+    }
+    if(got == 0){
+        LoudnessMeter_finish(&meter, out);
+        ok = SDL_TRUE;
+    }
+
+done:
+    LoudnessMeter_free(&meter);
+    AudioConverter_free(&conv);
+    SDL_free(frames);
+    if(src){
+        AudioSource_release(src);
+    }
+    return ok;
+}
+
+/* What brings `loudness` to the target, in hundredths of a dB, short of
+   pushing its true peak past full scale. */
+static int loudness_gain_mb(const Loudness *loudness){
+    if(!normalize_enabled || (loudness->lufs <= LOUDNESS_ABSOLUTE_GATE_LUFS)){
+        return 0;
+    }
+    float db = SDL_min(normalize_target_lufs - loudness->lufs, NORMALIZE_MAX_BOOST_DB);
+    if(loudness->peak > 0.0f){
+        db = SDL_min(db, -20.0f * SDL_log10f(loudness->peak));
+    }
+    return (int) SDL_floorf((db * 100.0f) + 0.5f);
+}
+
+#ifdef MYAMP_HAVE_DIRENT
+/* Every track measured so far, keyed like the library: a file whose size
+   or mtime changed is measured again. */
+#define LOUDNESS_CACHE_VERSION 1
+/* mtime, size, lufs, peak, then the path's length. */
+#define LOUDNESS_RECORD_LEN 26
+/* Results between saves while a big playlist is being worked through. */
+#define LOUDNESS_SAVE_EVERY 64
+/* Playlist entries stat'ed per loop, so a long one doesn't hold up a frame. */
+#define LOUDNESS_STATS_PER_UPDATE 64
+
+typedef struct LoudnessEntry{
+    char *path;
+    Sint64 mtime;
+    Sint64 size;
+    Loudness loudness;
+} LoudnessEntry;
+
+typedef struct LoudnessCache{
+    LoudnessEntry *entries; // sorted by path
+    int num_entries;
+    int capacity;
+} LoudnessCache;
+
+typedef struct LoudnessJob{
+    char *path;
+    Sint64 mtime;
+    Sint64 size;
+    Loudness loudness;
+    Uint64 ticks;
+    SDL_sem *done;            // posted instead of loudness_analyzed_event if set
+    struct LoudnessJob *next; // UI thread, in loudness_jobs
+} LoudnessJob;
+
+/* UI thread. NULL until normalization first needs it. */
+static LoudnessCache *loudness_cache = NULL;
+/* Where `loudness_cache` is kept, NULL to measure everything every session. */
+static char *loudness_cache_path = NULL;
+/* UI thread. Results not saved yet. */
+static int loudness_unsaved = 0;
+/* UI thread. Submitted and not handled yet, so nothing is measured twice at once. */
+static LoudnessJob *loudness_jobs = NULL;
+/* Posted by a finished job with the LoudnessJob in data1. */
+static Uint32 loudness_analyzed_event = (Uint32) -1;
+/* Jobs running or queued, deinit waits for them. */
+static SDL_atomic_t loudness_jobs_in_flight;
+/* Set at exit, jobs stop decoding. */
+static SDL_atomic_t loudness_cancel;
+
+static void LoudnessCache_free(LoudnessCache *cache){
+    if(cache){
+        for(int i = 0; i < cache->num_entries; ++i){
+            SDL_free(cache->entries[i].path);
+        }
+        SDL_free(cache->entries);
+        SDL_free(cache);
+    }
+}
+
+/* Where `path` is, or where it would go as ~index. */
+static int LoudnessCache_find(const LoudnessCache *cache, const char *path){
+    int lo = 0;
+    int hi = cache->num_entries;
+    while(lo < hi){
+        const int mid = lo + ((hi - lo) / 2);
+        const int cmp = SDL_strcmp(cache->entries[mid].path, path);
+        if(cmp == 0){
+            return mid;
+        }
+        if(cmp < 0){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return ~lo;
+}
+
+/* Takes `entry->path`, unless it returns FALSE. */
+static SDL_bool LoudnessCache_insert(LoudnessCache *cache, const LoudnessEntry *entry){
+    int index = LoudnessCache_find(cache, entry->path);
+    if(index >= 0){
+        SDL_free(cache->entries[index].path);
+        cache->entries[index] = *entry;
+        return SDL_TRUE;
+    }
+    index = ~index;
+    if(cache->num_entries == cache->capacity){
+        const int capacity = cache->capacity ? (cache->capacity * 2) : 256;
+        LoudnessEntry *entries = (LoudnessEntry *) SDL_realloc(cache->entries, capacity * sizeof(LoudnessEntry));
+        if(!entries){
+            return SDL_FALSE;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    SDL_memmove(&cache->entries[index + 1], &cache->entries[index], (cache->num_entries - index) * sizeof(LoudnessEntry));
+    cache->entries[index] = *entry;
+    cache->num_entries++;
+    return SDL_TRUE;
+}
+
+static float loudness_le_float(const Uint8 *ptr){
+    const Uint32 bits = zip_le32(ptr);
+    float value;
+    SDL_memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static SDL_bool loudness_write_float(SDL_RWops *rw, const float value){
+    Uint32 bits;
+    SDL_memcpy(&bits, &value, sizeof(bits));
+    return SDL_WriteLE32(rw, bits) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Same rules as LibraryIndex_load: empty if missing, damaged or from
+   another version, NULL only when out of memory. */
+static LoudnessCache *LoudnessCache_load(void){
+    LoudnessCache *cache = (LoudnessCache *) SDL_calloc(1, sizeof(LoudnessCache));
+    size_t len = 0;
+    Uint8 *data = loudness_cache_path ? (Uint8 *) SDL_LoadFile(loudness_cache_path, &len) : NULL;
+
+    if(!cache || !data || (len < 16) || (SDL_memcmp(data, "MYAMPLUD", 8) != 0) || (zip_le32(&data[8]) != LOUDNESS_CACHE_VERSION)){
+        SDL_free(data);
+        return cache;
+    }
+    const Uint32 count = zip_le32(&data[12]);
+    cache->entries = (count <= (len / LOUDNESS_RECORD_LEN)) ? (LoudnessEntry *) SDL_calloc(count ? count : 1, sizeof(LoudnessEntry)) : NULL;
+    cache->capacity = cache->entries ? (int) count : 0;
+
+    size_t pos = 16;
+    while((cache->num_entries < cache->capacity) && ((len - pos) >= LOUDNESS_RECORD_LEN)){
+        const Uint8 *record = &data[pos];
+        const Uint16 path_len = zip_le16(&record[24]);
+        if((path_len == 0) || ((len - pos - LOUDNESS_RECORD_LEN) < path_len)){
+            break;
+        }
+        LoudnessEntry *entry = &cache->entries[cache->num_entries];
+        entry->mtime = (Sint64) library_le64(&record[0]);
+        entry->size = (Sint64) library_le64(&record[8]);
+        entry->loudness.lufs = loudness_le_float(&record[16]);
+        entry->loudness.peak = loudness_le_float(&record[20]);
+        entry->path = library_string(&record[LOUDNESS_RECORD_LEN], path_len);
+        if(!entry->path){
+            break;
+        }
+        cache->num_entries++;
+        pos += LOUDNESS_RECORD_LEN + path_len;
+    }
+    SDL_free(data);
+    return cache;
+}
+
+/* Best effort, through a temporary file like LibraryIndex_save. */
+static void LoudnessCache_save(const LoudnessCache *cache){
+    const size_t len = loudness_cache_path ? (SDL_strlen(loudness_cache_path) + 32) : 0;
+    char *tmp_path = len ? (char *) SDL_malloc(len) : NULL;
+    SDL_RWops *rw;
+
+    if(!tmp_path){
+        return;
+    }
+    SDL_snprintf(tmp_path, len, "%s.%lu", loudness_cache_path, SDL_ThreadID());
+    rw = SDL_RWFromFile(tmp_path, "wb");
+    if(!rw){
+        SDL_free(tmp_path);
+        return;
+    }
+    SDL_bool ok = (SDL_RWwrite(rw, "MYAMPLUD", 8, 1) == 1) && SDL_WriteLE32(rw, LOUDNESS_CACHE_VERSION) && SDL_WriteLE32(rw, (Uint32) cache->num_entries);
+    for(int i = 0; ok && (i < cache->num_entries); ++i){
+        const LoudnessEntry *entry = &cache->entries[i];
+        const Uint16 path_len = (Uint16) SDL_strlen(entry->path); // update_loudness skips longer paths
+        ok = SDL_WriteLE64(rw, (Uint64) entry->mtime) && SDL_WriteLE64(rw, (Uint64) entry->size) &&
+             loudness_write_float(rw, entry->loudness.lufs) && loudness_write_float(rw, entry->loudness.peak) &&
+             SDL_WriteLE16(rw, path_len) && (SDL_RWwrite(rw, entry->path, path_len, 1) == 1);
+    }
+    ok = (SDL_RWclose(rw) == 0) && ok;
+    if(!ok || (rename(tmp_path, loudness_cache_path) != 0)){
+        remove(tmp_path);
+    }
+    SDL_free(tmp_path);
+}
+
+/* Worker. */
+static void loudness_analyze_file(int worker, void *data){
+    LoudnessJob *job = (LoudnessJob *) data;
+    const Uint64 start = SDL_GetPerformanceCounter();
+    SDL_Event e;
+
+    if(!analyze_loudness(job->path, &job->loudness, &loudness_cancel)){
+        // kept, so it isn't tried again until the file changes
+        job->loudness.lufs = LOUDNESS_NONE;
+        job->loudness.peak = 0.0f;
+    }
+    job->ticks = SDL_GetPerformanceCounter() - start;
+    if(job->done){
+        SDL_SemPost(job->done);
+        return;
+    }
+    SDL_zero(e);
+    e.type = loudness_analyzed_event;
+    e.user.data1 = job;
+    SDL_PushEvent(&e); // if that fails the job stays in loudness_jobs until deinit, its file isn't measured this session
+    SDL_AtomicAdd(&loudness_jobs_in_flight, -1);
+}
+
+/* Jobs at once, a core short of the pool so the decoder thread and the UI
+   always have one to themselves. */
+static int loudness_max_jobs(void){
+    return SDL_max(1, thread_pool.num_workers - 1);
+}
+
+/* UI thread. 1 with `loudness` from the cache, 0 if `path` needs measuring
+   as `mtime` and `size`, -1 if it can't be stat'ed. */
+static int loudness_lookup(const char *path, Loudness *loudness, Sint64 *mtime, Sint64 *size){
+    struct stat st;
+    if((SDL_strlen(path) >= LIBRARY_MAX_PATH) || (stat(path, &st) != 0) || !S_ISREG(st.st_mode)){
+        return -1;
+    }
+    *mtime = (Sint64) st.st_mtime;
+    *size = (Sint64) st.st_size;
+    const int index = LoudnessCache_find(loudness_cache, path);
+    if((index >= 0) && (loudness_cache->entries[index].mtime == *mtime) && (loudness_cache->entries[index].size == *size)){
+        *loudness = loudness_cache->entries[index].loudness;
+        return 1;
+    }
+    return 0;
+}
+
+/* UI thread. TRUE once `path` is being measured, whether by this call or
+   an earlier one. */
+static SDL_bool loudness_submit(const char *path, const Sint64 mtime, const Sint64 size){
+    for(const LoudnessJob *job = loudness_jobs; job; job = job->next){
+        if(SDL_strcmp(job->path, path) == 0){
+            return SDL_TRUE;
+        }
+    }
+    if(SDL_AtomicGet(&loudness_jobs_in_flight) >= loudness_max_jobs()){
+        return SDL_FALSE;
+    }
+    LoudnessJob *job = (LoudnessJob *) SDL_calloc(1, sizeof(LoudnessJob));
+    if(!job || !(job->path = SDL_strdup(path))){
+        SDL_free(job);
+        return SDL_FALSE;
+    }
+    job->mtime = mtime;
+    job->size = size;
+    SDL_AtomicAdd(&loudness_jobs_in_flight, 1);
+    if(!ThreadPool_submit(-1, loudness_analyze_file, job)){
+        SDL_AtomicAdd(&loudness_jobs_in_flight, -1);
+        SDL_free(job->path);
+        SDL_free(job);
+        return SDL_FALSE;
+    }
+    job->next = loudness_jobs;
+    loudness_jobs = job;
+    return SDL_TRUE;
+}
+
+/* UI thread, once a loop. Sources that are playing or queued get their
+   gain first, measured right away if they're not in the cache. Then the
+   playlist is worked through a few entries at a time, so tracks are ready
+   before they come up. */
+static void update_loudness(void){
+    Loudness loudness;
+    Sint64 mtime, size;
+
+    if(!normalize_enabled){
+        return;
+    }
+    if(loudness_unsaved && (SDL_AtomicGet(&loudness_jobs_in_flight) == 0)){
+        LoudnessCache_save(loudness_cache);
+        loudness_unsaved = 0;
+    }
+    if(!loudness_cache){
+        loudness_cache = LoudnessCache_load();
+        if(!loudness_cache || !ThreadPool_start()){
+            SDL_Log("Loudness normalization off: %s", SDL_GetError());
+            normalize_enabled = SDL_FALSE;
+            return;
+        }
+    }
+    for(AudioSource *src = audio_sources; src; src = (AudioSource *) SDL_AtomicGetPtr((void **) &src->next)){
+        if(src->loudness_checked){
+            continue;
+        }
+        const int found = loudness_lookup(src->fname, &loudness, &mtime, &size);
+        if(found > 0){
+            SDL_AtomicSet(&src->gain_mb, loudness_gain_mb(&loudness));
+        }
+        // a result applies itself to every source playing its file
+        src->loudness_checked = (found > 0) || (found < 0) || loudness_submit(src->fname, mtime, size);
+    }
+    for(int i = 0; (i < LOUDNESS_STATS_PER_UPDATE) && (playlist.loudness_next < playlist.num_entries); ++i){
+        const char *path = playlist.entries[playlist.loudness_next];
+        if((loudness_lookup(path, &loudness, &mtime, &size) == 0) && !loudness_submit(path, mtime, size)){
+            break; // no slot, the next result frees one
+        }
+        playlist.loudness_next++;
+    }
+}
+
+/* How soon update_loudness has more of the playlist to get through. */
+static Uint32 loudness_wait_ms(void){
+    if(normalize_enabled && (playlist.loudness_next < playlist.num_entries) &&
+       (!loudness_cache || (SDL_AtomicGet(&loudness_jobs_in_flight) < loudness_max_jobs()))){
+        return 0;
+    }
+    return IDLE_WAIT_MS;
+}
+
+/* UI thread, with the LoudnessJob from loudness_analyzed_event. */
+static void loudness_analyzed(LoudnessJob *job){
+    LoudnessEntry entry;
+
+    for(LoudnessJob **link = &loudness_jobs; *link; link = &(*link)->next){
+        if(*link == job){
+            *link = job->next;
+            break;
+        }
+    }
+    for(AudioSource *src = audio_sources; src; src = (AudioSource *) SDL_AtomicGetPtr((void **) &src->next)){
+        if(SDL_strcmp(src->fname, job->path) == 0){
+            SDL_AtomicSet(&src->gain_mb, loudness_gain_mb(&job->loudness));
+            src->loudness_checked = SDL_TRUE;
+        }
+    }
+    entry.path = job->path;
+    entry.mtime = job->mtime;
+    entry.size = job->size;
+    entry.loudness = job->loudness;
+    if(LoudnessCache_insert(loudness_cache, &entry)){
+        job->path = NULL;
+        loudness_unsaved++;
+    }
+    if(loudness_unsaved >= LOUDNESS_SAVE_EVERY){
+        LoudnessCache_save(loudness_cache);
+        loudness_unsaved = 0;
+    }
+    SDL_free(job->path);
+    SDL_free(job);
+}
+#endif
+
+/* Frames per device callback unless myamp.ini or the command line say otherwise. */
+#define AUDIO_DEVICE_SAMPLES 4096
+/* What a buffer size may be set to. SDL wants powers of two. */
+#define AUDIO_MIN_DEVICE_SAMPLES 64
+#define AUDIO_MAX_DEVICE_SAMPLES 16384
+#define AUDIO_MIN_FREQ 8000
+#define AUDIO_MAX_FREQ 384000
+
+/* Adaptive buffer: halved after AUDIO_ADAPT_STABLE_MS of playback without a
+   late callback or a blown deadline, doubled as soon as there is one. */
+#define AUDIO_ADAPT_STABLE_MS 3000
+#define AUDIO_ADAPT_MIN_SAMPLES 128
+
+/* Requested device settings, from myamp.ini and then the command line. A rate
+   of 0 is the device's native rate, a buffer of 0 is adaptive. */
+static int audio_config_freq = 0;
+static int audio_config_samples = AUDIO_DEVICE_SAMPLES;
+
+/* Buffer size the device was actually opened with. */
+static int audio_device_samples = 0;
+
+/* Adaptive mode never shrinks below `floor`, the smallest buffer seen to
+   glitch doubled. `glitches` is late_callbacks + deadline_misses at the last
+   check, `since` when the current buffer started proving itself. */
+static int audio_adapt_floor = AUDIO_ADAPT_MIN_SAMPLES;
+static Uint64 audio_adapt_glitches = 0;
+static Uint64 audio_adapt_since = 0;
+
+static SDL_bool parse_audio_freq(const char *text, int *freq){
+    char *end;
+    long value;
+
+    if(SDL_strcasecmp(text, "native") == 0){
+        *freq = 0;
+        return SDL_TRUE;
+    }
+    value = SDL_strtol(text, &end, 10);
+    if((end == text) || *end || (value < AUDIO_MIN_FREQ) || (value > AUDIO_MAX_FREQ)){
+        SDL_SetError("Bad rate '%s', want native or %d-%d", text, AUDIO_MIN_FREQ, AUDIO_MAX_FREQ);
+        return SDL_FALSE;
+    }
+    *freq = (int) value;
+    return SDL_TRUE;
+}
+
+/* Sizes that aren't a power of two are rounded up to one. */
+static SDL_bool parse_audio_buffer(const char *text, int *samples){
+    char *end;
+    long value;
+
+    if(SDL_strcasecmp(text, "auto") == 0){
+        *samples = 0;
+        return SDL_TRUE;
+    }
+    value = SDL_strtol(text, &end, 10);
+    if((end == text) || *end || (value < AUDIO_MIN_DEVICE_SAMPLES) || (value > AUDIO_MAX_DEVICE_SAMPLES)){
+        SDL_SetError("Bad buffer '%s', want auto or %d-%d frames", text, AUDIO_MIN_DEVICE_SAMPLES, AUDIO_MAX_DEVICE_SAMPLES);
+        return SDL_FALSE;
+    }
+    *samples = 1 << (SDL_MostSignificantBitIndex32((Uint32) value - 1) + 1);
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_crossfade(const char *text, int *ms){
+    char *end;
+    const long value = SDL_strtol(text, &end, 10);
+    if((end == text) || *end || (value < 0) || (value > MAX_CROSSFADE_MS)){
+        SDL_SetError("Bad crossfade '%s', want 0-%d ms", text, MAX_CROSSFADE_MS);
+        return SDL_FALSE;
+    }
+    *ms = (int) value;
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_resampler(const char *text, const ResamplerPreset **preset){
+    for(size_t i = 0; i < SDL_arraysize(resampler_presets); ++i){
+        if(SDL_strcasecmp(text, resampler_presets[i].name) == 0){
+            *preset = &resampler_presets[i];
+            return SDL_TRUE;
+        }
+    }
+    SDL_SetError("Bad resampler '%s', want fast, medium or high", text);
+    return SDL_FALSE;
+}
+
+/* "off", "on" for the default target, or the target itself in LUFS. */
+static SDL_bool parse_normalize(const char *text){
+    char *end;
+    double value;
+
+    if(SDL_strcasecmp(text, "off") == 0){
+        normalize_enabled = SDL_FALSE;
+        return SDL_TRUE;
+    }else if(SDL_strcasecmp(text, "on") == 0){
+        normalize_enabled = SDL_TRUE;
+        normalize_target_lufs = NORMALIZE_DEFAULT_LUFS;
+        return SDL_TRUE;
+    }
+    value = SDL_strtod(text, &end);
+    if((end == text) || *end || (value < NORMALIZE_MIN_LUFS) || (value > NORMALIZE_MAX_LUFS)){
+        SDL_SetError("Bad normalize '%s', want off, on or %.0f to %.0f LUFS", text, NORMALIZE_MIN_LUFS, NORMALIZE_MAX_LUFS);
+        return SDL_FALSE;
+    }
+    normalize_enabled = SDL_TRUE;
+    normalize_target_lufs = (float) value;
+    return SDL_TRUE;
+}
+
+/* "double", or how many window pixels a skin pixel takes, 1 to SKIN_MAX_SCALE. */
+static SDL_bool parse_skin_scale(const char *text, float *scale){
+    char *end;
+    long value;
+
+    if(SDL_strcasecmp(text, "double") == 0){
+        *scale = 2.0f;
+        return SDL_TRUE;
+    }
+    value = SDL_strtol(text, &end, 10);
+    if((end == text) || *end || (value < 1) || (value > (long) SKIN_MAX_SCALE)){
+        SDL_SetError("Bad scale '%s', want double or a whole number from 1 to %.0f", text, SKIN_MAX_SCALE);
+        return SDL_FALSE;
+    }
+    *scale = (float) value;
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_skin_filter(const char *text, SkinFilter *filter){
+    if(SDL_strcasecmp(text, "nearest") == 0){
+        *filter = SKIN_FILTER_NEAREST;
+    }else if(SDL_strcasecmp(text, "scale2x") == 0){
+        *filter = SKIN_FILTER_SCALE2X;
+    }else{
+        SDL_SetError("Bad scale filter '%s', want nearest or scale2x", text);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+/* myamp.ini in the pref dir takes "rate=", "buffer=", "crossfade=",
+   "resampler=", "normalize=", "scale=" and "scale_filter=" lines with the
+   same values as --rate, --buffer, --crossfade, --resampler, --normalize,
+   --scale and --scale-filter, and "click=" for a sound to play over the
+   music whenever a button is clicked. No file is fine, bad lines are
+   logged and skipped. */
+static void load_audio_config(void){
+    char *dir = SDL_GetPrefPath("myamp", "myamp");
+    char *path;
+    SDL_RWops *rw;
+    char line[1024];
+    char *value;
+
+    if(!dir){
+        return;
+    }
+    const size_t len = SDL_strlen(dir) + sizeof("myamp.ini");
+    path = (char *) SDL_malloc(len);
+    if(path){
+        SDL_snprintf(path, len, "%smyamp.ini", dir);
+    }
+    SDL_free(dir);
+    rw = path ? SDL_RWFromFile(path, "rb") : NULL;
+    if(!rw){
+        SDL_free(path);
+        return;
+    }
+    while(read_ini_line(rw, line, sizeof(line), &value)){
+        SDL_bool ok = SDL_TRUE;
+        if(!value){
+            continue;
+        }
+        if(SDL_strcasecmp(line, "rate") == 0){
+            ok = parse_audio_freq(value, &audio_config_freq);
+        }else if(SDL_strcasecmp(line, "buffer") == 0){
+            ok = parse_audio_buffer(value, &audio_config_samples);
+        }else if(SDL_strcasecmp(line, "crossfade") == 0){
+            ok = parse_crossfade(value, &crossfade_ms);
+        }else if(SDL_strcasecmp(line, "resampler") == 0){
+            ok = parse_resampler(value, &resampler_preset);
+        }else if(SDL_strcasecmp(line, "normalize") == 0){
+            ok = parse_normalize(value);
+        }else if(SDL_strcasecmp(line, "scale") == 0){
+            ok = parse_skin_scale(value, &skin_scale);
+        }else if(SDL_strcasecmp(line, "scale_filter") == 0){
+            ok = parse_skin_filter(value, &skin_filter);
+        }else if((SDL_strcasecmp(line, "click") == 0) && *value){
+            SDL_free(click_sound);
+            click_sound = SDL_strdup(value);
+        }
+        if(!ok){
+            SDL_Log("%s: %s", path, SDL_GetError());
+        }
+    }
+    SDL_RWclose(rw);
+    SDL_free(path);
+}
+
+/* The rate the default output device runs at, if SDL can tell us. */
+static int native_audio_freq(void){
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    SDL_AudioSpec spec;
+    if((SDL_GetDefaultAudioInfo(NULL, &spec, 0) == 0) && (spec.freq > 0)){
+        return spec.freq;
+    }
+#endif
+    return AUDIO_DEFAULT_FREQ;
+}
+
+/* Opens the output paused. A `freq` of 0 asks for the device's native rate and
+   lets SDL move it, otherwise SDL resamples to whatever the device wants.
+   Buffer size is always negotiable. The sample format is not: the DSP is all
+   float32 and SDL does the last conversion when the device wants ints. */
+static SDL_AudioDeviceID open_audio_device(const int freq, const int samples, SDL_AudioSpec *obtained){
+    SDL_AudioSpec desired;
+    int allowed_changes = SDL_AUDIO_ALLOW_SAMPLES_CHANGE;
+
+    SDL_zero(desired);
+    desired.freq = freq;
+    if(freq == 0){
+        desired.freq = native_audio_freq();
+        allowed_changes |= SDL_AUDIO_ALLOW_FREQUENCY_CHANGE;
+    }
+    desired.format = AUDIO_F32;
+    desired.channels = AUDIO_OUT_CHANNELS;
+    desired.samples = (Uint16) samples;
+    desired.callback = feed_audio_device_callback;
+
+    return SDL_OpenAudioDevice(NULL, 0, &desired, obtained, allowed_changes);
+}
+
+/* Swaps in a device with a different buffer at the same rate. The new one is
+   opened (paused) before the old one goes, so a failure leaves us playing. */
+static SDL_bool resize_audio_buffer(const int samples){
+    SDL_AudioSpec obtained;
+    const SDL_AudioDeviceID device = open_audio_device(audio_out_freq, samples, &obtained);
+
+    if(device == 0){
+        return SDL_FALSE;
+    }
+    if(obtained.freq != audio_out_freq){
+        SDL_CloseAudioDevice(device);
+        SDL_SetError("Device came back at %dHz instead of %dHz", obtained.freq, audio_out_freq);
+        return SDL_FALSE;
+    }
+    SDL_CloseAudioDevice(audio_device);
+    audio_device = device;
+    audio_device_samples = obtained.samples;
+    pause_audio_device(paused);
+    return SDL_TRUE;
+}
+
+/* Called once per main loop iteration in adaptive mode. Pausing restarts the
+   clock so a buffer only counts as stable for time spent actually playing. */
+static void update_audio_buffer(void){
+    const Uint64 now = SDL_GetPerformanceCounter();
+    AudioStats stats;
+    Uint64 glitches;
+    int samples = audio_device_samples;
+
+    if(audio_config_samples != 0){
+        return;
+    }
+    AudioStats_snapshot(&stats);
+    glitches = stats.late_callbacks + stats.deadline_misses;
+    if(glitches != audio_adapt_glitches){
+        audio_adapt_glitches = glitches;
+        audio_adapt_floor = SDL_min(audio_device_samples * 2, AUDIO_MAX_DEVICE_SAMPLES);
+        samples = audio_adapt_floor;
+    }else if(paused || !source){
+        audio_adapt_since = now;
+        return;
+    }else if(((now - audio_adapt_since) * 1000) >= (AUDIO_ADAPT_STABLE_MS * SDL_GetPerformanceFrequency())){
+        samples = SDL_max(audio_device_samples / 2, audio_adapt_floor);
+    }
+    if(samples == audio_device_samples){
+        return;
+    }
+
+    const int old_samples = audio_device_samples;
+    if(resize_audio_buffer(samples)){
+        SDL_Log("Audio buffer %d -> %d frames (%.1fms)", old_samples, audio_device_samples,
+                (audio_device_samples * 1000.0) / audio_out_freq);
+    }else{
+        SDL_Log("Couldn't resize audio buffer, staying at %d frames: %s", old_samples, SDL_GetError());
+        audio_config_samples = old_samples;
+    }
+    audio_adapt_since = now;
+}
+
+static void init_everything(int argc, char **argv){
+    SDL_AudioSpec obtained;
+
+    load_audio_config();
+    for(int i = 1; i < argc; ++i){
+        if((SDL_strcmp(argv[i], "--audio-stats") == 0) && (i + 1 < argc)){
+            audio_stats_path = argv[++i];
+        }else if(SDL_strcmp(argv[i], "--stats-overlay") == 0){
+            stats_overlay = SDL_TRUE;
+        }else if((SDL_strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)){
+            if(!parse_audio_freq(argv[++i], &audio_config_freq)){
+                SDL_Log("--rate: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--buffer") == 0) && (i + 1 < argc)){
+            if(!parse_audio_buffer(argv[++i], &audio_config_samples)){
+                SDL_Log("--buffer: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--crossfade") == 0) && (i + 1 < argc)){
+            if(!parse_crossfade(argv[++i], &crossfade_ms)){
+                SDL_Log("--crossfade: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--resampler") == 0) && (i + 1 < argc)){
+            if(!parse_resampler(argv[++i], &resampler_preset)){
+                SDL_Log("--resampler: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--normalize") == 0) && (i + 1 < argc)){
+            if(!parse_normalize(argv[++i])){
+                SDL_Log("--normalize: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--scale") == 0) && (i + 1 < argc)){
+            if(!parse_skin_scale(argv[++i], &skin_scale)){
+                SDL_Log("--scale: %s", SDL_GetError());
+            }
+        }else if((SDL_strcmp(argv[i], "--scale-filter") == 0) && (i + 1 < argc)){
+            if(!parse_skin_filter(argv[++i], &skin_filter)){
+                SDL_Log("--scale-filter: %s", SDL_GetError());
+            }
+        }
+    }
+    int window_w, window_h;
+    scaled_window_size(&window_w, &window_h);
+    
+    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1){
+        panic_and_abort("SDL_Init failed", SDL_GetError());
+    }
+
+    // shaped so skins with a REGION.TXT can cut it, plain if the platform can't do that
+    window = SDL_CreateShapedWindow("Hello SDL", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, window_w, window_h, 0);
+    if(window){
+        SDL_SetWindowHitTest(window, window_hit_test, &skin);
+    }else{
+        window = SDL_CreateWindow("Hello SDL", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, window_w, window_h, 0);
+    }
+    if(!window){
+        panic_and_abort("SDL_CreateWindow Failed!", SDL_GetError());
+    }
+    // Tells SDL we want this event enabled
+    // It is disabled by default due to having mem allocation
+    // unfamiliar users may fall in the trap of not freeing the mem
+    // resulting in memory leak <---
+
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    if(!renderer){
+        panic_and_abort("SDL_CreateRenderer Failed!", SDL_GetError());
+    }
+
+
+    skin_loaded_event = SDL_RegisterEvents(1);
+    if(skin_loaded_event == (Uint32) -1){
+        panic_and_abort("SDL_RegisterEvents Failed!", SDL_GetError());
+    }
+    audio_error_event = SDL_RegisterEvents(1);
+    if(audio_error_event == (Uint32) -1){
+        panic_and_abort("SDL_RegisterEvents Failed!", SDL_GetError());
+    }
+#ifdef MYAMP_HAVE_DIRENT
+    library_scanned_event = SDL_RegisterEvents(1);
+    if(library_scanned_event == (Uint32) -1){
+        panic_and_abort("SDL_RegisterEvents Failed!", SDL_GetError());
+    }
+    loudness_analyzed_event = SDL_RegisterEvents(1);
+    if(loudness_analyzed_event == (Uint32) -1){
+        panic_and_abort("SDL_RegisterEvents Failed!", SDL_GetError());
+    }
+#endif
+
+    pref_dir = SDL_GetPrefPath("myamp", "myamp"); // MAY BE NULL, skins just load the slow way and scans start from scratch
+#ifdef MYAMP_HAVE_DIRENT
+    if(pref_dir){
+        const size_t len = SDL_strlen(pref_dir) + 16;
+        library_index_path = (char *) SDL_malloc(len);
+        if(library_index_path){
+            SDL_snprintf(library_index_path, len, "%slibrary.idx", pref_dir);
+        }
+        loudness_cache_path = (char *) SDL_malloc(len);
+        if(loudness_cache_path){
+            SDL_snprintf(loudness_cache_path, len, "%sloudness.idx", pref_dir);
+        }
+    }
+#endif
+    // FIXME: Load a real thing
+    load_skin(&skin, "base.wsz");
+
+    // adaptive mode starts big and works its way down
+    audio_device = open_audio_device(audio_config_freq, audio_config_samples ? audio_config_samples : AUDIO_DEVICE_SAMPLES, &obtained);
+    if(audio_device == 0){
+        panic_and_abort("OpeAudioDevice Failed!", SDL_GetError());
+    }
+    audio_out_freq = obtained.freq;
+    audio_device_samples = obtained.samples;
+    audio_adapt_since = SDL_GetPerformanceCounter();
+    SDL_Log("Audio device: %dHz, %d frame buffer (%.1fms)%s, %s resampler", audio_out_freq, audio_device_samples,
+            (audio_device_samples * 1000.0) / audio_out_freq, audio_config_samples ? "" : ", adaptive", resampler_preset->name);
+    // band edges are in FFT bins at the device rate
+    init_visualizer(&visualizer);
+
+    SDL_EventState(SDL_DROPFILE, SDL_ENABLE); 
+    SDL_EventState(SDL_DROPCOMPLETE, SDL_ENABLE);
+    Playlist_append(&playlist, "music.wav");
+    play_track(&skin, 0);
+
+}
+
+/* Quads for one frame, all from the skin atlas, submitted with a single
+   SDL_RenderGeometry call. */
+#define SPRITE_BATCH_MAX_QUADS 256
+
+typedef struct SpriteBatch{
+    SDL_Vertex vertices[SPRITE_BATCH_MAX_QUADS * 4];
+    int indices[SPRITE_BATCH_MAX_QUADS * 6];
+    int num_quads;
+    float scale; // target pixels per skin pixel
+} SpriteBatch;
+
+static SpriteBatch sprite_batch = { .scale = 1.0f };
+
+/* Skin-space `rect` in pixels of a target drawn at `scale`. Edges are
+   rounded rather than the size, so neighbours still meet. */
+static SDL_Rect scale_rect(const SDL_Rect *rect, const float scale){
+    const int x0 = (int) SDL_floorf(((float) rect->x * scale) + 0.5f);
+    const int y0 = (int) SDL_floorf(((float) rect->y * scale) + 0.5f);
+    const int x1 = (int) SDL_floorf(((float) (rect->x + rect->w) * scale) + 0.5f);
+    const int y1 = (int) SDL_floorf(((float) (rect->y + rect->h) * scale) + 0.5f);
+    const SDL_Rect scaled = { x0, y0, x1 - x0, y1 - y0 };
+    return scaled;
+}
+
+/* Draw calls actually handed to the renderer, reported at exit. */
+static Uint64 draw_calls = 0;
+
+static void flush_sprite_batch(SDL_Renderer *renderer, SpriteBatch *batch, SDL_Texture *texture){
+    if(batch->num_quads){
+        SDL_RenderGeometry(renderer, texture, batch->vertices, batch->num_quads * 4, batch->indices, batch->num_quads * 6);
+        batch->num_quads = 0;
+        draw_calls++;
+    }
+}
+
+/* Queues atlas rect `src` drawn at `dst`, clipped to `clip` on the CPU so
+   every dirty region can share one submission. Rects are in skin pixels,
+   the batch's scale takes them to the target. */
+static void batch_sprite(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *src, const SDL_Rect *dst,
+                         const SDL_Rect *clip, const SDL_Color color){
+    SDL_Rect visible;
+    if(!SDL_IntersectRect(dst, clip, &visible)){
+        return;
+    }
+    if(batch->num_quads == SPRITE_BATCH_MAX_QUADS){
+        flush_sprite_batch(renderer, batch, skin->atlas);
+    }
+
+    // no atlas at all means untextured fills, tex coords don't matter then
+    const float inv_w = skin->atlas_w ? (1.0f / (float) skin->atlas_w) : 0.0f;
+    const float inv_h = skin->atlas_h ? (1.0f / (float) skin->atlas_h) : 0.0f;
+    const float scale_x = (float) src->w / (float) dst->w;
+    const float scale_y = (float) src->h / (float) dst->h;
+    const float u0 = ((float) src->x + ((float) (visible.x - dst->x) * scale_x)) * inv_w;
+    const float v0 = ((float) src->y + ((float) (visible.y - dst->y) * scale_y)) * inv_h;
+    const float u1 = u0 + (((float) visible.w * scale_x) * inv_w);
+    const float v1 = v0 + (((float) visible.h * scale_y) * inv_h);
+    const float x0 = (float) visible.x * batch->scale;
+    const float y0 = (float) visible.y * batch->scale;
+    const float x1 = (float) (visible.x + visible.w) * batch->scale;
+    const float y1 = (float) (visible.y + visible.h) * batch->scale;
+
+    SDL_Vertex *vert = &batch->vertices[batch->num_quads * 4];
+    int *idx = &batch->indices[batch->num_quads * 6];
+    const int base = batch->num_quads * 4;
+
+    vert[0].position.x = x0; vert[0].position.y = y0; vert[0].tex_coord.x = u0; vert[0].tex_coord.y = v0;
+    vert[1].position.x = x1; vert[1].position.y = y0; vert[1].tex_coord.x = u1; vert[1].tex_coord.y = v0;
+    vert[2].position.x = x0; vert[2].position.y = y1; vert[2].tex_coord.x = u0; vert[2].tex_coord.y = v1;
+    vert[3].position.x = x1; vert[3].position.y = y1; vert[3].tex_coord.x = u1; vert[3].tex_coord.y = v1;
+    vert[0].color = vert[1].color = vert[2].color = vert[3].color = color;
+
+    idx[0] = base + 0; idx[1] = base + 1; idx[2] = base + 2;
+    idx[3] = base + 2; idx[4] = base + 1; idx[5] = base + 3;
+    batch->num_quads++;
+}
+
+/* Solid colour fill, drawn with the atlas' white pixel tinted by the vertex colour. */
+static void batch_fill(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *dst, const SDL_Rect *clip,
+                       const Uint8 r, const Uint8 g, const Uint8 b){
+    const SDL_Color color = { r, g, b, 255 };
+    batch_sprite(batch, skin, &skin->white_pixel, dst, clip, color);
+}
+
+static const SDL_Color sprite_color = { 255, 255, 255, 255 };
+
+static void draw_button(SpriteBatch *batch, const WinAmpSkin *skin, const WinAmpSkinButton *btn, const SDL_Rect *clip){
+   
+    const SDL_bool pressed = (skin->pressed == btn);
+    if(btn->texture == NULL){
+        if(pressed){
+            batch_fill(batch, skin, &btn->dst_rect, clip, 0, 0, 255);
+        }else{
+            batch_fill(batch, skin, &btn->dst_rect, clip, 255, 0, 0);
+        }
+    }else{
+        const SDL_Rect *btn_rect = pressed ? &btn->src_rect_pressed : &btn->src_rect_unpressed;
+        batch_sprite(batch, skin, btn_rect, &btn->dst_rect, clip, sprite_color);
+    }
+}
+
+static void draw_slider(SpriteBatch *batch, const WinAmpSkin *skin, const WinAmpSkinSlider *slider, const SDL_Rect *clip){
+
+
+    SDL_assert(slider->value >= 0.0f);
+    SDL_assert(slider->value <= 1.0f);
+   
+    if(slider->texture == NULL){
+        const int color = (int)(slider->value * 255.0f);
+        batch_fill(batch, skin, &slider->dst_rect, clip, 200, 0, (Uint8) color);
+    }else{
+        const int frame_idx = ((int)((float)(slider->num_frames - 1) * slider->value));
+        const int srcx = slider->x_offset + ((frame_idx % slider->frames_per_row) * slider->w);
+        const int srcy = slider->y_offset + ((frame_idx / slider->frames_per_row) * slider->h);
+        const SDL_Rect src_rect = { srcx, srcy, slider->dst_rect.w, slider->dst_rect.h};
+        batch_sprite(batch, skin, &src_rect, &slider->dst_rect, clip, sprite_color);
+    }
+    draw_button(batch, skin, &slider->knob, clip);
+}
+
+/* TEXT.BMP is a grid of 5x6 glyphs, three rows of 31. \x01 marks glyphs
+   we never ask for (the accented capitals, the ellipsis, unused cells). */
+static const char *const skin_text_rows[] = {
+    "abcdefghijklmnopqrstuvwxyz\"@\x01\x01 ",
+    "0123456789\x01.:()-'!_+\\/[]^&%,=$#",
+    "\x01\x01\x01?*",
+};
+
+/* Queues `text` in TEXT.BMP's font, at most `max_chars` of it. Anything
+   the font doesn't have comes out as a space. */
+static void draw_text(SpriteBatch *batch, const WinAmpSkin *skin, const int x, const int y, const char *text,
+                      const int max_chars, const SDL_Rect *clip){
+    const SDL_Rect *font = &skin->bitmaps[WASBMP_TEXT];
+    if(!font->w){
+        return;
+    }
+    for(int i = 0; text[i] && (i < max_chars); ++i){
+        const char ch = (char) SDL_tolower((unsigned char) text[i]);
+        int row = 0;
+        int col = 30; // space
+        for(int r = 0; (ch > '\x01') && (r < (int) SDL_arraysize(skin_text_rows)); ++r){
+            const char *found = SDL_strchr(skin_text_rows[r], ch);
+            if(found){
+                row = r;
+                col = (int) (found - skin_text_rows[r]);
+                break;
+            }
+        }
+        const SDL_Rect src = { font->x + (col * SKIN_TEXT_GLYPH_W), font->y + (row * SKIN_TEXT_GLYPH_H), SKIN_TEXT_GLYPH_W, SKIN_TEXT_GLYPH_H };
+        const SDL_Rect dst = { x + (i * SKIN_TEXT_GLYPH_W), y, SKIN_TEXT_GLYPH_W, SKIN_TEXT_GLYPH_H };
+        batch_sprite(batch, skin, &src, &dst, clip, sprite_color);
+    }
+}
+
+/* "mmss" in the skin's digits with the readout's top left at (x,y), over
+   the piece of MAIN.BMP they cover. Empty `text` is just the background. */
+static void draw_time_readout(SpriteBatch *batch, const WinAmpSkin *skin, const int x, const int y, const char *text,
+                              const SDL_Rect *clip){
+    const SDL_Rect *main_bmp = &skin->bitmaps[WASBMP_MAIN];
+    const SDL_Rect *digits = skin->bitmaps[WASBMP_NUMS_EX].w ? &skin->bitmaps[WASBMP_NUMS_EX] : &skin->bitmaps[WASBMP_NUMBERS];
+    const SDL_Rect dst = { x, y, time_rect.w, time_rect.h };
+
+    if(main_bmp->w){
+        const SDL_Rect src = { main_bmp->x + time_rect.x, main_bmp->y + time_rect.y, time_rect.w, time_rect.h };
+        batch_sprite(batch, skin, &src, &dst, clip, sprite_color);
+    }else{
+        batch_fill(batch, skin, &dst, clip, 0, 0, 0);
+    }
+    for(int i = 0; digits->w && text[i] && (i < (int) SDL_arraysize(time_digit_x)); ++i){
+        const SDL_Rect src = { digits->x + ((text[i] - '0') * SKIN_DIGIT_W), digits->y, SKIN_DIGIT_W, SKIN_DIGIT_H };
+        const SDL_Rect digit_dst = { x + time_digit_x[i], y, SKIN_DIGIT_W, SKIN_DIGIT_H };
+        batch_sprite(batch, skin, &src, &digit_dst, clip, sprite_color);
+    }
+}
+
+/* "3. Artist - Title (4:05)" for the marquee, from the library's tags when
+   it has the file, else the file name. Length in seconds, 0 if unknown. */
+static void format_track_title(char *text, const size_t len, const int index, Uint32 seconds){
+    const char *path = playlist.entries[index];
+    const char *base = path;
+    for(const char *ptr = path; *ptr; ++ptr){
+        if((*ptr == '/') || (*ptr == '\\')){
+            base = ptr + 1;
+        }
+    }
+    const char *ext = SDL_strrchr(base, '.');
+    const int name_len = ext ? (int) (ext - base) : (int) SDL_strlen(base);
+    const TrackInfo *info = NULL;
+#ifdef MYAMP_HAVE_DIRENT
+    const int found = library ? LibraryIndex_find(library, path) : -1;
+    info = (found >= 0) ? &library->tracks[found].info : NULL;
+#endif
+    if(!seconds && info && info->freq){
+        seconds = (Uint32) (info->num_frames / (Uint64) info->freq);
+    }
+
+    int used;
+    if(info && info->title){
+        used = SDL_snprintf(text, len, "%d. %s%s%s", index + 1, info->artist ? info->artist : "", info->artist ? " - " : "", info->title);
+    }else{
+        used = SDL_snprintf(text, len, "%d. %.*s", index + 1, name_len, base);
+    }
+    if(seconds && (used >= 0) && ((size_t) used < len)){
+        SDL_snprintf(text + used, len - used, " (%u:%02u)", (unsigned int) (seconds / 60), (unsigned int) (seconds % 60));
+    }
+}
+
+/* UI thread. Redraws a readout's texture from its text, through the sprite
+   batch so it's one draw call like everything else. */
+static void render_readout(SDL_Texture *texture, const WinAmpSkin *skin, const SDL_bool is_time){
+    const SDL_Rect area = { 0, 0, is_time ? time_rect.w : skin->title_w, is_time ? time_rect.h : SKIN_TEXT_GLYPH_H };
+    SDL_SetRenderTarget(renderer, texture);
+    // readouts are made at the atlas' scale, same as frame_target
+    sprite_batch.scale = (float) skin->atlas_scale;
+    if(is_time){
+        draw_time_readout(&sprite_batch, skin, 0, 0, skin->time_text, &area);
+    }else{
+        draw_text(&sprite_batch, skin, 0, 0, skin->title_text, (int) sizeof(skin->title_text), &area);
+    }
+    flush_sprite_batch(renderer, &sprite_batch, skin->atlas);
+    SDL_SetRenderTarget(renderer, NULL);
+}
+
+/* Called once per main loop iteration. Works out what the readouts should
+   say from the callback's last PlaybackState, and only redraws the ones
+   whose text changed. Scrolls the marquee while playing. */
+static void update_readouts(WinAmpSkin *skin){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    const SDL_bool playing = (current != NULL) && !paused;
+    PlaybackState state;
+    char time_text[sizeof(skin->time_text)] = "";
+    char title[sizeof(skin->title_text)] = "";
+    int title_index = -1;
+    Uint32 seconds = 0;
+
+    PlaybackState_snapshot(&state);
+    if(current){
+        // a track that just started hasn't been through the callback yet
+        const Uint32 position = (state.source == current) ? (state.position / (Uint32) audio_out_freq) : 0;
+        const Uint32 minutes = SDL_min(position / 60, 99);
+        SDL_snprintf(time_text, sizeof(time_text), "%02u%02u", (unsigned int) minutes, (unsigned int) (position % 60));
+        seconds = (state.source == current) ? (state.length / (Uint32) audio_out_freq) : 0;
+    }
+    if((playlist.current >= 0) && (playlist.current < playlist.num_entries)){
+        title_index = playlist.current;
+        format_track_title(title, sizeof(title), title_index, seconds);
+        // short ones are padded to cover the whole marquee, long ones scroll round
+        // with a separator, leaving room for it
+        const int len = (int) SDL_strlen(title);
+        if(len <= MARQUEE_CHARS){
+            SDL_snprintf(title + len, sizeof(title) - len, "%*s", MARQUEE_CHARS - len, "");
+        }else{
+            SDL_snprintf(title + SDL_min(len, (int) sizeof(title) - 8), 8, "  ***  ");
+        }
+    }
+
+    if(skin->readouts_stale || SDL_strcmp(time_text, skin->time_text)){
+        SDL_strlcpy(skin->time_text, time_text, sizeof(skin->time_text));
+        if(skin->time_texture){
+            render_readout(skin->time_texture, skin, SDL_TRUE);
+        }
+        mark_dirty(skin, &time_rect);
+    }
+    if(skin->readouts_stale || SDL_strcmp(title, skin->title_text)){
+        SDL_strlcpy(skin->title_text, title, sizeof(skin->title_text));
+        skin->title_w = (int) SDL_strlen(title) * SKIN_TEXT_GLYPH_W;
+        // the length turning up later doesn't start the scroll over
+        if((title_index != skin->title_index) || (skin->title_w <= marquee_rect.w)){
+            skin->marquee_offset = 0;
+        }
+        skin->marquee_offset %= SDL_max(skin->title_w, 1);
+        skin->title_index = title_index;
+        if(skin->title_texture && skin->title_w){
+            render_readout(skin->title_texture, skin, SDL_FALSE);
+        }
+        mark_dirty(skin, &marquee_rect);
+    }
+    skin->readouts_stale = SDL_FALSE;
+
+    const Uint64 now = SDL_GetPerformanceCounter();
+    const Uint64 step_ticks = (MARQUEE_STEP_MS * SDL_GetPerformanceFrequency()) / 1000;
+    if(!playing || (skin->title_w <= marquee_rect.w)){
+        skin->marquee_last_step = now;
+    }else if((now - skin->marquee_last_step) >= step_ticks){
+        skin->marquee_offset = (skin->marquee_offset + 1) % skin->title_w;
+        skin->marquee_last_step = now;
+        mark_dirty(skin, &marquee_rect);
+    }
+}
+
+/* How long handle_events can sleep before update_readouts has something
+   to change: the next marquee step, or the next second ticking over. */
+static Uint32 readouts_wait_ms(const WinAmpSkin *skin){
+    AudioSource *current = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    PlaybackState state;
+    if(!current || paused){
+        return IDLE_WAIT_MS;
+    }
+    if(skin->title_w > marquee_rect.w){
+        const Uint64 elapsed_ms = ((SDL_GetPerformanceCounter() - skin->marquee_last_step) * 1000) / SDL_GetPerformanceFrequency();
+        return (elapsed_ms >= MARQUEE_STEP_MS) ? 1 : (Uint32) (MARQUEE_STEP_MS - elapsed_ms);
+    }
+    PlaybackState_snapshot(&state);
+    if(state.source != current){
+        return 1;
+    }
+    const Uint32 frames_left = (Uint32) audio_out_freq - (state.position % (Uint32) audio_out_freq);
+    return SDL_min(((frames_left * 1000) / (Uint32) audio_out_freq) + 1, IDLE_WAIT_MS);
+}
+
+/* Queues the readouts' glyphs straight into the frame, for renderers
+   without the textures. */
+static void draw_readout_glyphs(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *clip){
+    SDL_Rect marquee_clip;
+    if(!skin->time_texture){
+        draw_time_readout(batch, skin, time_rect.x, time_rect.y, skin->time_text, clip);
+    }
+    if(!skin->title_texture && skin->title_w && SDL_IntersectRect(&marquee_rect, clip, &marquee_clip)){
+        const int x = marquee_rect.x - skin->marquee_offset;
+        const int max_chars = (int) sizeof(skin->title_text);
+        draw_text(batch, skin, x, marquee_rect.y, skin->title_text, max_chars, &marquee_clip);
+        draw_text(batch, skin, x + skin->title_w, marquee_rect.y, skin->title_text, max_chars, &marquee_clip);
+    }
+}
+
+/* The readouts have their own textures, so they go over whatever draw_skin
+   put there. The marquee wraps round, so it can take two copies. Drawn at
+   the sprite batch's scale; the textures are at the atlas'. */
+static void draw_readouts(SDL_Renderer *renderer, const WinAmpSkin *skin){
+    const float scale = sprite_batch.scale;
+    const float texture_scale = (float) skin->atlas_scale;
+    if(skin->time_texture){
+        const SDL_Rect dst = scale_rect(&time_rect, scale);
+        SDL_RenderCopy(renderer, skin->time_texture, NULL, &dst);
+        draw_calls++;
+    }
+    if(skin->title_texture && skin->title_w){
+        const SDL_Rect src = { skin->marquee_offset, 0, SDL_min(marquee_rect.w, skin->title_w - skin->marquee_offset), SKIN_TEXT_GLYPH_H };
+        const SDL_Rect dst = { marquee_rect.x, marquee_rect.y, src.w, SKIN_TEXT_GLYPH_H };
+        const SDL_Rect scaled_src = scale_rect(&src, texture_scale);
+        const SDL_Rect scaled_dst = scale_rect(&dst, scale);
+        SDL_RenderCopy(renderer, skin->title_texture, &scaled_src, &scaled_dst);
+        draw_calls++;
+        if(src.w < marquee_rect.w){
+            const SDL_Rect wrap_src = { 0, 0, marquee_rect.w - src.w, SKIN_TEXT_GLYPH_H };
+            const SDL_Rect wrap_dst = { marquee_rect.x + src.w, marquee_rect.y, wrap_src.w, SKIN_TEXT_GLYPH_H };
+            const SDL_Rect scaled_wrap_src = scale_rect(&wrap_src, texture_scale);
+            const SDL_Rect scaled_wrap_dst = scale_rect(&wrap_dst, scale);
+            SDL_RenderCopy(renderer, skin->title_texture, &scaled_wrap_src, &scaled_wrap_dst);
+            draw_calls++;
+        }
+    }
+}
+
+/* Piece of PLEDIT.BMP at (sx,sy) drawn at (dx,dy) in the playlist window. */
+static void draw_pledit_piece(SpriteBatch *batch, const WinAmpSkin *skin, const int sx, const int sy, const int w, const int h,
+                              const int dx, const int dy, const SDL_Rect *clip){
+    const SDL_Rect *pledit = &skin->bitmaps[WASBMP_PLEDIT];
+    const SDL_Rect src = { pledit->x + sx, pledit->y + sy, w, h };
+    const SDL_Rect dst = { dx, SKIN_PLEDIT_Y + dy, w, h };
+    batch_sprite(batch, skin, &src, &dst, clip, sprite_color);
+}
+
+static void draw_playlist(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *clip){
+    const PlaylistColors *colors = &skin->playlist_colors;
+
+    if(skin->bitmaps[WASBMP_PLEDIT].w){
+        // active title bar: corners, tiles and the title centered over them
+        draw_pledit_piece(batch, skin, 0, 0, 25, 20, 0, 0, clip);
+        for(int x = 25; x < SKIN_MAIN_W - 25; x += 25){
+            draw_pledit_piece(batch, skin, 127, 0, 25, 20, x, 0, clip);
+        }
+        draw_pledit_piece(batch, skin, 26, 0, 100, 20, (SKIN_MAIN_W - 100) / 2, 0, clip);
+        draw_pledit_piece(batch, skin, 153, 0, 25, 20, SKIN_MAIN_W - 25, 0, clip);
+        for(int y = 20; y < SKIN_PLEDIT_H - 38; y += 29){
+            draw_pledit_piece(batch, skin, 0, 42, 12, 29, 0, y, clip);
+            draw_pledit_piece(batch, skin, 31, 42, 20, 29, SKIN_MAIN_W - 20, y, clip);
+        }
+        draw_pledit_piece(batch, skin, 0, 72, 125, 38, 0, SKIN_PLEDIT_H - 38, clip);
+        draw_pledit_piece(batch, skin, 126, 72, 150, 38, 125, SKIN_PLEDIT_H - 38, clip);
+    }else{
+        const SDL_Rect dst = { 0, SKIN_PLEDIT_Y, SKIN_MAIN_W, SKIN_PLEDIT_H };
+        batch_fill(batch, skin, &dst, clip, 0, 0, 0);
+    }
+
+    // the list itself doesn't quite fill the hole PLEDIT.BMP leaves for it
+    const SDL_Rect list_bg = { playlist_rect.x, playlist_rect.y, playlist_rect.w, SKIN_PLEDIT_H - 38 - 20 };
+    batch_fill(batch, skin, &list_bg, clip, colors->normal_bg.r, colors->normal_bg.g, colors->normal_bg.b);
+
+    const int max_chars = (playlist_rect.w - 2) / SKIN_TEXT_GLYPH_W;
+    for(int row = 0; row < PLAYLIST_ROWS; ++row){
+        const int index = playlist.scroll + row;
+        if(index >= playlist.num_entries){
+            break;
+        }
+        const SDL_Rect row_rect = { playlist_rect.x, playlist_rect.y + (row * PLAYLIST_ROW_H), playlist_rect.w, PLAYLIST_ROW_H };
+        if(!SDL_HasIntersection(&row_rect, clip)){
+            continue;
+        }
+        if(index == playlist.current){
+            batch_fill(batch, skin, &row_rect, clip, colors->selected_bg.r, colors->selected_bg.g, colors->selected_bg.b);
+        }
+
+        // "3. song", the file name without its directory or extension
+        const char *base = playlist.entries[index];
+        for(const char *ptr = base; *ptr; ++ptr){
+            if((*ptr == '/') || (*ptr == '\\')){
+                base = ptr + 1;
+            }
+        }
+        const char *ext = SDL_strrchr(base, '.');
+        const int name_len = ext ? (int) (ext - base) : (int) SDL_strlen(base);
+        char text[64];
+        SDL_snprintf(text, sizeof(text), "%d. %.*s", index + 1, name_len, base);
+        draw_text(batch, skin, row_rect.x + 1, row_rect.y + 1, text, max_chars, clip);
+    }
+}
+
+/* Four lines of numbers and the callback time histogram, one bar per
+   bucket, in place of the playlist. Bars for buckets slower than a period
+   use the current track color. */
+static void draw_stats_overlay(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *clip){
+    const PlaylistColors *colors = &skin->playlist_colors;
+    const int max_chars = (playlist_rect.w - 2) / SKIN_TEXT_GLYPH_W;
+    const double ms_per_tick = 1000.0 / (double) SDL_GetPerformanceFrequency();
+    AudioStats stats;
+    PlaybackState state;
+    char text[4][64];
+
+    if(!SDL_HasIntersection(&playlist_rect, clip)){
+        return;
+    }
+    AudioStats_snapshot(&stats);
+    PlaybackState_snapshot(&state);
+    batch_fill(batch, skin, &playlist_rect, clip, colors->normal_bg.r, colors->normal_bg.g, colors->normal_bg.b);
+
+    const double period_ms = (stats.period_frames * 1000.0) / audio_out_freq;
+    const Uint64 frames = stats.frames_filled + stats.frames_padded;
+    // peaks in dBFS, floored where a 16 bit source goes quiet
+    SDL_snprintf(text[0], sizeof(text[0]), "%dhz %u frames %.1fms peak %.0f %.0fdb", audio_out_freq, (unsigned int) stats.period_frames, period_ms,
+                 20.0 * SDL_log10(SDL_max(state.peaks[0], 1.0f / 32768.0f)), 20.0 * SDL_log10(SDL_max(state.peaks[1], 1.0f / 32768.0f)));
+    SDL_snprintf(text[1], sizeof(text[1]), "callbacks %" SDL_PRIu64 " avg %.3fms max %.3fms", stats.callbacks,
+                 stats.callbacks ? ((stats.busy_ticks * ms_per_tick) / stats.callbacks) : 0.0, stats.max_ticks * ms_per_tick);
+    SDL_snprintf(text[2], sizeof(text[2]), "misses %" SDL_PRIu64 " late %" SDL_PRIu64 " underruns %" SDL_PRIu64,
+                 stats.deadline_misses, stats.late_callbacks, stats.underruns);
+    SDL_snprintf(text[3], sizeof(text[3]), "padded %.2f%% p50 %uus p99 %uus", frames ? ((stats.frames_padded * 100.0) / frames) : 0.0,
+                 (unsigned int) AudioStats_percentile_us(&stats, 0.5), (unsigned int) AudioStats_percentile_us(&stats, 0.99));
+    for(int i = 0; i < (int) SDL_arraysize(text); ++i){
+        draw_text(batch, skin, playlist_rect.x + 1, playlist_rect.y + 1 + (i * PLAYLIST_ROW_H), text[i], max_chars, clip);
+    }
+
+    // log scaled so one slow callback in ten thousand still shows
+    const int bar_w = (playlist_rect.w - 2) / AUDIO_STATS_BUCKETS;
+    const int max_h = playlist_rect.h - (4 * PLAYLIST_ROW_H) - 2;
+    const int bottom = playlist_rect.y + playlist_rect.h - 1;
+    Uint64 most = 1;
+    for(int i = 0; i < AUDIO_STATS_BUCKETS; ++i){
+        most = SDL_max(most, stats.histogram[i]);
+    }
+    for(int i = 0; i < AUDIO_STATS_BUCKETS; ++i){
+        if(stats.histogram[i] == 0){
+            continue;
+        }
+        const int h = 1 + (int) ((max_h - 1) * (SDL_log((double) stats.histogram[i]) / SDL_log((double) most + 1.0)));
+        const SDL_Rect bar = { playlist_rect.x + 1 + (i * bar_w), bottom - h, bar_w - 1, h };
+        const double bucket_ms = (i > 0) ? (((Uint32) 1 << (i - 1)) / 1000.0) : 0.0;
+        const SDL_Color color = (stats.period_frames && (bucket_ms >= period_ms)) ? colors->current : colors->normal;
+        batch_fill(batch, skin, &bar, clip, color.r, color.g, color.b);
+    }
+}
+
+/* Queues the part of the skin inside `clip`. */
+static void draw_skin(SpriteBatch *batch, const WinAmpSkin *skin, const SDL_Rect *clip){
+
+    if(skin->bitmaps[WASBMP_MAIN].w){
+        const SDL_Rect *src = &skin->bitmaps[WASBMP_MAIN];
+        const SDL_Rect dst = { 0, 0, SKIN_MAIN_W, SKIN_MAIN_H };
+        batch_sprite(batch, skin, src, &dst, clip, sprite_color);
+    }else{
+        const SDL_Rect dst = { 0, 0, SKIN_MAIN_W, SKIN_MAIN_H };
+        batch_fill(batch, skin, &dst, clip, 0, 0, 0);
+    }
+    draw_readout_glyphs(batch, skin, clip);
+
+    if(skin->bitmaps[WASBMP_EQMAIN].w){
+        const SDL_Rect *eqmain = &skin->bitmaps[WASBMP_EQMAIN];
+        const SDL_Rect src = { eqmain->x, eqmain->y, SKIN_MAIN_W, SKIN_EQ_H };
+        const SDL_Rect dst = { 0, SKIN_EQ_Y, SKIN_MAIN_W, SKIN_EQ_H };
+        // active title bar lives further down the bitmap
+        const SDL_Rect title_src = { eqmain->x, eqmain->y + 134, SKIN_MAIN_W, 14 };
+        const SDL_Rect title_dst = { 0, SKIN_EQ_Y, SKIN_MAIN_W, 14 };
+        batch_sprite(batch, skin, &src, &dst, clip, sprite_color);
+        batch_sprite(batch, skin, &title_src, &title_dst, clip, sprite_color);
+    }else{
+        const SDL_Rect dst = { 0, SKIN_EQ_Y, SKIN_MAIN_W, SKIN_EQ_H };
+        batch_fill(batch, skin, &dst, clip, 0, 0, 0);
+    }
+
+    draw_playlist(batch, skin, clip);
+    if(stats_overlay){
+        draw_stats_overlay(batch, skin, clip);
+    }
+
+    int i;
+    for(i = 0; i < SDL_arraysize(skin->buttons); ++i){
+        draw_button(batch, skin, &skin->buttons[i], clip);
+    }
+
+    for(i = 0; i < SDL_arraysize(skin->sliders); ++i){
+        draw_slider(batch, skin, &skin->sliders[i], clip);
+    }
+}
+
+/* The visualizer has its own texture, so it goes over whatever draw_skin put there. */
+static void draw_visualizer(SDL_Renderer *renderer, const WinAmpSkin *skin){
+    if(skin->vis_texture && (visualizer.mode != VIS_OFF)){
+        const SDL_Rect dst = scale_rect(&vis_rect, sprite_batch.scale);
+        SDL_RenderCopy(renderer, skin->vis_texture, NULL, &dst);
+        draw_calls++;
+    }
+}
+
+static void draw_frame(SDL_Renderer *renderer, WinAmpSkin *skin){
+
+    if((skin->num_dirty_rects == 0) && !skin->needs_present){
+        frames_skipped++;
+        return;
+    }
+
+    if(skin->frame_target){
+        // only touch what changed, the rest of last frame is still in frame_target,
+        // which is at the atlas' scale so sprites go texel for pixel
+        sprite_batch.scale = (float) skin->atlas_scale;
+        SDL_SetRenderTarget(renderer, skin->frame_target);
+        SDL_bool vis_dirty = SDL_FALSE;
+        SDL_bool readouts_dirty = SDL_FALSE;
+        for(int i = 0; i < skin->num_dirty_rects; ++i){
+            draw_skin(&sprite_batch, skin, &skin->dirty_rects[i]);
+            vis_dirty |= SDL_HasIntersection(&skin->dirty_rects[i], &vis_rect);
+            readouts_dirty |= SDL_HasIntersection(&skin->dirty_rects[i], &time_rect) ||
+                              SDL_HasIntersection(&skin->dirty_rects[i], &marquee_rect);
+        }
+        flush_sprite_batch(renderer, &sprite_batch, skin->atlas);
+        if(vis_dirty){
+            draw_visualizer(renderer, skin);
+        }
+        if(readouts_dirty){
+            draw_readouts(renderer, skin);
+        }
+        SDL_SetRenderTarget(renderer, NULL);
+        SDL_RenderCopy(renderer, skin->frame_target, NULL, NULL);
+        draw_calls++;
+    }else{
+        const SDL_Rect whole = { 0, 0, SKIN_WINDOW_W, SKIN_WINDOW_H };
+        sprite_batch.scale = skin_scale;
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        draw_skin(&sprite_batch, skin, &whole);
+        flush_sprite_batch(renderer, &sprite_batch, skin->atlas);
+        draw_visualizer(renderer, skin);
+        draw_readouts(renderer, skin);
+    }
+    SDL_RenderPresent(renderer);
+
+    skin->num_dirty_rects = 0;
+    skin->needs_present = SDL_FALSE;
+    frames_rendered++;
+}
+
+
+/* JSON, or flat metric,value CSV if the name ends in .csv. */
+static SDL_bool write_audio_stats(const char *path, const AudioStats *stats){
+    const double ms_per_tick = 1000.0 / (double) SDL_GetPerformanceFrequency();
+    const char *ext = SDL_strrchr(path, '.');
+    const SDL_bool csv = (ext && (SDL_strcasecmp(ext, ".csv") == 0)) ? SDL_TRUE : SDL_FALSE;
+    const struct{
+        const char *name;
+        double value;
+    } metrics[] = {
+        { "device_freq",         audio_out_freq },
+        { "period_frames",       stats->period_frames },
+        { "period_ms",           (stats->period_frames * 1000.0) / audio_out_freq },
+        { "callbacks",           (double) stats->callbacks },
+        { "frames_filled",       (double) stats->frames_filled },
+        { "frames_padded",       (double) stats->frames_padded },
+        { "underruns",           (double) stats->underruns },
+        { "frames_underrun",     (double) stats->frames_underrun },
+        { "deadline_misses",     (double) stats->deadline_misses },
+        { "late_callbacks",      (double) stats->late_callbacks },
+        { "mean_ms",             stats->callbacks ? ((stats->busy_ticks * ms_per_tick) / stats->callbacks) : 0.0 },
+        { "max_ms",              stats->max_ticks * ms_per_tick },
+        { "max_interval_ms",     stats->max_interval_ticks * ms_per_tick },
+        { "p50_us",              AudioStats_percentile_us(stats, 0.5) },
+        { "p99_us",              AudioStats_percentile_us(stats, 0.99) },
+        { "p999_us",             AudioStats_percentile_us(stats, 0.999) },
+    };
+
+    FILE *f = fopen(path, "w");
+    if(!f){
+        return SDL_FALSE;
+    }
+    if(csv){
+        fprintf(f, "metric,value\n");
+        for(int i = 0; i < (int) SDL_arraysize(metrics); ++i){
+            fprintf(f, "%s,%.15g\n", metrics[i].name, metrics[i].value);
+        }
+        for(int i = 0; i < AUDIO_STATS_BUCKETS - 1; ++i){
+            fprintf(f, "callbacks_below_%uus,%" SDL_PRIu64 "\n", (unsigned int) 1 << i, stats->histogram[i]);
+        }
+        fprintf(f, "callbacks_at_least_%uus,%" SDL_PRIu64 "\n", (unsigned int) 1 << (AUDIO_STATS_BUCKETS - 2), stats->histogram[AUDIO_STATS_BUCKETS - 1]);
+    }else{
+        fprintf(f, "{");
+        for(int i = 0; i < (int) SDL_arraysize(metrics); ++i){
+            fprintf(f, "\"%s\":%.15g,", metrics[i].name, metrics[i].value);
+        }
+        // "below_us" is null for the last bucket, it has everything slower
+        fprintf(f, "\"histogram\":[");
+        for(int i = 0; i < AUDIO_STATS_BUCKETS; ++i){
+            if(i < AUDIO_STATS_BUCKETS - 1){
+                fprintf(f, "{\"below_us\":%u,\"callbacks\":%" SDL_PRIu64 "},", (unsigned int) 1 << i, stats->histogram[i]);
+            }else{
+                fprintf(f, "{\"below_us\":null,\"callbacks\":%" SDL_PRIu64 "}", stats->histogram[i]);
+            }
+        }
+        fprintf(f, "]}\n");
+    }
+    const SDL_bool ok = ferror(f) ? SDL_FALSE : SDL_TRUE;
+    return (fclose(f) == 0) && ok;
+}
+
+static void deinit_everything(void){
+    // FIXME: free_skin
+    stop_audio();
+    Playlist_clear(&playlist);
+
+    // loader, decoder and scan threads push events and use SDL, let them finish first
+#ifdef MYAMP_HAVE_DIRENT
+    SDL_AtomicSet(&library_scan_cancel, 1);
+    SDL_AtomicSet(&loudness_cancel, 1);
+    while((SDL_AtomicGet(&library_scans_in_flight) > 0) || (SDL_AtomicGet(&loudness_jobs_in_flight) > 0)){
+        SDL_Delay(1);
+    }
+#endif
+    while((SDL_AtomicGet(&skin_loads_in_flight) > 0) || (SDL_AtomicGet(&decoders_in_flight) > 0)){
+        SDL_Delay(1);
+    }
     SDL_Event e;
     while(SDL_PollEvent(&e)){
+        if(e.type == skin_loaded_event){
+            DecodedSkin_free((DecodedSkin *) e.user.data1);
+        }else if(e.type == audio_error_event){
+            SDL_free(e.user.data1);
+        }
+#ifdef MYAMP_HAVE_DIRENT
+        else if(e.type == library_scanned_event){
+            LibraryScan_free((LibraryScan *) e.user.data1);
+        }else if(e.type == loudness_analyzed_event){
+            // cancelled ones measured nothing, keep only what finished
+            LoudnessJob *job = (LoudnessJob *) e.user.data1;
+            if(job->loudness.lufs != LOUDNESS_NONE){
+                loudness_analyzed(job);
+            }
+        }
+#endif
+    }
+    ThreadPool_stop();
+#ifdef MYAMP_HAVE_DIRENT
+    if(library_next_scan){
+        LibraryScan_free(library_next_scan);
+    }
+    LibraryIndex_free(library);
+    SDL_free(library_index_path);
+    if(loudness_unsaved){
+        LoudnessCache_save(loudness_cache);
+    }
+    while(loudness_jobs){
+        LoudnessJob *next = loudness_jobs->next;
+        SDL_free(loudness_jobs->path);
+        SDL_free(loudness_jobs);
+        loudness_jobs = next;
+    }
+    LoudnessCache_free(loudness_cache);
+    SDL_free(loudness_cache_path);
+#endif
+
+    const double ms_per_tick = 1000.0 / (double) SDL_GetPerformanceFrequency();
+    SDL_Log("Audio device locked %" SDL_PRIu64 " times, %.3fms total, %.3fms longest",
+            audio_lock_count, audio_lock_ticks * ms_per_tick, audio_lock_max_ticks * ms_per_tick);
+    SDL_Log("Rendered %" SDL_PRIu64 " frames with %" SDL_PRIu64 " draw calls, skipped %" SDL_PRIu64 " with nothing to redraw",
+            frames_rendered, draw_calls, frames_skipped);
+
+    // the device is still open, stop the callback so the numbers hold still
+    SDL_PauseAudioDevice(audio_device, SDL_TRUE);
+    AudioStats stats;
+    AudioStats_snapshot(&stats);
+    SDL_Log("Audio callbacks: %" SDL_PRIu64 ", %.3fms mean, %.3fms longest, %" SDL_PRIu64 " over their deadline, %" SDL_PRIu64 " late, %"
+            SDL_PRIu64 " underruns (%" SDL_PRIu64 " frames)", stats.callbacks,
+            stats.callbacks ? ((stats.busy_ticks * ms_per_tick) / stats.callbacks) : 0.0, stats.max_ticks * ms_per_tick,
+            stats.deadline_misses, stats.late_callbacks, stats.underruns, stats.frames_underrun);
+    if(audio_stats_path && !write_audio_stats(audio_stats_path, &stats)){
+        fprintf(stderr, "Could not write audio stats to %s\n", audio_stats_path);
+    }
+
+
+    SDL_CloseAudioDevice(audio_device);
+    SDL_DestroyWindow(window);
+    SDL_DestroyRenderer(renderer);
+    SDL_free(pref_dir);
+    SDL_free(click_sound);
+    SDL_Quit();
+}
+
+static void handle_slider_motion(WinAmpSkinSlider *slider, const SDL_Point *pt){
+    if(skin.pressed == &slider->knob){
+        float new_val;
+        if(slider->vertical){
+            const int new_knob_y = pt->y - (slider->knob.dst_rect.h/2);
+            const int topy = slider->dst_rect.y;
+            const int bottomy = topy + slider->dst_rect.h - slider->knob.dst_rect.h;
+            new_val = 1.0f - (((float)pt->y - (float)slider->dst_rect.y) / (float)slider->dst_rect.h);
+            slider->knob.dst_rect.y = SDL_clamp(new_knob_y, topy, bottomy);
+        }else{
+            const int new_knob_x = pt->x - (slider->knob.dst_rect.w/2);
+            const int leftx = slider->dst_rect.x;
+            const int rightx = leftx + slider->dst_rect.w - slider->knob.dst_rect.w;
+            new_val = ((float)pt->x - (float)slider->dst_rect.x) / (float)slider->dst_rect.w;
+            slider->knob.dst_rect.x = SDL_clamp(new_knob_x, leftx, rightx);
+        }
+        mark_dirty(&skin, &slider->dst_rect);
+
+        slider->value = SDL_clamp(new_val, 0.0f, 1.0f);
+        if(slider->audio_param){
+            // Mixer thread picks this up on its next callback and ramps to it
+            atomic_set_float(slider->audio_param, slider->value);
+        }
+        if(slider->onChange){
+            slider->onChange();
+        }
+    }
+}
+
+
+/* Set between drops, so the first file of the next one knows to start a new playlist. */
+static SDL_bool new_drop = SDL_TRUE;
+
+static SDL_bool handle_events(WinAmpSkin *skin){
+    SDL_Event e;
+    Uint32 wait_ms = SDL_min(SDL_min(visualizer_wait_ms(skin), stats_overlay_wait_ms()), readouts_wait_ms(skin));
+#ifdef MYAMP_HAVE_DIRENT
+    wait_ms = SDL_min(wait_ms, loudness_wait_ms());
+#endif
+    // Nothing changes on screen unless an event says so, sleep until one shows up
+    if(!SDL_WaitEventTimeout(&e, wait_ms)){
+        return SDL_TRUE;
+    }
+    do{
         switch(e.type){
             case SDL_QUIT:
                 // Dont keep going
                 return SDL_FALSE;
                 break;
-            case SDL_MOUSEBUTTONDOWN:{
+            case SDL_MOUSEBUTTONDOWN:{
+
+                const SDL_Point pt = window_to_skin(e.button.x, e.button.y);
+                const HitId hit = hit_test(skin, &pt);
+
+                if(e.button.button != SDL_BUTTON_LEFT){
+                    break;
+                }
+                if(!skin->pressed){
+                    if((hit >= HIT_BUTTON_FIRST) && (hit < HIT_SLIDER_FIRST)){
+                        skin->pressed = &skin->buttons[hit - HIT_BUTTON_FIRST];
+                    }else if((hit >= HIT_SLIDER_FIRST) && (hit < HIT_VISUALIZER)){
+                        skin->pressed = &skin->sliders[hit - HIT_SLIDER_FIRST].knob;
+                    }
+                }
+                if(skin->pressed){
+                    SDL_CaptureMouse(SDL_TRUE);
+                    mark_dirty(skin, &skin->pressed->dst_rect);
+                }else if(hit == HIT_VISUALIZER){
+                    cycle_visualizer_mode(skin);
+                }else if((hit == HIT_PLAYLIST) && (e.button.clicks == 2)){
+                    play_track(skin, playlist.scroll + ((pt.y - playlist_rect.y) / PLAYLIST_ROW_H));
+                    start_playback();
+                }
+
+                break;
+            }
+            case SDL_MOUSEBUTTONUP:{
+
+                if(e.button.button != SDL_BUTTON_LEFT){
+                    break;
+                }
+
+                if(skin->pressed){
+                    SDL_CaptureMouse(SDL_FALSE);
+                    for(int i = 0; i < SDL_arraysize(skin->sliders); ++i){
+                        if((skin->pressed == &skin->sliders[i].knob) && skin->sliders[i].onRelease){
+                            skin->sliders[i].onRelease();
+                        }
+                    }
+                    if(skin->pressed->onClick != NULL){
+                        const SDL_Point pt = window_to_skin(e.button.x, e.button.y);
+                        if(SDL_PointInRect(&pt, &skin->pressed->dst_rect)){
+                            skin->pressed->onClick();
+                            play_click_sound(); // after, so STOP doesn't cut it off
+                        }
+                    }
+                    mark_dirty(skin, &skin->pressed->dst_rect);
+                    skin->pressed = NULL;
+                }
+                break;    
+            }
+            case SDL_MOUSEMOTION:{
+                 const SDL_Point pt = window_to_skin(e.motion.x, e.motion.y);
+                 for(int i = 0; i < SDL_arraysize(skin->sliders); ++i){
+                     handle_slider_motion(&skin->sliders[i], &pt);
+                 }
+                 break;
+             }
+            case SDL_MOUSEWHEEL:{
+                int x, y;
+                SDL_GetMouseState(&x, &y);
+                const SDL_Point pt = window_to_skin(x, y);
+                if(hit_test(skin, &pt) == HIT_PLAYLIST){
+                    const int max_scroll = SDL_max(playlist.num_entries - PLAYLIST_ROWS, 0);
+                    playlist.scroll = SDL_clamp(playlist.scroll - e.wheel.y, 0, max_scroll);
+                    mark_dirty(skin, &playlist_rect);
+                }
+                break;
+            }
+            case SDL_DROPFILE:{
+                const char *ptr = SDL_strrchr(e.drop.file, '.');
+                if(ptr && ((SDL_strcasecmp(ptr, ".wsz") == 0) || (SDL_strcasecmp(ptr, ".zip") == 0))){
+                    load_skin_async(e.drop.file);
+#ifdef MYAMP_HAVE_DIRENT
+                }else if(is_directory(e.drop.file)){
+                    // its tracks go on the end once it's scanned, and play if it started the drop
+                    if(new_drop){
+                        Playlist_clear(&playlist);
+                        mark_dirty(skin, &playlist_rect);
+                    }
+                    if(!library_add_folder(e.drop.file, new_drop)){
+                        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not scan folder!", SDL_GetError(), window);
+                    }
+                    new_drop = SDL_FALSE;
+#endif
+                }else if(new_drop){
+                    // first file of a drop replaces the playlist, the rest queue up behind it
+                    Playlist_clear(&playlist);
+                    Playlist_append(&playlist, e.drop.file);
+                    play_track(skin, 0);
+                    new_drop = SDL_FALSE;
+                }else{
+                    // update_playback starts decoding it once it's next
+                    Playlist_append(&playlist, e.drop.file);
+                    mark_dirty(skin, &playlist_rect);
+                }
+                SDL_free(e.drop.file);
+                break;
+            }
+            case SDL_DROPCOMPLETE:
+                new_drop = SDL_TRUE;
+                break;
+            case SDL_KEYDOWN:
+                if((e.key.keysym.sym == SDLK_F3) && !e.key.repeat){
+                    toggle_stats_overlay(skin);
+                }else if((e.key.keysym.sym == SDLK_d) && (e.key.keysym.mod & KMOD_CTRL) && !e.key.repeat){
+                    // Winamp's double size, back to 1x from any other scale
+                    set_skin_scale(skin, (skin_scale == 1.0f) ? 2.0f : 1.0f);
+                }
+                break;
+            case SDL_WINDOWEVENT:{
+                if(e.window.event == SDL_WINDOWEVENT_EXPOSED){
+                    skin->needs_present = SDL_TRUE;
+                }
+                break;
+            }
+            case SDL_RENDER_TARGETS_RESET:
+                // contents of frame_target and the readouts are gone
+                skin->readouts_stale = SDL_TRUE;
+                mark_all_dirty(skin);
+                break;
+            default:
+                if(e.type == skin_loaded_event){
+                    DecodedSkin *decoded = (DecodedSkin *) e.user.data1;
+                    if(decoded->generation != SDL_AtomicGet(&skin_generation)){
+                        // user already dropped another skin, that one wins
+                    }else if(!decoded->atlas){
+                        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not load skin!", "No skin bitmaps found.", window);
+                    }else{
+                        apply_skin(skin, decoded);
+                    }
+                    DecodedSkin_free(decoded);
+                }else if(e.type == audio_error_event){
+                    // playback has already moved on to the next track, if there is one
+                    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Could not open audio file!", (const char *) e.user.data1, window);
+                    SDL_free(e.user.data1);
+                }
+#ifdef MYAMP_HAVE_DIRENT
+                else if(e.type == library_scanned_event){
+                    library_scan_done(skin, (LibraryScan *) e.user.data1);
+                }else if(e.type == loudness_analyzed_event){
+                    loudness_analyzed((LoudnessJob *) e.user.data1);
+                }
+#endif
+                break;
+        }
+    }while(SDL_PollEvent(&e));
+    // Keep going
+    return SDL_TRUE;
+}
+
+
+/* ./myamp --render [options] file... : plays files into WAVs instead of the
+   sound card, as fast as the CPU allows. No window and no device, each file
+   gets its own source and DspChain on a pool worker, which decodes inline
+   instead of waiting on a decoder thread. Buffers are the size the device
+   would have asked for, so ramps land in the same place and the output is
+   bit for bit what the callback would have handed the device playing the
+   file from the top with the same settings. With normalization on each file
+   is measured first, the player keeps those results in its cache. */
+
+typedef struct RenderSettings{
+    EqParams eq;
+    float volume;
+    float balance;
+    Uint32 buffer_frames;
+    const char *out_dir;
+} RenderSettings;
+
+typedef struct RenderJob{
+    const RenderSettings *settings;
+    const char *in_path;
+    char *out_path;
+    char *error;  // NULL if it worked
+    Uint64 frames;
+    Uint64 ticks;
+    SDL_sem *done;
+} RenderJob;
+
+/* 32-bit float stereo at the output rate. Sizes past 4GB are clamped, most
+   readers stop at the end of the file anyway. */
+static SDL_bool render_write_header(SDL_RWops *rw, const Uint64 num_frames){
+    const Uint32 data_len = (Uint32) SDL_min(num_frames * AUDIO_OUT_FRAME_SIZE, (Uint64) (SDL_MAX_UINT32 - 36));
+    SDL_bool ok = SDL_TRUE;
+
+    ok &= SDL_RWwrite(rw, "RIFF", 4, 1) && SDL_WriteLE32(rw, 36 + data_len) && SDL_RWwrite(rw, "WAVEfmt ", 8, 1);
+    ok &= SDL_WriteLE32(rw, 16) && SDL_WriteLE16(rw, 3) && SDL_WriteLE16(rw, AUDIO_OUT_CHANNELS) && SDL_WriteLE32(rw, (Uint32) audio_out_freq);
+    ok &= SDL_WriteLE32(rw, (Uint32) (audio_out_freq * AUDIO_OUT_FRAME_SIZE)) && SDL_WriteLE16(rw, AUDIO_OUT_FRAME_SIZE) && SDL_WriteLE16(rw, 32);
+    ok &= SDL_RWwrite(rw, "data", 4, 1) && SDL_WriteLE32(rw, data_len);
+    return ok;
+}
+
+/* Worker. The callback's path for a single source with nothing layered
+   over it: read a buffer, run the chain over what came back. */
+static SDL_bool render_source(RenderJob *job, AudioSource *src, SDL_RWops *out){
+    const RenderSettings *settings = job->settings;
+    const Uint32 buffer_frames = settings->buffer_frames;
+    float *frames = (float *) SDL_malloc(buffer_frames * AUDIO_OUT_FRAME_SIZE);
+    DspChain chain;
+    AudioConverter conv;
+    SDL_bool decoding;
+    SDL_bool ok = SDL_FALSE;
+
+    SDL_zero(chain);
+    DspChain_reset(&chain, settings->volume, settings->balance);
+    SDL_zero(conv);
+    if(!frames){
+        SDL_OutOfMemory();
+        return SDL_FALSE;
+    }
+    if(!AudioSource_open_file(src)){
+        goto done;
+    }
+    decoding = src->map ? SDL_FALSE : SDL_TRUE;
+    if(decoding && !AudioConverter_init(&conv, src)){
+        SDL_OutOfMemory();
+        goto done;
+    }
+    if(!render_write_header(out, 0)){
+        goto done;
+    }
+    if(normalize_enabled){
+        // measured the way the player measures it, so it comes out at the gain the player would use
+        Loudness loudness;
+        SDL_atomic_t cancel;
+        SDL_AtomicSet(&cancel, 0);
+        if(!analyze_loudness(src->fname, &loudness, &cancel)){
+            loudness.lufs = LOUDNESS_NONE;
+            loudness.peak = 0.0f;
+        }
+        SDL_AtomicSet(&src->gain_mb, loudness_gain_mb(&loudness));
+    }
+
+    for(;;){
+        const int pulled = AudioSource_pull(src, &conv, &decoding, frames, buffer_frames);
+        if(pulled < 0){
+            goto done;
+        }else if(pulled == 0){
+            break;
+        }
+        const Uint32 got = (Uint32) pulled;
+        AudioSource_normalize(src, frames, got);
+        DspChain_process(&chain, frames, got, &settings->eq, settings->volume, settings->balance);
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        for(Uint32 i = 0; i < got * AUDIO_OUT_CHANNELS; ++i){
+            frames[i] = SDL_SwapFloatLE(frames[i]);
+        }
+#endif
+        if(SDL_RWwrite(out, frames, got * AUDIO_OUT_FRAME_SIZE, 1) != 1){
+            goto done;
+        }
+        job->frames += got;
+    }
+    ok = (SDL_RWseek(out, 0, RW_SEEK_SET) == 0) && render_write_header(out, job->frames);
+
+done:
+    AudioConverter_free(&conv);
+    SDL_free(frames);
+    return ok;
+}
+
+/* Worker. */
+static void render_file(int worker, void *data){
+    RenderJob *job = (RenderJob *) data;
+    const Uint64 start = SDL_GetPerformanceCounter();
+    AudioSource *src = (AudioSource *) SDL_calloc(1, sizeof(AudioSource));
+    SDL_RWops *out = NULL;
+    SDL_bool ok = SDL_FALSE;
+
+    if(!src){
+        SDL_OutOfMemory();
+        goto done;
+    }
+    SDL_AtomicSet(&src->refcount, 1);
+    src->fname = SDL_strdup(job->in_path);
+    if(!src->fname){
+        SDL_OutOfMemory();
+        goto done;
+    }
+    out = SDL_RWFromFile(job->out_path, "wb");
+    if(!out){
+        goto done;
+    }
+    ok = render_source(job, src, out);
+
+done:
+    if(!ok){
+        job->error = SDL_strdup(SDL_GetError());
+    }
+    if(out && (SDL_RWclose(out) != 0) && ok){
+        job->error = SDL_strdup(SDL_GetError());
+        ok = SDL_FALSE;
+    }
+    if(out && !ok){
+        remove(job->out_path); // don't leave something that looks like a finished render
+    }
+    if(src){
+        AudioSource_release(src);
+    }
+    job->ticks = SDL_GetPerformanceCounter() - start;
+    SDL_SemPost(job->done);
+}
+
+static void render_jobs_free(RenderJob *jobs, const int num_jobs){
+    if(jobs){
+        for(int i = 0; i < num_jobs; ++i){
+            SDL_free(jobs[i].out_path);
+            SDL_free(jobs[i].error);
+        }
+        SDL_free(jobs);
+    }
+}
+
+/* Renders each of `paths` to `out_dir`/<file name>.wav, all at once on the
+   thread pool, and waits for the lot. Per file results are in the jobs. */
+static RenderJob *render_files(const RenderSettings *settings, char **paths, const int num_files){
+    RenderJob *jobs = (RenderJob *) SDL_calloc(num_files, sizeof(RenderJob));
+    SDL_sem *done = SDL_CreateSemaphore(0);
+    int submitted = 0;
+
+    if(!jobs || !done){
+        SDL_OutOfMemory();
+        goto failed;
+    }
+    if(!ThreadPool_start()){
+        goto failed;
+    }
+    for(int i = 0; i < num_files; ++i){
+        const char *name = zip_basename(paths[i]);
+        const size_t len = SDL_strlen(settings->out_dir) + SDL_strlen(name) + 6;
+        RenderJob *job = &jobs[i];
+        job->settings = settings;
+        job->in_path = paths[i];
+        job->done = done;
+        job->out_path = (char *) SDL_malloc(len);
+        if(!job->out_path){
+            job->error = SDL_strdup("Out of memory");
+        }else{
+            // the extension stays, so song.wav doesn't get written over itself
+            SDL_snprintf(job->out_path, len, "%s/%s.wav", settings->out_dir, name);
+            if(ThreadPool_submit(-1, render_file, job)){
+                submitted++;
+                continue;
+            }
+            job->error = SDL_strdup(SDL_GetError());
+        }
+    }
+    while(submitted--){
+        SDL_SemWait(done);
+    }
+    SDL_DestroySemaphore(done);
+    return jobs;
+
+failed:
+    if(done){
+        SDL_DestroySemaphore(done);
+    }
+    SDL_free(jobs);
+    return NULL;
+}
+
+/* Parses a number in [min, max] for option `what`. */
+static SDL_bool parse_render_number(const char *what, const char *text, const double min, const double max, double *value){
+    char *end;
+    *value = SDL_strtod(text, &end);
+    if((end == text) || *end || !(*value >= min) || !(*value <= max)){
+        SDL_SetError("Bad %s '%s', want %g to %g", what, text, min, max);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+/* Preamp then each band, in dB, comma separated. Missing trailing bands stay flat. */
+static SDL_bool parse_render_eq(const char *text, float *values){
+    char db[32];
+    int i = 0;
+
+    for(const char *ptr = text; *ptr; ++i){
+        const char *comma = SDL_strchr(ptr, ',');
+        const size_t len = comma ? (size_t) (comma - ptr) : SDL_strlen(ptr);
+        double value;
+        if((i > EQ_NUM_BANDS) || (len >= sizeof(db))){
+            SDL_SetError("Bad eq '%s', want up to %d comma separated dB values, preamp first", text, EQ_NUM_BANDS + 1);
+            return SDL_FALSE;
+        }
+        SDL_strlcpy(db, ptr, len + 1);
+        if(!parse_render_number("eq band", db, -EQ_MAX_DB, EQ_MAX_DB, &value)){
+            return SDL_FALSE;
+        }
+        values[i] = (float) (((value / EQ_MAX_DB) + 1.0) / 2.0); // to slider positions
+        ptr = comma ? comma + 1 : ptr + len;
+    }
+    return SDL_TRUE;
+}
+
+/* --render [--out dir] [--volume 0-100] [--balance -100-100]
+   [--eq preamp,band,...] [--rate hz] [--buffer frames] [--resampler preset]
+   [--normalize off|on|lufs] file... Rate, buffer, resampler and
+   normalization default to myamp.ini's like playback does, except a native
+   rate means AUDIO_DEFAULT_FREQ as there's no device to ask. */
+static int run_render(int argc, char **argv){
+    RenderSettings settings;
+    float values[EQ_NUM_BANDS + 1];
+    RenderJob *jobs = NULL;
+    Uint64 total_frames = 0;
+    int failed = 0;
+    int i;
+
+    SDL_zero(settings);
+    settings.volume = 1.0f;
+    settings.balance = 0.5f;
+    settings.out_dir = ".";
+    SDL_memcpy(values, eq_values, sizeof(values));
+    load_audio_config();
+    for(i = 0; (i < argc) && (argv[i][0] == '-'); ++i){
+        const char *option = argv[i];
+        double value = 0.0;
+        SDL_bool ok = SDL_TRUE;
+        if(SDL_strcmp(option, "--") == 0){
+            i++;
+            break;
+        }else if(i + 1 >= argc){
+            ok = SDL_FALSE;
+            SDL_SetError("Unknown option or missing value");
+        }else if(SDL_strcmp(option, "--out") == 0){
+            settings.out_dir = argv[++i];
+        }else if(SDL_strcmp(option, "--volume") == 0){
+            ok = parse_render_number("volume", argv[++i], 0.0, 100.0, &value);
+            settings.volume = (float) (value / 100.0);
+        }else if(SDL_strcmp(option, "--balance") == 0){
+            ok = parse_render_number("balance", argv[++i], -100.0, 100.0, &value);
+            settings.balance = (float) ((value + 100.0) / 200.0);
+        }else if(SDL_strcmp(option, "--eq") == 0){
+            ok = parse_render_eq(argv[++i], values);
+        }else if(SDL_strcmp(option, "--rate") == 0){
+            ok = parse_audio_freq(argv[++i], &audio_config_freq);
+        }else if(SDL_strcmp(option, "--buffer") == 0){
+            ok = parse_audio_buffer(argv[++i], &audio_config_samples);
+        }else if(SDL_strcmp(option, "--resampler") == 0){
+            ok = parse_resampler(argv[++i], &resampler_preset);
+        }else if(SDL_strcmp(option, "--normalize") == 0){
+            ok = parse_normalize(argv[++i]);
+        }else{
+            ok = SDL_FALSE;
+            SDL_SetError("Unknown option");
+        }
+        if(!ok){
+            fprintf(stderr, "%s: %s\n", option, SDL_GetError());
+            return 1;
+        }
+    }
+    if(i == argc){
+        fprintf(stderr, "Usage: myamp --render [--out dir] [--volume 0-100] [--balance -100-100] "
+                        "[--eq preamp,band1,...,band%d] [--rate hz] [--buffer frames] [--resampler fast|medium|high] "
+                        "[--normalize off|on|lufs] file...\n", EQ_NUM_BANDS);
+        return 1;
+    }
+
+    if(SDL_Init(0) == -1){
+        fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+        return 1;
+    }
+    audio_out_freq = audio_config_freq ? audio_config_freq : AUDIO_DEFAULT_FREQ;
+    settings.buffer_frames = (Uint32) (audio_config_samples ? audio_config_samples : AUDIO_DEVICE_SAMPLES);
+    EqParams_compute(&settings.eq, values);
+
+    const Uint64 start = SDL_GetPerformanceCounter();
+    jobs = render_files(&settings, &argv[i], argc - i);
+    const double seconds = (double) (SDL_GetPerformanceCounter() - start) / (double) SDL_GetPerformanceFrequency();
+    if(!jobs){
+        fprintf(stderr, "Couldn't start rendering: %s\n", SDL_GetError());
+        failed = argc - i;
+    }
+    for(int j = 0; jobs && (j < argc - i); ++j){
+        const RenderJob *job = &jobs[j];
+        if(job->error){
+            fprintf(stderr, "%s: %s\n", job->in_path, job->error);
+            failed++;
+            continue;
+        }
+        const double audio_seconds = (double) job->frames / audio_out_freq;
+        const double job_seconds = (double) job->ticks / (double) SDL_GetPerformanceFrequency();
+        printf("%s -> %s: %.1fs in %.1fms, %.0fx realtime\n", job->in_path, job->out_path,
+               audio_seconds, job_seconds * 1000.0, (job_seconds > 0.0) ? (audio_seconds / job_seconds) : 0.0);
+        total_frames += job->frames;
+    }
+    printf("%d of %d files, %.1fs of audio in %.2fs on %d workers, %.0fx realtime\n", argc - i - failed, argc - i,
+           (double) total_frames / audio_out_freq, seconds, thread_pool.num_workers,
+           (seconds > 0.0) ? (((double) total_frames / audio_out_freq) / seconds) : 0.0);
+
+    render_jobs_free(jobs, argc - i);
+    ThreadPool_stop();
+    SDL_Quit();
+    return failed ? 1 : 0;
+}
+
+
+/* ./myamp --bench [suite...] : times the audio and skin hot paths without a
+   window or a running audio device (SDL's dummy drivers, software renderer)
+   and prints one JSON object per line so runs can be diffed between versions.
+   With no suites named, runs all of them. */
+
+typedef struct BenchTimer{
+    Uint64 start;
+    Uint64 total;
+    Uint64 min;
+    int iterations;
+} BenchTimer;
+
+static void BenchTimer_start(BenchTimer *t){
+    t->start = SDL_GetPerformanceCounter();
+}
+
+static void BenchTimer_stop(BenchTimer *t){
+    const Uint64 elapsed = SDL_GetPerformanceCounter() - t->start;
+    t->total += elapsed;
+    t->min = (t->iterations == 0) ? elapsed : SDL_min(t->min, elapsed);
+    t->iterations++;
+}
+
+static double bench_ticks_to_ns(const Uint64 ticks){
+    return ((double) ticks * 1e9) / (double) SDL_GetPerformanceFrequency();
+}
+
+static double BenchTimer_mean_ns(const BenchTimer *t){
+    return t->iterations ? (bench_ticks_to_ns(t->total) / t->iterations) : 0.0;
+}
+
+/* `extra` is printf-style and appended verbatim, so it should look like ,"key":value */
+static void bench_report(const char *suite, const char *name, const BenchTimer *t, const char *extra, ...){
+    va_list ap;
+    printf("{\"suite\":\"%s\",\"case\":\"%s\",\"iterations\":%d,\"mean_ns\":%.1f,\"min_ns\":%.1f",
+           suite, name, t->iterations, BenchTimer_mean_ns(t), bench_ticks_to_ns(t->min));
+    va_start(ap, extra);
+    vprintf(extra, ap);
+    va_end(ap);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int bench_failures = 0;
+
+/* For results that mean something is broken rather than slow: says so on
+   stderr and makes --bench exit non-zero, so it can't scroll past unseen. */
+static void bench_fail(const char *suite, const char *name, const char *fmt, ...){
+    va_list ap;
+    fprintf(stderr, "bench: FAILED %s/%s: ", suite, name);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    fflush(stderr);
+    bench_failures++;
+}
+
+/* The volume and balance loops feed_audio_device_callback used to run,
+   kept so the benchmark has something to compare the kernels against. */
+static void apply_volume_balance_reference(float *samples, Uint32 num_frames, const float volume, const float balance){
+    const Uint32 num_samples = num_frames * 2;
+    if(volume != 1.0f){
+        for(size_t i = 0; i < num_samples; ++i){
+            samples[i] *= volume;
+        }
+    }
+    if(balance != 0.5f){
+        for(size_t i = 0; i < num_samples; i += 2){
+            const float weightLeft  = balance <= 0.5f ? 1.0f: 2.0f*(1.0f - balance);
+            const float weightRight = balance >= 0.5f ? 1.0f: 2.0f*       (balance);
+            samples[i]   *= weightLeft;
+            samples[i+1] *= weightRight;
+        }
+    }
+}
+
+/* One callback's worth of gain processing, old loops vs every kernel this CPU supports. */
+static void bench_gain(void){
+    const Uint32 num_frames = AUDIO_DEVICE_SAMPLES;
+    const int iterations = 20000;
+    // kept close to unity so repeated passes never decay into denormals
+    const float from[2] = { 1.0f, 0.999f };
+    const float to[2] = { 0.999f, 1.0f };
+    float *samples = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    double reference_ns = 0.0;
+
+    if(!samples){
+        return;
+    }
+    for(Uint32 i = 0; i < num_frames * 2; ++i){
+        samples[i] = ((float) (i % 200) / 100.0f) - 1.0f;
+    }
+
+    for(int k = -1; k < (int) SDL_arraysize(dsp_kernels); ++k){
+        const DspKernel *kernel = (k >= 0) ? &dsp_kernels[k] : NULL;
+        BenchTimer t;
+        if(kernel && kernel->supported && !kernel->supported()){
+            continue;
+        }
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            BenchTimer_start(&t);
+            if(kernel){
+                kernel->stereo_gain(samples, num_frames, (i & 1) ? to : from, (i & 1) ? from : to);
+            }else{
+                apply_volume_balance_reference(samples, num_frames, (i & 1) ? 1.001f : 0.999f, (i & 1) ? 0.5005f : 0.4995f);
+            }
+            BenchTimer_stop(&t);
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        if(!kernel){
+            reference_ns = ns;
+        }
+        bench_report("gain", kernel ? kernel->name : "reference", &t, ",\"mframes_per_s\":%.1f,\"speedup\":%.2f,\"selected\":%s",
+                     (num_frames / ns) * 1e3, reference_ns / ns, (kernel == dsp_kernel) ? "true" : "false");
+    }
+    SDL_free(samples);
+}
+
+/* One callback's worth of 48000Hz 16-bit stereo to float: the SDL_AudioStream
+   the decoder would use versus every kernel the mapped path can pick. */
+static void bench_convert(void){
+    const Uint32 num_samples = AUDIO_DEVICE_SAMPLES * AUDIO_OUT_CHANNELS;
+    const int iterations = 20000;
+    Sint16 *in = (Sint16 *) SDL_malloc(num_samples * sizeof(Sint16));
+    float *out = (float *) SDL_malloc(num_samples * sizeof(float));
+    float *expected = (float *) SDL_malloc(num_samples * sizeof(float));
+    SDL_AudioStream *cvt = SDL_NewAudioStream(AUDIO_S16LSB, AUDIO_OUT_CHANNELS, audio_out_freq, AUDIO_F32, AUDIO_OUT_CHANNELS, audio_out_freq);
+    double reference_ns = 0.0;
+
+    if(!in || !out || !expected || !cvt){
+        goto done;
+    }
+    for(Uint32 i = 0; i < num_samples; ++i){
+        in[i] = SDL_SwapLE16((Sint16) ((i * 2654435761u) >> 16));
+    }
+    convert_s16_scalar(expected, in, num_samples);
+
+    for(int k = -1; k < (int) SDL_arraysize(dsp_kernels); ++k){
+        const DspKernel *kernel = (k >= 0) ? &dsp_kernels[k] : NULL;
+        BenchTimer t;
+        if(kernel && kernel->supported && !kernel->supported()){
+            continue;
+        }
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            BenchTimer_start(&t);
+            if(kernel){
+                kernel->convert_s16(out, in, num_samples);
+            }else{
+                SDL_AudioStreamPut(cvt, in, num_samples * sizeof(Sint16));
+                SDL_AudioStreamGet(cvt, out, num_samples * sizeof(float));
+            }
+            BenchTimer_stop(&t);
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        if(!kernel){
+            reference_ns = ns;
+        }
+        float max_error = 0.0f;
+        for(Uint32 i = 0; kernel && (i < num_samples); ++i){
+            max_error = SDL_max(max_error, SDL_fabsf(out[i] - expected[i]));
+        }
+        bench_report("convert", kernel ? kernel->name : "audio_stream", &t, ",\"mframes_per_s\":%.1f,\"speedup\":%.2f,\"max_error\":%g,\"selected\":%s",
+                     (AUDIO_DEVICE_SAMPLES / ns) * 1e3, reference_ns / ns, max_error, (kernel == dsp_kernel) ? "true" : "false");
+    }
+
+done:
+    SDL_FreeAudioStream(cvt);
+    SDL_free(expected);
+    SDL_free(out);
+    SDL_free(in);
+}
+
+/* Every band moved, not that the cost depends on it. */
+static const float bench_eq_values[EQ_NUM_BANDS + 1] = { 0.45f, 0.8f, 0.7f, 0.6f, 0.5f, 0.4f, 0.45f, 0.55f, 0.65f, 0.75f, 0.8f };
+
+/* Pushes all of `in` through `rs` from the start, a block at a time like
+   the decoder does, and flushes it. Returns how many frames came out. */
+static Uint32 bench_run_resampler(Resampler *rs, const float *in, const Uint32 num_in, float *out, const Uint32 out_capacity){
+    Uint32 done_in = 0;
+    Uint32 done_out = 0;
+
+    Resampler_reset(rs);
+    for(;;){
+        const Uint32 got = Resampler_read(rs, &out[done_out * 2], out_capacity - done_out);
+        done_out += got;
+        if(got){
+            continue;
+        }else if(rs->flushed || (done_out == out_capacity)){
+            break;
+        }
+        Uint32 room;
+        float *input = Resampler_input(rs, &room);
+        if(done_in < num_in){
+            const Uint32 count = SDL_min(room, num_in - done_in);
+            SDL_memcpy(input, &in[done_in * 2], count * AUDIO_OUT_FRAME_SIZE);
+            Resampler_commit(rs, count);
+            done_in += count;
+        }else{
+            Resampler_flush(rs);
+        }
+    }
+    return done_out;
+}
+
+static void bench_write_tone(float *frames, const Uint32 num_frames, const double hz, const int freq){
+    for(Uint32 i = 0; i < num_frames; ++i){
+        frames[i*2] = frames[i*2+1] = (float) (0.5 * SDL_sin((2.0 * M_PI * hz * i) / freq));
+    }
+}
+
+/* Least squares fit of a sine at `hz` to the left channel of `frames`,
+   skipping the filter's run in and out at either end. Returns its level
+   relative to bench_write_tone's, in dB, and the level of what's left
+   over relative to the fitted sine in `residual_db`. */
+static double bench_fit_tone(const float *frames, const Uint32 num_frames, const double hz, const int freq, double *residual_db){
+    const Uint32 margin = 1024;
+    double ss = 0.0, cc = 0.0, sc = 0.0, ys = 0.0, yc = 0.0;
+
+    for(Uint32 i = margin; i < num_frames - margin; ++i){
+        const double w = (2.0 * M_PI * hz * i) / freq;
+        const double sn = SDL_sin(w), cs = SDL_cos(w), y = frames[i*2];
+        ss += sn * sn; cc += cs * cs; sc += sn * cs; ys += y * sn; yc += y * cs;
+    }
+    const double det = (ss * cc) - (sc * sc);
+    const double a = ((ys * cc) - (yc * sc)) / det;
+    const double b = ((yc * ss) - (ys * sc)) / det;
+    const double amplitude = SDL_sqrt((a * a) + (b * b));
+    double error = 0.0;
+    for(Uint32 i = margin; i < num_frames - margin; ++i){
+        const double w = (2.0 * M_PI * hz * i) / freq;
+        const double e = frames[i*2] - ((a * SDL_sin(w)) + (b * SDL_cos(w)));
+        error += e * e;
+    }
+    error = SDL_sqrt(error / (num_frames - (2 * margin))) * M_SQRT2; // as a sine's peak
+    *residual_db = 20.0 * SDL_log10(SDL_max(error, 1e-12) / amplitude);
+    return 20.0 * SDL_log10(amplitude / 0.5);
+}
+
+/* Each resampler preset over a second of 44100Hz going to 48000Hz, with
+   every kernel this CPU supports and SDL_AudioStream for comparison. The
+   selected kernel's line also has the measured quality: passband ripple
+   from 20Hz to 15kHz, the response at 20kHz, what's left besides the tone
+   after a 19kHz sine goes through (images folding back), how much of a
+   30kHz sine gets through going from 96000Hz to 48000Hz (aliasing), and
+   what's left besides a 7kHz sine going from 22254Hz, a ratio with more
+   phases than filters. Any of those past its preset's limit fails. */
+static void bench_resample(void){
+    // a few dB short of what each preset measured when it went in, same order as resampler_presets
+    static const struct{
+        double ripple_db;
+        double image_db;
+        double alias_db;
+        double rare_ratio_db;
+    } limits[SDL_arraysize(resampler_presets)] = {
+        { 4.0,     -3.0,    1.0, -10.0 }, // linear, just don't let it get worse
+        { 0.01,   -74.0,  -80.0, -60.0 },
+        { 0.001, -108.0, -108.0, -60.0 },
+    };
+    const int in_freq = 44100;
+    const int out_freq = 48000;
+    const Uint32 num_in = (Uint32) in_freq;
+    const Uint32 out_capacity = (Uint32) out_freq * 2 + 1024;
+    const int iterations = 20;
+    float *in = (float *) SDL_malloc(num_in * 2 * AUDIO_OUT_FRAME_SIZE); // big enough for a second at 96000Hz
+    float *out = (float *) SDL_malloc(out_capacity * AUDIO_OUT_FRAME_SIZE);
+    float *expected = (float *) SDL_malloc(out_capacity * AUDIO_OUT_FRAME_SIZE);
+    SDL_AudioStream *cvt = SDL_NewAudioStream(AUDIO_F32, AUDIO_OUT_CHANNELS, in_freq, AUDIO_F32, AUDIO_OUT_CHANNELS, out_freq);
+    Resampler rs;
+    BenchTimer t;
+
+    SDL_zero(rs);
+    if(!in || !out || !expected || !cvt){
+        goto done;
+    }
+    for(Uint32 i = 0; i < num_in * 2; ++i){
+        in[i] = (float) (Sint32) (i * 2654435761u) * (0.5f / 2147483648.0f);
+    }
+
+    SDL_zero(t);
+    for(int i = 0; i < iterations; ++i){
+        BenchTimer_start(&t);
+        SDL_AudioStreamClear(cvt);
+        SDL_AudioStreamPut(cvt, in, (int) (num_in * AUDIO_OUT_FRAME_SIZE));
+        SDL_AudioStreamFlush(cvt);
+        SDL_AudioStreamGet(cvt, out, (int) (out_capacity * AUDIO_OUT_FRAME_SIZE));
+        BenchTimer_stop(&t);
+    }
+    bench_report("resample", "audio_stream", &t, ",\"mframes_per_s\":%.1f", (out_freq / BenchTimer_mean_ns(&t)) * 1e3);
+
+    for(size_t p = 0; p < SDL_arraysize(resampler_presets); ++p){
+        const ResamplerPreset *preset = &resampler_presets[p];
+        Uint32 num_expected = 0;
+        if(!Resampler_init(&rs, preset, in_freq, out_freq)){
+            goto done;
+        }
+        rs.process = resample_scalar;
+        num_expected = bench_run_resampler(&rs, in, num_in, expected, out_capacity);
+
+        for(size_t k = 0; k < SDL_arraysize(dsp_kernels); ++k){
+            const DspKernel *kernel = &dsp_kernels[k];
+            char case_name[64];
+            Uint32 num_out = 0;
+            if(kernel->supported && !kernel->supported()){
+                continue;
+            }
+            rs.process = kernel->resample;
+            SDL_zero(t);
+            for(int i = 0; i < iterations; ++i){
+                BenchTimer_start(&t);
+                num_out = bench_run_resampler(&rs, in, num_in, out, out_capacity);
+                BenchTimer_stop(&t);
+            }
+            float max_error = (num_out == num_expected) ? 0.0f : 1.0f;
+            for(Uint32 i = 0; (num_out == num_expected) && (i < num_out * 2); ++i){
+                max_error = SDL_max(max_error, SDL_fabsf(out[i] - expected[i]));
+            }
+            SDL_snprintf(case_name, sizeof(case_name), "%s_%s", preset->name, kernel->name);
+            if(kernel != dsp_kernel){
+                bench_report("resample", case_name, &t, ",\"taps\":%u,\"mframes_per_s\":%.1f,\"max_error\":%g,\"selected\":false",
+                             rs.taps, (num_out / BenchTimer_mean_ns(&t)) * 1e3, max_error);
+                continue;
+            }
+
+            static const double ripple_hz[] = { 20, 50, 100, 200, 500, 1000, 2000, 3000, 5000, 7000, 9000, 11000, 13000, 14000, 15000 };
+            const double mframes_per_s = (num_out / BenchTimer_mean_ns(&t)) * 1e3;
+            double lowest = 0.0, highest = 0.0, residual_db, image_db, alias_db, rare_db;
+            for(size_t h = 0; h < SDL_arraysize(ripple_hz); ++h){
+                bench_write_tone(in, num_in, ripple_hz[h], in_freq);
+                const Uint32 count = bench_run_resampler(&rs, in, num_in, out, out_capacity);
+                const double level = bench_fit_tone(out, count, ripple_hz[h], out_freq, &residual_db);
+                lowest = (h == 0) ? level : SDL_min(lowest, level);
+                highest = (h == 0) ? level : SDL_max(highest, level);
+            }
+            bench_write_tone(in, num_in, 20000.0, in_freq);
+            const double response_20k = bench_fit_tone(out, bench_run_resampler(&rs, in, num_in, out, out_capacity), 20000.0, out_freq, &residual_db);
+            bench_write_tone(in, num_in, 19000.0, in_freq);
+            bench_fit_tone(out, bench_run_resampler(&rs, in, num_in, out, out_capacity), 19000.0, out_freq, &image_db);
+
+            Resampler_free(&rs);
+            if(!Resampler_init(&rs, preset, 96000, out_freq)){
+                goto done;
+            }
+            bench_write_tone(in, num_in * 2, 30000.0, 96000);
+            const Uint32 count = bench_run_resampler(&rs, in, num_in * 2, out, out_capacity);
+            double power = 0.0;
+            for(Uint32 i = 1024; i < count - 1024; ++i){
+                power += (double) out[i*2] * out[i*2];
+            }
+            alias_db = 10.0 * SDL_log10(SDL_max(power / (count - 2048), 1e-24) / 0.125); // against the tone's own power
+
+            // 8000 phases, more than there are filters, so this is how close the nearest one gets
+            Resampler_free(&rs);
+            if(!Resampler_init(&rs, preset, 22254, out_freq)){
+                goto done;
+            }
+            bench_write_tone(in, 22254, 7000.0, 22254);
+            bench_fit_tone(out, bench_run_resampler(&rs, in, 22254, out, out_capacity), 7000.0, out_freq, &rare_db);
+            Resampler_free(&rs);
+            if(!Resampler_init(&rs, preset, in_freq, out_freq)){
+                goto done;
+            }
+            for(Uint32 i = 0; i < num_in * 2; ++i){
+                in[i] = (float) (Sint32) (i * 2654435761u) * (0.5f / 2147483648.0f);
+            }
+
+            bench_report("resample", case_name, &t, ",\"taps\":%u,\"mframes_per_s\":%.1f,\"max_error\":%g,\"selected\":true,"
+                         "\"ripple_db\":%.4f,\"response_20k_db\":%.2f,\"image_db\":%.1f,\"alias_db\":%.1f,\"rare_ratio_db\":%.1f",
+                         rs.taps, mframes_per_s, max_error, highest - lowest, response_20k, image_db, alias_db, rare_db);
+            if(!((highest - lowest) <= limits[p].ripple_db) || !(image_db <= limits[p].image_db) ||
+               !(alias_db <= limits[p].alias_db) || !(rare_db <= limits[p].rare_ratio_db)){
+                bench_fail("resample", case_name, "ripple %.4fdB (limit %g), images %.1fdB (%g), aliasing %.1fdB (%g), rare ratio %.1fdB (%g)",
+                           highest - lowest, limits[p].ripple_db, image_db, limits[p].image_db,
+                           alias_db, limits[p].alias_db, rare_db, limits[p].rare_ratio_db);
+            }
+        }
+        Resampler_free(&rs);
+    }
+
+done:
+    Resampler_free(&rs);
+    SDL_FreeAudioStream(cvt);
+    SDL_free(expected);
+    SDL_free(out);
+    SDL_free(in);
+}
+
+/* Every band at +12dB through a second of impulse response at each rate a
+   device might come back at, so a band that's unstable there shows up. */
+static void bench_eq_stability(void){
+    static const int rates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 96000 };
+    const int saved_freq = audio_out_freq;
+    float values[EQ_NUM_BANDS + 1];
+    EqParams params;
+
+    for(int b = 0; b <= EQ_NUM_BANDS; ++b){
+        values[b] = 1.0f;
+    }
+    for(size_t r = 0; r < SDL_arraysize(rates); ++r){
+        char name[32];
+        float samples[2 * 64];
+        EqState state;
+        float peak = 0.0f;
+        int flat = 0;
+        audio_out_freq = rates[r];
+        EqParams_compute(&params, values);
+        for(int b = 0; b < EQ_NUM_BANDS; ++b){
+            flat += (params.coeffs.b0[b] == 1.0f && params.coeffs.a1[b] == 0.0f) ? 1 : 0;
+        }
+        SDL_zero(state);
+        for(int block = 0; block < rates[r] / 64; ++block){
+            SDL_memset(samples, 0, sizeof(samples));
+            if(block == 0){
+                samples[0] = samples[1] = 1.0f;
+            }
+            eq_process_scalar(samples, 64, &params.coeffs, &state);
+            for(int i = 0; i < 2 * 64; ++i){
+                // NaN fails the comparison too
+                peak = (samples[i] <= peak) ? peak : samples[i];
+                peak = (-samples[i] <= peak) ? peak : -samples[i];
+            }
+        }
+        SDL_snprintf(name, sizeof(name), "stability_%dhz", rates[r]);
+        // ten bands of +12dB in series can't ring past this without being unstable
+        if(peak < 1e4f){
+            printf("{\"suite\":\"eq\",\"case\":\"%s\",\"flat_bands\":%d,\"peak\":%g}\n", name, flat, peak);
+        }else{
+            printf("{\"suite\":\"eq\",\"case\":\"%s\",\"flat_bands\":%d,\"peak\":null}\n", name, flat);
+            bench_fail("eq", name, "impulse response peaked at %g", peak);
+        }
+    }
+    fflush(stdout);
+    audio_out_freq = saved_freq;
+}
+
+/* One callback's worth of EQ for every kernel this CPU supports, scalar first
+   so the others can report how far off it they are. */
+static void bench_eq(void){
+    const Uint32 num_frames = AUDIO_DEVICE_SAMPLES;
+    const int iterations = 5000;
+    const double period_ns = (AUDIO_DEVICE_SAMPLES * 1e9) / audio_out_freq;
+    float *input = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    float *samples = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    float *expected = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    EqParams params;
+    double scalar_ns = 0.0;
+
+    if(!input || !samples || !expected){
+        goto done;
+    }
+    EqParams_compute(&params, bench_eq_values);
+    Uint32 seed = 1;
+    for(Uint32 i = 0; i < num_frames * 2; ++i){
+        seed = (seed * 1664525) + 1013904223;
+        input[i] = ((float) (seed >> 8) / (float) (1 << 23)) - 1.0f;
+    }
+
+    for(int k = (int) SDL_arraysize(dsp_kernels) - 1; k >= 0; --k){
+        const DspKernel *kernel = &dsp_kernels[k];
+        EqState state;
+        BenchTimer t;
+        float max_error = 0.0f;
+        if(kernel->supported && !kernel->supported()){
+            continue;
+        }
+        SDL_zero(state);
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            SDL_memcpy(samples, input, num_frames * AUDIO_OUT_FRAME_SIZE);
+            BenchTimer_start(&t);
+            kernel->eq(samples, num_frames, &params.coeffs, &state);
+            BenchTimer_stop(&t);
+            if(i == 0){
+                if(kernel->eq == eq_process_scalar){
+                    SDL_memcpy(expected, samples, num_frames * AUDIO_OUT_FRAME_SIZE);
+                }
+                for(Uint32 j = 0; j < num_frames * 2; ++j){
+                    max_error = SDL_max(max_error, SDL_fabsf(samples[j] - expected[j]));
+                }
+            }
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        if(kernel->eq == eq_process_scalar){
+            scalar_ns = ns;
+        }
+        bench_report("eq", kernel->name, &t, ",\"frames\":%u,\"budget_pct\":%.4f,\"speedup\":%.2f,\"max_error\":%g,\"selected\":%s",
+                     num_frames, (ns * 100.0) / period_ns, scalar_ns / ns, max_error, (kernel == dsp_kernel) ? "true" : "false");
+    }
+
+done:
+    SDL_free(input);
+    SDL_free(samples);
+    SDL_free(expected);
+    bench_eq_stability();
+}
+
+/* feed_audio_device_callback fed from a ring that's always full (or always
+   empty), so only the callback itself is on the clock. */
+static void bench_callback(void){
+    static const struct{
+        const char *name;
+        float volume;
+        float balance;
+        float drag;   // if not 0, volume alternates by this much every callback
+        SDL_bool underrun;
+        SDL_bool eq;
+    } cases[] = {
+        { "unity",          1.0f, 0.5f, 0.0f,  SDL_FALSE, SDL_FALSE },
+        { "volume",         0.5f, 0.5f, 0.0f,  SDL_FALSE, SDL_FALSE },
+        { "balance_left",   1.0f, 0.2f, 0.0f,  SDL_FALSE, SDL_FALSE },
+        { "volume_balance", 0.5f, 0.8f, 0.0f,  SDL_FALSE, SDL_FALSE },
+        { "volume_drag",    0.5f, 0.5f, 0.1f,  SDL_FALSE, SDL_FALSE },
+        { "eq",             1.0f, 0.5f, 0.0f,  SDL_FALSE, SDL_TRUE  },
+        { "eq_volume",      0.5f, 0.5f, 0.0f,  SDL_FALSE, SDL_TRUE  },
+        { "underrun",       1.0f, 0.5f, 0.0f,  SDL_TRUE,  SDL_FALSE },
+    };
+    const int iterations = 20000;
+    const int len = AUDIO_DEVICE_SAMPLES * AUDIO_OUT_FRAME_SIZE;
+    // how long one callback's worth of audio lasts at the device rate
+    const double period_ns = (AUDIO_DEVICE_SAMPLES * 1e9) / audio_out_freq;
+    AudioSource *src = (AudioSource *) SDL_calloc(1, sizeof(AudioSource));
+    float *pattern = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    Uint8 *output = (Uint8 *) SDL_malloc(len);
+
+    if(!src || !pattern || !output){
+        goto done;
+    }
+    src->ring.capacity = AUDIO_RING_FRAMES;
+    src->ring.samples = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    if(!src->ring.samples){
+        goto done;
+    }
+    SDL_AtomicSet(&src->refcount, 1);
+    SDL_AtomicSet(&src->finished, 1); // no decoder thread, we refill the ring ourselves
+    for(Uint32 i = 0; i < AUDIO_RING_FRAMES * AUDIO_OUT_CHANNELS; ++i){
+        pattern[i] = ((float) (i % 200) / 100.0f) - 1.0f;
+    }
+    SDL_AtomicSetPtr((void **) &source, src);
+
+    for(size_t c = 0; c < SDL_arraysize(cases); ++c){
+        BenchTimer t;
+        SDL_zero(t);
+        device_dsp.applied_gain[0] = device_dsp.applied_gain[1] = 1.0f;
+        atomic_set_float(&audio_balance, cases[c].balance);
+        publish_eq(cases[c].eq ? bench_eq_values : eq_values);
+        for(int i = 0; i < iterations; ++i){
+            AudioRing *ring = &src->ring;
+            const Uint32 available = AudioRing_available(ring);
+            if(cases[c].underrun){
+                while(AudioRing_read(ring, (float *) output, AUDIO_DEVICE_SAMPLES)){}
+            }else if(available < AUDIO_DEVICE_SAMPLES){
+                AudioRing_write(ring, pattern, ring->capacity - available);
+            }
+            atomic_set_float(&audio_volume, cases[c].volume + ((i & 1) ? cases[c].drag : 0.0f));
+
+            BenchTimer_start(&t);
+            feed_audio_device_callback(NULL, output, len);
+            BenchTimer_stop(&t);
+        }
+        bench_report("callback", cases[c].name, &t, ",\"volume\":%.2f,\"balance\":%.2f,\"frames\":%d,\"budget_pct\":%.4f",
+                     cases[c].volume, cases[c].balance, AUDIO_DEVICE_SAMPLES, (BenchTimer_mean_ns(&t) * 100.0) / period_ns);
+    }
+
+    SDL_AtomicSetPtr((void **) &source, NULL);
+    publish_eq(eq_values);
+    atomic_set_float(&audio_volume, 1.0f);
+    atomic_set_float(&audio_balance, 0.5f);
+    device_dsp.applied_gain[0] = device_dsp.applied_gain[1] = 1.0f;
+
+done:
+    AudioSource_free(src);
+    SDL_free(pattern);
+    SDL_free(output);
+}
+
+/* A source with no decoder behind it, the benchmark keeps its ring topped up. */
+static AudioSource *bench_ring_source(void){
+    AudioSource *src = (AudioSource *) SDL_calloc(1, sizeof(AudioSource));
+    if(!src){
+        return NULL;
+    }
+    src->ring.capacity = AUDIO_RING_FRAMES;
+    src->ring.samples = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    SDL_AtomicSet(&src->refcount, 1);
+    SDL_AtomicSet(&src->finished, 1);
+    if(!src->ring.samples){
+        AudioSource_free(src);
+        return NULL;
+    }
+    return src;
+}
+
+static void bench_fill_ring(AudioSource *src, const float *pattern){
+    AudioRing *ring = &src->ring;
+    const Uint32 available = AudioRing_available(ring);
+    if(available < (AUDIO_DEVICE_SAMPLES * 2)){
+        AudioRing_write(ring, pattern, ring->capacity - available);
+    }
+}
+
+/* Empties the mixer without freeing the sources, bench_mix owns them. */
+static void bench_take_back_voices(void){
+    lock_audio_device();
+    Mixer_run_commands();
+    for(int v = 0; v < MIXER_MAX_VOICES; ++v){
+        if(mixer_voices[v].src){
+            Mixer_retire(&mixer_voices[v]);
+        }
+    }
+    unlock_audio_device();
+    SDL_AtomicSet(&mixer_retired_tail, SDL_AtomicGet(&mixer_retired_head));
+    mixer_voices_out = 0;
+}
+
+/* Summing voices: the mix kernels on their own, then whole callbacks with a
+   track and 0 to MIXER_MAX_VOICES voices on top of it. */
+static void bench_mix(void){
+    static const int voice_counts[] = { 0, 1, 4, MIXER_MAX_VOICES };
+    const Uint32 num_frames = AUDIO_DEVICE_SAMPLES;
+    const int iterations = 20000;
+    const int len = AUDIO_DEVICE_SAMPLES * AUDIO_OUT_FRAME_SIZE;
+    const double period_ns = (AUDIO_DEVICE_SAMPLES * 1e9) / audio_out_freq;
+    float *pattern = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    float *output = (float *) SDL_malloc(len);
+    AudioSource *music = bench_ring_source();
+    AudioSource *voices[MIXER_MAX_VOICES];
+    double scalar_ns = 0.0;
+
+    SDL_zero(voices);
+    if(!pattern || !output || !music){
+        goto done;
+    }
+    for(Uint32 i = 0; i < AUDIO_RING_FRAMES * AUDIO_OUT_CHANNELS; ++i){
+        pattern[i] = ((float) (i % 200) / 100.0f) - 1.0f;
+    }
+
+    // scalar is last in the table, time it first so the others have something to compare to
+    for(int k = (int) SDL_arraysize(dsp_kernels) - 1; k >= 0; --k){
+        const DspKernel *kernel = &dsp_kernels[k];
+        BenchTimer t;
+        if(kernel->supported && !kernel->supported()){
+            continue;
+        }
+        SDL_memset(output, 0, len);
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            BenchTimer_start(&t);
+            // alternating sign so the sum stays put
+            kernel->mix(output, pattern, num_frames, (i & 1) ? 0.25f : -0.25f, (i & 1) ? 0.5f : -0.5f);
+            BenchTimer_stop(&t);
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        if(!kernel->supported){
+            scalar_ns = ns;
+        }
+        bench_report("mix", kernel->name, &t, ",\"mframes_per_s\":%.1f,\"speedup\":%.2f,\"selected\":%s",
+                     (num_frames / ns) * 1e3, scalar_ns / ns, (kernel == dsp_kernel) ? "true" : "false");
+    }
+
+    SDL_AtomicSetPtr((void **) &source, music);
+    for(size_t c = 0; c < SDL_arraysize(voice_counts); ++c){
+        char case_name[32];
+        BenchTimer t;
+
+        for(int v = 0; v < voice_counts[c]; ++v){
+            voices[v] = voices[v] ? voices[v] : bench_ring_source();
+            if(!voices[v] || !Mixer_add_voice(voices[v], 0.25f, 0.25f, 0, SDL_FALSE)){
+                goto stop;
+            }
+        }
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            bench_fill_ring(music, pattern);
+            for(int v = 0; v < voice_counts[c]; ++v){
+                bench_fill_ring(voices[v], pattern);
+            }
+            BenchTimer_start(&t);
+            feed_audio_device_callback(NULL, (Uint8 *) output, len);
+            BenchTimer_stop(&t);
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "callback_%d_voices", voice_counts[c]);
+        bench_report("mix", case_name, &t, ",\"frames\":%d,\"budget_pct\":%.4f", AUDIO_DEVICE_SAMPLES, (BenchTimer_mean_ns(&t) * 100.0) / period_ns);
+
+        bench_take_back_voices();
+    }
+
+stop:
+    bench_take_back_voices();
+    SDL_AtomicSetPtr((void **) &source, NULL);
+
+done:
+    for(int v = 0; v < MIXER_MAX_VOICES; ++v){
+        AudioSource_free(voices[v]);
+    }
+    AudioSource_free(music);
+    SDL_free(pattern);
+    SDL_free(output);
+}
+
+/* 16-bit stereo sine. At 44100Hz the decoder has to resample and convert,
+   at 48000Hz it gets mapped and converted in the callback. */
+static SDL_bool bench_write_wav(const char *fname, const Uint32 freq, const Uint32 seconds){
+    const Uint32 num_frames = freq * seconds;
+    const Uint32 data_len = num_frames * 4;
+    SDL_RWops *rw = SDL_RWFromFile(fname, "wb");
+    Sint16 chunk[DECODE_CHUNK_FRAMES * 2];
+    SDL_bool ok = SDL_TRUE;
+
+    if(!rw){
+        return SDL_FALSE;
+    }
+    ok &= SDL_RWwrite(rw, "RIFF", 4, 1) && SDL_WriteLE32(rw, 36 + data_len) && SDL_RWwrite(rw, "WAVEfmt ", 8, 1);
+    ok &= SDL_WriteLE32(rw, 16) && SDL_WriteLE16(rw, 1) && SDL_WriteLE16(rw, 2) && SDL_WriteLE32(rw, freq);
+    ok &= SDL_WriteLE32(rw, freq * 4) && SDL_WriteLE16(rw, 4) && SDL_WriteLE16(rw, 16);
+    ok &= SDL_RWwrite(rw, "data", 4, 1) && SDL_WriteLE32(rw, data_len);
+    for(Uint32 frame = 0; ok && (frame < num_frames); frame += DECODE_CHUNK_FRAMES){
+        const Uint32 count = SDL_min(DECODE_CHUNK_FRAMES, num_frames - frame);
+        for(Uint32 i = 0; i < count; ++i){
+            const Sint16 sample = (Sint16) (SDL_sin((frame + i) * (2.0 * M_PI * 440.0 / freq)) * 16000.0);
+            chunk[i*2] = chunk[i*2+1] = SDL_SwapLE16(sample);
+        }
+        ok &= (SDL_RWwrite(rw, chunk, count * 4, 1) == 1);
+    }
+    return (SDL_RWclose(rw) == 0) && ok;
+}
+
+/* open_new_audio_file, then how long until the callback would have
+   something to play, how long the decoder spent converting the lot, and
+   how long a seek takes to come up with audio. */
+static void bench_audio_file(const char *name, const char *fname, const int iterations){
+    BenchTimer open_time, first_sample, decode, seek;
+    float *scratch = (float *) SDL_malloc(AUDIO_RING_FRAMES * AUDIO_OUT_FRAME_SIZE);
+    Uint64 num_frames = 0;
+    SDL_bool mapped = SDL_FALSE;
+    char case_name[64];
+
+    if(!scratch){
+        return;
+    }
+    SDL_zero(open_time);
+    SDL_zero(first_sample);
+    SDL_zero(decode);
+    SDL_zero(seek);
+    for(int i = 0; i < iterations; ++i){
+        BenchTimer_start(&open_time);
+        first_sample.start = open_time.start;
+        if(!open_new_audio_file(fname)){
+            fprintf(stderr, "bench: couldn't open %s: %s\n", fname, SDL_GetError());
+            SDL_free(scratch);
+            return;
+        }
+        BenchTimer_stop(&open_time);
+
+        // the device is never started, we play the part of the callback
+        while(!AudioSource_available(source) && !SDL_AtomicGet(&source->finished)){
+            SDL_Delay(0);
+        }
+        BenchTimer_stop(&first_sample);
+
+        num_frames = 0;
+        Uint64 read_ticks = 0;
+        for(;;){
+            const SDL_bool finished = SDL_AtomicGet(&source->finished) ? SDL_TRUE : SDL_FALSE;
+            const Uint64 read_start = SDL_GetPerformanceCounter();
+            const Uint32 got = AudioSource_read(source, scratch, AUDIO_RING_FRAMES);
+            read_ticks += SDL_GetPerformanceCounter() - read_start;
+            num_frames += got;
+            if(finished && !got){
+                break;
+            }else if(!got){
+                SDL_Delay(1);
+            }
+        }
+        if(num_frames == 0){
+            // the decoder thread couldn't open it, and has already said why
+            stop_audio();
+            SDL_free(scratch);
+            return;
+        }
+        // wall clock would mostly measure DECODE_IDLE_MS naps, count the decoder's working time instead.
+        // Mapped files are converted by the callback, so that's where their time goes.
+        const Uint64 busy_ticks = source->busy_ticks + (source->map ? read_ticks : 0);
+        decode.total += busy_ticks;
+        decode.min = (decode.iterations == 0) ? busy_ticks : SDL_min(decode.min, busy_ticks);
+        decode.iterations++;
+        mapped = source->map ? SDL_TRUE : SDL_FALSE;
+
+        // should cost the same whatever the file's length
+        BenchTimer_start(&seek);
+        AudioSource_seek(source, SDL_AtomicGet(&source->length) / 2);
+        while(SDL_AtomicGet(&source->seek_done) != SDL_AtomicGet(&source->seek_request)){
+            SDL_Delay(0);
+        }
+        AudioSource_sync_seek(source);
+        while(!AudioSource_available(source)){
+            SDL_Delay(0);
+        }
+        BenchTimer_stop(&seek);
+        stop_audio();
+    }
 
-                const SDL_Point pt = {e.button.x, e.button.y};
+    const double seconds = (double) num_frames / audio_out_freq;
+    SDL_snprintf(case_name, sizeof(case_name), "%s/open", name);
+    bench_report("audio_file", case_name, &open_time, "");
+    SDL_snprintf(case_name, sizeof(case_name), "%s/first_sample", name);
+    bench_report("audio_file", case_name, &first_sample, "");
+    SDL_snprintf(case_name, sizeof(case_name), "%s/decode", name);
+    bench_report("audio_file", case_name, &decode, ",\"frames\":%" SDL_PRIu64 ",\"seconds\":%.1f,\"realtime_factor\":%.1f,\"mapped\":%s",
+                 num_frames, seconds, (seconds * 1e9) / BenchTimer_mean_ns(&decode), mapped ? "true" : "false");
+    SDL_snprintf(case_name, sizeof(case_name), "%s/seek", name);
+    bench_report("audio_file", case_name, &seek, "");
+    SDL_free(scratch);
+}
 
-                if(e.button.button != SDL_BUTTON_LEFT){
-                    break;
-                }
-                if(!skin->pressed){
-                    for(int i = 0; i < SDL_arraysize(skin->buttons); ++i){
-                        WinAmpSkinButton *btn = &skin->buttons[i];
-                        if(SDL_PointInRect(&pt, &btn->dst_rect)){
-                            skin->pressed = btn;
-                            break;
-                        }
-                    }
-                }
+static void bench_audio(void){
+    static const struct{ const char *name; const char *fname; Uint32 freq; Uint32 seconds; int iterations; } files[] = {
+        { "music.wav",      "music.wav",                    0,   0, 10 },
+        { "synth_30s",      "myamp-bench-30s.wav",      44100,  30, 10 },
+        { "synth_600s",     "myamp-bench-600s.wav",     44100, 600,  2 },
+        { "synth_600s_48k", "myamp-bench-600s-48k.wav", 48000, 600,  2 },
+    };
 
-                if(!skin->pressed){
-                    for(int i = 0; i < SDL_arraysize(skin->sliders); ++i){
-                        WinAmpSkinSlider *slider = &skin->sliders[i];
-                        if(SDL_PointInRect(&pt, &slider->dst_rect)){
-                            skin->pressed = &slider->knob;
-                            break;
-                        }
-                    }
-                }
-                if(skin->pressed){
-                    SDL_CaptureMouse(SDL_TRUE);
-                }
+    for(size_t i = 0; i < SDL_arraysize(files); ++i){
+        if(files[i].seconds && !bench_write_wav(files[i].fname, files[i].freq, files[i].seconds)){
+            fprintf(stderr, "bench: couldn't write %s: %s\n", files[i].fname, SDL_GetError());
+            continue;
+        }
+        bench_audio_file(files[i].name, files[i].fname, files[i].iterations);
+        if(files[i].seconds){
+            remove(files[i].fname);
+        }
+    }
+}
+
+/* Reads every skin bitmap out of `fname` without decoding it. */
+static SDL_bool bench_read_skin_files(const char *fname, Uint8 *scratch, const size_t scratch_len){
+    ZipArchive *zip = ZipArchive_load(fname);
+    int found = 0;
+    for(int i = 0; i < WASBMP_COUNT; ++i){
+        SDL_RWops *rw = openrw(zip, fname, skin_bitmap_names[i]);
+        if(rw){
+            while(SDL_RWread(rw, scratch, 1, scratch_len) > 0){}
+            SDL_RWclose(rw);
+            found++;
+        }
+    }
+    ZipArchive_unload(zip);
+    return found ? SDL_TRUE : SDL_FALSE;
+}
+
+/* REGION.TXT that shouldn't shape anything: counts past what was parsed,
+   big enough to overflow an int sum, that no PointList can back. */
+static void bench_region(void){
+    static const char *bad[] = {
+        "[Normal]\nNumPoints=1100000000\nPointList=0,0,275,0,275,116\n",
+        "[Normal]\nNumPoints=2147483647,3\nPointList=0,0,275,0,275,116,0,0,275,0,275,116\n",
+        "[Normal]\nNumPoints=1073741824,1073741824,3\nPointList=0,0,275,0,275,116\n",
+        "[Normal]\nNumPoints=2,3\nPointList=0,0,275,0,0,0,275,0,275,116\n",
+    };
+    Uint8 *mask = (Uint8 *) SDL_malloc(SKIN_WINDOW_W * SKIN_WINDOW_H);
+    char case_name[32];
+
+    if(!mask){
+        return;
+    }
+    for(size_t i = 0; i < SDL_arraysize(bad); ++i){
+        BenchTimer t;
+        SDL_bool shaped = SDL_FALSE;
+        SDL_zero(t);
+        for(int j = 0; j < 100; ++j){
+            BenchTimer_start(&t);
+            shaped |= parse_region_txt(SDL_RWFromConstMem(bad[i], (int) SDL_strlen(bad[i])), mask);
+            BenchTimer_stop(&t);
+        }
+        for(int j = 0; j < SKIN_WINDOW_W * SKIN_WINDOW_H; ++j){
+            shaped |= mask[j] ? SDL_FALSE : SDL_TRUE;
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "region_bad_%d", (int) i);
+        bench_report("skin", case_name, &t, ",\"shaped\":%s", shaped ? "true" : "false");
+        if(shaped){
+            bench_fail("skin", case_name, "REGION.TXT with counts its PointList can't back shaped the window");
+        }
+    }
+    SDL_free(mask);
+}
 
+static void bench_skin(void){
+    static const char *skins[] = { "base.wsz", "atlas.wsz", "bugs.wsz", "base" };
+    const size_t scratch_len = 64 * 1024;
+    Uint8 *scratch = (Uint8 *) SDL_malloc(scratch_len);
+    char case_name[64];
+
+    if(!scratch){
+        return;
+    }
+    for(size_t s = 0; s < SDL_arraysize(skins); ++s){
+        BenchTimer t;
+        DecodedSkin *decoded = NULL;
+
+        // ZipArchive_load + openrw, i.e. finding and inflating the bitmaps
+        SDL_zero(t);
+        for(int i = 0; i < 20; ++i){
+            BenchTimer_start(&t);
+            const SDL_bool found = bench_read_skin_files(skins[s], scratch, scratch_len);
+            BenchTimer_stop(&t);
+            if(!found){
                 break;
             }
-            case SDL_MOUSEBUTTONUP:{
+        }
+        if(t.iterations < 20){
+            fprintf(stderr, "bench: no skin bitmaps in %s\n", skins[s]);
+            continue;
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "%s/read", skins[s]);
+        bench_report("skin", case_name, &t, "");
 
-                if(e.button.button != SDL_BUTTON_LEFT){
-                    break;
+        // ...plus BMP decoding and atlas packing, what a cache miss costs
+        SDL_zero(t);
+        for(int i = 0; i < 20; ++i){
+            DecodedSkin_free(decoded);
+            BenchTimer_start(&t);
+            decoded = decode_skin_files(skins[s]);
+            BenchTimer_stop(&t);
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "%s/decode", skins[s]);
+        bench_report("skin", case_name, &t, ",\"atlas_w\":%d,\"atlas_h\":%d",
+                     (decoded && decoded->atlas) ? decoded->atlas->w : 0, (decoded && decoded->atlas) ? decoded->atlas->h : 0);
+        DecodedSkin_free(decoded);
+        decoded = NULL;
+
+        // what the loader thread does on a first start: hash, miss, decode, write the cache
+        Uint64 hash, len;
+        if(pref_dir && hash_file(skins[s], &hash, &len)){
+            char *path = skin_cache_path(hash, "");
+            SDL_zero(t);
+            for(int i = 0; path && (i < 20); ++i){
+                DecodedSkin_free(decoded);
+                remove(path);
+                BenchTimer_start(&t);
+                decoded = decode_skin(skins[s]);
+                BenchTimer_stop(&t);
+            }
+            SDL_free(path);
+            SDL_snprintf(case_name, sizeof(case_name), "%s/cold", skins[s]);
+            bench_report("skin", case_name, &t, "");
+        }
+
+        // ...and on every start after that: hash, map
+        SDL_zero(t);
+        for(int i = 0; i < 20; ++i){
+            DecodedSkin_free(decoded);
+            BenchTimer_start(&t);
+            decoded = decode_skin(skins[s]);
+            BenchTimer_stop(&t);
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "%s/warm", skins[s]);
+        bench_report("skin", case_name, &t, ",\"cached\":%s", (decoded && decoded->cache) ? "true" : "false");
+
+        // ...and the texture upload left for the render thread
+        SDL_zero(t);
+        for(int i = 0; i < 20; ++i){
+            BenchTimer_start(&t);
+            apply_skin(&skin, decoded);
+            BenchTimer_stop(&t);
+        }
+        SDL_snprintf(case_name, sizeof(case_name), "%s/apply", skins[s]);
+        bench_report("skin", case_name, &t, "");
+        if(!hit_map_matches_controls(&skin, skin.region)){
+            bench_fail("skin", case_name, "hit map doesn't match the controls: %s", SDL_GetError());
+        }
+        DecodedSkin_free(decoded);
+    }
+    SDL_free(scratch);
+    bench_region();
+}
+
+/* Frames at 1x and scaled up, each with its time against the same case at
+   1x, overall and per window pixel. The atlas is scaled once by scale_skin
+   and frame_target is the window's size, so a frame is the same draw calls
+   at every scale and nothing is stretched: what a frame costs per pixel
+   should hold, a software renderer still has scale squared times the
+   pixels to fill. Draw calls that differ from 1x, or a frame_target that
+   would be stretched to the window, fail. The screen is SKIN_MAX_SCALE
+   times the skin, the viewport picks the window's size out of it. */
+static void bench_draw(void){
+    static const struct{ const char *name; int iterations; } cases[] = {
+        { "full",   500 },
+        { "slider", 2000 },
+        { "button", 2000 },
+        { "idle",   100000 },
+    };
+    static const struct{ const char *suffix; float scale; SkinFilter filter; } scales[] = {
+        { "",             1.0f, SKIN_FILTER_NEAREST },
+        { "@2x",          2.0f, SKIN_FILTER_NEAREST },
+        { "@3x",          3.0f, SKIN_FILTER_NEAREST },
+        { "@4x",          4.0f, SKIN_FILTER_NEAREST },
+        { "@4x_scale2x",  4.0f, SKIN_FILTER_SCALE2X },
+    };
+    const float scale = skin_scale;
+    const SkinFilter filter = skin_filter;
+    double base_ns[SDL_arraysize(cases)] = { 0.0 };
+    Uint64 base_draw_calls[SDL_arraysize(cases)] = { 0 };
+    char case_name[64];
+
+    load_skin(&skin, "base.wsz");
+    for(size_t s = 0; s < SDL_arraysize(scales); ++s){
+        BenchTimer t;
+        SDL_Rect viewport = { 0, 0, 0, 0 };
+
+        // what Ctrl+D costs, from 1x to this and back
+        SDL_zero(t);
+        skin_filter = scales[s].filter;
+        for(int i = 0; i < 20; ++i){
+            set_skin_scale(&skin, 1.0f);
+            BenchTimer_start(&t);
+            set_skin_scale(&skin, scales[s].scale);
+            BenchTimer_stop(&t);
+        }
+        if(scales[s].scale != 1.0f){
+            SDL_snprintf(case_name, sizeof(case_name), "rescale%s", scales[s].suffix);
+            bench_report("draw", case_name, &t, ",\"atlas_scale\":%d", skin.atlas_scale);
+        }
+
+        scaled_window_size(&viewport.w, &viewport.h);
+        SDL_RenderSetViewport(renderer, &viewport);
+        int target_w = 0, target_h = 0;
+        if(skin.frame_target){
+            SDL_QueryTexture(skin.frame_target, NULL, NULL, &target_w, &target_h);
+        }
+        if((target_w != viewport.w) || (target_h != viewport.h)){
+            SDL_snprintf(case_name, sizeof(case_name), "frame%s", scales[s].suffix);
+            bench_fail("draw", case_name, "frame_target is %dx%d for a %dx%d window", target_w, target_h, viewport.w, viewport.h);
+        }
+        const double window_pixels = (double) viewport.w * (double) viewport.h;
+        for(size_t c = 0; c < SDL_arraysize(cases); ++c){
+            const Uint64 draw_calls_before = draw_calls;
+            SDL_zero(t);
+            for(int i = 0; i < cases[c].iterations; ++i){
+                switch(c){
+                    case 0: mark_all_dirty(&skin); break;
+                    case 1: mark_dirty(&skin, &skin.sliders[WASSLD_VOLUME].dst_rect); break;
+                    case 2: mark_dirty(&skin, &skin.buttons[WASBTN_PLAY].dst_rect); break;
+                    default: break;
                 }
+                BenchTimer_start(&t);
+                draw_frame(renderer, &skin);
+                BenchTimer_stop(&t);
+            }
+            const Uint64 calls = draw_calls - draw_calls_before;
+            const double ns = BenchTimer_mean_ns(&t);
+            base_ns[c] = (s == 0) ? ns : base_ns[c];
+            base_draw_calls[c] = (s == 0) ? calls : base_draw_calls[c];
+            SDL_snprintf(case_name, sizeof(case_name), "%s%s", cases[c].name, scales[s].suffix);
+            bench_report("draw", case_name, &t, ",\"draw_calls\":%" SDL_PRIu64 ",\"vs_1x\":%.2f,\"per_pixel_vs_1x\":%.2f",
+                         calls, ns / base_ns[c], (ns / window_pixels) / (base_ns[c] / (SKIN_WINDOW_W * SKIN_WINDOW_H)));
+            if(calls != base_draw_calls[c]){
+                bench_fail("draw", case_name, "%" SDL_PRIu64 " draw calls, %" SDL_PRIu64 " at 1x", calls, base_draw_calls[c]);
+            }
+        }
+    }
 
-                if(skin->pressed){
-                    SDL_CaptureMouse(SDL_FALSE);
-                    if(skin->pressed->onClick != NULL){
-                        const SDL_Point pt = {e.button.x, e.button.y};
-                        if(SDL_PointInRect(&pt, &skin->pressed->dst_rect)){
-                            skin->pressed->onClick();
-                        }
-                    }
-                    skin->pressed = NULL;
+    skin_filter = filter;
+    skin_scale = scale;
+    scale_skin(&skin);
+    SDL_RenderSetViewport(renderer, NULL);
+}
+
+/* update_visualizer's per frame work, minus the texture upload. */
+static void bench_vis(void){
+    static const struct{ const char *name; VisMode mode; } cases[] = {
+        { "spectrum", VIS_SPECTRUM },
+        { "scope",    VIS_SCOPE },
+    };
+    const int iterations = 20000;
+    const Uint32 num_frames = 4096;
+    float *frames = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    Uint32 *pixels = (Uint32 *) SDL_malloc(VIS_W * VIS_H * sizeof(Uint32));
+    const VisMode mode = visualizer.mode;
+
+    if(!frames || !pixels){
+        goto done;
+    }
+    for(Uint32 i = 0; i < num_frames; ++i){
+        const double t = (double) i / audio_out_freq;
+        frames[i*2]   = (float) ((0.5 * SDL_sin(2.0 * M_PI * 110.0 * t)) + (0.1 * SDL_sin(2.0 * M_PI * 3000.0 * t)));
+        frames[i*2+1] = (float) ((0.5 * SDL_sin(2.0 * M_PI * 220.0 * t)) + (0.1 * SDL_sin(2.0 * M_PI * 9000.0 * t)));
+    }
+    for(size_t c = 0; c < SDL_arraysize(cases); ++c){
+        BenchTimer t;
+        SDL_zero(t);
+        visualizer.mode = cases[c].mode;
+        for(int i = 0; i < iterations; ++i){
+            if((i % 4) == 0){
+                VisTap_write(&vis_tap, frames, num_frames); // a callback every ~4 frames at 60fps
+            }
+            BenchTimer_start(&t);
+            const SDL_bool have_audio = vis_read_tap(&visualizer, SDL_GetPerformanceCounter());
+            vis_analyze(&visualizer, have_audio, 1.0f / 60.0f);
+            vis_paint(&visualizer, default_vis_colors, pixels, VIS_W);
+            BenchTimer_stop(&t);
+        }
+        bench_report("vis", cases[c].name, &t, ",\"core_pct_at_60fps\":%.4f", (BenchTimer_mean_ns(&t) * 60.0 * 100.0) / 1e9);
+    }
+
+done:
+    visualizer.mode = mode;
+    SDL_free(frames);
+    SDL_free(pixels);
+}
+
+#ifdef MYAMP_HAVE_DIRENT
+/* Scans `root` the way a dropped folder is, and waits for it. */
+static LibraryScan *bench_scan_folder(const char *root){
+    SDL_Event e;
+    if(!library_add_folder(root, SDL_FALSE)){
+        return NULL;
+    }
+    while(SDL_WaitEvent(&e)){
+        if(e.type == library_scanned_event){
+            return (LibraryScan *) e.user.data1;
+        }
+    }
+    return NULL;
+}
+
+/* A made up library of tiny WAVs, so it's the walk and the index being
+   timed rather than the disk: a first scan with no index, the same again
+   from the index loaded off disk and already in memory, and with 1% of the
+   files changed. */
+static void bench_library(void){
+    static const char *cases[] = { "cold", "startup", "warm", "changed" };
+    const int num_dirs = 100;
+    const int files_per_dir = 100;
+    char *root = NULL;
+    char *index_path = NULL;
+    char path[LIBRARY_MAX_PATH];
+    size_t len;
+
+    if(!pref_dir){
+        return;
+    }
+    len = SDL_strlen(pref_dir) + 32;
+    root = (char *) SDL_malloc(len);
+    index_path = (char *) SDL_malloc(len);
+    if(!root || !index_path){
+        goto done;
+    }
+    // its own index, the real one isn't touched
+    SDL_snprintf(root, len, "%sbench-library", pref_dir);
+    SDL_snprintf(index_path, len, "%sbench-library.idx", pref_dir);
+    library_index_path = index_path;
+    if(library_scanned_event == (Uint32) -1){
+        library_scanned_event = SDL_RegisterEvents(1);
+    }
+
+    mkdir(root, 0755);
+    for(int d = 0; d < num_dirs; ++d){
+        SDL_snprintf(path, sizeof(path), "%s/artist%03d", root, d);
+        mkdir(path, 0755);
+        for(int f = 0; f < files_per_dir; ++f){
+            SDL_snprintf(path, sizeof(path), "%s/artist%03d/track%03d.wav", root, d, f);
+            if(!bench_write_wav(path, 44100, 0)){ // just the header
+                fprintf(stderr, "Couldn't write %s\n", path);
+                goto done;
+            }
+        }
+        SDL_snprintf(path, sizeof(path), "%s/artist%03d/cover.jpg", root, d);
+        bench_write_wav(path, 44100, 0); // never opened
+    }
+    remove(index_path);
+
+    for(size_t c = 0; c < SDL_arraysize(cases); ++c){
+        BenchTimer t;
+        SDL_zero(t);
+        if(c == 1){
+            LibraryIndex_free(library);
+            library = NULL;
+        }else if(c == 3){
+            for(int d = 0; d < num_dirs; ++d){
+                SDL_snprintf(path, sizeof(path), "%s/artist%03d/track000.wav", root, d);
+                bench_write_wav(path, 8000, 1); // a different size, the mtime may not have moved
+            }
+        }
+        BenchTimer_start(&t);
+        LibraryScan *scan = bench_scan_folder(root);
+        BenchTimer_stop(&t);
+        if(!scan){
+            fprintf(stderr, "Couldn't scan %s: %s\n", root, SDL_GetError());
+            goto done;
+        }
+        const int files = SDL_AtomicGet(&scan->files);
+        const int files_read = SDL_AtomicGet(&scan->files_read);
+        library_scan_done(&skin, scan);
+        bench_report("library", cases[c], &t, ",\"files\":%d,\"files_read\":%d,\"tracks\":%d,\"workers\":%d,\"files_per_sec\":%.0f",
+                     files, files_read, playlist.num_entries, thread_pool.num_workers, (files * 1e9) / BenchTimer_mean_ns(&t));
+        Playlist_clear(&playlist);
+    }
+
+done:
+    LibraryIndex_free(library);
+    library = NULL;
+    library_index_path = NULL;
+    if(root){
+        for(int d = 0; d < num_dirs; ++d){
+            for(int f = 0; f < files_per_dir; ++f){
+                SDL_snprintf(path, sizeof(path), "%s/artist%03d/track%03d.wav", root, d, f);
+                remove(path);
+            }
+            SDL_snprintf(path, sizeof(path), "%s/artist%03d/cover.jpg", root, d);
+            remove(path);
+            SDL_snprintf(path, sizeof(path), "%s/artist%03d", root, d);
+            rmdir(path);
+        }
+        rmdir(root);
+    }
+    if(index_path){
+        remove(index_path);
+    }
+    SDL_free(root);
+    SDL_free(index_path);
+}
+#endif
+
+/* --render's throughput over a batch of synthetic files, one per worker
+   twice over: resampled through the decoder at 44100Hz, mapped at 48000Hz.
+   Volume and EQ are on so the whole chain runs. */
+/* Renders a few seconds of `freq` and plays the same file through
+   feed_audio_device_callback from silence with the same settings. Any
+   sample that isn't the same to the bit fails. */
+static void bench_render_matches_device(const char *name, const Uint32 freq){
+    char path[] = "myamp-bench-render-check";
+    char *paths[1] = { path };
+    const float volume = atomic_get_float(&audio_volume);
+    const float balance = atomic_get_float(&audio_balance);
+    const Uint32 buffer_len = AUDIO_DEVICE_SAMPLES * AUDIO_OUT_FRAME_SIZE;
+    float *frames = (float *) SDL_malloc(buffer_len);
+    RenderSettings settings;
+    Uint8 *rendered = NULL;
+    size_t rendered_len = 0;
+    Uint64 compared = 0;
+    Uint64 differing = 0;
+    char case_name[64];
+
+    SDL_zero(settings);
+    settings.volume = 0.8f;
+    settings.balance = 0.3f;
+    settings.buffer_frames = AUDIO_DEVICE_SAMPLES;
+    settings.out_dir = ".";
+    EqParams_compute(&settings.eq, bench_eq_values);
+    SDL_snprintf(case_name, sizeof(case_name), "%s_matches_device", name);
+    if(!frames || !bench_write_wav(path, freq, 3)){
+        fprintf(stderr, "bench: couldn't write %s: %s\n", path, SDL_GetError());
+        goto done;
+    }
+    RenderJob *jobs = render_files(&settings, paths, 1);
+    if(jobs && !jobs[0].error){
+        rendered = (Uint8 *) SDL_LoadFile(jobs[0].out_path, &rendered_len);
+    }
+    if(jobs && jobs[0].out_path){
+        remove(jobs[0].out_path);
+    }
+    render_jobs_free(jobs, 1);
+    if(!rendered || (rendered_len < 44)){
+        bench_fail("render", case_name, "couldn't render %s", path);
+        goto done;
+    }
+
+    atomic_set_float(&audio_volume, settings.volume);
+    atomic_set_float(&audio_balance, settings.balance);
+    publish_eq(bench_eq_values);
+    feed_audio_device_callback(NULL, (Uint8 *) frames, (int) buffer_len); // with nothing playing, like a fresh start
+    if(!open_new_audio_file(path)){
+        bench_fail("render", case_name, "couldn't play %s: %s", path, SDL_GetError());
+        goto done;
+    }
+    const Uint64 num_rendered = (rendered_len - 44) / sizeof(float);
+    AudioSource *src = (AudioSource *) SDL_AtomicGetPtr((void **) &source);
+    for(;;){
+        // only call it with a full buffer waiting, a real device would have underrun otherwise
+        while(!SDL_AtomicGet(&src->finished) && (AudioSource_available(src) < AUDIO_DEVICE_SAMPLES)){
+            SDL_Delay(1);
+        }
+        if(SDL_AtomicGet(&src->finished) && !AudioSource_available(src)){
+            break;
+        }
+        feed_audio_device_callback(NULL, (Uint8 *) frames, (int) buffer_len);
+        for(Uint32 i = 0; i < AUDIO_DEVICE_SAMPLES * AUDIO_OUT_CHANNELS; ++i, ++compared){
+            float expected = 0.0f; // past the end the device gets silence
+            if(compared < num_rendered){
+                SDL_memcpy(&expected, &rendered[44 + (compared * sizeof(float))], sizeof(float));
+                expected = SDL_SwapFloatLE(expected);
+            }
+            differing += (SDL_memcmp(&frames[i], &expected, sizeof(float)) != 0) ? 1 : 0;
+        }
+    }
+    stop_audio();
+    printf("{\"suite\":\"render\",\"case\":\"%s\",\"samples\":%" SDL_PRIu64 ",\"differing\":%" SDL_PRIu64 "}\n",
+           case_name, num_rendered, differing);
+    fflush(stdout);
+    if(differing || (compared < num_rendered)){
+        bench_fail("render", case_name, "%" SDL_PRIu64 " of %" SDL_PRIu64 " samples differ from the device's", differing, num_rendered);
+    }
+
+done:
+    while(SDL_AtomicGet(&decoders_in_flight) > 0){
+        SDL_Delay(1);
+    }
+    atomic_set_float(&audio_volume, volume);
+    atomic_set_float(&audio_balance, balance);
+    publish_eq(eq_values);
+    remove(path);
+    SDL_free(rendered);
+    SDL_free(frames);
+}
+
+static void bench_render(void){
+    static const struct{ const char *name; Uint32 freq; } cases[] = {
+        { "decoded", 44100 },
+        { "mapped",  48000 },
+    };
+    const Uint32 seconds = 30;
+    const int iterations = 3;
+    RenderSettings settings;
+    char *paths[THREAD_POOL_MAX_WORKERS * 2];
+    int num_files;
+
+    if(!ThreadPool_start()){
+        return;
+    }
+    num_files = thread_pool.num_workers * 2;
+    SDL_zero(settings);
+    settings.volume = 0.8f;
+    settings.balance = 0.5f;
+    settings.buffer_frames = AUDIO_DEVICE_SAMPLES;
+    settings.out_dir = ".";
+    EqParams_compute(&settings.eq, bench_eq_values);
+
+    for(size_t c = 0; c < SDL_arraysize(cases); ++c){
+        BenchTimer t;
+        Uint64 frames = 0;
+        int written = 0;
+        SDL_bool ok = SDL_TRUE;
+
+        SDL_zero(t);
+        for(; written < num_files; ++written){
+            paths[written] = (char *) SDL_malloc(32);
+            if(!paths[written]){
+                break;
+            }
+            SDL_snprintf(paths[written], 32, "myamp-bench-render%d", written);
+            if(!bench_write_wav(paths[written], cases[c].freq, seconds)){
+                fprintf(stderr, "bench: couldn't write %s: %s\n", paths[written], SDL_GetError());
+                remove(paths[written]);
+                SDL_free(paths[written]);
+                break;
+            }
+        }
+        for(int i = 0; ok && (written == num_files) && (i < iterations); ++i){
+            BenchTimer_start(&t);
+            RenderJob *jobs = render_files(&settings, paths, num_files);
+            BenchTimer_stop(&t);
+            for(int j = 0; jobs && (j < num_files); ++j){
+                if(jobs[j].error){
+                    fprintf(stderr, "bench: couldn't render %s: %s\n", jobs[j].in_path, jobs[j].error);
+                    ok = SDL_FALSE;
+                }
+                frames += jobs[j].frames;
+                if(jobs[j].out_path){
+                    remove(jobs[j].out_path);
                 }
-                break;    
             }
-            case SDL_MOUSEMOTION:{
-                 const SDL_Point pt = {e.motion.x, e.motion.y};
-                 for(int i = 0; i < SDL_arraysize(skin->sliders); ++i){
-                     handle_slider_motion(&skin->sliders[i], &pt);
-                 }
-                 break;
-             }
-            case SDL_DROPFILE:{
-                const char *ptr = SDL_strrchr(e.drop.file, '.');
-                if(ptr && ((SDL_strcasecmp(ptr, ".wsz") == 0) || (SDL_strcasecmp(ptr, ".zip") == 0))){
-                    load_skin(skin, e.drop.file);
-                }else{
-                    open_new_audio_file(e.drop.file);
+            ok &= jobs ? SDL_TRUE : SDL_FALSE;
+            render_jobs_free(jobs, num_files);
+        }
+        if(ok && t.iterations){
+            const double audio_seconds = (double) frames / (audio_out_freq * (double) t.iterations);
+            bench_report("render", cases[c].name, &t, ",\"files\":%d,\"workers\":%d,\"audio_seconds\":%.1f,\"realtime\":%.1f",
+                         num_files, thread_pool.num_workers, audio_seconds, (audio_seconds * 1e9) / BenchTimer_mean_ns(&t));
+        }
+        while(written--){
+            remove(paths[written]);
+            SDL_free(paths[written]);
+        }
+        bench_render_matches_device(cases[c].name, cases[c].freq);
+    }
+}
+
+#ifdef MYAMP_HAVE_DIRENT
+/* K-weighting per kernel against the scalar one, the meter against R128's
+   reference tones, then whole files measured on the pool, one job at a
+   time and then more at once up to a job per worker. */
+static void bench_loudness(void){
+    const Uint32 num_frames = (Uint32) audio_out_freq; // a second
+    const Uint32 seconds = 10;
+    const int iterations = 200;
+    float *frames = (float *) SDL_malloc(num_frames * AUDIO_OUT_FRAME_SIZE);
+    KWeightCoeffs coeffs;
+    double reference_ns = 0.0;
+    double reference_energy = 0.0;
+    double single_ns = 0.0;
+    char *paths[THREAD_POOL_MAX_WORKERS * 2];
+    LoudnessJob jobs[THREAD_POOL_MAX_WORKERS * 2];
+    SDL_sem *done = NULL;
+    int num_files = 0;
+    int written = 0;
+
+    if(!frames){
+        return;
+    }
+    KWeightCoeffs_compute(&coeffs, audio_out_freq);
+    for(Uint32 i = 0; i < num_frames * 2; ++i){
+        // something with lows and highs in it, so both stages have work
+        frames[i] = (float) ((0.4 * SDL_sin(i * 0.013)) + (0.2 * SDL_sin(i * 1.7)) + (((i * 2654435761u) >> 24) / 2560.0) - 0.05);
+    }
+    for(int k = (int) SDL_arraysize(dsp_kernels) - 1; k >= 0; --k){
+        const DspKernel *kernel = &dsp_kernels[k];
+        KWeightState state;
+        double energy = 0.0;
+        BenchTimer t;
+        if(kernel->supported && !kernel->supported()){
+            continue;
+        }
+        SDL_zero(t);
+        for(int i = 0; i < iterations; ++i){
+            SDL_zero(state);
+            BenchTimer_start(&t);
+            energy = kernel->kweight(&coeffs, &state, frames, num_frames);
+            BenchTimer_stop(&t);
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        if(!kernel->supported){
+            reference_ns = ns;
+            reference_energy = energy;
+        }
+        bench_report("loudness", kernel->name, &t, ",\"mframes_per_s\":%.1f,\"speedup\":%.2f,\"energy_error\":%.2e,\"selected\":%s",
+                     (num_frames / ns) * 1e3, reference_ns / ns, SDL_fabs(energy - reference_energy) / reference_energy,
+                     (kernel == dsp_kernel) ? "true" : "false");
+    }
+
+    // EBU Tech 3341's first case: 1kHz at -23dBFS in both channels reads -23 LUFS.
+    // Then a quarter of the rate, 45 degrees off, so every sample misses the crest by 3dB.
+    static const struct{ const char *name; double hz; double phase; double level_db; } tones[] = {
+        { "1khz_-23dbfs", 1000.0, 0.0, -23.0 },
+        { "fs/4_true_peak", 0.0, M_PI / 4.0, -6.0 },
+    };
+    for(size_t c = 0; c < SDL_arraysize(tones); ++c){
+        const double hz = (tones[c].hz > 0.0) ? tones[c].hz : (audio_out_freq / 4.0);
+        const double amplitude = SDL_pow(10.0, tones[c].level_db / 20.0);
+        LoudnessMeter meter;
+        Loudness loudness;
+        float sample_peak = 0.0f;
+        BenchTimer t;
+
+        SDL_zero(t);
+        if(!LoudnessMeter_init(&meter, audio_out_freq)){
+            break;
+        }
+        BenchTimer_start(&t);
+        for(Uint32 s = 0; s < seconds; ++s){
+            for(Uint32 i = 0; i < num_frames; ++i){
+                const Uint64 n = ((Uint64) s * num_frames) + i;
+                frames[i*2] = frames[i*2+1] = (float) (amplitude * SDL_sin((((2.0 * M_PI * hz) / audio_out_freq) * (double) (n % (Uint64) audio_out_freq)) + tones[c].phase));
+                sample_peak = SDL_max(sample_peak, SDL_fabsf(frames[i*2]));
+            }
+            LoudnessMeter_feed(&meter, frames, num_frames);
+        }
+        LoudnessMeter_finish(&meter, &loudness);
+        BenchTimer_stop(&t);
+        LoudnessMeter_free(&meter);
+        bench_report("loudness", tones[c].name, &t, ",\"lufs\":%.2f,\"sample_peak_db\":%.2f,\"true_peak_db\":%.2f,\"level_db\":%.2f",
+                     loudness.lufs, 20.0 * SDL_log10(sample_peak), 20.0 * SDL_log10(loudness.peak), tones[c].level_db);
+    }
+
+    // 44100Hz files, so the measuring includes decoding and resampling like most of a library would
+    if(!ThreadPool_start() || !(done = SDL_CreateSemaphore(0))){
+        goto cleanup;
+    }
+    num_files = thread_pool.num_workers * 2;
+    for(; written < num_files; ++written){
+        paths[written] = (char *) SDL_malloc(32);
+        if(!paths[written]){
+            break;
+        }
+        SDL_snprintf(paths[written], 32, "myamp-bench-loudness%d", written);
+        if(!bench_write_wav(paths[written], 44100, seconds)){
+            fprintf(stderr, "bench: couldn't write %s: %s\n", paths[written], SDL_GetError());
+            remove(paths[written]);
+            SDL_free(paths[written]);
+            break;
+        }
+    }
+    for(int parallel = 1; written == num_files; parallel = SDL_min(parallel * 2, thread_pool.num_workers)){
+        BenchTimer t;
+        SDL_bool ok = SDL_TRUE;
+        SDL_zero(t);
+        for(int i = 0; i < 3; ++i){
+            int submitted = 0;
+            int finished = 0;
+            SDL_zeroa(jobs);
+            BenchTimer_start(&t);
+            while(finished < num_files){
+                if((submitted < num_files) && ((submitted - finished) < parallel)){
+                    jobs[submitted].path = paths[submitted];
+                    jobs[submitted].done = done;
+                    if(ThreadPool_submit(-1, loudness_analyze_file, &jobs[submitted])){
+                        submitted++;
+                        continue;
+                    }
+                    ok = SDL_FALSE;
+                    break;
                 }
-                SDL_free(e.drop.file);
-                break;
+                SDL_SemWait(done);
+                finished++;
+            }
+            BenchTimer_stop(&t);
+            for(int j = 0; j < submitted; ++j){
+                ok &= (jobs[j].loudness.lufs > LOUDNESS_ABSOLUTE_GATE_LUFS) ? SDL_TRUE : SDL_FALSE;
             }
         }
+        if(!ok){
+            fprintf(stderr, "bench: couldn't measure the loudness of %d files\n", num_files);
+            break;
+        }
+        const double ns = BenchTimer_mean_ns(&t);
+        char name[32];
+        if(parallel == 1){
+            single_ns = ns;
+        }
+        SDL_snprintf(name, sizeof(name), "files_x%d", parallel);
+        bench_report("loudness", name, &t, ",\"files\":%d,\"workers\":%d,\"lufs\":%.2f,\"realtime\":%.1f,\"speedup\":%.2f",
+                     num_files, thread_pool.num_workers, jobs[0].loudness.lufs,
+                     ((double) num_files * seconds * 1e9) / ns, single_ns / ns);
+        if(parallel == thread_pool.num_workers){
+            break;
+        }
     }
-    // Keep going
-    return SDL_TRUE;
+
+cleanup:
+    while(written-- > 0){
+        remove(paths[written]);
+        SDL_free(paths[written]);
+    }
+    if(done){
+        SDL_DestroySemaphore(done);
+    }
+    SDL_free(frames);
 }
+#endif
+
+static int run_benchmarks(int argc, char **argv){
+    static const struct{ const char *name; void (*run)(void); } suites[] = {
+        { "gain",     bench_gain },
+        { "convert",  bench_convert },
+        { "resample", bench_resample },
+        { "eq",       bench_eq },
+        { "callback", bench_callback },
+        { "mix",      bench_mix },
+        { "audio",    bench_audio },
+        { "skin",     bench_skin },
+        { "draw",     bench_draw },
+        { "vis",      bench_vis },
+        { "render",   bench_render },
+#ifdef MYAMP_HAVE_DIRENT
+        { "library",  bench_library },
+        { "loudness", bench_loudness },
+#endif
+    };
+    SDL_Surface *screen = NULL;
+    SDL_version version;
+    int retval = 1;
+
+    for(int i = 0; i < argc; ++i){
+        size_t s = 0;
+        while((s < SDL_arraysize(suites)) && SDL_strcmp(argv[i], suites[s].name)){
+            s++;
+        }
+        if(s == SDL_arraysize(suites)){
+            fprintf(stderr, "Unknown benchmark '%s', have: gain convert resample eq callback mix audio skin draw vis render library loudness\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // no window, no sound card, just the code paths
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    SDL_SetHint(SDL_HINT_AUDIODRIVER, "dummy");
+    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1){
+        fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+        return 1;
+    }
+    screen = SDL_CreateRGBSurfaceWithFormat(0, (int) (SKIN_WINDOW_W * SKIN_MAX_SCALE), (int) (SKIN_WINDOW_H * SKIN_MAX_SCALE), 32, SDL_PIXELFORMAT_ARGB8888);
+    renderer = screen ? SDL_CreateSoftwareRenderer(screen) : NULL;
+    if(!renderer){
+        fprintf(stderr, "Couldn't create software renderer: %s\n", SDL_GetError());
+        goto done;
+    }
+    // opened so locking it is real work, but never unpaused: we call the callback ourselves
+    audio_device = open_audio_device(AUDIO_DEFAULT_FREQ, AUDIO_DEVICE_SAMPLES, NULL);
+    if(audio_device == 0){
+        fprintf(stderr, "Couldn't open dummy audio device: %s\n", SDL_GetError());
+        goto done;
+    }
 
+    pref_dir = SDL_GetPrefPath("myamp", "myamp"); // MAY BE NULL, the skin suite skips its cold case
+
+    SDL_GetVersion(&version);
+    printf("{\"suite\":\"info\",\"sdl\":\"%d.%d.%d\",\"video_driver\":\"%s\",\"cpus\":%d,\"kernel\":\"%s\",\"frames_per_callback\":%d}\n",
+           version.major, version.minor, version.patch, SDL_GetCurrentVideoDriver(), SDL_GetCPUCount(),
+           dsp_kernel->name, AUDIO_DEVICE_SAMPLES);
+
+    for(size_t s = 0; s < SDL_arraysize(suites); ++s){
+        SDL_bool wanted = (argc == 0) ? SDL_TRUE : SDL_FALSE;
+        for(int i = 0; i < argc; ++i){
+            wanted |= (SDL_strcmp(argv[i], suites[s].name) == 0) ? SDL_TRUE : SDL_FALSE;
+        }
+        if(wanted){
+            suites[s].run();
+        }
+    }
+    retval = bench_failures ? 1 : 0;
+
+done:
+    stop_audio();
+    while(SDL_AtomicGet(&decoders_in_flight) > 0){
+        SDL_Delay(1);
+    }
+    ThreadPool_stop();
+    destroy_skin_textures(&skin);
+    SDL_FreeSurface(skin.atlas_pixels);
+    SDL_free(skin.region);
+    SDL_zero(skin);
+    if(audio_device){
+        SDL_CloseAudioDevice(audio_device);
+    }
+    if(renderer){
+        SDL_DestroyRenderer(renderer);
+    }
+    SDL_FreeSurface(screen);
+    SDL_free(pref_dir);
+    SDL_Quit();
+    return retval;
+}
 
 int main(int argc, char **argv){
 
+    select_dsp_kernels();
+    if((argc > 1) && (SDL_strcmp(argv[1], "--bench") == 0)){
+        init_visualizer(&visualizer);
+        return run_benchmarks(argc - 2, argv + 2);
+    }
+    if((argc > 1) && (SDL_strcmp(argv[1], "--render") == 0)){
+        return run_render(argc - 2, argv + 2);
+    }
+
     // will panic_and_abort if there are any issues
     init_everything(argc, argv); 
     while(handle_events(&skin)){
+        update_playback(&skin);
+#ifdef MYAMP_HAVE_DIRENT
+        update_loudness();
+#endif
+        update_visualizer(&skin);
+        update_stats_overlay(&skin);
+        update_readouts(&skin);
+        update_audio_buffer();
         draw_frame(renderer, &skin);
     }
     deinit_everything(); 